@@ -6,3 +6,7 @@
 
 find_package(PkgConfig)
 pkg_check_modules(GStreamer gstreamer-1.0 REQUIRED IMPORTED_TARGET)
+pkg_check_modules(GStreamerAllocators gstreamer-allocators-1.0 REQUIRED IMPORTED_TARGET)
+pkg_check_modules(GStreamerApp gstreamer-app-1.0 REQUIRED IMPORTED_TARGET)
+pkg_check_modules(GStreamerBase gstreamer-base-1.0 REQUIRED IMPORTED_TARGET)
+pkg_check_modules(GStreamerVideo gstreamer-video-1.0 REQUIRED IMPORTED_TARGET)
@@ -0,0 +1,343 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+/*
+ * Compares the BGRx to I420/NV12 kernels used by screencastconvert
+ * with GStreamer's video converter, the core of videoconvert.
+ *
+ * Then the same when scaling HiDPI frames down: GStreamer's converter
+ * scaling and converting, our scaler writing a scaled frame that is
+ * converted afterwards, and the fused path screencastconvert uses.
+ *
+ * First of all, the SIMD scalers are checked to be bit-exact with the
+ * scalar one over a range of scaling ratios.
+ *
+ * Usage: screencast-convert-bench [iterations]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "colorconvert.h"
+#include "slicepool.h"
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+struct Resolution {
+    const char *name;
+    int width;
+    int height;
+};
+
+struct Scaling {
+    const char *name;
+    Resolution source;
+    Resolution target;
+};
+
+static double measure(int iterations, const std::function<void()> &func)
+{
+    // One warm-up run to fault in the pages
+    func();
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        func();
+    const auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+static void report(const char *resolution, const char *target, const char *name,
+                   int threads, double ms, double baseline)
+{
+    printf("%-6s %-5s %-16s %3d threads %8.2f ms/frame %8.1f fps %6.2fx\n",
+           resolution, target, name, threads, ms, 1000.0 / ms, baseline / ms);
+}
+
+static GstBuffer *randomFrame(const GstVideoInfo *info)
+{
+    GstBuffer *buffer = gst_buffer_new_allocate(nullptr, GST_VIDEO_INFO_SIZE(info), nullptr);
+
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    srand(42);
+    for (gsize i = 0; i < map.size; ++i)
+        map.data[i] = uint8_t(rand());
+    gst_buffer_unmap(buffer, &map);
+
+    return buffer;
+}
+
+static bool checkScaling()
+{
+    // Ratios with many taps per pixel and with few, on flat images,
+    // where every weight counts, and on noise
+    srand(42);
+    int mismatches = 0;
+    int cases = 0;
+    for (int sourceWidth = 2; sourceWidth <= 300; sourceWidth += 7) {
+        for (int targetWidth = 1; targetWidth < sourceWidth; targetWidth += 1 + targetWidth / 3) {
+            const int sourceHeight = 2 + sourceWidth % 37;
+            const int targetHeight = 1 + targetWidth % sourceHeight;
+            if (targetHeight >= sourceHeight)
+                continue;
+
+            for (bool flat : { true, false }) {
+                std::vector<uint8_t> data(size_t(sourceWidth) * size_t(sourceHeight) * 4);
+                for (auto &byte : data)
+                    byte = flat ? 200 : uint8_t(rand());
+
+                ColorConverter::SourceImage source;
+                source.data = data.data();
+                source.stride = sourceWidth * 4;
+                source.width = sourceWidth;
+                source.height = sourceHeight;
+
+                ColorConverter scalar(ColorConverter::BGRx, ColorConverter::I420, ColorConverter::Scalar);
+                scalar.setScale(sourceWidth, sourceHeight, targetWidth, targetHeight);
+                std::vector<uint8_t> expected(size_t(targetWidth) * size_t(targetHeight) * 4);
+                scalar.scale(source, expected.data(), targetWidth * 4, 0, targetHeight);
+
+                for (int impl = ColorConverter::SSE41; impl <= ColorConverter::bestImplementation(); ++impl) {
+                    ColorConverter simd(ColorConverter::BGRx, ColorConverter::I420, ColorConverter::Implementation(impl));
+                    simd.setScale(sourceWidth, sourceHeight, targetWidth, targetHeight);
+                    std::vector<uint8_t> actual(expected.size());
+                    simd.scale(source, actual.data(), targetWidth * 4, 0, targetHeight);
+
+                    ++cases;
+                    if (actual != expected) {
+                        if (mismatches++ < 10)
+                            printf("%s scaling %dx%d to %dx%d (%s) differs from scalar\n",
+                                   ColorConverter::implementationName(ColorConverter::Implementation(impl)),
+                                   sourceWidth, sourceHeight, targetWidth, targetHeight,
+                                   flat ? "flat" : "noise");
+                    }
+                }
+            }
+        }
+    }
+
+    printf("scaling check: %d of %d cases differ from scalar\n", mismatches, cases);
+    return mismatches == 0;
+}
+
+static void benchmarkScaling(const Scaling &scaling, int iterations, int cores)
+{
+    GstVideoInfo inInfo, scaledInfo, outInfo;
+    gst_video_info_set_format(&inInfo, GST_VIDEO_FORMAT_BGRx, scaling.source.width, scaling.source.height);
+    gst_video_info_set_format(&scaledInfo, GST_VIDEO_FORMAT_BGRx, scaling.target.width, scaling.target.height);
+    gst_video_info_set_format(&outInfo, GST_VIDEO_FORMAT_I420, scaling.target.width, scaling.target.height);
+    gst_video_colorimetry_from_string(&outInfo.colorimetry, "bt709");
+
+    GstBuffer *inBuffer = randomFrame(&inInfo);
+    GstBuffer *scaledBuffer = gst_buffer_new_allocate(nullptr, GST_VIDEO_INFO_SIZE(&scaledInfo), nullptr);
+    GstBuffer *outBuffer = gst_buffer_new_allocate(nullptr, GST_VIDEO_INFO_SIZE(&outInfo), nullptr);
+
+    GstVideoFrame inFrame, scaledFrame, outFrame;
+    gst_video_frame_map(&inFrame, &inInfo, inBuffer, GST_MAP_READ);
+    gst_video_frame_map(&scaledFrame, &scaledInfo, scaledBuffer, GST_MAP_READWRITE);
+    gst_video_frame_map(&outFrame, &outInfo, outBuffer, GST_MAP_WRITE);
+
+    // GStreamer's converter, which scales and converts in one go, on one thread is the baseline
+    double baseline = 0;
+    for (int threads : { 1, cores }) {
+        GstStructure *config = gst_structure_new("GstVideoConverter",
+                                                 GST_VIDEO_CONVERTER_OPT_THREADS, G_TYPE_UINT, guint(threads),
+                                                 GST_VIDEO_CONVERTER_OPT_RESAMPLER_METHOD,
+                                                 GST_TYPE_VIDEO_RESAMPLER_METHOD, GST_VIDEO_RESAMPLER_METHOD_LINEAR,
+                                                 nullptr);
+        GstVideoConverter *converter = gst_video_converter_new(&inInfo, &outInfo, config);
+        const double ms = measure(iterations, [&]() {
+            gst_video_converter_frame(converter, &inFrame, &outFrame);
+        });
+        gst_video_converter_free(converter);
+
+        if (threads == 1)
+            baseline = ms;
+        report(scaling.name, "I420", "videoconvert", threads, ms, baseline);
+
+        if (cores == 1)
+            break;
+    }
+
+    ColorConverter::SourceImage source;
+    source.data = static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&inFrame, 0));
+    source.stride = GST_VIDEO_FRAME_PLANE_STRIDE(&inFrame, 0);
+    source.width = scaling.source.width;
+    source.height = scaling.source.height;
+
+    ColorConverter::SourceImage scaled;
+    scaled.data = static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&scaledFrame, 0));
+    scaled.stride = GST_VIDEO_FRAME_PLANE_STRIDE(&scaledFrame, 0);
+    scaled.width = scaling.target.width;
+    scaled.height = scaling.target.height;
+
+    ColorConverter::TargetImage target;
+    for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(&outFrame); ++i) {
+        target.planes[i] = static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&outFrame, i));
+        target.strides[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&outFrame, i);
+    }
+
+    ColorConverter scaler(ColorConverter::BGRx, ColorConverter::I420);
+    scaler.setScale(source.width, source.height, scaled.width, scaled.height);
+    const ColorConverter converter(ColorConverter::BGRx, ColorConverter::I420);
+
+    for (int threads : { 1, cores }) {
+        SlicePool pool(threads);
+        const int slices = threads * 2;
+        const int rows = (((scaling.target.height + slices - 1) / slices) + 1) & ~1;
+        uint8_t *scaledData = static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&scaledFrame, 0));
+
+        // Scaled frame written out, then read back to be converted
+        double ms = measure(iterations, [&]() {
+            pool.run(slices, [&](int slice) {
+                scaler.scale(source, scaledData, scaled.stride, slice * rows, (slice + 1) * rows);
+            });
+            pool.run(slices, [&](int slice) {
+                converter.convert(scaled, target, slice * rows, (slice + 1) * rows);
+            });
+        });
+        report(scaling.name, "I420", "separate", threads, ms, baseline);
+
+        ms = measure(iterations, [&]() {
+            pool.run(slices, [&](int slice) {
+                scaler.convert(source, target, slice * rows, (slice + 1) * rows);
+            });
+        });
+        report(scaling.name, "I420", "fused", threads, ms, baseline);
+
+        if (cores == 1)
+            break;
+    }
+
+    gst_video_frame_unmap(&outFrame);
+    gst_video_frame_unmap(&scaledFrame);
+    gst_video_frame_unmap(&inFrame);
+    gst_buffer_unref(outBuffer);
+    gst_buffer_unref(scaledBuffer);
+    gst_buffer_unref(inBuffer);
+}
+
+int main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+
+    if (!checkScaling())
+        return 1;
+
+    const int iterations = argc > 1 ? atoi(argv[1]) : 50;
+    const int cores = int(std::max(1u, std::thread::hardware_concurrency()));
+
+    static const Resolution resolutions[] = {
+        { "1080p", 1920, 1080 },
+        { "1440p", 2560, 1440 },
+        { "4K", 3840, 2160 },
+    };
+    static const GstVideoFormat targets[] = { GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_NV12 };
+
+    for (const auto &resolution : resolutions) {
+        for (const GstVideoFormat targetFormat : targets) {
+            GstVideoInfo inInfo, outInfo;
+            gst_video_info_set_format(&inInfo, GST_VIDEO_FORMAT_BGRx, resolution.width, resolution.height);
+            gst_video_info_set_format(&outInfo, targetFormat, resolution.width, resolution.height);
+            gst_video_colorimetry_from_string(&outInfo.colorimetry, "bt709");
+
+            GstBuffer *inBuffer = gst_buffer_new_allocate(nullptr, GST_VIDEO_INFO_SIZE(&inInfo), nullptr);
+            GstBuffer *outBuffer = gst_buffer_new_allocate(nullptr, GST_VIDEO_INFO_SIZE(&outInfo), nullptr);
+
+            GstMapInfo map;
+            gst_buffer_map(inBuffer, &map, GST_MAP_WRITE);
+            srand(42);
+            for (gsize i = 0; i < map.size; ++i)
+                map.data[i] = uint8_t(rand());
+            gst_buffer_unmap(inBuffer, &map);
+
+            GstVideoFrame inFrame, outFrame;
+            gst_video_frame_map(&inFrame, &inInfo, inBuffer, GST_MAP_READ);
+            gst_video_frame_map(&outFrame, &outInfo, outBuffer, GST_MAP_WRITE);
+
+            const char *targetName = gst_video_format_to_string(targetFormat);
+
+            // GStreamer's converter on one thread is the baseline
+            double baseline = 0;
+            for (int threads : { 1, cores }) {
+                GstStructure *config = gst_structure_new("GstVideoConverter",
+                                                         GST_VIDEO_CONVERTER_OPT_THREADS, G_TYPE_UINT, guint(threads),
+                                                         nullptr);
+                GstVideoConverter *converter = gst_video_converter_new(&inInfo, &outInfo, config);
+                const double ms = measure(iterations, [&]() {
+                    gst_video_converter_frame(converter, &inFrame, &outFrame);
+                });
+                gst_video_converter_free(converter);
+
+                if (threads == 1)
+                    baseline = ms;
+                report(resolution.name, targetName, "videoconvert", threads, ms, baseline);
+
+                if (cores == 1)
+                    break;
+            }
+
+            ColorConverter::SourceImage source;
+            source.data = static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&inFrame, 0));
+            source.stride = GST_VIDEO_FRAME_PLANE_STRIDE(&inFrame, 0);
+            source.width = resolution.width;
+            source.height = resolution.height;
+
+            ColorConverter::TargetImage target;
+            for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(&outFrame); ++i) {
+                target.planes[i] = static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&outFrame, i));
+                target.strides[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&outFrame, i);
+            }
+
+            const auto best = ColorConverter::bestImplementation();
+            for (int impl = ColorConverter::Scalar; impl <= best; ++impl) {
+                const ColorConverter converter(ColorConverter::BGRx,
+                                               targetFormat == GST_VIDEO_FORMAT_NV12 ? ColorConverter::NV12 : ColorConverter::I420,
+                                               ColorConverter::Implementation(impl));
+                const char *name = ColorConverter::implementationName(converter.implementation());
+
+                for (int threads : { 1, cores }) {
+                    SlicePool pool(threads);
+                    const int slices = threads * 2;
+                    const int rows = (((resolution.height + slices - 1) / slices) + 1) & ~1;
+
+                    const double ms = measure(iterations, [&]() {
+                        pool.run(slices, [&](int slice) {
+                            converter.convert(source, target, slice * rows, (slice + 1) * rows);
+                        });
+                    });
+                    report(resolution.name, targetName, name, threads, ms, baseline);
+
+                    if (cores == 1)
+                        break;
+                }
+            }
+
+            gst_video_frame_unmap(&outFrame);
+            gst_video_frame_unmap(&inFrame);
+            gst_buffer_unref(outBuffer);
+            gst_buffer_unref(inBuffer);
+        }
+    }
+
+    static const Scaling scalings[] = {
+        { "4K>1080p", { "4K", 3840, 2160 }, { "1080p", 1920, 1080 } },
+        { "5K>1440p", { "5K", 5120, 2880 }, { "1440p", 2560, 1440 } },
+        { "5K>1080p", { "5K", 5120, 2880 }, { "1080p", 1920, 1080 } },
+    };
+    for (const auto &scaling : scalings)
+        benchmarkScaling(scaling, iterations, cores);
+
+    gst_deinit();
+    return 0;
+}
@@ -0,0 +1,293 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+/*
+ * Receives a stream sent by liri-screencast --live --latency-stamp,
+ * decodes it and reads back the capture time drawn on every frame:
+ * prints the glass to glass latency once per second as JSON, then
+ * a summary that fails if it is above the target.
+ *
+ * Sender and receiver must run on the same machine, the stamp is
+ * read from the monotonic clock.
+ *
+ * Usage: screencast-live-receiver [options] url, see --help
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QTimer>
+#include <QUrl>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "latencystamp.h"
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+struct Measurement {
+    QMutex mutex;
+    GstVideoInfo info;
+    bool hasInfo = false;
+    quint64 frames = 0;
+    quint64 stamped = 0;
+    std::vector<double> latencies;
+};
+
+static GstPadProbeReturn frame_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Measurement *measurement = static_cast<Measurement *>(user_data);
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps = nullptr;
+            gst_event_parse_caps(event, &caps);
+            QMutexLocker locker(&measurement->mutex);
+            measurement->hasInfo = gst_video_info_from_caps(&measurement->info, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    // Read as soon as the frame is decoded, before anything else runs
+    const uint32_t now = LatencyStamp::now();
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    QMutexLocker locker(&measurement->mutex);
+    measurement->frames++;
+    if (!measurement->hasInfo)
+        return GST_PAD_PROBE_OK;
+
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, &measurement->info, buffer, GST_MAP_READ))
+        return GST_PAD_PROBE_OK;
+
+    uint32_t captured = 0;
+    if (LatencyStamp::read(static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0)),
+                           GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+                           GST_VIDEO_FRAME_WIDTH(&frame), GST_VIDEO_FRAME_HEIGHT(&frame), &captured)) {
+        measurement->stamped++;
+        measurement->latencies.push_back(LatencyStamp::elapsed(captured, now) / 1000.0);
+    }
+    gst_video_frame_unmap(&frame);
+
+    Q_UNUSED(pad)
+    return GST_PAD_PROBE_OK;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(p * (sorted.size() - 1) + 0.5))];
+}
+
+static QJsonObject summarize(quint64 frames, quint64 stamped, std::vector<double> latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    QJsonObject object;
+    object[QStringLiteral("frames")] = double(frames);
+    object[QStringLiteral("stamped")] = double(stamped);
+    object[QStringLiteral("latency-min-ms")] = latencies.empty() ? 0 : latencies.front();
+    object[QStringLiteral("latency-p50-ms")] = percentile(latencies, 0.5);
+    object[QStringLiteral("latency-p95-ms")] = percentile(latencies, 0.95);
+    object[QStringLiteral("latency-max-ms")] = latencies.empty() ? 0 : latencies.back();
+    return object;
+}
+
+static QByteArray depayloader(const QString &encoding)
+{
+    if (encoding == QLatin1String("H264"))
+        return QByteArrayLiteral("rtph264depay");
+    if (encoding == QLatin1String("VP8"))
+        return QByteArrayLiteral("rtpvp8depay");
+    if (encoding == QLatin1String("VP9"))
+        return QByteArrayLiteral("rtpvp9depay");
+    if (encoding == QLatin1String("AV1"))
+        return QByteArrayLiteral("rtpav1depay");
+    return QByteArray();
+}
+
+static GstElement *createPipeline(const QUrl &url, const QString &encoding, int jitter)
+{
+    // Decoded frames are read as they come, not when they are due
+    const QByteArray tail = QByteArrayLiteral(
+                " ! decodebin ! videoconvert ! video/x-raw,format=I420 ! fakesink name=sink sync=false");
+
+    QByteArray description;
+    const QString scheme = url.scheme();
+    if (scheme == QLatin1String("rtp")) {
+        const QByteArray depay = depayloader(encoding);
+        if (depay.isEmpty()) {
+            qWarning("Unsupported RTP encoding \"%s\".", qPrintable(encoding));
+            return nullptr;
+        }
+        description = QByteArrayLiteral("udpsrc name=src ! rtpjitterbuffer name=jitter ! ") + depay + tail;
+    } else if (scheme == QLatin1String("srt")) {
+        description = QByteArrayLiteral("srtsrc name=src") + tail;
+    } else if (scheme == QLatin1String("rtsp")) {
+        description = QByteArrayLiteral("rtspsrc name=src") + tail;
+    } else {
+        qWarning("Unsupported URL \"%s\", use rtp://, srt:// or rtsp://.", qPrintable(url.toString()));
+        return nullptr;
+    }
+
+    GError *error = nullptr;
+    GstElement *pipeline = gst_parse_launch(description.constData(), &error);
+    if (!pipeline) {
+        qWarning("Unable to create the pipeline: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return nullptr;
+    }
+    g_clear_error(&error);
+
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    if (scheme == QLatin1String("rtp")) {
+        GstCaps *caps = gst_caps_new_simple("application/x-rtp",
+                                            "media", G_TYPE_STRING, "video",
+                                            "clock-rate", G_TYPE_INT, 90000,
+                                            "encoding-name", G_TYPE_STRING, qPrintable(encoding),
+                                            nullptr);
+        g_object_set(src, "port", url.port(5000), "caps", caps, nullptr);
+        if (!url.host().isEmpty())
+            g_object_set(src, "address", url.host().toUtf8().constData(), nullptr);
+        gst_caps_unref(caps);
+
+        GstElement *jitterBuffer = gst_bin_get_by_name(GST_BIN(pipeline), "jitter");
+        g_object_set(jitterBuffer, "latency", guint(jitter), nullptr);
+        gst_object_unref(jitterBuffer);
+    } else if (scheme == QLatin1String("srt")) {
+        g_object_set(src, "uri", url.toString().toUtf8().constData(), "latency", jitter, nullptr);
+    } else {
+        g_object_set(src, "location", url.toString().toUtf8().constData(), "latency", guint(jitter), nullptr);
+    }
+    gst_object_unref(src);
+
+    return pipeline;
+}
+
+int main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Measures the glass to glass latency of a live screencast"));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("url"),
+                                 QStringLiteral("rtp://:port, srt://:port?mode=listener or rtsp://host:port/path."));
+
+    QCommandLineOption encodingOption(QStringLiteral("encoding"),
+                                      QStringLiteral("RTP encoding name: H264, VP8, VP9 or AV1."),
+                                      QStringLiteral("name"), QStringLiteral("H264"));
+    parser.addOption(encodingOption);
+    QCommandLineOption jitterOption(QStringLiteral("jitter"),
+                                    QStringLiteral("Jitter buffer or SRT latency."),
+                                    QStringLiteral("ms"), QStringLiteral("20"));
+    parser.addOption(jitterOption);
+    QCommandLineOption durationOption(QStringLiteral("duration"),
+                                      QStringLiteral("Seconds to measure for, from the first stamped frame."),
+                                      QStringLiteral("seconds"), QStringLiteral("10"));
+    parser.addOption(durationOption);
+    QCommandLineOption targetOption(QStringLiteral("target"),
+                                    QStringLiteral("Fail if the 95th percentile is above this latency."),
+                                    QStringLiteral("ms"), QStringLiteral("100"));
+    parser.addOption(targetOption);
+
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    const QUrl url(parser.positionalArguments().first());
+    GstElement *pipeline = createPipeline(url, parser.value(encodingOption).toUpper(),
+                                          parser.value(jitterOption).toInt());
+    if (!pipeline)
+        return 1;
+
+    Measurement measurement;
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    GstPad *pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(pad, GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                      frame_probe_cb, &measurement, nullptr);
+    gst_object_unref(pad);
+    gst_object_unref(sink);
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    gst_bus_add_watch(bus, [](GstBus *, GstMessage *msg, gpointer) -> gboolean {
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+            GError *err = nullptr;
+            gst_message_parse_error(msg, &err, nullptr);
+            qWarning("Error received from element %s: %s", GST_OBJECT_NAME(msg->src), err->message);
+            g_clear_error(&err);
+            QCoreApplication::exit(2);
+        } else if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS) {
+            QCoreApplication::quit();
+        }
+        return TRUE;
+    }, nullptr);
+    gst_object_unref(bus);
+
+    // One line per second, the summary covers the whole measurement
+    const int duration = parser.value(durationOption).toInt();
+    const double target = parser.value(targetOption).toDouble();
+    int seconds = 0;
+    quint64 totalFrames = 0, totalStamped = 0;
+    std::vector<double> all;
+
+    QTimer timer;
+    timer.setInterval(1000);
+    QObject::connect(&timer, &QTimer::timeout, [&]() {
+        quint64 frames = 0, stamped = 0;
+        std::vector<double> latencies;
+        {
+            QMutexLocker locker(&measurement.mutex);
+            std::swap(frames, measurement.frames);
+            std::swap(stamped, measurement.stamped);
+            latencies.swap(measurement.latencies);
+        }
+
+        // Waiting for the sender
+        if (totalStamped == 0 && stamped == 0)
+            return;
+
+        totalFrames += frames;
+        totalStamped += stamped;
+        all.insert(all.end(), latencies.begin(), latencies.end());
+        printf("%s\n", QJsonDocument(summarize(frames, stamped, latencies)).toJson(QJsonDocument::Compact).constData());
+        fflush(stdout);
+
+        if (duration > 0 && ++seconds >= duration) {
+            QJsonObject summary = summarize(totalFrames, totalStamped, all);
+            summary[QStringLiteral("target-ms")] = target;
+            const bool passed = !all.empty() && summary[QStringLiteral("latency-p95-ms")].toDouble() <= target;
+            summary[QStringLiteral("passed")] = passed;
+            printf("%s\n", QJsonDocument(summary).toJson(QJsonDocument::Compact).constData());
+            QCoreApplication::exit(passed ? 0 : 1);
+        }
+    });
+    timer.start();
+
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        qWarning("Unable to start the pipeline");
+        gst_object_unref(pipeline);
+        return 1;
+    }
+
+    const int result = app.exec();
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    gst_deinit();
+    return result;
+}
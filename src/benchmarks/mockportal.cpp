@@ -0,0 +1,268 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+/*
+ * A stand-in for org.freedesktop.portal.ScreenCast that hands out
+ * nodes of the local PipeWire daemon, to measure the time to first
+ * frame on a private session bus without a desktop.
+ *
+ * The source picker is simulated by delaying the response to Start,
+ * unless a valid restore token was passed to SelectSources.
+ *
+ * Usage: screencast-mock-portal --node <id> [options], see --help
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusContext>
+#include <QDBusError>
+#include <QDBusMessage>
+#include <QDBusMetaType>
+#include <QDBusObjectPath>
+#include <QDBusUnixFileDescriptor>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QUuid>
+
+#include <cstdio>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct MockStream {
+    uint nodeId = 0;
+    QVariantMap properties;
+};
+Q_DECLARE_METATYPE(MockStream)
+Q_DECLARE_METATYPE(QList<MockStream>)
+
+QDBusArgument &operator<<(QDBusArgument &arg, const MockStream &stream)
+{
+    arg.beginStructure();
+    arg << stream.nodeId << stream.properties;
+    arg.endStructure();
+    return arg;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &arg, MockStream &stream)
+{
+    arg.beginStructure();
+    arg >> stream.nodeId >> stream.properties;
+    arg.endStructure();
+    return arg;
+}
+
+static int connectToPipeWire()
+{
+    QByteArray dir = qgetenv("PIPEWIRE_RUNTIME_DIR");
+    if (dir.isEmpty())
+        dir = qgetenv("XDG_RUNTIME_DIR");
+    QByteArray name = qgetenv("PIPEWIRE_REMOTE");
+    if (name.isEmpty())
+        name = QByteArrayLiteral("pipewire-0");
+    const QByteArray path = dir + '/' + name;
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (size_t(path.size()) >= sizeof(addr.sun_path))
+        return -1;
+    memcpy(addr.sun_path, path.constData(), size_t(path.size()));
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+class MockScreenCast : public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.freedesktop.portal.ScreenCast")
+    Q_PROPERTY(uint AvailableSourceTypes READ availableSourceTypes)
+    Q_PROPERTY(uint AvailableCursorModes READ availableCursorModes)
+    Q_PROPERTY(uint version READ version)
+public:
+    QVector<uint> nodes;
+    // Response delay of every request and the extra time taken by the picker
+    int delay = 0;
+    int pickerDelay = 1000;
+
+    explicit MockScreenCast(QObject *parent = nullptr)
+        : QObject(parent)
+    {
+        m_timer.start();
+    }
+
+    uint availableSourceTypes() const { return 1; }
+    uint availableCursorModes() const { return 1; }
+    uint version() const { return 4; }
+
+public Q_SLOTS:
+    QDBusObjectPath CreateSession(const QVariantMap &options)
+    {
+        const QString session = objectPath(QStringLiteral("session"),
+                                           options.value(QStringLiteral("session_handle_token")).toString());
+        return respond("CreateSession", options, { { QStringLiteral("session_handle"), session } });
+    }
+
+    QDBusObjectPath SelectSources(const QDBusObjectPath &session, const QVariantMap &options)
+    {
+        const QString token = options.value(QStringLiteral("restore_token")).toString();
+        Session &state = m_sessions[session.path()];
+        state.restored = m_tokens.remove(token);
+        state.persistMode = options.value(QStringLiteral("persist_mode")).toUInt();
+        return respond("SelectSources", options, {});
+    }
+
+    QDBusObjectPath Start(const QDBusObjectPath &session, const QString &parentWindow, const QVariantMap &options)
+    {
+        Q_UNUSED(parentWindow)
+
+        QList<MockStream> streams;
+        for (uint nodeId : qAsConst(nodes)) {
+            MockStream stream;
+            stream.nodeId = nodeId;
+            stream.properties.insert(QStringLiteral("source_type"), 1u);
+            streams.append(stream);
+        }
+
+        QVariantMap results = { { QStringLiteral("streams"), QVariant::fromValue(streams) } };
+        const Session state = m_sessions.value(session.path());
+        if (state.persistMode > 0) {
+            const QString token = QUuid::createUuid().toString().mid(1, 36);
+            m_tokens.insert(token);
+            results.insert(QStringLiteral("restore_token"), token);
+        }
+
+        return respond("Start", options, results, state.restored ? 0 : pickerDelay);
+    }
+
+    QDBusUnixFileDescriptor OpenPipeWireRemote(const QDBusObjectPath &session, const QVariantMap &options)
+    {
+        Q_UNUSED(session)
+        Q_UNUSED(options)
+
+        log("OpenPipeWireRemote");
+        const int fd = connectToPipeWire();
+        if (fd < 0) {
+            sendErrorReply(QDBusError::Failed, QStringLiteral("Unable to connect to PipeWire"));
+            return QDBusUnixFileDescriptor();
+        }
+
+        // The descriptor is duplicated
+        QDBusUnixFileDescriptor result(fd);
+        close(fd);
+        return result;
+    }
+
+private:
+    struct Session {
+        bool restored = false;
+        uint persistMode = 0;
+    };
+
+    QElapsedTimer m_timer;
+    QHash<QString, Session> m_sessions;
+    QSet<QString> m_tokens;
+
+    void log(const char *method, const char *note = "")
+    {
+        fprintf(stderr, "%6lld ms %s%s\n", m_timer.elapsed(), method, note);
+    }
+
+    QString objectPath(const QString &kind, const QString &token) const
+    {
+        // Same scheme as xdg-desktop-portal
+        QString sender = message().service().mid(1);
+        sender.replace(QLatin1Char('.'), QLatin1Char('_'));
+        return QStringLiteral("/org/freedesktop/portal/desktop/%1/%2/%3").arg(kind, sender, token);
+    }
+
+    QDBusObjectPath respond(const char *method, const QVariantMap &options, const QVariantMap &results,
+                            int extraDelay = 0)
+    {
+        log(method, extraDelay > 0 ? " (picker)" : "");
+
+        const QString request = objectPath(QStringLiteral("request"),
+                                           options.value(QStringLiteral("handle_token")).toString());
+        const QString sender = message().service();
+
+        // Like the real portal, the response comes after the reply
+        QTimer::singleShot(delay + extraDelay, this, [request, sender, results]() {
+            auto signal = QDBusMessage::createTargetedSignal(sender, request,
+                                                             QStringLiteral("org.freedesktop.portal.Request"),
+                                                             QStringLiteral("Response"));
+            signal << 0u << results;
+            QDBusConnection::sessionBus().send(signal);
+        });
+
+        return QDBusObjectPath(request);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Mock screen cast portal for startup measurements"));
+    parser.addHelpOption();
+
+    QCommandLineOption nodeOption(QStringLiteral("node"),
+                                  QStringLiteral("PipeWire node handed out as a stream, can be repeated."),
+                                  QStringLiteral("id"));
+    parser.addOption(nodeOption);
+    QCommandLineOption delayOption(QStringLiteral("delay"),
+                                   QStringLiteral("Time the portal takes to answer each request."),
+                                   QStringLiteral("ms"), QStringLiteral("0"));
+    parser.addOption(delayOption);
+    QCommandLineOption pickerDelayOption(QStringLiteral("picker-delay"),
+                                         QStringLiteral("Time the user takes to pick the sources, skipped with a valid restore token."),
+                                         QStringLiteral("ms"), QStringLiteral("1000"));
+    parser.addOption(pickerDelayOption);
+
+    parser.process(app);
+
+    qDBusRegisterMetaType<MockStream>();
+    qDBusRegisterMetaType<QList<MockStream>>();
+
+    MockScreenCast screenCast;
+    for (const QString &node : parser.values(nodeOption)) {
+        if (node.toUInt() == 0) {
+            fprintf(stderr, "Invalid node \"%s\".\n", qPrintable(node));
+            return 1;
+        }
+        screenCast.nodes.append(node.toUInt());
+    }
+    if (screenCast.nodes.isEmpty()) {
+        fprintf(stderr, "At least one node is required.\n");
+        return 1;
+    }
+    screenCast.delay = qMax(0, parser.value(delayOption).toInt());
+    screenCast.pickerDelay = qMax(0, parser.value(pickerDelayOption).toInt());
+
+    auto bus = QDBusConnection::sessionBus();
+    if (!bus.registerObject(QStringLiteral("/org/freedesktop/portal/desktop"), &screenCast,
+                            QDBusConnection::ExportAllSlots | QDBusConnection::ExportAllProperties) ||
+            !bus.registerService(QStringLiteral("org.freedesktop.portal.Desktop"))) {
+        fprintf(stderr, "Unable to register the portal: %s\n", qPrintable(bus.lastError().message()));
+        return 1;
+    }
+
+    return app.exec();
+}
+
+#include "mockportal.moc"
@@ -0,0 +1,588 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+/*
+ * Runs the recording pipeline, from capture to the muxer, with
+ * videotestsrc standing in for PipeWire and prints one JSON object
+ * per configuration.
+ *
+ * Every configuration runs in a child process so that its peak
+ * memory usage is measured on its own.
+ *
+ * With --spool the encoder is also replaced by the spool sink, to
+ * compare what recording costs with and without deferred encoding.
+ *
+ * With --thread-layout shared,staged every configuration runs with
+ * both layouts, the CPU time of each stage's streaming threads is
+ * part of the result.
+ *
+ * With --memory-budget the capture branch is put on a memory budget of
+ * that many MiB, the most memory its raw frames took and how many of
+ * them were dropped are part of the result.
+ *
+ * Usage: screencast-bench [options], see --help
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QScopedPointer>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "capturebranch.h"
+#include "elements.h"
+#include "encoder.h"
+#include "memorybudget.h"
+
+#include <gst/gst.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Defined by screencast.cpp in the application
+Q_LOGGING_CATEGORY(lcScreencast, "liri.screencast")
+
+struct Configuration {
+    int width = 0;
+    int height = 0;
+    QString format;
+    EncoderSettings encoderSettings;
+    // Compression of the spool written instead of encoding, if not empty
+    QString spool;
+    bool moving = true;
+    int framerate = 60;
+    bool live = true;
+    bool deduplicate = true;
+    int warmup = 1;
+    int duration = 5;
+    ThreadLayout::Layout threadLayout = ThreadLayout::Shared;
+    // MiB, 0 runs without a budget
+    int memoryBudget = 0;
+    MemoryBudget::Policy memoryPolicy = MemoryBudget::DropOldest;
+};
+
+// Frame timings, from the probes on the streaming threads
+struct Measurement {
+    QMutex mutex;
+    bool running = false;
+    std::map<GstClockTime, qint64> captured;
+    std::vector<double> latencies;
+    quint64 frames = 0;
+    quint64 encoded = 0;
+};
+
+static GstPadProbeReturn capture_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    Measurement *measurement = static_cast<Measurement *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    QMutexLocker locker(&measurement->mutex);
+    if (!measurement->running)
+        return GST_PAD_PROBE_OK;
+
+    measurement->frames++;
+    if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+        // Deduplicated frames never come out
+        if (measurement->captured.size() >= 4096)
+            measurement->captured.erase(measurement->captured.begin());
+        measurement->captured[GST_BUFFER_PTS(buffer)] = g_get_monotonic_time();
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn encoded_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    Measurement *measurement = static_cast<Measurement *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    QMutexLocker locker(&measurement->mutex);
+    if (!measurement->running)
+        return GST_PAD_PROBE_OK;
+
+    measurement->encoded++;
+    auto it = measurement->captured.find(GST_BUFFER_PTS(buffer));
+    if (it != measurement->captured.end()) {
+        measurement->latencies.push_back((g_get_monotonic_time() - it->second) / 1000.0);
+        measurement->captured.erase(it);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static qint64 cpuTime()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+
+    return (qint64(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000 +
+            usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// CPU time of the streaming threads of each stage
+static QVector<qint64> stageTimes(const ThreadLayout &threads)
+{
+    QVector<qint64> times(ThreadLayout::Other + 1, 0);
+    for (const auto &thread : threads.threads())
+        times[thread.stage] += thread.cpuTime;
+    return times;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(p * (sorted.size() - 1) + 0.5))];
+}
+
+static QJsonObject describe(const Configuration &config)
+{
+    QJsonObject object;
+    object[QStringLiteral("resolution")] = QStringLiteral("%1x%2").arg(config.width).arg(config.height);
+    object[QStringLiteral("format")] = config.format;
+    if (config.spool.isEmpty()) {
+        object[QStringLiteral("encoder")] = EncoderSettings::codecNames().at(config.encoderSettings.codec);
+        object[QStringLiteral("preset")] = EncoderSettings::presetNames().at(config.encoderSettings.preset);
+        object[QStringLiteral("threads")] = config.encoderSettings.effectiveThreads();
+    } else {
+        object[QStringLiteral("encoder")] = QStringLiteral("spool-%1").arg(config.spool);
+    }
+    object[QStringLiteral("pattern")] = config.moving ? QStringLiteral("moving") : QStringLiteral("static");
+    object[QStringLiteral("live")] = config.live;
+    object[QStringLiteral("framerate")] = config.framerate;
+    object[QStringLiteral("thread-layout")] = ThreadLayout::layoutName(config.threadLayout);
+    if (config.memoryBudget > 0) {
+        object[QStringLiteral("memory-budget-mib")] = config.memoryBudget;
+        object[QStringLiteral("memory-policy")] = MemoryBudget::policyName(config.memoryPolicy);
+    }
+    return object;
+}
+
+static QJsonObject run(const Configuration &config)
+{
+    QJsonObject result = describe(config);
+
+    const bool spool = !config.spool.isEmpty();
+    QScopedPointer<Encoder> encoder(Encoder::create(config.encoderSettings.codec));
+    if (!spool && !encoder->isAvailable()) {
+        result[QStringLiteral("error")] = QStringLiteral("encoder not available");
+        return result;
+    }
+
+    GstElement *pipeline = gst_pipeline_new(nullptr);
+    GstBin *bin = GST_BIN(pipeline);
+
+    // Same caps as a compositor would negotiate
+    GstElement *src = gst_element_factory_make("videotestsrc", nullptr);
+    GstElement *filter = gst_element_factory_make("capsfilter", nullptr);
+    // The spool sink takes the place of encoder, muxer and sink
+    GstElement *muxer = spool ? nullptr : encoder->createMuxer(config.encoderSettings);
+    GstElement *sink = spool ? nullptr : gst_element_factory_make("fakesink", nullptr);
+    if (!src || !filter || (!spool && (!muxer || !sink))) {
+        for (auto *element : { src, filter, muxer, sink }) {
+            if (element)
+                gst_object_unref(gst_object_ref_sink(element));
+        }
+        gst_object_unref(pipeline);
+        result[QStringLiteral("error")] = QStringLiteral("missing elements");
+        return result;
+    }
+
+    g_object_set(src, "is-live", gboolean(config.live), "pattern", 0 /* smpte */,
+                 "horizontal-speed", config.moving ? 8 : 0, nullptr);
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "format", G_TYPE_STRING, config.format.toUtf8().constData(),
+                                        "width", G_TYPE_INT, config.width,
+                                        "height", G_TYPE_INT, config.height,
+                                        "framerate", GST_TYPE_FRACTION, config.framerate, 1,
+                                        nullptr);
+    g_object_set(filter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+    if (sink)
+        g_object_set(sink, "sync", FALSE, nullptr);
+
+    CaptureSettings captureSettings;
+    captureSettings.framerate = config.framerate;
+    captureSettings.deduplicate = config.deduplicate;
+    captureSettings.spool = spool;
+    captureSettings.threadLayout = config.threadLayout;
+    Spool::parseCompression(config.spool.toUtf8().constData(), &captureSettings.spoolCompression);
+
+    CaptureBranch branch;
+    if (!addAndLinkElements(bin, { src, filter }) || (!spool && !addAndLinkElements(bin, { muxer, sink })) ||
+            !branch.create(bin, filter, config.format, captureSettings, encoder.data(), config.encoderSettings) ||
+            (!spool && !gst_element_link(branch.tail, muxer))) {
+        gst_object_unref(pipeline);
+        result[QStringLiteral("error")] = QStringLiteral("unable to build the pipeline");
+        return result;
+    }
+
+    // Written to the disk like a recording would
+    const QByteArray spoolFile = QDir::temp().filePath(QStringLiteral("screencast-bench-%1.spool")
+                                                       .arg(getpid())).toUtf8();
+    if (spool)
+        g_object_set(branch.encoder, "location", spoolFile.constData(), nullptr);
+
+    Measurement measurement;
+    GstPad *capturePad = gst_element_get_static_pad(filter, "src");
+    gst_pad_add_probe(capturePad, GST_PAD_PROBE_TYPE_BUFFER, capture_probe_cb, &measurement, nullptr);
+    gst_object_unref(capturePad);
+    GstPad *encodedPad = gst_element_get_static_pad(branch.tail, spool ? "sink" : "src");
+    gst_pad_add_probe(encodedPad, GST_PAD_PROBE_TYPE_BUFFER, encoded_probe_cb, &measurement, nullptr);
+    gst_object_unref(encodedPad);
+
+    // The source stands in for the compositor's, on the capture thread
+    ThreadLayout::assign(src, ThreadLayout::Capture);
+    if (muxer)
+        ThreadLayout::assign(muxer, ThreadLayout::Mux);
+    QScopedPointer<ThreadLayout> threads(new ThreadLayout(pipeline));
+    threads->setPolicies(captureSettings);
+    QVector<qint64> startStageTimes;
+
+    QScopedPointer<MemoryBudget> budget;
+    MemoryBudget::Account *account = nullptr;
+    if (config.memoryBudget > 0) {
+        budget.reset(new MemoryBudget(quint64(config.memoryBudget) * 1024 * 1024, config.memoryPolicy));
+        account = budget->addAccount();
+        budget->addBranch(account, branch.convertQueue, branch.convert, branch.queue);
+    }
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    QString error;
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+        error = QStringLiteral("unable to start the pipeline");
+
+    // Warm up, then measure
+    QElapsedTimer timer;
+    qint64 startCpu = 0, startWall = 0;
+    timer.start();
+    const qint64 end = qint64(config.warmup + config.duration) * 1000;
+    while (error.isEmpty() && timer.elapsed() < end) {
+        if (!measurement.running && timer.elapsed() >= config.warmup * 1000) {
+            QMutexLocker locker(&measurement.mutex);
+            measurement.running = true;
+            startCpu = cpuTime();
+            startStageTimes = stageTimes(*threads);
+            startWall = timer.nsecsElapsed() / 1000;
+        }
+
+        GstMessage *msg = gst_bus_timed_pop_filtered(bus, 50 * GST_MSECOND,
+                                                     GstMessageType(GST_MESSAGE_ERROR | GST_MESSAGE_EOS));
+        if (!msg)
+            continue;
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+            GError *err = nullptr;
+            gst_message_parse_error(msg, &err, nullptr);
+            error = QString::fromUtf8(err->message);
+            g_clear_error(&err);
+        } else {
+            error = QStringLiteral("unexpected end of stream");
+        }
+        gst_message_unref(msg);
+    }
+
+    {
+        QMutexLocker locker(&measurement.mutex);
+        measurement.running = false;
+    }
+    const double wall = (timer.nsecsElapsed() / 1000 - startWall) / 1e6;
+    const double cpu = (cpuTime() - startCpu) / 1e6;
+    const QVector<qint64> endStageTimes = stageTimes(*threads);
+    const MemoryBudget::Usage memory = account ? budget->usage(account) : MemoryBudget::Usage();
+
+    if (spool) {
+        GstStructure *stats = nullptr;
+        g_object_get(branch.encoder, "stats", &stats, nullptr);
+        guint64 frames = 0, bytesIn = 0, bytesWritten = 0, renderTime = 0;
+        if (stats) {
+            gst_structure_get_uint64(stats, "frames", &frames);
+            gst_structure_get_uint64(stats, "bytes-in", &bytesIn);
+            gst_structure_get_uint64(stats, "bytes-written", &bytesWritten);
+            gst_structure_get_uint64(stats, "render-time", &renderTime);
+            gst_structure_free(stats);
+        }
+        result[QStringLiteral("spool-ratio")] = bytesWritten > 0 ? double(bytesIn) / bytesWritten : 0;
+        result[QStringLiteral("spool-ms-per-frame")] = frames > 0 ? renderTime / 1e6 / frames : 0;
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    threads.reset();
+    budget.reset();
+    gst_object_unref(bus);
+    gst_object_unref(pipeline);
+    if (spool)
+        unlink(spoolFile.constData());
+
+    if (!error.isEmpty()) {
+        result[QStringLiteral("error")] = error;
+        return result;
+    }
+
+    std::sort(measurement.latencies.begin(), measurement.latencies.end());
+    QJsonObject latency;
+    latency[QStringLiteral("p50")] = percentile(measurement.latencies, 0.5);
+    latency[QStringLiteral("p90")] = percentile(measurement.latencies, 0.9);
+    latency[QStringLiteral("p99")] = percentile(measurement.latencies, 0.99);
+    latency[QStringLiteral("max")] = measurement.latencies.empty() ? 0 : measurement.latencies.back();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    result[QStringLiteral("seconds")] = wall;
+    result[QStringLiteral("frames")] = double(measurement.frames);
+    result[QStringLiteral("fps")] = measurement.frames / wall;
+    result[QStringLiteral("encoded-fps")] = measurement.encoded / wall;
+    result[QStringLiteral("latency-ms")] = latency;
+    result[QStringLiteral("cpu-seconds")] = cpu;
+    result[QStringLiteral("cpu-cores")] = cpu / wall;
+    // What isn't in any stage ran on threads the elements started themselves
+    QJsonObject stages;
+    for (int stage = ThreadLayout::Capture; stage <= ThreadLayout::Other; ++stage) {
+        const qint64 time = endStageTimes.value(stage) - startStageTimes.value(stage);
+        if (time > 0)
+            stages[ThreadLayout::stageName(ThreadLayout::Stage(stage))] = time / 1e9 / wall;
+    }
+    result[QStringLiteral("stage-cpu-cores")] = stages;
+    result[QStringLiteral("peak-rss-kib")] = double(usage.ru_maxrss);
+    if (account) {
+        result[QStringLiteral("frames-peak-bytes")] = double(memory.peak);
+        result[QStringLiteral("frames-dropped")] = double(memory.dropped);
+    }
+    return result;
+}
+
+static void print(const QJsonObject &object)
+{
+    printf("%s\n", QJsonDocument(object).toJson(QJsonDocument::Compact).constData());
+    fflush(stdout);
+}
+
+static QStringList splitList(const QString &value)
+{
+    return value.split(QLatin1Char(','), QString::SkipEmptyParts);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Benchmark of the capture, convert, encode and mux pipeline"));
+    parser.addHelpOption();
+
+    QCommandLineOption resolutionOption(QStringLiteral("resolution"),
+                                        QStringLiteral("Comma separated list of resolutions."),
+                                        QStringLiteral("WxH"), QStringLiteral("1280x720,1920x1080,3840x2160"));
+    parser.addOption(resolutionOption);
+    QCommandLineOption formatOption(QStringLiteral("format"),
+                                    QStringLiteral("Comma separated list of source formats."),
+                                    QStringLiteral("formats"), QStringLiteral("BGRx,NV12"));
+    parser.addOption(formatOption);
+    QCommandLineOption encoderOption(QStringLiteral("encoder"),
+                                     QStringLiteral("Comma separated list of encoders, one of: %1.")
+                                     .arg(EncoderSettings::codecNames().join(QLatin1String(", "))),
+                                     QStringLiteral("names"), EncoderSettings::codecNames().join(QLatin1Char(',')));
+    parser.addOption(encoderOption);
+    QCommandLineOption presetOption(QStringLiteral("preset"),
+                                    QStringLiteral("Encoder preset."),
+                                    QStringLiteral("preset"), QStringLiteral("fast"));
+    parser.addOption(presetOption);
+    QCommandLineOption threadsOption(QStringLiteral("threads"),
+                                     QStringLiteral("Comma separated list of encoder thread counts, 0 uses all cores."),
+                                     QStringLiteral("counts"), QStringLiteral("1,0"));
+    parser.addOption(threadsOption);
+    QCommandLineOption patternOption(QStringLiteral("pattern"),
+                                     QStringLiteral("Comma separated list of patterns, moving or static."),
+                                     QStringLiteral("patterns"), QStringLiteral("moving,static"));
+    parser.addOption(patternOption);
+    QCommandLineOption framerateOption(QStringLiteral("framerate"),
+                                       QStringLiteral("Capture framerate."),
+                                       QStringLiteral("fps"), QStringLiteral("60"));
+    parser.addOption(framerateOption);
+    QCommandLineOption unthrottledOption(QStringLiteral("unthrottled"),
+                                         QStringLiteral("Produce frames as fast as the pipeline takes them instead of in real time, latency then includes queueing."));
+    parser.addOption(unthrottledOption);
+    QCommandLineOption noDedupOption(QStringLiteral("no-deduplicate"),
+                                     QStringLiteral("Encode frames even when they are identical to the previous one."));
+    parser.addOption(noDedupOption);
+    QCommandLineOption spoolOption(QStringLiteral("spool"),
+                                   QStringLiteral("Comma separated list of spool compressions (lz4, zstd, none) to also run with the spool sink in place of the encoder."),
+                                   QStringLiteral("methods"));
+    parser.addOption(spoolOption);
+    QCommandLineOption threadLayoutOption(QStringLiteral("thread-layout"),
+                                          QStringLiteral("Comma separated list of streaming thread layouts, one of: %1.")
+                                          .arg(ThreadLayout::layoutNames().join(QLatin1String(", "))),
+                                          QStringLiteral("layouts"), ThreadLayout::layoutName(ThreadLayout::Shared));
+    parser.addOption(threadLayoutOption);
+    QCommandLineOption memoryBudgetOption(QStringLiteral("memory-budget"),
+                                          QStringLiteral("Comma separated list of memory budgets for raw frames, 0 runs without one."),
+                                          QStringLiteral("MiB"), QStringLiteral("0"));
+    parser.addOption(memoryBudgetOption);
+    QCommandLineOption memoryPolicyOption(QStringLiteral("memory-policy"),
+                                          QStringLiteral("Which frame to drop when the budget is used up, one of: %1.")
+                                          .arg(MemoryBudget::policyNames().join(QLatin1String(", "))),
+                                          QStringLiteral("policy"), MemoryBudget::policyName(MemoryBudget::DropOldest));
+    parser.addOption(memoryPolicyOption);
+    QCommandLineOption durationOption(QStringLiteral("duration"),
+                                      QStringLiteral("Seconds to measure each configuration for, after one second of warm-up."),
+                                      QStringLiteral("seconds"), QStringLiteral("5"));
+    parser.addOption(durationOption);
+
+    parser.process(app);
+
+    Configuration base;
+    base.framerate = qMax(1, parser.value(framerateOption).toInt());
+    base.live = !parser.isSet(unthrottledOption);
+    base.deduplicate = !parser.isSet(noDedupOption);
+    base.duration = qMax(1, parser.value(durationOption).toInt());
+    if (!EncoderSettings::parsePreset(parser.value(presetOption), base.encoderSettings.preset)) {
+        fprintf(stderr, "Unknown preset \"%s\".\n", qPrintable(parser.value(presetOption)));
+        return 1;
+    }
+    if (!MemoryBudget::parsePolicy(parser.value(memoryPolicyOption), base.memoryPolicy)) {
+        fprintf(stderr, "Unknown memory policy \"%s\".\n", qPrintable(parser.value(memoryPolicyOption)));
+        return 1;
+    }
+
+    QVector<Configuration> configs;
+    const auto resolutions = splitList(parser.value(resolutionOption));
+    const auto formats = splitList(parser.value(formatOption));
+    const auto encoders = splitList(parser.value(encoderOption));
+    const auto threadCounts = splitList(parser.value(threadsOption));
+    const auto patterns = splitList(parser.value(patternOption));
+    const auto spools = splitList(parser.value(spoolOption));
+    for (const auto &name : spools) {
+        Spool::Compression compression;
+        if (!Spool::parseCompression(name.toUtf8().constData(), &compression) || !Spool::isSupported(compression)) {
+            fprintf(stderr, "Unsupported spool compression \"%s\".\n", qPrintable(name));
+            return 1;
+        }
+    }
+    for (const auto &resolution : resolutions) {
+        const auto size = resolution.split(QLatin1Char('x'));
+        Configuration config = base;
+        config.width = size.value(0).toInt();
+        config.height = size.value(1).toInt();
+        if (size.size() != 2 || config.width <= 0 || config.height <= 0) {
+            fprintf(stderr, "Invalid resolution \"%s\".\n", qPrintable(resolution));
+            return 1;
+        }
+
+        for (const auto &format : formats) {
+            config.format = format;
+            for (const auto &name : encoders) {
+                if (!EncoderSettings::parseCodec(name, config.encoderSettings.codec)) {
+                    fprintf(stderr, "Unknown encoder \"%s\".\n", qPrintable(name));
+                    return 1;
+                }
+                for (const auto &threads : threadCounts) {
+                    config.encoderSettings.threads = qMax(0, threads.toInt());
+                    for (const auto &pattern : patterns) {
+                        config.moving = pattern != QLatin1String("static");
+                        configs.append(config);
+                    }
+                }
+            }
+
+            // Encoder settings don't apply, the spool is encoded later
+            for (const auto &name : spools) {
+                Configuration spoolConfig = config;
+                spoolConfig.spool = name;
+                for (const auto &pattern : patterns) {
+                    spoolConfig.moving = pattern != QLatin1String("static");
+                    configs.append(spoolConfig);
+                }
+            }
+        }
+    }
+
+    // Every configuration with each layout, one after the other
+    QVector<ThreadLayout::Layout> layouts;
+    for (const auto &name : splitList(parser.value(threadLayoutOption))) {
+        ThreadLayout::Layout layout;
+        if (!ThreadLayout::parseLayout(name, layout)) {
+            fprintf(stderr, "Unknown thread layout \"%s\".\n", qPrintable(name));
+            return 1;
+        }
+        layouts.append(layout);
+    }
+    QVector<Configuration> layoutConfigs;
+    for (const auto &config : qAsConst(configs)) {
+        for (const auto layout : qAsConst(layouts)) {
+            Configuration layoutConfig = config;
+            layoutConfig.threadLayout = layout;
+            layoutConfigs.append(layoutConfig);
+        }
+    }
+    configs = layoutConfigs;
+
+    // And with each budget
+    QVector<int> budgets;
+    for (const auto &value : splitList(parser.value(memoryBudgetOption))) {
+        bool ok = false;
+        const int budget = value.toInt(&ok);
+        if (!ok || budget < 0) {
+            fprintf(stderr, "Invalid memory budget \"%s\".\n", qPrintable(value));
+            return 1;
+        }
+        budgets.append(budget);
+    }
+    QVector<Configuration> budgetConfigs;
+    for (const auto &config : qAsConst(configs)) {
+        for (int budget : qAsConst(budgets)) {
+            Configuration budgetConfig = config;
+            budgetConfig.memoryBudget = budget;
+            budgetConfigs.append(budgetConfig);
+        }
+    }
+    configs = budgetConfigs;
+
+    // GStreamer is only initialized in the children, the parent stays single threaded
+    for (const auto &config : qAsConst(configs)) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            gst_init(nullptr, nullptr);
+            if (!registerElements()) {
+                QJsonObject result = describe(config);
+                result[QStringLiteral("error")] = QStringLiteral("unable to register the built-in elements");
+                print(result);
+                _exit(1);
+            }
+            print(run(config));
+            _exit(0);
+        }
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status)) {
+            QJsonObject result = describe(config);
+            result[QStringLiteral("error")] = QStringLiteral("crashed");
+            print(result);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,260 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+/*
+ * Encodes and decodes videotestsrc patterns with the lossless screen
+ * codec, on one and two threads, and checks that every decoded frame
+ * is identical to the source.
+ *
+ * Then the same round trip through the screencastscreenenc and
+ * screencastscreendec elements.
+ *
+ * Exits with 1 when a frame doesn't match.
+ *
+ * Usage: screencast-screencodec-bench [frames] [width] [height]
+ */
+
+#include <QLoggingCategory>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "screencodec.h"
+#include "screendecelement.h"
+#include "screenencelement.h"
+#include "slicepool.h"
+
+#include <gst/app/gstappsink.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+// Defined by screencast.cpp in the application
+Q_LOGGING_CATEGORY(lcScreencast, "liri.screencast")
+
+struct Pattern {
+    const char *name;
+    const char *properties;
+};
+
+// From mostly static, like a desktop, to noise that only raw tiles can hold
+static const Pattern patterns[] = {
+    { "ball", "pattern=ball background-color=0xff303030" },
+    { "smpte-scroll", "pattern=smpte horizontal-speed=4" },
+    { "zone-plate", "pattern=zone-plate kx2=20 ky2=20 kt=1" },
+    { "snow", "pattern=snow" },
+};
+
+static GstElement *launch(const char *description)
+{
+    GError *error = nullptr;
+    GstElement *pipeline = gst_parse_launch(description, &error);
+    if (!pipeline) {
+        fprintf(stderr, "Unable to create the pipeline: %s\n", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return nullptr;
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    return pipeline;
+}
+
+static GstSample *pull(GstElement *pipeline, const char *name)
+{
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), name);
+    GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(sink));
+    gst_object_unref(sink);
+    return sample;
+}
+
+static bool sameFrame(const uint8_t *a, int aStride, const uint8_t *b, int bStride, int width, int height)
+{
+    for (int y = 0; y < height; ++y) {
+        if (memcmp(a + y * aStride, b + y * bStride, size_t(width) * 4) != 0)
+            return false;
+    }
+    return true;
+}
+
+static bool benchmarkCodec(const Pattern &pattern, int frames, int width, int height, int threads)
+{
+    char description[512];
+    snprintf(description, sizeof(description),
+             "videotestsrc %s num-buffers=%d ! "
+             "video/x-raw,format=BGRx,width=%d,height=%d,framerate=30/1 ! "
+             "appsink name=sink sync=false",
+             pattern.properties, frames, width, height);
+    GstElement *pipeline = launch(description);
+    if (!pipeline)
+        return false;
+
+    SlicePool pool(threads);
+    ScreenEncoder encoder(width, height, threads * 2);
+    ScreenDecoder decoder(width, height);
+    std::vector<uint8_t> compressed;
+
+    // Decoded frames alternate, the one before is the reference
+    const int stride = width * 4;
+    std::vector<uint8_t> decoded[2] = {
+        std::vector<uint8_t>(size_t(stride) * height),
+        std::vector<uint8_t>(size_t(stride) * height),
+    };
+
+    double encodeMs = 0, decodeMs = 0;
+    int count = 0;
+    bool matches = true;
+
+    while (GstSample *sample = pull(pipeline, "sink")) {
+        GstVideoInfo info;
+        gst_video_info_from_caps(&info, gst_sample_get_caps(sample));
+        GstVideoFrame frame;
+        gst_video_frame_map(&frame, &info, gst_sample_get_buffer(sample), GST_MAP_READ);
+        const uint8_t *pixels = static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0));
+        const int pixelsStride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0);
+
+        compressed.clear();
+        auto start = std::chrono::steady_clock::now();
+        encoder.encode(pixels, pixelsStride, count == 0, compressed, &pool);
+        auto end = std::chrono::steady_clock::now();
+        encodeMs += std::chrono::duration<double, std::milli>(end - start).count();
+
+        uint8_t *current = decoded[count % 2].data();
+        const uint8_t *previous = count > 0 ? decoded[(count + 1) % 2].data() : nullptr;
+        start = std::chrono::steady_clock::now();
+        const bool succeeded = decoder.decode(compressed.data(), compressed.size(),
+                                              previous, stride, current, stride, &pool);
+        end = std::chrono::steady_clock::now();
+        decodeMs += std::chrono::duration<double, std::milli>(end - start).count();
+
+        if (!succeeded || !sameFrame(pixels, pixelsStride, current, stride, width, height)) {
+            fprintf(stderr, "%s: frame %d doesn't match after the round trip\n", pattern.name, count);
+            matches = false;
+        }
+
+        gst_video_frame_unmap(&frame);
+        gst_sample_unref(sample);
+        ++count;
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    if (count == 0)
+        return false;
+
+    const auto &stats = encoder.stats();
+    const double tiles = double(stats.skipTiles + stats.paletteTiles + stats.rawTiles);
+    printf("%-12s %dx%d %d threads  encode %7.2f ms/frame %7.1f fps  decode %7.2f ms/frame %7.1f fps  "
+           "ratio %7.1f:1  skip %5.1f%%  palette %5.1f%%  raw %5.1f%%\n",
+           pattern.name, width, height, threads,
+           encodeMs / count, count * 1000.0 / encodeMs, decodeMs / count, count * 1000.0 / decodeMs,
+           stats.bytesOut > 0 ? double(stats.bytesIn) / stats.bytesOut : 0,
+           100.0 * stats.skipTiles / tiles, 100.0 * stats.paletteTiles / tiles, 100.0 * stats.rawTiles / tiles);
+    fflush(stdout);
+
+    return matches;
+}
+
+static bool checkElements(int frames, int width, int height)
+{
+    // The keyframe interval makes the decoder go through both kinds of frames
+    char description[512];
+    snprintf(description, sizeof(description),
+             "videotestsrc pattern=ball num-buffers=%d ! "
+             "video/x-raw,format=BGRx,width=%d,height=%d,framerate=30/1 ! tee name=t "
+             "t. ! queue ! appsink name=source sync=false "
+             "t. ! queue ! screencastscreenenc keyframe-interval=10 ! screencastscreendec ! "
+             "appsink name=decoded sync=false",
+             frames, width, height);
+    GstElement *pipeline = launch(description);
+    if (!pipeline)
+        return false;
+
+    int count = 0;
+    bool matches = true;
+    while (GstSample *source = pull(pipeline, "source")) {
+        GstSample *decoded = pull(pipeline, "decoded");
+        if (!decoded) {
+            fprintf(stderr, "elements: frame %d is missing\n", count);
+            gst_sample_unref(source);
+            matches = false;
+            break;
+        }
+
+        GstVideoInfo sourceInfo, decodedInfo;
+        gst_video_info_from_caps(&sourceInfo, gst_sample_get_caps(source));
+        gst_video_info_from_caps(&decodedInfo, gst_sample_get_caps(decoded));
+        GstVideoFrame sourceFrame, decodedFrame;
+        gst_video_frame_map(&sourceFrame, &sourceInfo, gst_sample_get_buffer(source), GST_MAP_READ);
+        gst_video_frame_map(&decodedFrame, &decodedInfo, gst_sample_get_buffer(decoded), GST_MAP_READ);
+
+        if (!sameFrame(static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&sourceFrame, 0)),
+                       GST_VIDEO_FRAME_PLANE_STRIDE(&sourceFrame, 0),
+                       static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&decodedFrame, 0)),
+                       GST_VIDEO_FRAME_PLANE_STRIDE(&decodedFrame, 0), width, height)) {
+            fprintf(stderr, "elements: frame %d doesn't match after the round trip\n", count);
+            matches = false;
+        }
+
+        gst_video_frame_unmap(&decodedFrame);
+        gst_video_frame_unmap(&sourceFrame);
+        gst_sample_unref(decoded);
+        gst_sample_unref(source);
+        ++count;
+    }
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+    if (msg) {
+        GError *error = nullptr;
+        gst_message_parse_error(msg, &error, nullptr);
+        fprintf(stderr, "elements: %s\n", error->message);
+        g_clear_error(&error);
+        gst_message_unref(msg);
+        matches = false;
+    }
+    gst_object_unref(bus);
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    printf("%-12s %dx%d %d frames %s\n", "elements", width, height, count,
+           matches && count == frames ? "identical" : "MISMATCH");
+    return matches && count == frames;
+}
+
+int main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+
+    const int frames = argc > 1 ? atoi(argv[1]) : 120;
+    const int width = argc > 2 ? atoi(argv[2]) : 3840;
+    const int height = argc > 3 ? atoi(argv[3]) : 2160;
+    if (frames <= 0 || width <= 0 || height <= 0) {
+        fprintf(stderr, "Usage: %s [frames] [width] [height]\n", argv[0]);
+        return 1;
+    }
+
+    if (!gst_element_register(nullptr, "screencastscreenenc", GST_RANK_NONE, SCREENCAST_TYPE_SCREEN_ENC) ||
+            !gst_element_register(nullptr, "screencastscreendec", GST_RANK_NONE, SCREENCAST_TYPE_SCREEN_DEC)) {
+        fprintf(stderr, "Unable to register the screen codec elements.\n");
+        return 1;
+    }
+
+    bool succeeded = true;
+    for (const auto &pattern : patterns) {
+        // The codec is meant to keep up with 4K on one or two cores
+        for (int threads : { 1, 2 })
+            succeeded = benchmarkCodec(pattern, frames, width, height, threads) && succeeded;
+    }
+    succeeded = checkElements(std::min(frames, 60), width, height) && succeeded;
+
+    gst_deinit();
+    return succeeded ? 0 : 1;
+}
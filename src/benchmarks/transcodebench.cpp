@@ -0,0 +1,254 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+/*
+ * Encodes the same input with a growing number of threads in the
+ * chunked transcoder and prints one JSON object per run, with the
+ * speedup over the first run.
+ *
+ * Without --input a spool of a moving test pattern is recorded first.
+ * Before that, a freshly built pool is checked to hand its first job
+ * to every thread.
+ *
+ * Usage: screencast-transcode-bench [options], see --help
+ */
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QScopedPointer>
+#include <QThread>
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "elements.h"
+#include "encoder.h"
+#include "spool.h"
+#include "transcoder.h"
+#include "workstealingpool.h"
+
+#include <gst/gst.h>
+
+// Defined by screencast.cpp in the application
+Q_LOGGING_CATEGORY(lcScreencast, "liri.screencast")
+
+static void print(const QJsonObject &object)
+{
+    printf("%s\n", QJsonDocument(object).toJson(QJsonDocument::Compact).constData());
+    fflush(stdout);
+}
+
+static QStringList splitList(const QString &value)
+{
+    return value.split(QLatin1Char(','), QString::SkipEmptyParts);
+}
+
+static bool checkPool(int threads)
+{
+    // Tasks long enough for every worker to wake up and take some
+    WorkStealingPool pool(threads);
+    std::mutex mutex;
+    std::set<std::thread::id> used;
+    pool.run(pool.threadCount() * 4, [&mutex, &used](int) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::lock_guard<std::mutex> locker(mutex);
+        used.insert(std::this_thread::get_id());
+    });
+
+    QJsonObject result;
+    result[QStringLiteral("check")] = QStringLiteral("pool");
+    result[QStringLiteral("threads")] = pool.threadCount();
+    result[QStringLiteral("threads-used")] = int(used.size());
+    print(result);
+
+    return int(used.size()) == pool.threadCount();
+}
+
+static bool recordSpool(const QString &fileName, int width, int height, int framerate, int seconds,
+                        Spool::Compression compression)
+{
+    // What the capture branch spools, as fast as it can be written
+    const QString description = QStringLiteral(
+                "videotestsrc pattern=smpte horizontal-speed=4 num-buffers=%1 ! "
+                "video/x-raw,format=I420,width=%2,height=%3,framerate=%4/1 ! "
+                "screencastspoolsink name=sink keyframe-interval=%5")
+            .arg(seconds * framerate).arg(width).arg(height).arg(framerate).arg(framerate * 2);
+
+    GError *error = nullptr;
+    GstElement *pipeline = gst_parse_launch(description.toUtf8().constData(), &error);
+    if (!pipeline) {
+        fprintf(stderr, "Unable to record the spool: %s\n", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return false;
+    }
+
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    g_object_set(sink, "location", QFile::encodeName(fileName).constData(),
+                 "compression", Spool::compressionName(compression), nullptr);
+    gst_object_unref(sink);
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE,
+                                                 GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    const bool succeeded = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (!succeeded) {
+        gst_message_parse_error(msg, &error, nullptr);
+        fprintf(stderr, "Unable to record the spool: %s\n", error->message);
+        g_clear_error(&error);
+    }
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return succeeded;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Benchmark of chunked transcoding across cores"));
+    parser.addHelpOption();
+
+    QCommandLineOption inputOption(QStringLiteral("input"),
+                                   QStringLiteral("Spool or recording to encode, instead of a generated spool."),
+                                   QStringLiteral("file"));
+    parser.addOption(inputOption);
+    QCommandLineOption resolutionOption(QStringLiteral("resolution"),
+                                        QStringLiteral("Resolution of the generated spool."),
+                                        QStringLiteral("WxH"), QStringLiteral("1920x1080"));
+    parser.addOption(resolutionOption);
+    QCommandLineOption durationOption(QStringLiteral("duration"),
+                                      QStringLiteral("Seconds of the generated spool."),
+                                      QStringLiteral("seconds"), QStringLiteral("60"));
+    parser.addOption(durationOption);
+    QCommandLineOption framerateOption(QStringLiteral("framerate"),
+                                       QStringLiteral("Framerate of the generated spool."),
+                                       QStringLiteral("fps"), QStringLiteral("30"));
+    parser.addOption(framerateOption);
+    QCommandLineOption encoderOption(QStringLiteral("encoder"),
+                                     QStringLiteral("Encoder, one of: %1.")
+                                     .arg(EncoderSettings::codecNames().join(QLatin1String(", "))),
+                                     QStringLiteral("name"), QStringLiteral("x264"));
+    parser.addOption(encoderOption);
+    QCommandLineOption presetOption(QStringLiteral("preset"),
+                                    QStringLiteral("Encoder preset."),
+                                    QStringLiteral("preset"), QStringLiteral("fast"));
+    parser.addOption(presetOption);
+    QCommandLineOption threadsOption(QStringLiteral("threads"),
+                                     QStringLiteral("Comma separated list of pool sizes, 0 uses all cores."),
+                                     QStringLiteral("counts"), QStringLiteral("1,2,4,0"));
+    parser.addOption(threadsOption);
+
+    parser.process(app);
+
+    EncoderSettings settings;
+    if (!EncoderSettings::parseCodec(parser.value(encoderOption), settings.codec)) {
+        fprintf(stderr, "Unknown encoder \"%s\".\n", qPrintable(parser.value(encoderOption)));
+        return 1;
+    }
+    if (!EncoderSettings::parsePreset(parser.value(presetOption), settings.preset)) {
+        fprintf(stderr, "Unknown preset \"%s\".\n", qPrintable(parser.value(presetOption)));
+        return 1;
+    }
+
+    if (!checkPool(QThread::idealThreadCount())) {
+        fprintf(stderr, "The first job of a new pool didn't reach every thread.\n");
+        return 1;
+    }
+
+    gst_init(nullptr, nullptr);
+    if (!registerElements()) {
+        fprintf(stderr, "Unable to register the built-in elements.\n");
+        return 1;
+    }
+
+    QScopedPointer<Encoder> encoder(Encoder::create(settings.codec));
+    if (!encoder->isAvailable()) {
+        fprintf(stderr, "Encoder \"%s\" is not installed.\n", qPrintable(encoder->name()));
+        return 1;
+    }
+    settings.container = encoder->defaultContainer();
+
+    QString input = parser.value(inputOption);
+    const bool generated = input.isEmpty();
+    if (generated) {
+        const auto size = parser.value(resolutionOption).split(QLatin1Char('x'));
+        const int width = size.value(0).toInt();
+        const int height = size.value(1).toInt();
+        if (size.size() != 2 || width <= 0 || height <= 0) {
+            fprintf(stderr, "Invalid resolution \"%s\".\n", qPrintable(parser.value(resolutionOption)));
+            return 1;
+        }
+
+        input = QDir::temp().filePath(QStringLiteral("screencast-transcode-bench-%1.spool")
+                                      .arg(QCoreApplication::applicationPid()));
+        if (!recordSpool(input, width, height, qMax(1, parser.value(framerateOption).toInt()),
+                         qMax(1, parser.value(durationOption).toInt()), Spool::defaultCompression()))
+            return 1;
+    }
+
+    const QString output = QDir::temp().filePath(QStringLiteral("screencast-transcode-bench-%1.%2")
+                                                 .arg(QCoreApplication::applicationPid())
+                                                 .arg(EncoderSettings::fileExtension(settings.container)));
+
+    double baseline = 0;
+    for (const auto &value : splitList(parser.value(threadsOption))) {
+        Transcoder transcoder(input, output, encoder.data(), settings);
+        transcoder.setThreads(qMax(0, value.toInt()));
+
+        QJsonObject result;
+        result[QStringLiteral("input")] = input;
+        result[QStringLiteral("encoder")] = encoder->name();
+        result[QStringLiteral("cores")] = QThread::idealThreadCount();
+
+        bool succeeded = false;
+        QEventLoop loop;
+        QObject::connect(&transcoder, &Transcoder::finished, &loop, [&loop, &succeeded](bool finished) {
+            succeeded = finished;
+            loop.quit();
+        });
+        if (transcoder.start())
+            loop.exec();
+
+        result[QStringLiteral("threads")] = transcoder.threadCount();
+        result[QStringLiteral("chunks")] = transcoder.chunkCount();
+        if (!succeeded) {
+            result[QStringLiteral("error")] = QStringLiteral("transcoding failed");
+            print(result);
+            continue;
+        }
+
+        const double seconds = transcoder.elapsed() / 1000.0;
+        if (baseline <= 0)
+            baseline = seconds;
+        result[QStringLiteral("frames")] = double(transcoder.framesDone());
+        result[QStringLiteral("seconds")] = seconds;
+        result[QStringLiteral("fps")] = seconds > 0 ? transcoder.framesDone() / seconds : 0;
+        result[QStringLiteral("speedup")] = seconds > 0 ? baseline / seconds : 0;
+        result[QStringLiteral("output-bytes")] = double(QFileInfo(output).size());
+        print(result);
+    }
+
+    QFile::remove(output);
+    if (generated)
+        QFile::remove(input);
+
+    return 0;
+}
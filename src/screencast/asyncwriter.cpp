@@ -0,0 +1,470 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "asyncwriter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Buffers are aligned to pages so the kernel copies whole pages
+static const size_t pageSize = 4096;
+
+const uint64_t AsyncWriter::Histogram::bucketLimits[] = {
+    100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+static uint64_t nowNs()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/*
+ * Histogram
+ */
+
+void AsyncWriter::Histogram::add(uint64_t ns)
+{
+    int bucket = 0;
+    while (bucket < bucketCount - 1 && ns >= bucketLimits[bucket])
+        ++bucket;
+
+    buckets[bucket]++;
+    count++;
+    total += ns;
+    if (ns > max)
+        max = ns;
+}
+
+const char *AsyncWriter::Histogram::bucketName(int bucket)
+{
+    static const char *const names[] = { "100us", "1ms", "10ms", "100ms", "1s", "inf" };
+    return bucket >= 0 && bucket < bucketCount ? names[bucket] : "";
+}
+
+/*
+ * AsyncWriter
+ */
+
+AsyncWriter::AsyncWriter()
+    : AsyncWriter(Options())
+{
+}
+
+AsyncWriter::AsyncWriter(const Options &options)
+    : m_options(options)
+{
+    m_options.bufferSize = (m_options.bufferSize + pageSize - 1) / pageSize * pageSize;
+    if (m_options.bufferSize == 0)
+        m_options.bufferSize = pageSize;
+    if (m_options.bufferCount < 2)
+        m_options.bufferCount = 2;
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    close();
+}
+
+bool AsyncWriter::open(const char *path)
+{
+    m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        m_error = errno;
+        return false;
+    }
+
+    m_buffers.resize(size_t(m_options.bufferCount));
+    for (auto &buffer : m_buffers) {
+        void *data = nullptr;
+        if (posix_memalign(&data, pageSize, m_options.bufferSize) != 0) {
+            m_error = ENOMEM;
+            close();
+            return false;
+        }
+        buffer.data = static_cast<uint8_t *>(data);
+        m_free.push_back(&buffer);
+    }
+    m_current = m_free.back();
+    m_free.pop_back();
+
+    m_backend = PWrite;
+#ifdef HAVE_LIBURING
+    if (m_options.useIoUring) {
+        auto *ring = new io_uring;
+        if (io_uring_queue_init(unsigned(m_options.bufferCount), ring, 0) == 0) {
+            // Plain writes came with Linux 5.6, as did probing: before
+            // that every write would fail with EINVAL
+            io_uring_probe *probe = io_uring_get_probe_ring(ring);
+            const bool canWrite = probe && io_uring_opcode_supported(probe, IORING_OP_WRITE);
+            if (probe)
+                io_uring_free_probe(probe);
+
+            if (canWrite) {
+                m_ring = ring;
+                m_backend = IoUring;
+            } else {
+                io_uring_queue_exit(ring);
+                delete ring;
+            }
+        } else {
+            // Old kernel or io_uring disabled, pwrite works everywhere
+            delete ring;
+        }
+    }
+#endif
+
+    m_thread = std::thread(&AsyncWriter::ioLoop, this);
+
+    return true;
+}
+
+bool AsyncWriter::close()
+{
+    if (m_fd < 0)
+        return m_error == 0;
+
+    if (m_thread.joinable()) {
+        flush(true);
+
+        {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+        m_thread.join();
+    }
+
+#ifdef HAVE_LIBURING
+    if (m_ring) {
+        auto *ring = static_cast<io_uring *>(m_ring);
+        io_uring_queue_exit(ring);
+        delete ring;
+        m_ring = nullptr;
+    }
+#endif
+
+    releasePreallocated();
+
+    if (::close(m_fd) < 0 && m_error == 0)
+        m_error = errno;
+    m_fd = -1;
+
+    for (auto &buffer : m_buffers)
+        free(buffer.data);
+    m_buffers.clear();
+    m_free.clear();
+    m_current = nullptr;
+
+    return m_error == 0;
+}
+
+const char *AsyncWriter::backendName(Backend backend)
+{
+    switch (backend) {
+    case PWrite:
+        return "pwrite";
+    case IoUring:
+        return "io_uring";
+    }
+
+    return "unknown";
+}
+
+bool AsyncWriter::write(const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+    while (size > 0) {
+        const size_t chunk = std::min(size, m_options.bufferSize - m_fill);
+        memcpy(m_current->data + m_fill, bytes, chunk);
+        m_fill += chunk;
+        bytes += chunk;
+        size -= chunk;
+
+        if (m_fill == m_options.bufferSize && !submit(false))
+            return false;
+    }
+
+    return error() == 0;
+}
+
+bool AsyncWriter::seek(uint64_t offset)
+{
+    if (offset == position())
+        return true;
+
+    if (m_fill > 0 && !submit(false))
+        return false;
+
+    m_bufferOffset = offset;
+    return true;
+}
+
+bool AsyncWriter::sync()
+{
+    return submit(true);
+}
+
+bool AsyncWriter::flush(bool sync)
+{
+    if ((m_fill > 0 || sync) && !submit(sync))
+        return false;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_pending.empty() && m_inFlight == 0; });
+    return m_error == 0;
+}
+
+int AsyncWriter::error() const
+{
+    std::lock_guard<std::mutex> locker(m_mutex);
+    return m_error;
+}
+
+AsyncWriter::Stats AsyncWriter::stats() const
+{
+    std::lock_guard<std::mutex> locker(m_mutex);
+    return m_stats;
+}
+
+bool AsyncWriter::submit(bool sync)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_error != 0)
+        return false;
+
+    Request request;
+    request.offset = m_bufferOffset;
+    request.length = m_fill;
+    request.sync = sync;
+    if (m_fill > 0) {
+        request.buffer = m_current;
+        m_current = nullptr;
+    }
+    m_pending.push_back(request);
+    m_wake.notify_one();
+
+    if (m_current)
+        return true;
+
+    m_bufferOffset += m_fill;
+    m_fill = 0;
+
+    // All buffers are being written: the caller has to wait for the disk
+    if (m_free.empty()) {
+        const uint64_t start = nowNs();
+        m_done.wait(lock, [this] { return !m_free.empty(); });
+        m_stats.stalls.add(nowNs() - start);
+    }
+    m_current = m_free.back();
+    m_free.pop_back();
+
+    return m_error == 0;
+}
+
+void AsyncWriter::ioLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;) {
+        m_wake.wait(lock, [this] { return m_quit || !m_pending.empty(); });
+        if (m_pending.empty())
+            break;
+
+        std::vector<Request> requests(m_pending.begin(), m_pending.end());
+        m_pending.clear();
+        m_inFlight = int(requests.size());
+        const bool failed = m_error != 0;
+        lock.unlock();
+
+        // Once a write failed the file is broken, just recycle the buffers
+        const int error = failed ? 0 : writeRequests(requests);
+
+        lock.lock();
+        if (error != 0 && m_error == 0)
+            m_error = error;
+        for (const auto &request : requests) {
+            if (request.buffer)
+                m_free.push_back(request.buffer);
+        }
+        m_inFlight = 0;
+        m_done.notify_all();
+    }
+}
+
+int AsyncWriter::writeRequests(std::vector<Request> &requests)
+{
+    size_t first = 0;
+
+    while (first < requests.size()) {
+        // Requests that follow each other are written together, a seek
+        // or a sync ends the group so that overlapping writes are ordered
+        size_t last = first + 1;
+        while (last < requests.size() && !requests[last - 1].sync &&
+               requests[last].offset == requests[last - 1].offset + requests[last - 1].length)
+            ++last;
+
+        const uint64_t end = requests[last - 1].offset + requests[last - 1].length;
+        preallocate(end);
+
+#ifdef HAVE_LIBURING
+        if (m_ring) {
+            auto *ring = static_cast<io_uring *>(m_ring);
+            int submitted = 0;
+            const uint64_t start = nowNs();
+
+            for (size_t i = first; i < last; ++i) {
+                if (requests[i].length == 0)
+                    continue;
+                io_uring_sqe *sqe = io_uring_get_sqe(ring);
+                io_uring_prep_write(sqe, m_fd, requests[i].buffer->data, unsigned(requests[i].length),
+                                    requests[i].offset);
+                io_uring_sqe_set_data(sqe, &requests[i]);
+                ++submitted;
+            }
+
+            int result = submitted > 0 ? io_uring_submit(ring) : 0;
+            if (result < 0)
+                return -result;
+
+            int error = 0;
+            for (int i = 0; i < submitted; ++i) {
+                io_uring_cqe *cqe = nullptr;
+                result = io_uring_wait_cqe(ring, &cqe);
+                if (result < 0)
+                    return -result;
+
+                const Request *request = static_cast<const Request *>(io_uring_cqe_get_data(cqe));
+                const int res = cqe->res;
+                io_uring_cqe_seen(ring, cqe);
+
+                if (res < 0) {
+                    error = -res;
+                } else if (size_t(res) < request->length && error == 0) {
+                    // Short write, finish it synchronously
+                    error = writeRange(request->buffer->data + res, request->length - size_t(res),
+                                       request->offset + uint64_t(res));
+                }
+
+                std::lock_guard<std::mutex> locker(m_mutex);
+                m_stats.writeLatency.add(nowNs() - start);
+                m_stats.writes++;
+                if (res > 0)
+                    m_stats.bytesWritten += request->length;
+            }
+            if (error != 0)
+                return error;
+        } else
+#endif
+        {
+            for (size_t i = first; i < last; ++i) {
+                if (requests[i].length == 0)
+                    continue;
+
+                const uint64_t start = nowNs();
+                const int error = writeRange(requests[i].buffer->data, requests[i].length, requests[i].offset);
+                if (error != 0)
+                    return error;
+
+                std::lock_guard<std::mutex> locker(m_mutex);
+                m_stats.writeLatency.add(nowNs() - start);
+                m_stats.writes++;
+                m_stats.bytesWritten += requests[i].length;
+            }
+        }
+
+        writeback(end);
+
+        if (requests[last - 1].sync) {
+            if (fdatasync(m_fd) < 0 && errno != EINVAL)
+                return errno;
+
+            std::lock_guard<std::mutex> locker(m_mutex);
+            m_stats.syncs++;
+        }
+
+        first = last;
+    }
+
+    return 0;
+}
+
+int AsyncWriter::writeRange(const uint8_t *data, size_t length, uint64_t offset)
+{
+    while (length > 0) {
+        const ssize_t written = pwrite(m_fd, data, length, off_t(offset));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += written;
+        length -= size_t(written);
+        offset += uint64_t(written);
+    }
+
+    return 0;
+}
+
+void AsyncWriter::preallocate(uint64_t end)
+{
+    // Reserve space ahead of the writes so the file stays contiguous,
+    // the file size only grows with the data actually written
+    while (m_options.preallocate > 0 && m_allocated < end) {
+        if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, off_t(m_allocated), off_t(m_options.preallocate)) < 0) {
+            // Not supported by the file system, don't try again
+            m_options.preallocate = 0;
+            break;
+        }
+        m_allocated += m_options.preallocate;
+    }
+}
+
+void AsyncWriter::releasePreallocated()
+{
+    if (m_allocated == 0)
+        return;
+
+    // The file size is the end of what was written, the blocks
+    // reserved past it would stay allocated for good; truncating to
+    // the same size frees them, punching a hole beyond the end doesn't
+    struct stat st;
+    if (fstat(m_fd, &st) < 0 || uint64_t(st.st_size) >= m_allocated)
+        return;
+
+    if (ftruncate(m_fd, st.st_size) < 0 && m_error == 0)
+        m_error = errno;
+    m_allocated = 0;
+}
+
+void AsyncWriter::writeback(uint64_t end)
+{
+    if (m_options.writeback == 0 || end <= m_writebackEnd || end - m_writebackEnd < m_options.writeback)
+        return;
+
+    // Start writing back the new range and wait for the previous one,
+    // this keeps the amount of dirty pages bounded without blocking
+    // on the data that was just written
+    sync_file_range(m_fd, off_t(m_writebackEnd), off_t(end - m_writebackEnd), SYNC_FILE_RANGE_WRITE);
+    if (m_writebackEnd > m_writebackStart) {
+        sync_file_range(m_fd, off_t(m_writebackStart), off_t(m_writebackEnd - m_writebackStart),
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    m_writebackStart = m_writebackEnd;
+    m_writebackEnd = end;
+}
@@ -0,0 +1,149 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef ASYNCWRITER_H
+#define ASYNCWRITER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Writes a file from a dedicated I/O thread.
+ *
+ * Data is copied into a few large page aligned buffers, full buffers
+ * are written by the I/O thread with io_uring when available or with
+ * pwrite otherwise, so the caller only waits when all the buffers are
+ * in flight. That wait is a stall and is recorded in a histogram.
+ *
+ * The file is preallocated in large chunks and written back to disk
+ * with sync_file_range as it grows, to avoid bursts of dirty pages.
+ */
+class AsyncWriter
+{
+public:
+    enum Backend {
+        PWrite,
+        IoUring
+    };
+
+    struct Options {
+        size_t bufferSize = 4 * 1024 * 1024;
+        int bufferCount = 8;
+        // Preallocation chunk, 0 disables preallocation
+        uint64_t preallocate = 64 * 1024 * 1024;
+        // Start writeback every this many bytes, 0 leaves it to the kernel
+        uint64_t writeback = 8 * 1024 * 1024;
+        bool useIoUring = true;
+    };
+
+    // Durations in nanoseconds, bucket i counts values below
+    // bucketLimits[i] and the last bucket everything above
+    struct Histogram {
+        static const int bucketCount = 6;
+        static const uint64_t bucketLimits[bucketCount - 1];
+
+        uint64_t buckets[bucketCount] = {};
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t max = 0;
+
+        void add(uint64_t ns);
+        static const char *bucketName(int bucket);
+    };
+
+    struct Stats {
+        uint64_t bytesWritten = 0;
+        uint64_t writes = 0;
+        uint64_t syncs = 0;
+        // Time the caller waited for a free buffer
+        Histogram stalls;
+        // Time each write took on the I/O thread
+        Histogram writeLatency;
+    };
+
+    AsyncWriter();
+    explicit AsyncWriter(const Options &options);
+    ~AsyncWriter();
+
+    // Returns false and sets error() on failure
+    bool open(const char *path);
+    bool close();
+
+    Backend backend() const { return m_backend; }
+    static const char *backendName(Backend backend);
+
+    // Appends at the current position, only blocks when no buffer is free
+    bool write(const void *data, size_t size);
+    // Moves the current position, for muxers rewriting their headers
+    bool seek(uint64_t offset);
+    uint64_t position() const { return m_bufferOffset + m_fill; }
+
+    // Writes what is buffered and syncs it to disk, without waiting
+    bool sync();
+    // Waits for everything to be written, and synced if requested
+    bool flush(bool sync);
+
+    // errno of the first failure, 0 if none
+    int error() const;
+
+    Stats stats() const;
+
+private:
+    struct Buffer {
+        uint8_t *data = nullptr;
+    };
+
+    struct Request {
+        Buffer *buffer = nullptr;
+        uint64_t offset = 0;
+        size_t length = 0;
+        bool sync = false;
+    };
+
+    Options m_options;
+    Backend m_backend = PWrite;
+    int m_fd = -1;
+    void *m_ring = nullptr;
+
+    // Owned by the caller's thread
+    Buffer *m_current = nullptr;
+    uint64_t m_bufferOffset = 0;
+    size_t m_fill = 0;
+
+    // Owned by the I/O thread
+    uint64_t m_allocated = 0;
+    uint64_t m_writebackStart = 0;
+    uint64_t m_writebackEnd = 0;
+
+    std::vector<Buffer> m_buffers;
+    std::thread m_thread;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::vector<Buffer *> m_free;
+    std::deque<Request> m_pending;
+    int m_inFlight = 0;
+    int m_error = 0;
+    bool m_quit = false;
+    Stats m_stats;
+
+    bool submit(bool sync);
+
+    void ioLoop();
+    int writeRequests(std::vector<Request> &requests);
+    int writeRange(const uint8_t *data, size_t length, uint64_t offset);
+    void preallocate(uint64_t end);
+    // Frees what was reserved past the end of the file
+    void releasePreallocated();
+    void writeback(uint64_t end);
+};
+
+#endif // ASYNCWRITER_H
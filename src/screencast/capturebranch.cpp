@@ -0,0 +1,174 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QStringList>
+
+#include "capturebranch.h"
+
+#include <gst/gst.h>
+
+bool addAndLinkElements(GstBin *bin, const QVector<GstElement *> &elements)
+{
+    for (auto *element : elements)
+        gst_bin_add(bin, element);
+
+    for (int i = 1; i < elements.size(); ++i) {
+        if (!gst_element_link(elements.at(i - 1), elements.at(i))) {
+            qCWarning(lcScreencast, "Failed to link %s to %s",
+                      GST_OBJECT_NAME(elements.at(i - 1)), GST_OBJECT_NAME(elements.at(i)));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool CaptureBranch::isFastFormat(const QString &format)
+{
+    // Packed RGB, which is what compositors hand out, has a fast path
+    static const QStringList fastFormats = {
+        QStringLiteral("bgrx"), QStringLiteral("bgra"), QStringLiteral("rgbx"), QStringLiteral("rgba"),
+        QStringLiteral("xrgb"), QStringLiteral("argb"), QStringLiteral("xbgr"), QStringLiteral("abgr")
+    };
+    return fastFormats.contains(format, Qt::CaseInsensitive);
+}
+
+bool CaptureBranch::create(GstBin *bin, GstElement *source, const QString &format,
+                           const CaptureSettings &captureSettings,
+                           const Encoder *encoderBackend, const EncoderSettings &encoderSettings)
+{
+    const bool fastConvert = isFastFormat(format);
+    convert = gst_element_factory_make(fastConvert ? "screencastconvert" : "videoconvert", nullptr);
+    if (captureSettings.outputSize.height() > 0) {
+        // Scaled while converting, so the full size frame is only read once
+        if (fastConvert && convert)
+            g_object_set(convert,
+                         "max-width", captureSettings.outputSize.width(),
+                         "max-height", captureSettings.outputSize.height(),
+                         nullptr);
+        else
+            qCWarning(lcScreencast, "Frames in %s format are recorded at their full size",
+                      qPrintable(format));
+    }
+    // Each branch encodes on its own streaming thread
+    queue = gst_element_factory_make("queue", nullptr);
+    const bool staged = captureSettings.threadLayout == ThreadLayout::Staged;
+    if (staged) {
+        convertQueue = gst_element_factory_make("queue", nullptr);
+        if (!captureSettings.spool)
+            muxQueue = gst_element_factory_make("queue", nullptr);
+    }
+    GstElement *parser = nullptr;
+    if (captureSettings.spool) {
+        // Encoded later, a keyframe every two seconds bounds what
+        // a damaged record costs
+        encoder = gst_element_factory_make("screencastspoolsink", nullptr);
+        if (encoder)
+            g_object_set(encoder,
+                         "compression", Spool::compressionName(captureSettings.spoolCompression),
+                         "keyframe-interval", guint(captureSettings.framerate * 2),
+                         nullptr);
+    } else {
+        encoder = encoderBackend->createEncoder(encoderSettings);
+        parser = encoderBackend->createParser();
+    }
+
+    QVector<GstElement *> elements;
+    if (captureSettings.deduplicate && fastConvert) {
+        // Skip identical frames before they are converted; at constant
+        // framerate videorate fills the gap with duplicates of the last
+        // frame, so they are still encoded, only in variable framerate
+        // mode the encoder doesn't see them either
+        dedup = gst_element_factory_make("screencastdedup", nullptr);
+        elements.append(dedup);
+    }
+    if (staged)
+        elements.append(convertQueue);
+    elements.append(convert);
+    if (captureSettings.cursorMode == Portal::Metadata && fastConvert) {
+        // The cursor is drawn onto the converter's own buffers, the
+        // compositor's are read-only and shared with the dedup reference
+        cursor = gst_element_factory_make("screencastcursor", nullptr);
+        elements.append(cursor);
+    }
+    const bool live = !captureSettings.liveUrl.isEmpty();
+    if (live && captureSettings.latencyStamp) {
+        stamp = gst_element_factory_make("screencastlatencystamp", nullptr);
+        elements.append(stamp);
+    }
+    if (!captureSettings.variableFramerate) {
+        // Constant framerate: duplicate or drop frames to match the target,
+        // duplicates are made after conversion so they only cost a reference
+        rate = gst_element_factory_make("videorate", nullptr);
+        GstElement *filter = gst_element_factory_make("capsfilter", nullptr);
+        if (filter) {
+            GstCaps *caps = gst_caps_new_simple("video/x-raw", "framerate", GST_TYPE_FRACTION,
+                                                captureSettings.framerate, 1, nullptr);
+            g_object_set(filter, "caps", caps, nullptr);
+            gst_caps_unref(caps);
+        }
+        elements.append(rate);
+        elements.append(filter);
+    }
+    elements.append(queue);
+    elements.append(encoder);
+    if (parser)
+        elements.append(parser);
+    if (staged && !captureSettings.spool)
+        elements.append(muxQueue);
+
+    if (elements.contains(nullptr)) {
+        qCWarning(lcScreencast, "Unable to create the pipeline, some elements are missing");
+        for (auto *element : qAsConst(elements)) {
+            if (element)
+                gst_object_unref(gst_object_ref_sink(element));
+        }
+        *this = CaptureBranch();
+        return false;
+    }
+
+    if (live) {
+        // A late frame is worth less than the next one: rather than
+        // letting the encoder fall behind, drop the oldest waiting frame
+        g_object_set(queue, "max-size-buffers", 2u, "leaky", 2,
+                     "max-size-time", G_GUINT64_CONSTANT(0), "max-size-bytes", 0, nullptr);
+        if (convertQueue)
+            g_object_set(convertQueue, "max-size-buffers", 2u, "leaky", 2,
+                         "max-size-time", G_GUINT64_CONSTANT(0), "max-size-bytes", 0, nullptr);
+    } else {
+        // Half a second of frames: the quality controller reacts well before
+        // the queue is full and the encoder backs up into the capture; a
+        // memory budget also limits the bytes and makes the queue leaky
+        g_object_set(queue, "max-size-buffers", guint(qMax(2, captureSettings.framerate / 2)),
+                     "max-size-time", G_GUINT64_CONSTANT(0), "max-size-bytes", 0, nullptr);
+        // Captured frames hold PipeWire's buffers, of which there are
+        // only a few, the encoder queue is where frames wait
+        if (convertQueue)
+            g_object_set(convertQueue, "max-size-buffers", 2u,
+                         "max-size-time", G_GUINT64_CONSTANT(0), "max-size-bytes", 0, nullptr);
+    }
+    if (muxQueue) {
+        // Encoded frames are small, a second of them absorbs the
+        // muxer waiting for the disk
+        g_object_set(muxQueue, "max-size-buffers", 0u, "max-size-bytes", 0u,
+                     "max-size-time", GST_SECOND, nullptr);
+    }
+
+    ThreadLayout::assign(queue, ThreadLayout::Encode);
+    if (convertQueue)
+        ThreadLayout::assign(convertQueue, ThreadLayout::Convert);
+    if (muxQueue)
+        ThreadLayout::assign(muxQueue, ThreadLayout::Mux);
+
+    if (!addAndLinkElements(bin, elements) || (source && !gst_element_link(source, elements.first()))) {
+        qCWarning(lcScreencast, "Unable to link the capture branch");
+        return false;
+    }
+
+    head = elements.first();
+    tail = elements.last();
+    return true;
+}
@@ -0,0 +1,64 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef CAPTUREBRANCH_H
+#define CAPTUREBRANCH_H
+
+#include <QString>
+#include <QVector>
+
+#include <gst/gstbin.h>
+
+#include "encoder.h"
+#include "screencast.h"
+
+bool addAndLinkElements(GstBin *bin, const QVector<GstElement *> &elements);
+
+/*
+ * The elements between a raw video source and the muxer:
+ * deduplication, conversion, cursor drawing, rate control, a queue
+ * and the encoder, with a latency stamp when streaming live. In
+ * spool mode the encoder is a spool sink and the branch ends there.
+ *
+ * With the staged thread layout a queue after deduplication moves
+ * conversion off the capture thread and one after the encoder moves
+ * muxing off the encoding thread.
+ *
+ * Shared by the recorder and the benchmarks, so that both
+ * measure the same pipeline.
+ */
+class CaptureBranch
+{
+public:
+    // Owned by the bin, head is linked to the source
+    GstElement *head = nullptr;
+    GstElement *dedup = nullptr;
+    GstElement *convert = nullptr;
+    GstElement *cursor = nullptr;
+    GstElement *stamp = nullptr;
+    GstElement *rate = nullptr;
+    // Only with the staged thread layout
+    GstElement *convertQueue = nullptr;
+    GstElement *muxQueue = nullptr;
+    // Before the encoder
+    GstElement *queue = nullptr;
+    // The spool sink in spool mode
+    GstElement *encoder = nullptr;
+    // Last element, to be linked to the muxer
+    GstElement *tail = nullptr;
+
+    // Whether the built-in converter handles this raw format
+    static bool isFastFormat(const QString &format);
+
+    // Adds the elements to the bin and links them after source, which
+    // must already be in the bin, or later to head if source is null;
+    // returns false if some elements are missing
+    bool create(GstBin *bin, GstElement *source, const QString &format,
+                const CaptureSettings &captureSettings,
+                const Encoder *encoderBackend, const EncoderSettings &encoderSettings);
+};
+
+#endif // CAPTUREBRANCH_H
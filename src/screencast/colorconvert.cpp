@@ -0,0 +1,676 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "colorconvert.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define COLORCONVERT_X86 1
+#  include <immintrin.h>
+#endif
+
+/*
+ * BT.709 limited range, 8 bit fixed point:
+ *
+ *   Y = (( 47 R + 157 G +  16 B + 128) >> 8) + 16
+ *   U = ((-26 R -  86 G + 112 B + 512) >> 10) + 128   (sum of a 2x2 block)
+ *   V = ((112 R - 102 G -  10 B + 512) >> 10) + 128   (sum of a 2x2 block)
+ */
+
+static const int16_t coeffY[3] = { 47, 157, 16 };
+static const int16_t coeffU[3] = { -26, -86, 112 };
+static const int16_t coeffV[3] = { 112, -102, -10 };
+
+typedef void (*RowPairFunc)(const uint8_t *src0, const uint8_t *src1,
+                            uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                            int width, bool interleaved,
+                            const ColorConverter::Coefficients &c);
+
+/*
+ * Scaling is separable: source rows are added up with their weights
+ * into 16 bit sums, which can't overflow as the weights add up to 256,
+ * then the columns of the sums are added up the same way.
+ */
+typedef void (*AccumulateFunc)(const uint8_t *src, int stride, const uint16_t *weights, int taps,
+                               uint16_t *sums, int count);
+typedef void (*ResampleFunc)(const uint16_t *sums, uint8_t *target, int width,
+                             const ColorConverter::Taps &columns);
+
+static inline int dot(const uint8_t *p, const int16_t *c)
+{
+    return c[0] * p[0] + c[1] * p[1] + c[2] * p[2] + c[3] * p[3];
+}
+
+static inline uint8_t luma(const uint8_t *p, const int16_t *c)
+{
+    return uint8_t(((dot(p, c) + 128) >> 8) + 16);
+}
+
+static inline uint8_t chroma(const uint8_t *a, const uint8_t *b,
+                             const uint8_t *c, const uint8_t *d, const int16_t *k)
+{
+    return uint8_t(((dot(a, k) + dot(b, k) + dot(c, k) + dot(d, k) + 512) >> 10) + 128);
+}
+
+// Converts from the even column x to the end of the row
+static void rowPairScalar(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                          int x, int width, bool interleaved,
+                          const ColorConverter::Coefficients &c)
+{
+    for (; x < width; x += 2) {
+        const uint8_t *a = src0 + x * 4;
+        const uint8_t *b = src1 + x * 4;
+        const bool last = x + 1 >= width;
+        const uint8_t *a1 = last ? a : a + 4;
+        const uint8_t *b1 = last ? b : b + 4;
+
+        y0[x] = luma(a, c.y);
+        y1[x] = luma(b, c.y);
+        if (!last) {
+            y0[x + 1] = luma(a1, c.y);
+            y1[x + 1] = luma(b1, c.y);
+        }
+
+        const uint8_t cu = chroma(a, a1, b, b1, c.u);
+        const uint8_t cv = chroma(a, a1, b, b1, c.v);
+        if (interleaved) {
+            u[x] = cu;
+            u[x + 1] = cv;
+        } else {
+            u[x / 2] = cu;
+            v[x / 2] = cv;
+        }
+    }
+}
+
+static void rowPairGeneric(const uint8_t *src0, const uint8_t *src1,
+                           uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                           int width, bool interleaved,
+                           const ColorConverter::Coefficients &c)
+{
+    rowPairScalar(src0, src1, y0, y1, u, v, 0, width, interleaved, c);
+}
+
+static void accumulateScalar(const uint8_t *src, int stride, const uint16_t *weights, int taps,
+                             uint16_t *sums, int from, int count)
+{
+    for (int i = from; i < count; ++i) {
+        uint16_t acc = 0;
+        for (int t = 0; t < taps; ++t)
+            acc = uint16_t(acc + src[t * stride + i] * weights[t]);
+        sums[i] = acc;
+    }
+}
+
+static void accumulateGeneric(const uint8_t *src, int stride, const uint16_t *weights, int taps,
+                              uint16_t *sums, int count)
+{
+    accumulateScalar(src, stride, weights, taps, sums, 0, count);
+}
+
+static void resampleScalar(const uint16_t *sums, uint8_t *target, int width,
+                           const ColorConverter::Taps &columns)
+{
+    const int *first = columns.first.data();
+    const uint16_t *weights = columns.weights.data();
+    const int count = columns.count;
+
+    for (int x = 0; x < width; ++x, weights += count) {
+        const uint16_t *pixel = sums + first[x] * 4;
+        uint32_t acc[4] = { 32768, 32768, 32768, 32768 };
+        for (int t = 0; t < count; ++t, pixel += 4) {
+            const uint32_t weight = weights[t];
+            for (int c = 0; c < 4; ++c)
+                acc[c] += pixel[c] * weight;
+        }
+        for (int c = 0; c < 4; ++c)
+            target[x * 4 + c] = uint8_t(acc[c] >> 16);
+    }
+}
+
+#ifdef COLORCONVERT_X86
+
+__attribute__((target("sse4.1")))
+static void accumulateSSE41(const uint8_t *src, int stride, const uint16_t *weights, int taps,
+                            uint16_t *sums, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    // All the rows of a target row are added up in registers, so the
+    // sums are only written once
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = zero;
+        __m128i hi = zero;
+        for (int t = 0; t < taps; ++t) {
+            const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + t * stride + i));
+            const __m128i w = _mm_set1_epi16(short(weights[t]));
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), w));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), w));
+        }
+        __m128i *out = reinterpret_cast<__m128i *>(sums + i);
+        _mm_storeu_si128(out, lo);
+        _mm_storeu_si128(out + 1, hi);
+    }
+
+    accumulateScalar(src, stride, weights, taps, sums, i, count);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i resamplePixelSSE41(const uint16_t *pixel, const uint16_t *lanes, int count)
+{
+    // The four channels of a pixel at once, two taps per step, the
+    // 16-bit products are widened by pairing their low and high halves
+    __m128i acc = _mm_set1_epi32(32768);
+    int t = 0;
+    for (; t + 2 <= count; t += 2) {
+        const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixel + t * 4));
+        const __m128i weights = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lanes + t * 4));
+        const __m128i lo = _mm_mullo_epi16(values, weights);
+        const __m128i hi = _mm_mulhi_epu16(values, weights);
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(lo, hi), _mm_unpackhi_epi16(lo, hi)));
+    }
+    if (t < count) {
+        const __m128i values = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixel + t * 4));
+        const __m128i weights = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(lanes + t * 4));
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(_mm_mullo_epi16(values, weights),
+                                                     _mm_mulhi_epu16(values, weights)));
+    }
+    return _mm_srli_epi32(acc, 16);
+}
+
+__attribute__((target("sse4.1")))
+static void resampleSSE41(const uint16_t *sums, uint8_t *target, int width,
+                          const ColorConverter::Taps &columns)
+{
+    // The target is written through a byte pointer, which may alias
+    // the taps as far as the compiler knows
+    const int *first = columns.first.data();
+    const uint16_t *lanes = columns.lanes.data();
+    const int count = columns.count;
+    const int stride = count * 4;
+
+    // Two pixels per step, independent of each other
+    int x = 0;
+    for (; x + 2 <= width; x += 2) {
+        const __m128i a = resamplePixelSSE41(sums + first[x] * 4, lanes + x * stride, count);
+        const __m128i b = resamplePixelSSE41(sums + first[x + 1] * 4, lanes + (x + 1) * stride, count);
+        const __m128i packed = _mm_packus_epi32(a, b);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(target + x * 4), _mm_packus_epi16(packed, packed));
+    }
+    if (x < width) {
+        const __m128i packed = _mm_packus_epi32(resamplePixelSSE41(sums + first[x] * 4, lanes + x * stride, count),
+                                                _mm_setzero_si128());
+        const int value = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+        memcpy(target + x * 4, &value, 4);
+    }
+}
+
+__attribute__((target("avx2")))
+static void accumulateAVX2(const uint8_t *src, int stride, const uint16_t *weights, int taps,
+                           uint16_t *sums, int count)
+{
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+        for (int t = 0; t < taps; ++t) {
+            const __m128i *in = reinterpret_cast<const __m128i *>(src + t * stride + i);
+            const __m256i w = _mm256_set1_epi16(short(weights[t]));
+            lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128(in)), w));
+            hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128(in + 1)), w));
+        }
+        __m256i *out = reinterpret_cast<__m256i *>(sums + i);
+        _mm256_storeu_si256(out, lo);
+        _mm256_storeu_si256(out + 1, hi);
+    }
+
+    accumulateScalar(src, stride, weights, taps, sums, i, count);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i lumaSSE41(const __m128i pixels, const __m128i coeffs)
+{
+    // Four pixels to four 32-bit luma values
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coeffs);
+    const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coeffs);
+    const __m128i sum = _mm_hadd_epi32(lo, hi);
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i columnSumsSSE41(const __m128i lo, const __m128i hi, const __m128i coeffs)
+{
+    // Vertical 2-pixel sums of four columns to four 32-bit dot products
+    return _mm_hadd_epi32(_mm_madd_epi16(lo, coeffs), _mm_madd_epi16(hi, coeffs));
+}
+
+__attribute__((target("sse4.1")))
+static void rowPairSSE41(const uint8_t *src0, const uint8_t *src1,
+                         uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                         int width, bool interleaved,
+                         const ColorConverter::Coefficients &c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i cy = _mm_setr_epi16(c.y[0], c.y[1], c.y[2], c.y[3], c.y[0], c.y[1], c.y[2], c.y[3]);
+    const __m128i cu = _mm_setr_epi16(c.u[0], c.u[1], c.u[2], c.u[3], c.u[0], c.u[1], c.u[2], c.u[3]);
+    const __m128i cv = _mm_setr_epi16(c.v[0], c.v[1], c.v[2], c.v[3], c.v[0], c.v[1], c.v[2], c.v[3]);
+    const __m128i lumaOffset = _mm_set1_epi16(16);
+    const __m128i chromaOffset = _mm_set1_epi16(128);
+    const __m128i chromaRound = _mm_set1_epi32(512);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r0[4], r1[4];
+        for (int i = 0; i < 4; ++i) {
+            r0[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src0 + (x + i * 4) * 4));
+            r1[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src1 + (x + i * 4) * 4));
+        }
+
+        // Luma, 16 pixels per row
+        __m128i l0 = _mm_packs_epi32(lumaSSE41(r0[0], cy), lumaSSE41(r0[1], cy));
+        __m128i l1 = _mm_packs_epi32(lumaSSE41(r0[2], cy), lumaSSE41(r0[3], cy));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x),
+                         _mm_packus_epi16(_mm_add_epi16(l0, lumaOffset), _mm_add_epi16(l1, lumaOffset)));
+        l0 = _mm_packs_epi32(lumaSSE41(r1[0], cy), lumaSSE41(r1[1], cy));
+        l1 = _mm_packs_epi32(lumaSSE41(r1[2], cy), lumaSSE41(r1[3], cy));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x),
+                         _mm_packus_epi16(_mm_add_epi16(l0, lumaOffset), _mm_add_epi16(l1, lumaOffset)));
+
+        // Chroma, 8 samples from the 2x2 block sums
+        __m128i su[4], sv[4];
+        for (int i = 0; i < 4; ++i) {
+            const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(r0[i], zero), _mm_unpacklo_epi8(r1[i], zero));
+            const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(r0[i], zero), _mm_unpackhi_epi8(r1[i], zero));
+            su[i] = columnSumsSSE41(lo, hi, cu);
+            sv[i] = columnSumsSSE41(lo, hi, cv);
+        }
+        const __m128i u0 = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(su[0], su[1]), chromaRound), 10);
+        const __m128i u1 = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(su[2], su[3]), chromaRound), 10);
+        const __m128i v0 = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(sv[0], sv[1]), chromaRound), 10);
+        const __m128i v1 = _mm_srai_epi32(_mm_add_epi32(_mm_hadd_epi32(sv[2], sv[3]), chromaRound), 10);
+        const __m128i u16 = _mm_add_epi16(_mm_packs_epi32(u0, u1), chromaOffset);
+        const __m128i v16 = _mm_add_epi16(_mm_packs_epi32(v0, v1), chromaOffset);
+        const __m128i u8 = _mm_packus_epi16(u16, u16);
+        const __m128i v8 = _mm_packus_epi16(v16, v16);
+
+        if (interleaved) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(u + x), _mm_unpacklo_epi8(u8, v8));
+        } else {
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2), u8);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2), v8);
+        }
+    }
+
+    rowPairScalar(src0, src1, y0, y1, u, v, x, width, interleaved, c);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lumaAVX2(const __m256i pixels, const __m256i coeffs)
+{
+    // Eight pixels to eight 32-bit luma values, in order
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coeffs);
+    const __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coeffs);
+    const __m256i sum = _mm256_hadd_epi32(lo, hi);
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i packLumaAVX2(const __m256i a, const __m256i b)
+{
+    // packs works within 128-bit lanes, put the 64-bit quarters back in order
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    const __m256i biased = _mm256_add_epi16(packed, _mm256_set1_epi16(16));
+    return _mm_packus_epi16(_mm256_castsi256_si128(biased), _mm256_extracti128_si256(biased, 1));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chromaSumsAVX2(const __m256i lo, const __m256i hi, const __m256i coeffs)
+{
+    return _mm256_hadd_epi32(_mm256_madd_epi16(lo, coeffs), _mm256_madd_epi16(hi, coeffs));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chromaPairsAVX2(const __m256i a, const __m256i b)
+{
+    // Horizontal pairs of column sums, lanes come out as 0 1 4 5 | 2 3 6 7
+    const __m256i pairs = _mm256_hadd_epi32(a, b);
+    const __m256i ordered = _mm256_permutevar8x32_epi32(pairs, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+    return _mm256_srai_epi32(_mm256_add_epi32(ordered, _mm256_set1_epi32(512)), 10);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i packChromaAVX2(const __m256i a, const __m256i b)
+{
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    const __m256i biased = _mm256_add_epi16(packed, _mm256_set1_epi16(128));
+    return _mm_packus_epi16(_mm256_castsi256_si128(biased), _mm256_extracti128_si256(biased, 1));
+}
+
+__attribute__((target("avx2")))
+static void rowPairAVX2(const uint8_t *src0, const uint8_t *src1,
+                        uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                        int width, bool interleaved,
+                        const ColorConverter::Coefficients &c)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i cy = _mm256_setr_epi16(c.y[0], c.y[1], c.y[2], c.y[3], c.y[0], c.y[1], c.y[2], c.y[3],
+                                         c.y[0], c.y[1], c.y[2], c.y[3], c.y[0], c.y[1], c.y[2], c.y[3]);
+    const __m256i cu = _mm256_setr_epi16(c.u[0], c.u[1], c.u[2], c.u[3], c.u[0], c.u[1], c.u[2], c.u[3],
+                                         c.u[0], c.u[1], c.u[2], c.u[3], c.u[0], c.u[1], c.u[2], c.u[3]);
+    const __m256i cv = _mm256_setr_epi16(c.v[0], c.v[1], c.v[2], c.v[3], c.v[0], c.v[1], c.v[2], c.v[3],
+                                         c.v[0], c.v[1], c.v[2], c.v[3], c.v[0], c.v[1], c.v[2], c.v[3]);
+
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i r0[4], r1[4];
+        for (int i = 0; i < 4; ++i) {
+            r0[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src0 + (x + i * 8) * 4));
+            r1[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src1 + (x + i * 8) * 4));
+        }
+
+        // Luma, 32 pixels per row
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x),
+                         packLumaAVX2(lumaAVX2(r0[0], cy), lumaAVX2(r0[1], cy)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x + 16),
+                         packLumaAVX2(lumaAVX2(r0[2], cy), lumaAVX2(r0[3], cy)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x),
+                         packLumaAVX2(lumaAVX2(r1[0], cy), lumaAVX2(r1[1], cy)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x + 16),
+                         packLumaAVX2(lumaAVX2(r1[2], cy), lumaAVX2(r1[3], cy)));
+
+        // Chroma, 16 samples from the 2x2 block sums
+        __m256i su[4], sv[4];
+        for (int i = 0; i < 4; ++i) {
+            const __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(r0[i], zero), _mm256_unpacklo_epi8(r1[i], zero));
+            const __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(r0[i], zero), _mm256_unpackhi_epi8(r1[i], zero));
+            su[i] = chromaSumsAVX2(lo, hi, cu);
+            sv[i] = chromaSumsAVX2(lo, hi, cv);
+        }
+        const __m128i u8 = packChromaAVX2(chromaPairsAVX2(su[0], su[1]), chromaPairsAVX2(su[2], su[3]));
+        const __m128i v8 = packChromaAVX2(chromaPairsAVX2(sv[0], sv[1]), chromaPairsAVX2(sv[2], sv[3]));
+
+        if (interleaved) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(u + x), _mm_unpacklo_epi8(u8, v8));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(u + x + 16), _mm_unpackhi_epi8(u8, v8));
+        } else {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(u + x / 2), u8);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(v + x / 2), v8);
+        }
+    }
+
+    rowPairScalar(src0, src1, y0, y1, u, v, x, width, interleaved, c);
+}
+
+#endif // COLORCONVERT_X86
+
+static RowPairFunc rowPairFunc(ColorConverter::Implementation implementation)
+{
+    switch (implementation) {
+#ifdef COLORCONVERT_X86
+    case ColorConverter::AVX2:
+        return rowPairAVX2;
+    case ColorConverter::SSE41:
+        return rowPairSSE41;
+#endif
+    default:
+        return rowPairGeneric;
+    }
+}
+
+static AccumulateFunc accumulateFunc(ColorConverter::Implementation implementation)
+{
+    switch (implementation) {
+#ifdef COLORCONVERT_X86
+    case ColorConverter::AVX2:
+        return accumulateAVX2;
+    case ColorConverter::SSE41:
+        return accumulateSSE41;
+#endif
+    default:
+        return accumulateGeneric;
+    }
+}
+
+static ResampleFunc resampleFunc(ColorConverter::Implementation implementation)
+{
+    switch (implementation) {
+#ifdef COLORCONVERT_X86
+    case ColorConverter::AVX2:
+    case ColorConverter::SSE41:
+        return resampleSSE41;
+#endif
+    default:
+        return resampleScalar;
+    }
+}
+
+// Target pixel i covers source pixels [i * source / target, (i + 1) * source / target)
+static void computeTaps(int source, int target, ColorConverter::Taps &taps)
+{
+    std::vector<int> offset(1, 0);
+    std::vector<uint16_t> weights;
+    taps.first.resize(size_t(target));
+    taps.count = 0;
+
+    for (int i = 0; i < target; ++i) {
+        // In units of 1 / target source pixels
+        const int64_t start = int64_t(i) * source;
+        const int64_t end = int64_t(i + 1) * source;
+        const int first = int(start / target);
+        const int last = int((end - 1) / target);
+
+        // Each weight is the difference of the rounded running total,
+        // so they add up to exactly 256 and flat areas stay flat,
+        // however many taps there are
+        int previous = 0;
+        for (int p = first; p <= last; ++p) {
+            const int64_t edge = std::min(end, int64_t(p + 1) * target);
+            const int total = int(((edge - start) * 256 + source / 2) / source);
+            weights.push_back(uint16_t(total - previous));
+            previous = total;
+        }
+
+        taps.first[size_t(i)] = first;
+        offset.push_back(int(weights.size()));
+        taps.count = std::max(taps.count, last - first + 1);
+    }
+
+    // Pad to the same number of taps, at the end unless that would read
+    // past the last source pixel; zero weights don't change the result
+    taps.weights.assign(size_t(target) * size_t(taps.count), 0);
+    for (int i = 0; i < target; ++i) {
+        const int used = offset[size_t(i) + 1] - offset[size_t(i)];
+        const int shift = std::max(0, taps.first[size_t(i)] + taps.count - source);
+        taps.first[size_t(i)] -= shift;
+        std::copy(weights.begin() + offset[size_t(i)], weights.begin() + offset[size_t(i)] + used,
+                  taps.weights.begin() + ptrdiff_t(i) * taps.count + shift);
+    }
+
+    taps.lanes.resize(taps.weights.size() * 4);
+    for (size_t i = 0; i < taps.weights.size(); ++i)
+        std::fill_n(taps.lanes.begin() + ptrdiff_t(i) * 4, 4, taps.weights[i]);
+}
+
+/*
+ * ColorConverter
+ */
+
+ColorConverter::ColorConverter(SourceFormat source, TargetFormat target,
+                               Implementation implementation)
+    : m_source(source)
+    , m_target(target)
+    , m_implementation(implementation > bestImplementation() ? bestImplementation() : implementation)
+{
+    // Byte offsets of R, G and B within a pixel
+    int r = 0, g = 1, b = 2;
+    switch (source) {
+    case BGRx:
+    case BGRA:
+        r = 2; g = 1; b = 0;
+        break;
+    case RGBx:
+    case RGBA:
+        r = 0; g = 1; b = 2;
+        break;
+    case xRGB:
+    case ARGB:
+        r = 1; g = 2; b = 3;
+        break;
+    case xBGR:
+    case ABGR:
+        r = 3; g = 2; b = 1;
+        break;
+    }
+
+    for (int i = 0; i < 4; ++i)
+        m_coefficients.y[i] = m_coefficients.u[i] = m_coefficients.v[i] = 0;
+    m_coefficients.y[r] = coeffY[0];
+    m_coefficients.y[g] = coeffY[1];
+    m_coefficients.y[b] = coeffY[2];
+    m_coefficients.u[r] = coeffU[0];
+    m_coefficients.u[g] = coeffU[1];
+    m_coefficients.u[b] = coeffU[2];
+    m_coefficients.v[r] = coeffV[0];
+    m_coefficients.v[g] = coeffV[1];
+    m_coefficients.v[b] = coeffV[2];
+}
+
+void ColorConverter::setScale(int sourceWidth, int sourceHeight, int targetWidth, int targetHeight)
+{
+    m_scaling = targetWidth > 0 && targetHeight > 0 &&
+            targetWidth <= sourceWidth && targetHeight <= sourceHeight &&
+            (targetWidth != sourceWidth || targetHeight != sourceHeight);
+    m_sourceWidth = sourceWidth;
+    m_sourceHeight = sourceHeight;
+    m_targetWidth = targetWidth;
+    m_targetHeight = targetHeight;
+
+    if (m_scaling) {
+        computeTaps(sourceWidth, targetWidth, m_columns);
+        computeTaps(sourceHeight, targetHeight, m_rows);
+    } else {
+        m_columns = Taps();
+        m_rows = Taps();
+    }
+}
+
+void ColorConverter::scaleRow(const SourceImage &source, int row, uint16_t *sums, uint8_t *target) const
+{
+    const uint16_t *weights = m_rows.weights.data() + size_t(row) * size_t(m_rows.count);
+    int first = m_rows.first[size_t(row)];
+    int taps = m_rows.count;
+
+    // Padding rows aren't read at all
+    while (taps > 1 && weights[0] == 0) {
+        ++weights;
+        ++first;
+        --taps;
+    }
+    while (taps > 1 && weights[taps - 1] == 0)
+        --taps;
+
+    accumulateFunc(m_implementation)(source.data + first * source.stride, source.stride,
+                                     weights, taps, sums, source.width * 4);
+    resampleFunc(m_implementation)(sums, target, m_targetWidth, m_columns);
+}
+
+void ColorConverter::scale(const SourceImage &source, uint8_t *target, int targetStride,
+                           int firstRow, int lastRow) const
+{
+    if (!m_scaling || source.width != m_sourceWidth || source.height != m_sourceHeight)
+        return;
+
+    std::vector<uint16_t> sums(size_t(source.width) * 4);
+    lastRow = std::min(lastRow, m_targetHeight);
+    for (int row = firstRow; row < lastRow; ++row)
+        scaleRow(source, row, sums.data(), target + row * targetStride);
+}
+
+void ColorConverter::convert(const SourceImage &source, const TargetImage &target,
+                             int firstRow, int lastRow) const
+{
+    const RowPairFunc func = rowPairFunc(m_implementation);
+    const bool interleaved = m_target == NV12;
+
+    if (m_scaling) {
+        if (source.width != m_sourceWidth || source.height != m_sourceHeight)
+            return;
+
+        // Two scaled rows at a time, converted while still in cache
+        std::vector<uint16_t> sums(size_t(source.width) * 4);
+        std::vector<uint8_t> rows(size_t(m_targetWidth) * 8);
+        uint8_t *row0 = rows.data();
+        uint8_t *row1 = rows.data() + m_targetWidth * 4;
+
+        lastRow = std::min(lastRow, m_targetHeight);
+        for (int row = firstRow; row < lastRow; row += 2) {
+            const int next = row + 1 < m_targetHeight ? row + 1 : row;
+            scaleRow(source, row, sums.data(), row0);
+            if (next != row)
+                scaleRow(source, next, sums.data(), row1);
+            uint8_t *y0 = target.planes[0] + row * target.strides[0];
+            uint8_t *y1 = target.planes[0] + next * target.strides[0];
+            uint8_t *u = target.planes[1] + (row / 2) * target.strides[1];
+            uint8_t *v = interleaved ? nullptr : target.planes[2] + (row / 2) * target.strides[2];
+
+            func(row0, next != row ? row1 : row0, y0, y1, u, v, m_targetWidth, interleaved, m_coefficients);
+        }
+        return;
+    }
+
+    if (lastRow > source.height)
+        lastRow = source.height;
+
+    for (int row = firstRow; row < lastRow; row += 2) {
+        // With an odd height the last row is paired with itself
+        const int next = row + 1 < source.height ? row + 1 : row;
+        const uint8_t *src0 = source.data + row * source.stride;
+        const uint8_t *src1 = source.data + next * source.stride;
+        uint8_t *y0 = target.planes[0] + row * target.strides[0];
+        uint8_t *y1 = target.planes[0] + next * target.strides[0];
+        uint8_t *u = target.planes[1] + (row / 2) * target.strides[1];
+        uint8_t *v = interleaved ? nullptr : target.planes[2] + (row / 2) * target.strides[2];
+
+        func(src0, src1, y0, y1, u, v, source.width, interleaved, m_coefficients);
+    }
+}
+
+ColorConverter::Implementation ColorConverter::bestImplementation()
+{
+#ifdef COLORCONVERT_X86
+    static const Implementation best = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return AVX2;
+        if (__builtin_cpu_supports("sse4.1"))
+            return SSE41;
+        return Scalar;
+    }();
+    return best;
+#else
+    return Scalar;
+#endif
+}
+
+const char *ColorConverter::implementationName(Implementation implementation)
+{
+    switch (implementation) {
+    case SSE41:
+        return "sse4.1";
+    case AVX2:
+        return "avx2";
+    default:
+        break;
+    }
+
+    return "scalar";
+}
@@ -0,0 +1,122 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef COLORCONVERT_H
+#define COLORCONVERT_H
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Packed 32-bit RGB to 4:2:0 YUV conversion with BT.709 limited range
+ * coefficients, using SSE4.1 or AVX2 when the CPU supports them.
+ *
+ * The source can also be scaled down on the way, with an area average
+ * computed one output row at a time right before it's converted: every
+ * source row is read once and the scaled image never hits memory.
+ *
+ * All implementations use the same fixed point arithmetic and
+ * produce bit-exact results.
+ */
+class ColorConverter
+{
+public:
+    enum SourceFormat {
+        BGRx,
+        BGRA,
+        RGBx,
+        RGBA,
+        xRGB,
+        ARGB,
+        xBGR,
+        ABGR
+    };
+
+    enum TargetFormat {
+        I420,
+        NV12
+    };
+
+    enum Implementation {
+        Scalar,
+        SSE41,
+        AVX2
+    };
+
+    struct SourceImage {
+        const uint8_t *data = nullptr;
+        int stride = 0;
+        int width = 0;
+        int height = 0;
+    };
+
+    struct TargetImage {
+        // Y, U, V planes for I420 and Y, UV for NV12
+        uint8_t *planes[3] = { nullptr, nullptr, nullptr };
+        int strides[3] = { 0, 0, 0 };
+    };
+
+    struct Coefficients {
+        int16_t y[4];
+        int16_t u[4];
+        int16_t v[4];
+    };
+
+    explicit ColorConverter(SourceFormat source, TargetFormat target,
+                            Implementation implementation = bestImplementation());
+
+    SourceFormat sourceFormat() const { return m_source; }
+    TargetFormat targetFormat() const { return m_target; }
+    Implementation implementation() const { return m_implementation; }
+
+    // Scale sourceWidth x sourceHeight images down to targetWidth x
+    // targetHeight, which can't be larger; the same size turns it off
+    void setScale(int sourceWidth, int sourceHeight, int targetWidth, int targetHeight);
+    bool isScaling() const { return m_scaling; }
+
+    // Converts target rows [firstRow, lastRow), firstRow must be even;
+    // these are also the source rows unless scaling
+    void convert(const SourceImage &source, const TargetImage &target,
+                 int firstRow, int lastRow) const;
+
+    // Only scales target rows [firstRow, lastRow) to packed 32-bit
+    // pixels in the source format, without converting them
+    void scale(const SourceImage &source, uint8_t *target, int targetStride,
+               int firstRow, int lastRow) const;
+
+    static Implementation bestImplementation();
+    static const char *implementationName(Implementation implementation);
+
+    // Source pixels averaged into one target pixel along one axis,
+    // with 8 bit weights adding up to 256; every target pixel has the
+    // same number of taps, padded with zero weights, so that kernels
+    // don't branch on it
+    struct Taps {
+        int count = 0;
+        std::vector<int> first;
+        std::vector<uint16_t> weights;
+        // Each weight repeated for the four channels of a pixel
+        std::vector<uint16_t> lanes;
+    };
+
+private:
+    SourceFormat m_source;
+    TargetFormat m_target;
+    Implementation m_implementation;
+    Coefficients m_coefficients;
+
+    bool m_scaling = false;
+    int m_sourceWidth = 0;
+    int m_sourceHeight = 0;
+    int m_targetWidth = 0;
+    int m_targetHeight = 0;
+    Taps m_columns;
+    Taps m_rows;
+
+    void scaleRow(const SourceImage &source, int row, uint16_t *sums, uint8_t *target) const;
+};
+
+#endif // COLORCONVERT_H
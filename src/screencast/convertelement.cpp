@@ -0,0 +1,522 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QThread>
+
+#include "colorconvert.h"
+#include "convertelement.h"
+#include "framepool.h"
+#include "screencast.h"
+#include "slicepool.h"
+
+#include <gst/video/video.h>
+
+#define SOURCE_FORMATS "{ BGRx, BGRA, RGBx, RGBA, xRGB, ARGB, xBGR, ABGR }"
+#define TARGET_FORMATS "{ I420, NV12 }"
+
+// Output buffers allocated up front and recycled
+static const guint minPoolBuffers = 4;
+
+enum {
+    PROP_0,
+    PROP_N_THREADS,
+    PROP_IMPLEMENTATION,
+    PROP_MAX_WIDTH,
+    PROP_MAX_HEIGHT,
+    PROP_MAX_POOL_BYTES,
+    PROP_POOL_BYTES,
+    PROP_POOL_PEAK_BYTES
+};
+
+struct _ScreencastConvert
+{
+    GstVideoFilter parent;
+
+    guint nThreads;
+    gint maxWidth;
+    gint maxHeight;
+    guint64 maxPoolBytes;
+    ColorConverter *converter;
+    SlicePool *pool;
+    // The output pool when it is our own, which knows its size
+    ScreencastFramePool *framePool;
+};
+
+G_DEFINE_TYPE(ScreencastConvert, screencast_convert, GST_TYPE_VIDEO_FILTER)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(SOURCE_FORMATS)));
+
+static GstStaticPadTemplate srcTemplate =
+        GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(TARGET_FORMATS)));
+
+static bool sourceFormat(GstVideoFormat format, ColorConverter::SourceFormat &result)
+{
+    switch (format) {
+    case GST_VIDEO_FORMAT_BGRx:
+        result = ColorConverter::BGRx;
+        return true;
+    case GST_VIDEO_FORMAT_BGRA:
+        result = ColorConverter::BGRA;
+        return true;
+    case GST_VIDEO_FORMAT_RGBx:
+        result = ColorConverter::RGBx;
+        return true;
+    case GST_VIDEO_FORMAT_RGBA:
+        result = ColorConverter::RGBA;
+        return true;
+    case GST_VIDEO_FORMAT_xRGB:
+        result = ColorConverter::xRGB;
+        return true;
+    case GST_VIDEO_FORMAT_ARGB:
+        result = ColorConverter::ARGB;
+        return true;
+    case GST_VIDEO_FORMAT_xBGR:
+        result = ColorConverter::xBGR;
+        return true;
+    case GST_VIDEO_FORMAT_ABGR:
+        result = ColorConverter::ABGR;
+        return true;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+static void setFormatList(GstStructure *structure, const char *const *formats)
+{
+    GValue list = G_VALUE_INIT;
+    GValue value = G_VALUE_INIT;
+
+    g_value_init(&list, GST_TYPE_LIST);
+    g_value_init(&value, G_TYPE_STRING);
+    for (; *formats; ++formats) {
+        g_value_set_string(&value, *formats);
+        gst_value_list_append_value(&list, &value);
+    }
+    gst_structure_take_value(structure, "format", &list);
+    g_value_unset(&value);
+}
+
+// Largest even size that fits the limits with the same aspect ratio, never larger
+static void scaled_size(ScreencastConvert *self, int width, int height, int *outWidth, int *outHeight)
+{
+    GST_OBJECT_LOCK(self);
+    const int maxWidth = self->maxWidth;
+    const int maxHeight = self->maxHeight;
+    GST_OBJECT_UNLOCK(self);
+
+    double factor = 1.0;
+    if (maxWidth > 0 && width > maxWidth)
+        factor = qMin(factor, double(maxWidth) / width);
+    if (maxHeight > 0 && height > maxHeight)
+        factor = qMin(factor, double(maxHeight) / height);
+
+    if (factor >= 1.0) {
+        *outWidth = width;
+        *outHeight = height;
+        return;
+    }
+
+    *outWidth = qMax(2, int(width * factor + 0.5) & ~1);
+    *outHeight = qMax(2, int(height * factor + 0.5) & ~1);
+}
+
+static bool is_scaling(ScreencastConvert *self)
+{
+    GST_OBJECT_LOCK(self);
+    const bool scaling = self->maxWidth > 0 || self->maxHeight > 0;
+    GST_OBJECT_UNLOCK(self);
+    return scaling;
+}
+
+static GstCaps *screencast_convert_transform_caps(GstBaseTransform *trans, GstPadDirection direction,
+                                                  GstCaps *caps, GstCaps *filter)
+{
+    ScreencastConvert *self = SCREENCAST_CONVERT(trans);
+    const bool scaling = is_scaling(self);
+
+    static const char *const sourceFormats[] = {
+        "BGRx", "BGRA", "RGBx", "RGBA", "xRGB", "ARGB", "xBGR", "ABGR", nullptr
+    };
+    static const char *const targetFormats[] = { "I420", "NV12", nullptr };
+
+    GstCaps *result = gst_caps_new_empty();
+
+    for (guint i = 0; i < gst_caps_get_size(caps); ++i) {
+        GstStructure *structure = gst_structure_copy(gst_caps_get_structure(caps, i));
+        GstCapsFeatures *features = gst_caps_get_features(caps, i);
+
+        gst_structure_remove_fields(structure, "format", "colorimetry", "chroma-site", nullptr);
+        if (scaling) {
+            // Scaling is decided here rather than negotiated, the output
+            // size only depends on the input size and the limits
+            int width = 0, height = 0;
+            if (direction == GST_PAD_SINK && gst_structure_get_int(structure, "width", &width) &&
+                    gst_structure_get_int(structure, "height", &height)) {
+                scaled_size(self, width, height, &width, &height);
+                gst_structure_set(structure, "width", G_TYPE_INT, width, "height", G_TYPE_INT, height, nullptr);
+            } else {
+                gst_structure_set(structure,
+                                  "width", GST_TYPE_INT_RANGE, 1, G_MAXINT,
+                                  "height", GST_TYPE_INT_RANGE, 1, G_MAXINT,
+                                  nullptr);
+            }
+            gst_structure_remove_field(structure, "pixel-aspect-ratio");
+        }
+        if (direction == GST_PAD_SINK) {
+            setFormatList(structure, targetFormats);
+            gst_structure_set(structure,
+                              "colorimetry", G_TYPE_STRING, "bt709",
+                              "chroma-site", G_TYPE_STRING, "mpeg2",
+                              nullptr);
+        } else {
+            setFormatList(structure, sourceFormats);
+        }
+
+        gst_caps_append_structure_full(result, structure,
+                                       features ? gst_caps_features_copy(features) : nullptr);
+    }
+
+    if (filter) {
+        GstCaps *intersection = gst_caps_intersect_full(filter, result, GST_CAPS_INTERSECT_FIRST);
+        gst_caps_unref(result);
+        result = intersection;
+    }
+
+    return result;
+}
+
+static gboolean screencast_convert_decide_allocation(GstBaseTransform *trans, GstQuery *query)
+{
+    ScreencastConvert *self = SCREENCAST_CONVERT(trans);
+    GstCaps *caps = nullptr;
+    GstVideoInfo info;
+
+    gst_query_parse_allocation(query, &caps, nullptr);
+    if (!caps || !gst_video_info_from_caps(&info, caps))
+        return FALSE;
+
+    // Make sure the output pool is preallocated so that buffers are only
+    // recycled once streaming; the maximum stays whatever downstream asked
+    // for because encoders with lookahead hold on to many input frames
+    GstBufferPool *pool = nullptr;
+    guint size = 0, min = 0, max = 0;
+    if (gst_query_get_n_allocation_pools(query) > 0) {
+        gst_query_parse_nth_allocation_pool(query, 0, &pool, &size, &min, &max);
+        if (!pool)
+            pool = screencast_frame_pool_new();
+        size = MAX(size, guint(GST_VIDEO_INFO_SIZE(&info)));
+        min = MAX(min, minPoolBuffers);
+        if (max > 0 && max < min)
+            max = min;
+        gst_query_set_nth_allocation_pool(query, 0, pool, size, min, max);
+    } else {
+        pool = screencast_frame_pool_new();
+        gst_query_add_allocation_pool(query, pool, GST_VIDEO_INFO_SIZE(&info), minPoolBuffers, 0);
+    }
+    gst_object_unref(pool);
+
+    if (!GST_BASE_TRANSFORM_CLASS(screencast_convert_parent_class)->decide_allocation(trans, query))
+        return FALSE;
+
+    // A pool from downstream, a hardware encoder's, is not ours to size
+    pool = gst_base_transform_get_buffer_pool(trans);
+    GST_OBJECT_LOCK(self);
+    g_clear_object(&self->framePool);
+    if (pool && SCREENCAST_IS_FRAME_POOL(pool)) {
+        self->framePool = SCREENCAST_FRAME_POOL(gst_object_ref(pool));
+        screencast_frame_pool_set_max_bytes(self->framePool, self->maxPoolBytes);
+    }
+    GST_OBJECT_UNLOCK(self);
+    if (pool)
+        gst_object_unref(pool);
+
+    return TRUE;
+}
+
+static gboolean screencast_convert_transform_meta(GstBaseTransform *trans, GstBuffer *outbuf,
+                                                  GstMeta *meta, GstBuffer *inbuf)
+{
+    ScreencastConvert *self = SCREENCAST_CONVERT(trans);
+
+    // Only metas that depend on the format are dropped
+    static const gchar *validTags[] = {
+        GST_META_TAG_VIDEO_STR,
+        GST_META_TAG_VIDEO_ORIENTATION_STR,
+        GST_META_TAG_VIDEO_SIZE_STR,
+        nullptr
+    };
+    if (!gst_meta_api_type_tags_contain_only(meta->info->api, validTags))
+        return FALSE;
+
+    // When scaling, regions of interest and the cursor are scaled too
+    if (self->converter && self->converter->isScaling() &&
+            gst_meta_api_type_has_tag(meta->info->api, g_quark_from_static_string(GST_META_TAG_VIDEO_SIZE_STR))) {
+        if (meta->info->transform_func) {
+            GstVideoFilter *filter = GST_VIDEO_FILTER(trans);
+            GstVideoMetaTransform transform = { &filter->in_info, &filter->out_info };
+            meta->info->transform_func(outbuf, meta, inbuf, gst_video_meta_transform_scale_get_quark(), &transform);
+        }
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean screencast_convert_set_info(GstVideoFilter *filter,
+                                            GstCaps *incaps, GstVideoInfo *inInfo,
+                                            GstCaps *outcaps, GstVideoInfo *outInfo)
+{
+    Q_UNUSED(incaps)
+    Q_UNUSED(outcaps)
+
+    ScreencastConvert *self = SCREENCAST_CONVERT(filter);
+
+    ColorConverter::SourceFormat source;
+    if (!sourceFormat(GST_VIDEO_INFO_FORMAT(inInfo), source))
+        return FALSE;
+
+    const ColorConverter::TargetFormat target =
+            GST_VIDEO_INFO_FORMAT(outInfo) == GST_VIDEO_FORMAT_NV12
+            ? ColorConverter::NV12 : ColorConverter::I420;
+
+    // Only scaling down is supported
+    if (GST_VIDEO_INFO_WIDTH(inInfo) < GST_VIDEO_INFO_WIDTH(outInfo) ||
+            GST_VIDEO_INFO_HEIGHT(inInfo) < GST_VIDEO_INFO_HEIGHT(outInfo))
+        return FALSE;
+
+    delete self->converter;
+    self->converter = new ColorConverter(source, target);
+    self->converter->setScale(GST_VIDEO_INFO_WIDTH(inInfo), GST_VIDEO_INFO_HEIGHT(inInfo),
+                              GST_VIDEO_INFO_WIDTH(outInfo), GST_VIDEO_INFO_HEIGHT(outInfo));
+
+    const int threads = self->nThreads > 0
+            ? int(self->nThreads) : qBound(1, QThread::idealThreadCount() / 2, 4);
+    if (!self->pool || self->pool->threadCount() != threads) {
+        delete self->pool;
+        self->pool = new SlicePool(threads);
+    }
+
+    qCInfo(lcScreencast, "Converting %s %dx%d to %s %dx%d using %s kernels on %d threads",
+           gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(inInfo)),
+           GST_VIDEO_INFO_WIDTH(inInfo), GST_VIDEO_INFO_HEIGHT(inInfo),
+           gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(outInfo)),
+           GST_VIDEO_INFO_WIDTH(outInfo), GST_VIDEO_INFO_HEIGHT(outInfo),
+           ColorConverter::implementationName(self->converter->implementation()),
+           threads);
+
+    return TRUE;
+}
+
+static GstFlowReturn screencast_convert_transform_frame(GstVideoFilter *filter,
+                                                        GstVideoFrame *inframe,
+                                                        GstVideoFrame *outframe)
+{
+    ScreencastConvert *self = SCREENCAST_CONVERT(filter);
+
+    ColorConverter::SourceImage source;
+    source.data = static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(inframe, 0));
+    source.stride = GST_VIDEO_FRAME_PLANE_STRIDE(inframe, 0);
+    source.width = GST_VIDEO_FRAME_WIDTH(inframe);
+    source.height = GST_VIDEO_FRAME_HEIGHT(inframe);
+
+    ColorConverter::TargetImage target;
+    for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(outframe); ++i) {
+        target.planes[i] = static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(outframe, i));
+        target.strides[i] = GST_VIDEO_FRAME_PLANE_STRIDE(outframe, i);
+    }
+
+    // Two slices per thread to even out threads that get descheduled,
+    // each slice starts on an even row of the output
+    const int height = GST_VIDEO_FRAME_HEIGHT(outframe);
+    const int slices = self->pool->threadCount() * 2;
+    const int rows = (((height + slices - 1) / slices) + 1) & ~1;
+    const ColorConverter *converter = self->converter;
+
+    self->pool->run(slices, [&](int slice) {
+        converter->convert(source, target, slice * rows, (slice + 1) * rows);
+    });
+
+    return GST_FLOW_OK;
+}
+
+static void screencast_convert_set_property(GObject *object, guint propId,
+                                            const GValue *value, GParamSpec *pspec)
+{
+    ScreencastConvert *self = SCREENCAST_CONVERT(object);
+
+    switch (propId) {
+    case PROP_N_THREADS:
+        self->nThreads = g_value_get_uint(value);
+        break;
+    case PROP_MAX_WIDTH:
+        GST_OBJECT_LOCK(self);
+        self->maxWidth = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(self);
+        gst_base_transform_reconfigure_src(GST_BASE_TRANSFORM(self));
+        break;
+    case PROP_MAX_HEIGHT:
+        GST_OBJECT_LOCK(self);
+        self->maxHeight = g_value_get_int(value);
+        GST_OBJECT_UNLOCK(self);
+        gst_base_transform_reconfigure_src(GST_BASE_TRANSFORM(self));
+        break;
+    case PROP_MAX_POOL_BYTES:
+        GST_OBJECT_LOCK(self);
+        self->maxPoolBytes = g_value_get_uint64(value);
+        if (self->framePool)
+            screencast_frame_pool_set_max_bytes(self->framePool, self->maxPoolBytes);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_convert_get_property(GObject *object, guint propId,
+                                            GValue *value, GParamSpec *pspec)
+{
+    ScreencastConvert *self = SCREENCAST_CONVERT(object);
+
+    switch (propId) {
+    case PROP_N_THREADS:
+        g_value_set_uint(value, self->nThreads);
+        break;
+    case PROP_MAX_WIDTH:
+        GST_OBJECT_LOCK(self);
+        g_value_set_int(value, self->maxWidth);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    case PROP_MAX_HEIGHT:
+        GST_OBJECT_LOCK(self);
+        g_value_set_int(value, self->maxHeight);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    case PROP_MAX_POOL_BYTES:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint64(value, self->maxPoolBytes);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    case PROP_POOL_BYTES:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint64(value, self->framePool ? screencast_frame_pool_get_bytes(self->framePool) : 0);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    case PROP_POOL_PEAK_BYTES:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint64(value, self->framePool ? screencast_frame_pool_get_peak_bytes(self->framePool) : 0);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    case PROP_IMPLEMENTATION:
+        g_value_set_string(value, ColorConverter::implementationName(
+                               self->converter ? self->converter->implementation()
+                                               : ColorConverter::bestImplementation()));
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_convert_finalize(GObject *object)
+{
+    ScreencastConvert *self = SCREENCAST_CONVERT(object);
+
+    delete self->converter;
+    self->converter = nullptr;
+    delete self->pool;
+    self->pool = nullptr;
+    g_clear_object(&self->framePool);
+
+    G_OBJECT_CLASS(screencast_convert_parent_class)->finalize(object);
+}
+
+static void screencast_convert_class_init(ScreencastConvertClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseTransformClass *transformClass = GST_BASE_TRANSFORM_CLASS(klass);
+    GstVideoFilterClass *filterClass = GST_VIDEO_FILTER_CLASS(klass);
+
+    objectClass->set_property = screencast_convert_set_property;
+    objectClass->get_property = screencast_convert_get_property;
+    objectClass->finalize = screencast_convert_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_N_THREADS,
+                g_param_spec_uint("n-threads", "Threads",
+                                  "Number of conversion threads (0 = automatic)",
+                                  0, 64, 0,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_IMPLEMENTATION,
+                g_param_spec_string("implementation", "Implementation",
+                                    "Conversion kernels in use",
+                                    nullptr,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_MAX_WIDTH,
+                g_param_spec_int("max-width", "Maximum width",
+                                 "Scale down wider frames, keeping the aspect ratio (0 = no limit)",
+                                 0, G_MAXINT, 0,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_MAX_HEIGHT,
+                g_param_spec_int("max-height", "Maximum height",
+                                 "Scale down taller frames, keeping the aspect ratio (0 = no limit)",
+                                 0, G_MAXINT, 0,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_MAX_POOL_BYTES,
+                g_param_spec_uint64("max-pool-bytes", "Maximum pool bytes",
+                                    "Free released output buffers while the pool holds more (0 = keep all)",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_POOL_BYTES,
+                g_param_spec_uint64("pool-bytes", "Pool bytes",
+                                    "Memory of the output buffers, in use or not",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_POOL_PEAK_BYTES,
+                g_param_spec_uint64("pool-peak-bytes", "Pool peak bytes",
+                                    "Most memory the output buffers ever took",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast colorspace converter",
+                                          "Filter/Converter/Video",
+                                          "Converts packed RGB screen captures to I420 or NV12, optionally scaling them down",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+    gst_element_class_add_static_pad_template(elementClass, &srcTemplate);
+
+    transformClass->transform_caps = screencast_convert_transform_caps;
+    transformClass->decide_allocation = screencast_convert_decide_allocation;
+    transformClass->transform_meta = screencast_convert_transform_meta;
+    transformClass->passthrough_on_same_caps = FALSE;
+
+    filterClass->set_info = screencast_convert_set_info;
+    filterClass->transform_frame = screencast_convert_transform_frame;
+}
+
+static void screencast_convert_init(ScreencastConvert *self)
+{
+    self->nThreads = 0;
+    self->maxWidth = 0;
+    self->maxHeight = 0;
+    self->maxPoolBytes = 0;
+    self->converter = nullptr;
+    self->pool = nullptr;
+    self->framePool = nullptr;
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef CONVERTELEMENT_H
+#define CONVERTELEMENT_H
+
+#include <gst/video/gstvideofilter.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_CONVERT (screencast_convert_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastConvert, screencast_convert, SCREENCAST, CONVERT, GstVideoFilter)
+
+G_END_DECLS
+
+#endif // CONVERTELEMENT_H
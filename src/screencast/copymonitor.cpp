@@ -0,0 +1,198 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "copymonitor.h"
+#include "pipewiresrcelement.h"
+#include "screencast.h"
+
+#include <gst/allocators/gstfdmemory.h>
+
+static GstElement *peerElement(GstPad *pad)
+{
+    GstPad *peer = gst_pad_get_peer(pad);
+    if (!peer)
+        return nullptr;
+
+    GstElement *element = gst_pad_get_parent_element(peer);
+    gst_object_unref(peer);
+    return element;
+}
+
+CopyMonitor::CopyMonitor(GstElement *source, GstElement *encoder)
+{
+    m_sourcePad = gst_element_get_static_pad(source, "src");
+    m_sourceProbe = gst_pad_add_probe(m_sourcePad, GST_PAD_PROBE_TYPE_BUFFER,
+                                      sourceProbe, this, nullptr);
+
+    m_encoderPad = gst_element_get_static_pad(encoder, "sink");
+    m_encoderProbe = gst_pad_add_probe(m_encoderPad, GST_PAD_PROBE_TYPE_BUFFER,
+                                       encoderProbe, this, nullptr);
+
+    // Walk the linear chain of elements between source and encoder
+    GstElement *element = peerElement(m_sourcePad);
+    while (element && element != encoder) {
+        Stage *stage = new Stage();
+        stage->monitor = this;
+        stage->element = element;
+        stage->sinkPad = gst_element_get_static_pad(element, "sink");
+        stage->srcPad = gst_element_get_static_pad(element, "src");
+
+        if (!stage->sinkPad || !stage->srcPad) {
+            g_clear_object(&stage->sinkPad);
+            g_clear_object(&stage->srcPad);
+            gst_object_unref(element);
+            delete stage;
+            break;
+        }
+
+        stage->sinkProbe = gst_pad_add_probe(stage->sinkPad, GST_PAD_PROBE_TYPE_BUFFER,
+                                             stageInputProbe, stage, nullptr);
+        stage->srcProbe = gst_pad_add_probe(stage->srcPad, GST_PAD_PROBE_TYPE_BUFFER,
+                                            stageOutputProbe, stage, nullptr);
+        m_stages.append(stage);
+
+        element = peerElement(stage->srcPad);
+    }
+
+    if (element)
+        gst_object_unref(element);
+}
+
+CopyMonitor::~CopyMonitor()
+{
+    gst_pad_remove_probe(m_sourcePad, m_sourceProbe);
+    gst_object_unref(m_sourcePad);
+    gst_pad_remove_probe(m_encoderPad, m_encoderProbe);
+    gst_object_unref(m_encoderPad);
+
+    for (auto *stage : qAsConst(m_stages)) {
+        gst_pad_remove_probe(stage->sinkPad, stage->sinkProbe);
+        gst_pad_remove_probe(stage->srcPad, stage->srcProbe);
+        gst_object_unref(stage->sinkPad);
+        gst_object_unref(stage->srcPad);
+        gst_object_unref(stage->element);
+    }
+    qDeleteAll(m_stages);
+}
+
+void CopyMonitor::report(uint nodeId)
+{
+    const quint64 frames = m_frames.fetchAndStoreRelaxed(0);
+    const quint64 fdFrames = m_fdFrames.fetchAndStoreRelaxed(0);
+    const quint64 copies = m_copies.fetchAndStoreRelaxed(0);
+    const quint64 conversions = m_conversions.fetchAndStoreRelaxed(0);
+
+    if (frames == 0)
+        return;
+
+    qCInfo(lcScreencast,
+           "Stream %d: %llu frames, %.2f copies and %.2f conversions per frame, "
+           "%llu%% of the frames captured without copying",
+           nodeId, frames, double(copies) / frames, double(conversions) / frames,
+           fdFrames * 100 / frames);
+}
+
+GstMemory *CopyMonitor::rootMemory(GstBuffer *buffer)
+{
+    if (gst_buffer_n_memory(buffer) == 0)
+        return nullptr;
+
+    // Shared sub-memories point to the same data as their parent
+    GstMemory *memory = gst_buffer_peek_memory(buffer, 0);
+    while (memory->parent)
+        memory = memory->parent;
+    return memory;
+}
+
+GstPadProbeReturn CopyMonitor::sourceProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    CopyMonitor *self = static_cast<CopyMonitor *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    // memfd and DMA-BUF memory are mapped straight from the compositor,
+    // and so is the memory screencastpipewiresrc wraps; anything else
+    // has been copied by the source
+    GstMemory *memory = rootMemory(buffer);
+    static const GQuark mappedQuark = g_quark_from_static_string(SCREENCAST_MAPPED_MEMORY_QUARK);
+    if (memory && (gst_is_fd_memory(memory) ||
+                   gst_mini_object_get_qdata(GST_MINI_OBJECT(memory), mappedQuark)))
+        self->m_fdFrames.fetchAndAddRelaxed(1);
+
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn CopyMonitor::encoderProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+    Q_UNUSED(info)
+
+    CopyMonitor *self = static_cast<CopyMonitor *>(user_data);
+    self->m_frames.fetchAndAddRelaxed(1);
+
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn CopyMonitor::stageInputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    Stage *stage = static_cast<Stage *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    // The memory pointer is only compared, never dereferenced
+    QMutexLocker locker(&stage->mutex);
+    stage->lastMemory = rootMemory(buffer);
+    stage->lastPts = GST_BUFFER_PTS(buffer);
+
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn CopyMonitor::stageOutputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    Stage *stage = static_cast<Stage *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    {
+        QMutexLocker locker(&stage->mutex);
+
+        // Frames that were reordered or queued can't be matched, skip them
+        if (!GST_CLOCK_TIME_IS_VALID(stage->lastPts) || GST_BUFFER_PTS(buffer) != stage->lastPts)
+            return GST_PAD_PROBE_OK;
+        if (rootMemory(buffer) == stage->lastMemory)
+            return GST_PAD_PROBE_OK;
+    }
+
+    GstCaps *inputCaps = gst_pad_get_current_caps(stage->sinkPad);
+    GstCaps *outputCaps = gst_pad_get_current_caps(stage->srcPad);
+    bool converted = true;
+    if (inputCaps && outputCaps) {
+        const GstStructure *in = gst_caps_get_structure(inputCaps, 0);
+        const GstStructure *out = gst_caps_get_structure(outputCaps, 0);
+        int inWidth = 0, inHeight = 0, outWidth = 0, outHeight = 0;
+        gst_structure_get_int(in, "width", &inWidth);
+        gst_structure_get_int(in, "height", &inHeight);
+        gst_structure_get_int(out, "width", &outWidth);
+        gst_structure_get_int(out, "height", &outHeight);
+        converted = g_strcmp0(gst_structure_get_string(in, "format"),
+                              gst_structure_get_string(out, "format")) != 0 ||
+                inWidth != outWidth || inHeight != outHeight;
+    }
+    if (inputCaps)
+        gst_caps_unref(inputCaps);
+    if (outputCaps)
+        gst_caps_unref(outputCaps);
+
+    if (converted)
+        stage->monitor->m_conversions.fetchAndAddRelaxed(1);
+    else
+        stage->monitor->m_copies.fetchAndAddRelaxed(1);
+
+    return GST_PAD_PROBE_OK;
+}
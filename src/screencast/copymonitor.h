@@ -0,0 +1,66 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef COPYMONITOR_H
+#define COPYMONITOR_H
+
+#include <QAtomicInteger>
+#include <QMutex>
+#include <QVector>
+
+#include <gst/gst.h>
+
+/*
+ * Counts how many times frame data is copied or converted
+ * between the capture source and the encoder input.
+ *
+ * A probe on the sink pad of every element in between records the
+ * memory a frame arrived with, a probe on the source pad checks whether
+ * the frame with the same timestamp leaves with different memory.
+ * Elements that change format or size are accounted as conversions,
+ * everything else as a copy.
+ */
+class CopyMonitor
+{
+public:
+    explicit CopyMonitor(GstElement *source, GstElement *encoder);
+    ~CopyMonitor();
+
+    void report(uint nodeId);
+
+private:
+    struct Stage {
+        CopyMonitor *monitor = nullptr;
+        GstElement *element = nullptr;
+        GstPad *sinkPad = nullptr;
+        GstPad *srcPad = nullptr;
+        gulong sinkProbe = 0;
+        gulong srcProbe = 0;
+        QMutex mutex;
+        GstMemory *lastMemory = nullptr;
+        GstClockTime lastPts = GST_CLOCK_TIME_NONE;
+    };
+
+    QVector<Stage *> m_stages;
+    GstPad *m_sourcePad = nullptr;
+    gulong m_sourceProbe = 0;
+    GstPad *m_encoderPad = nullptr;
+    gulong m_encoderProbe = 0;
+
+    QAtomicInteger<quint64> m_frames = 0;
+    QAtomicInteger<quint64> m_fdFrames = 0;
+    QAtomicInteger<quint64> m_copies = 0;
+    QAtomicInteger<quint64> m_conversions = 0;
+
+    static GstMemory *rootMemory(GstBuffer *buffer);
+
+    static GstPadProbeReturn sourceProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    static GstPadProbeReturn encoderProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    static GstPadProbeReturn stageInputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    static GstPadProbeReturn stageOutputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+};
+
+#endif // COPYMONITOR_H
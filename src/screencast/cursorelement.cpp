@@ -0,0 +1,280 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QtGlobal>
+
+#include "cursorelement.h"
+#include "cursormeta.h"
+
+#include <gst/video/video.h>
+
+#include <vector>
+
+#define FORMATS "{ I420, NV12 }"
+
+enum {
+    PROP_0,
+    PROP_FRAMES_BLENDED
+};
+
+// The cursor image converted to BT.709 limited range, one sample per pixel
+struct CursorImage {
+    guint serial = 0;
+    double scale = 1.0;
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> y;
+    std::vector<uint8_t> u;
+    std::vector<uint8_t> v;
+    std::vector<uint8_t> alpha;
+};
+
+struct _ScreencastCursor
+{
+    GstBaseTransform parent;
+
+    GstVideoInfo info;
+    CursorImage *image;
+
+    guint64 framesBlended;
+};
+
+G_DEFINE_TYPE(ScreencastCursor, screencast_cursor, GST_TYPE_BASE_TRANSFORM)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static GstStaticPadTemplate srcTemplate =
+        GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static bool update_image(ScreencastCursor *self, ScreencastCursorMeta *meta)
+{
+    GstMapInfo map;
+    if (!gst_buffer_map(meta->image, &map, GST_MAP_READ))
+        return false;
+
+    const int width = int(meta->width);
+    const int height = int(meta->height);
+    if (width <= 0 || height <= 0 || map.size < gsize(width) * gsize(height) * 4) {
+        gst_buffer_unmap(meta->image, &map);
+        return false;
+    }
+
+    // Drawn smaller once the frame was scaled down
+    const int scaledWidth = qBound(1, int(width * meta->scale + 0.5), width);
+    const int scaledHeight = qBound(1, int(height * meta->scale + 0.5), height);
+
+    CursorImage *image = self->image;
+    image->serial = meta->serial;
+    image->scale = meta->scale;
+    image->width = scaledWidth;
+    image->height = scaledHeight;
+    const size_t count = size_t(scaledWidth) * size_t(scaledHeight);
+    image->y.resize(count);
+    image->u.resize(count);
+    image->v.resize(count);
+    image->alpha.resize(count);
+
+    // Same coefficients as the color converter, a cursor is a few
+    // thousand pixels so there's no point in vectorizing this
+    for (int ty = 0; ty < scaledHeight; ++ty) {
+        const int sy0 = ty * height / scaledHeight;
+        const int sy1 = qMax(sy0 + 1, (ty + 1) * height / scaledHeight);
+        for (int tx = 0; tx < scaledWidth; ++tx) {
+            const int sx0 = tx * width / scaledWidth;
+            const int sx1 = qMax(sx0 + 1, (tx + 1) * width / scaledWidth);
+
+            // Colors are weighted by their alpha, so that transparent
+            // pixels don't darken the edges
+            int sumAlpha = 0, sumR = 0, sumG = 0, sumB = 0;
+            for (int sy = sy0; sy < sy1; ++sy) {
+                for (int sx = sx0; sx < sx1; ++sx) {
+                    const uint8_t *pixel = map.data + (sy * width + sx) * 4;
+                    const int a = pixel[3];
+                    sumB += pixel[0] * a;
+                    sumG += pixel[1] * a;
+                    sumR += pixel[2] * a;
+                    sumAlpha += a;
+                }
+            }
+
+            const size_t i = size_t(ty) * size_t(scaledWidth) + size_t(tx);
+            const int samples = (sy1 - sy0) * (sx1 - sx0);
+            const int r = sumAlpha > 0 ? sumR / sumAlpha : 0;
+            const int g = sumAlpha > 0 ? sumG / sumAlpha : 0;
+            const int b = sumAlpha > 0 ? sumB / sumAlpha : 0;
+            image->y[i] = uint8_t(((47 * r + 157 * g + 16 * b + 128) >> 8) + 16);
+            image->u[i] = uint8_t(((-26 * r - 86 * g + 112 * b + 128) >> 8) + 128);
+            image->v[i] = uint8_t(((112 * r - 102 * g - 10 * b + 128) >> 8) + 128);
+            image->alpha[i] = uint8_t(sumAlpha / samples);
+        }
+    }
+
+    gst_buffer_unmap(meta->image, &map);
+    return true;
+}
+
+static void blend(const CursorImage *image, int cursorX, int cursorY, GstVideoFrame *frame)
+{
+    const int frameWidth = GST_VIDEO_FRAME_WIDTH(frame);
+    const int frameHeight = GST_VIDEO_FRAME_HEIGHT(frame);
+
+    const int x0 = qMax(0, cursorX);
+    const int y0 = qMax(0, cursorY);
+    const int x1 = qMin(frameWidth, cursorX + image->width);
+    const int y1 = qMin(frameHeight, cursorY + image->height);
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    // Luma, one sample per pixel
+    uint8_t *lumaPlane = static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(frame, 0));
+    const int lumaStride = GST_VIDEO_FRAME_PLANE_STRIDE(frame, 0);
+    for (int y = y0; y < y1; ++y) {
+        uint8_t *row = lumaPlane + y * lumaStride;
+        const int offset = (y - cursorY) * image->width - cursorX;
+        for (int x = x0; x < x1; ++x) {
+            const int a = image->alpha[offset + x];
+            if (a > 0)
+                row[x] = uint8_t((image->y[offset + x] * a + row[x] * (255 - a) + 127) / 255);
+        }
+    }
+
+    // Chroma, each sample covers 2x2 pixels and is weighted by
+    // how much of the block the cursor covers
+    const bool nv12 = GST_VIDEO_FRAME_FORMAT(frame) == GST_VIDEO_FORMAT_NV12;
+    uint8_t *uPlane = static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(frame, 1));
+    uint8_t *vPlane = nv12 ? uPlane + 1 : static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(frame, 2));
+    const int uStride = GST_VIDEO_FRAME_PLANE_STRIDE(frame, 1);
+    const int vStride = nv12 ? uStride : GST_VIDEO_FRAME_PLANE_STRIDE(frame, 2);
+    const int step = nv12 ? 2 : 1;
+
+    for (int cy = y0 / 2; cy < (y1 + 1) / 2; ++cy) {
+        for (int cx = x0 / 2; cx < (x1 + 1) / 2; ++cx) {
+            int sumAlpha = 0, sumU = 0, sumV = 0;
+            for (int dy = 0; dy < 2; ++dy) {
+                const int y = cy * 2 + dy;
+                if (y < y0 || y >= y1)
+                    continue;
+                for (int dx = 0; dx < 2; ++dx) {
+                    const int x = cx * 2 + dx;
+                    if (x < x0 || x >= x1)
+                        continue;
+                    const int i = (y - cursorY) * image->width + x - cursorX;
+                    const int a = image->alpha[i];
+                    sumAlpha += a;
+                    sumU += image->u[i] * a;
+                    sumV += image->v[i] * a;
+                }
+            }
+            if (sumAlpha == 0)
+                continue;
+
+            uint8_t *u = uPlane + cy * uStride + cx * step;
+            uint8_t *v = vPlane + cy * vStride + cx * step;
+            *u = uint8_t((sumU + *u * (4 * 255 - sumAlpha) + 510) / (4 * 255));
+            *v = uint8_t((sumV + *v * (4 * 255 - sumAlpha) + 510) / (4 * 255));
+        }
+    }
+}
+
+static gboolean screencast_cursor_set_caps(GstBaseTransform *trans, GstCaps *incaps, GstCaps *outcaps)
+{
+    Q_UNUSED(outcaps)
+
+    ScreencastCursor *self = SCREENCAST_CURSOR(trans);
+    return gst_video_info_from_caps(&self->info, incaps);
+}
+
+static GstFlowReturn screencast_cursor_transform_ip(GstBaseTransform *trans, GstBuffer *buffer)
+{
+    ScreencastCursor *self = SCREENCAST_CURSOR(trans);
+
+    ScreencastCursorMeta *meta = screencast_buffer_get_cursor_meta(buffer);
+    if (!meta || !meta->visible || !meta->image)
+        return GST_FLOW_OK;
+
+    if (self->image->serial != meta->serial || self->image->scale != meta->scale || self->image->width == 0) {
+        if (!update_image(self, meta))
+            return GST_FLOW_OK;
+    }
+
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, &self->info, buffer, GST_MAP_READWRITE))
+        return GST_FLOW_ERROR;
+    blend(self->image, meta->x, meta->y, &frame);
+    gst_video_frame_unmap(&frame);
+
+    GST_OBJECT_LOCK(self);
+    self->framesBlended++;
+    GST_OBJECT_UNLOCK(self);
+
+    return GST_FLOW_OK;
+}
+
+static void screencast_cursor_get_property(GObject *object, guint propId,
+                                           GValue *value, GParamSpec *pspec)
+{
+    ScreencastCursor *self = SCREENCAST_CURSOR(object);
+
+    switch (propId) {
+    case PROP_FRAMES_BLENDED:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint64(value, self->framesBlended);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_cursor_finalize(GObject *object)
+{
+    ScreencastCursor *self = SCREENCAST_CURSOR(object);
+
+    delete self->image;
+    self->image = nullptr;
+
+    G_OBJECT_CLASS(screencast_cursor_parent_class)->finalize(object);
+}
+
+static void screencast_cursor_class_init(ScreencastCursorClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseTransformClass *transformClass = GST_BASE_TRANSFORM_CLASS(klass);
+
+    objectClass->get_property = screencast_cursor_get_property;
+    objectClass->finalize = screencast_cursor_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_FRAMES_BLENDED,
+                g_param_spec_uint64("frames-blended", "Frames blended",
+                                    "Number of frames the cursor was drawn on",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast cursor compositor",
+                                          "Filter/Effect/Video",
+                                          "Draws the cursor sent as metadata onto the frames",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+    gst_element_class_add_static_pad_template(elementClass, &srcTemplate);
+
+    transformClass->set_caps = screencast_cursor_set_caps;
+    transformClass->transform_ip = screencast_cursor_transform_ip;
+}
+
+static void screencast_cursor_init(ScreencastCursor *self)
+{
+    self->image = new CursorImage();
+    self->framesBlended = 0;
+
+    gst_base_transform_set_in_place(GST_BASE_TRANSFORM(self), TRUE);
+}
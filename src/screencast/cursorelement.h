@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef CURSORELEMENT_H
+#define CURSORELEMENT_H
+
+#include <gst/base/gstbasetransform.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_CURSOR (screencast_cursor_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastCursor, screencast_cursor, SCREENCAST, CURSOR, GstBaseTransform)
+
+G_END_DECLS
+
+#endif // CURSORELEMENT_H
@@ -0,0 +1,126 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QtGlobal>
+
+#include "cursormeta.h"
+
+#include <gst/video/video.h>
+
+static gboolean screencast_cursor_meta_init(GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+    Q_UNUSED(params)
+    Q_UNUSED(buffer)
+
+    ScreencastCursorMeta *cursor = reinterpret_cast<ScreencastCursorMeta *>(meta);
+    cursor->visible = FALSE;
+    cursor->x = 0;
+    cursor->y = 0;
+    cursor->serial = 0;
+    cursor->image = nullptr;
+    cursor->width = 0;
+    cursor->height = 0;
+    cursor->scale = 1.0;
+    return TRUE;
+}
+
+static void screencast_cursor_meta_free(GstMeta *meta, GstBuffer *buffer)
+{
+    Q_UNUSED(buffer)
+
+    ScreencastCursorMeta *cursor = reinterpret_cast<ScreencastCursorMeta *>(meta);
+    if (cursor->image)
+        gst_buffer_unref(cursor->image);
+    cursor->image = nullptr;
+}
+
+static gboolean screencast_cursor_meta_transform(GstBuffer *dest, GstMeta *meta, GstBuffer *buffer,
+                                                 GQuark type, gpointer data)
+{
+    Q_UNUSED(buffer)
+
+    ScreencastCursorMeta *cursor = reinterpret_cast<ScreencastCursorMeta *>(meta);
+
+    // Position is in pixels, it stays valid across copies and conversions
+    // and is moved along when the frame is scaled
+    gint x = cursor->x;
+    gint y = cursor->y;
+    gdouble scale = cursor->scale;
+    if (GST_VIDEO_META_TRANSFORM_IS_SCALE(type)) {
+        const GstVideoMetaTransform *transform = static_cast<const GstVideoMetaTransform *>(data);
+        const gint inWidth = GST_VIDEO_INFO_WIDTH(transform->in_info);
+        const gint inHeight = GST_VIDEO_INFO_HEIGHT(transform->in_info);
+        if (inWidth <= 0 || inHeight <= 0)
+            return FALSE;
+        const gdouble scaleX = gdouble(GST_VIDEO_INFO_WIDTH(transform->out_info)) / inWidth;
+        const gdouble scaleY = gdouble(GST_VIDEO_INFO_HEIGHT(transform->out_info)) / inHeight;
+        x = gint(x * scaleX);
+        y = gint(y * scaleY);
+        scale *= qMin(scaleX, scaleY);
+    } else if (!GST_META_TRANSFORM_IS_COPY(type)) {
+        return FALSE;
+    }
+
+    ScreencastCursorMeta *copy = screencast_buffer_add_cursor_meta(dest, cursor->visible, x, y, cursor->serial,
+                                                                   cursor->image, cursor->width, cursor->height);
+    if (!copy)
+        return FALSE;
+    copy->scale = scale;
+    return TRUE;
+}
+
+GType screencast_cursor_meta_api_get_type()
+{
+    static volatile gsize type = 0;
+    static const gchar *tags[] = { GST_META_TAG_VIDEO_STR, GST_META_TAG_VIDEO_SIZE_STR, nullptr };
+
+    if (g_once_init_enter(&type)) {
+        GType api = gst_meta_api_type_register("ScreencastCursorMetaAPI", tags);
+        g_once_init_leave(&type, api);
+    }
+    return GType(type);
+}
+
+const GstMetaInfo *screencast_cursor_meta_get_info()
+{
+    static const GstMetaInfo *info = nullptr;
+
+    if (g_once_init_enter(&info)) {
+        const GstMetaInfo *meta = gst_meta_register(SCREENCAST_CURSOR_META_API_TYPE, "ScreencastCursorMeta",
+                                                    sizeof(ScreencastCursorMeta),
+                                                    screencast_cursor_meta_init,
+                                                    screencast_cursor_meta_free,
+                                                    screencast_cursor_meta_transform);
+        g_once_init_leave(&info, meta);
+    }
+    return info;
+}
+
+ScreencastCursorMeta *screencast_buffer_add_cursor_meta(GstBuffer *buffer, gboolean visible, gint x, gint y,
+                                                        guint serial, GstBuffer *image,
+                                                        guint width, guint height)
+{
+    ScreencastCursorMeta *cursor = reinterpret_cast<ScreencastCursorMeta *>(
+                gst_buffer_add_meta(buffer, SCREENCAST_CURSOR_META_INFO, nullptr));
+    if (!cursor)
+        return nullptr;
+
+    cursor->visible = visible;
+    cursor->x = x;
+    cursor->y = y;
+    cursor->serial = serial;
+    cursor->image = image ? gst_buffer_ref(image) : nullptr;
+    cursor->width = image ? width : 0;
+    cursor->height = image ? height : 0;
+    cursor->scale = 1.0;
+    return cursor;
+}
+
+ScreencastCursorMeta *screencast_buffer_get_cursor_meta(GstBuffer *buffer)
+{
+    return reinterpret_cast<ScreencastCursorMeta *>(
+                gst_buffer_get_meta(buffer, SCREENCAST_CURSOR_META_API_TYPE));
+}
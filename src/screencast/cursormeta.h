@@ -0,0 +1,48 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef CURSORMETA_H
+#define CURSORMETA_H
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Mouse cursor sent by the compositor next to the frame instead of
+ * being drawn into it, blended back by screencastcursor.
+ */
+typedef struct {
+    GstMeta meta;
+
+    gboolean visible;
+    // Top left corner of the image in the frame
+    gint x;
+    gint y;
+    // Changes every time the image does
+    guint serial;
+    // BGRA with straight alpha, rows of width * 4 bytes, can be null
+    GstBuffer *image;
+    guint width;
+    guint height;
+    // Size the image is drawn at, below 1 once the frame was scaled down
+    gdouble scale;
+} ScreencastCursorMeta;
+
+#define SCREENCAST_CURSOR_META_API_TYPE (screencast_cursor_meta_api_get_type())
+#define SCREENCAST_CURSOR_META_INFO (screencast_cursor_meta_get_info())
+
+GType screencast_cursor_meta_api_get_type();
+const GstMetaInfo *screencast_cursor_meta_get_info();
+
+ScreencastCursorMeta *screencast_buffer_add_cursor_meta(GstBuffer *buffer, gboolean visible, gint x, gint y,
+                                                        guint serial, GstBuffer *image,
+                                                        guint width, guint height);
+ScreencastCursorMeta *screencast_buffer_get_cursor_meta(GstBuffer *buffer);
+
+G_END_DECLS
+
+#endif // CURSORMETA_H
@@ -0,0 +1,353 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QtGlobal>
+
+#include "cursormeta.h"
+#include "dedupelement.h"
+#include "tiletracker.h"
+
+#include <gst/video/video.h>
+
+#define FORMATS "{ BGRx, BGRA, RGBx, RGBA, xRGB, ARGB, xBGR, ABGR }"
+
+// Regions of interest attached to a frame before falling back to the bounding box
+static const int maxRegions = 16;
+
+enum {
+    PROP_0,
+    PROP_TILE_SIZE,
+    PROP_MAX_STATIC_TIME,
+    PROP_USE_DAMAGE,
+    PROP_ROI_HINTS,
+    PROP_FRAMES_IN,
+    PROP_FRAMES_DROPPED
+};
+
+// Cursor sent as metadata, as of the last frame let through
+struct CursorState {
+    bool visible = false;
+    int x = 0;
+    int y = 0;
+    guint serial = 0;
+    int width = 0;
+    int height = 0;
+
+    bool operator!=(const CursorState &other) const
+    {
+        if (!visible && !other.visible)
+            return false;
+        return visible != other.visible || x != other.x || y != other.y ||
+                serial != other.serial || width != other.width || height != other.height;
+    }
+};
+
+struct _ScreencastDedup
+{
+    GstBaseTransform parent;
+
+    guint tileSize;
+    GstClockTime maxStaticTime;
+    gboolean useDamage;
+    gboolean roiHints;
+
+    GstVideoInfo info;
+    TileTracker *tracker;
+    GQuark dirtyQuark;
+    GstClockTime lastOutput;
+    CursorState *lastCursor;
+
+    guint64 framesIn;
+    guint64 framesDropped;
+};
+
+G_DEFINE_TYPE(ScreencastDedup, screencast_dedup, GST_TYPE_BASE_TRANSFORM)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static GstStaticPadTemplate srcTemplate =
+        GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static gboolean screencast_dedup_set_caps(GstBaseTransform *trans, GstCaps *incaps, GstCaps *outcaps)
+{
+    Q_UNUSED(outcaps)
+
+    ScreencastDedup *self = SCREENCAST_DEDUP(trans);
+
+    if (!gst_video_info_from_caps(&self->info, incaps))
+        return FALSE;
+
+    delete self->tracker;
+    self->tracker = new TileTracker(int(self->tileSize));
+    self->tracker->reset(GST_VIDEO_INFO_WIDTH(&self->info), GST_VIDEO_INFO_HEIGHT(&self->info));
+    self->lastOutput = GST_CLOCK_TIME_NONE;
+    *self->lastCursor = CursorState();
+
+    return TRUE;
+}
+
+static void add_cursor_hint(ScreencastDedup *self, GstBuffer *buffer, const CursorState &cursor)
+{
+    if (!cursor.visible)
+        return;
+
+    const int x0 = qMax(0, cursor.x);
+    const int y0 = qMax(0, cursor.y);
+    const int x1 = qMin(GST_VIDEO_INFO_WIDTH(&self->info), cursor.x + cursor.width);
+    const int y1 = qMin(GST_VIDEO_INFO_HEIGHT(&self->info), cursor.y + cursor.height);
+    if (x1 <= x0 || y1 <= y0)
+        return;
+
+    gst_buffer_add_video_region_of_interest_meta_id(buffer, self->dirtyQuark, guint(x0), guint(y0),
+                                                    guint(x1 - x0), guint(y1 - y0));
+}
+
+static GstFlowReturn screencast_dedup_transform_ip(GstBaseTransform *trans, GstBuffer *buffer)
+{
+    ScreencastDedup *self = SCREENCAST_DEDUP(trans);
+
+    // Damage reported by the compositor, if any
+    std::vector<TileTracker::Rect> damage;
+    bool hasDamage = false;
+    if (self->useDamage) {
+        gpointer state = nullptr;
+        GstMeta *meta;
+        while ((meta = gst_buffer_iterate_meta_filtered(buffer, &state, GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE))) {
+            auto *roi = reinterpret_cast<GstVideoRegionOfInterestMeta *>(meta);
+            // Skip our own hints, the source may push the same buffer again
+            if (roi->roi_type == self->dirtyQuark)
+                continue;
+            // An empty region says the source knows nothing changed
+            hasDamage = true;
+            if (roi->w == 0 || roi->h == 0)
+                continue;
+
+            TileTracker::Rect rect;
+            rect.x = int(roi->x);
+            rect.y = int(roi->y);
+            rect.width = int(roi->w);
+            rect.height = int(roi->h);
+            damage.push_back(rect);
+        }
+    }
+
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, &self->info, buffer, GST_MAP_READ))
+        return GST_FLOW_ERROR;
+    const int changed = self->tracker->update(static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0)),
+                                              GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+                                              hasDamage ? &damage : nullptr);
+    gst_video_frame_unmap(&frame);
+
+    // The cursor is drawn later on, moving it changes the picture too
+    CursorState cursor;
+    if (ScreencastCursorMeta *meta = screencast_buffer_get_cursor_meta(buffer)) {
+        cursor.visible = meta->visible && meta->image;
+        cursor.x = meta->x;
+        cursor.y = meta->y;
+        cursor.serial = meta->serial;
+        cursor.width = int(meta->width);
+        cursor.height = int(meta->height);
+    }
+    const bool cursorChanged = cursor != *self->lastCursor;
+
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    const bool stale = GST_CLOCK_TIME_IS_VALID(self->lastOutput) && GST_CLOCK_TIME_IS_VALID(pts) &&
+            pts >= self->lastOutput + self->maxStaticTime;
+
+    GST_OBJECT_LOCK(self);
+    self->framesIn++;
+    if (changed == 0 && !stale && !cursorChanged)
+        self->framesDropped++;
+    GST_OBJECT_UNLOCK(self);
+
+    // Identical frame: drop it, the previous one lasts until the next
+    // frame that is let through
+    if (changed == 0 && !stale && !cursorChanged)
+        return GST_BASE_TRANSFORM_FLOW_DROPPED;
+
+    self->lastOutput = pts;
+    GST_BUFFER_DURATION(buffer) = GST_CLOCK_TIME_NONE;
+
+    const int tiles = self->tracker->columns() * self->tracker->rows();
+    if (self->roiHints && changed < tiles) {
+        if (changed > 0) {
+            const auto regions = self->tracker->dirtyRegions(maxRegions);
+            for (const auto &rect : regions) {
+                gst_buffer_add_video_region_of_interest_meta_id(buffer, self->dirtyQuark,
+                                                                guint(rect.x), guint(rect.y),
+                                                                guint(rect.width), guint(rect.height));
+            }
+        }
+        // Where the cursor was and where it is now
+        if (cursorChanged) {
+            add_cursor_hint(self, buffer, *self->lastCursor);
+            add_cursor_hint(self, buffer, cursor);
+        }
+    }
+    *self->lastCursor = cursor;
+
+    return GST_FLOW_OK;
+}
+
+static gboolean screencast_dedup_stop(GstBaseTransform *trans)
+{
+    ScreencastDedup *self = SCREENCAST_DEDUP(trans);
+
+    delete self->tracker;
+    self->tracker = nullptr;
+
+    return TRUE;
+}
+
+static void screencast_dedup_set_property(GObject *object, guint propId,
+                                          const GValue *value, GParamSpec *pspec)
+{
+    ScreencastDedup *self = SCREENCAST_DEDUP(object);
+
+    switch (propId) {
+    case PROP_TILE_SIZE:
+        self->tileSize = g_value_get_uint(value);
+        break;
+    case PROP_MAX_STATIC_TIME:
+        self->maxStaticTime = g_value_get_uint64(value);
+        break;
+    case PROP_USE_DAMAGE:
+        self->useDamage = g_value_get_boolean(value);
+        break;
+    case PROP_ROI_HINTS:
+        self->roiHints = g_value_get_boolean(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_dedup_get_property(GObject *object, guint propId,
+                                          GValue *value, GParamSpec *pspec)
+{
+    ScreencastDedup *self = SCREENCAST_DEDUP(object);
+
+    switch (propId) {
+    case PROP_TILE_SIZE:
+        g_value_set_uint(value, self->tileSize);
+        break;
+    case PROP_MAX_STATIC_TIME:
+        g_value_set_uint64(value, self->maxStaticTime);
+        break;
+    case PROP_USE_DAMAGE:
+        g_value_set_boolean(value, self->useDamage);
+        break;
+    case PROP_ROI_HINTS:
+        g_value_set_boolean(value, self->roiHints);
+        break;
+    case PROP_FRAMES_IN:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint64(value, self->framesIn);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    case PROP_FRAMES_DROPPED:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint64(value, self->framesDropped);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_dedup_finalize(GObject *object)
+{
+    ScreencastDedup *self = SCREENCAST_DEDUP(object);
+
+    delete self->tracker;
+    self->tracker = nullptr;
+    delete self->lastCursor;
+    self->lastCursor = nullptr;
+
+    G_OBJECT_CLASS(screencast_dedup_parent_class)->finalize(object);
+}
+
+static void screencast_dedup_class_init(ScreencastDedupClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseTransformClass *transformClass = GST_BASE_TRANSFORM_CLASS(klass);
+
+    objectClass->set_property = screencast_dedup_set_property;
+    objectClass->get_property = screencast_dedup_get_property;
+    objectClass->finalize = screencast_dedup_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_TILE_SIZE,
+                g_param_spec_uint("tile-size", "Tile size",
+                                  "Size in pixels of the tiles that are compared",
+                                  16, 512, 64,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_MAX_STATIC_TIME,
+                g_param_spec_uint64("max-static-time", "Maximum static time",
+                                    "Let an identical frame through after this many nanoseconds",
+                                    0, G_MAXUINT64, GST_SECOND,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_USE_DAMAGE,
+                g_param_spec_boolean("use-damage", "Use damage",
+                                     "Only compare the regions the source reports as damaged",
+                                     TRUE,
+                                     GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_ROI_HINTS,
+                g_param_spec_boolean("roi-hints", "Region of interest hints",
+                                     "Attach the changed regions as region of interest metadata",
+                                     TRUE,
+                                     GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_FRAMES_IN,
+                g_param_spec_uint64("frames-in", "Frames in",
+                                    "Number of frames received",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_FRAMES_DROPPED,
+                g_param_spec_uint64("frames-dropped", "Frames dropped",
+                                    "Number of identical frames dropped",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast frame deduplicator",
+                                          "Filter/Video",
+                                          "Drops frames identical to the previous one",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+    gst_element_class_add_static_pad_template(elementClass, &srcTemplate);
+
+    transformClass->set_caps = screencast_dedup_set_caps;
+    transformClass->transform_ip = screencast_dedup_transform_ip;
+    transformClass->stop = screencast_dedup_stop;
+}
+
+static void screencast_dedup_init(ScreencastDedup *self)
+{
+    self->tileSize = 64;
+    self->maxStaticTime = GST_SECOND;
+    self->useDamage = TRUE;
+    self->roiHints = TRUE;
+    self->tracker = nullptr;
+    self->dirtyQuark = g_quark_from_static_string("dirty");
+    self->lastOutput = GST_CLOCK_TIME_NONE;
+    self->lastCursor = new CursorState();
+    self->framesIn = 0;
+    self->framesDropped = 0;
+
+    gst_base_transform_set_in_place(GST_BASE_TRANSFORM(self), TRUE);
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef DEDUPELEMENT_H
+#define DEDUPELEMENT_H
+
+#include <gst/base/gstbasetransform.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_DEDUP (screencast_dedup_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastDedup, screencast_dedup, SCREENCAST, DEDUP, GstBaseTransform)
+
+G_END_DECLS
+
+#endif // DEDUPELEMENT_H
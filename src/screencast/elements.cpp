@@ -0,0 +1,37 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "convertelement.h"
+#include "cursorelement.h"
+#include "dedupelement.h"
+#include "elements.h"
+#include "filesinkelement.h"
+#include "latencystampelement.h"
+#include "screendecelement.h"
+#include "screenencelement.h"
+#include "spoolsinkelement.h"
+#ifdef HAVE_PIPEWIRE
+#include "pipewiresrcelement.h"
+#endif
+
+#include <gst/gst.h>
+
+bool registerElements()
+{
+    bool registered = gst_element_register(nullptr, "screencastconvert", GST_RANK_NONE, SCREENCAST_TYPE_CONVERT) &&
+            gst_element_register(nullptr, "screencastcursor", GST_RANK_NONE, SCREENCAST_TYPE_CURSOR) &&
+            gst_element_register(nullptr, "screencastdedup", GST_RANK_NONE, SCREENCAST_TYPE_DEDUP) &&
+            gst_element_register(nullptr, "screencastfilesink", GST_RANK_NONE, SCREENCAST_TYPE_FILE_SINK) &&
+            gst_element_register(nullptr, "screencastlatencystamp", GST_RANK_NONE, SCREENCAST_TYPE_LATENCY_STAMP) &&
+            gst_element_register(nullptr, "screencastscreendec", GST_RANK_NONE, SCREENCAST_TYPE_SCREEN_DEC) &&
+            gst_element_register(nullptr, "screencastscreenenc", GST_RANK_NONE, SCREENCAST_TYPE_SCREEN_ENC) &&
+            gst_element_register(nullptr, "screencastspoolsink", GST_RANK_NONE, SCREENCAST_TYPE_SPOOL_SINK);
+#ifdef HAVE_PIPEWIRE
+    registered = registered &&
+            gst_element_register(nullptr, "screencastpipewiresrc", GST_RANK_NONE, SCREENCAST_TYPE_PIPEWIRE_SRC);
+#endif
+    return registered;
+}
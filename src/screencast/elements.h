@@ -0,0 +1,13 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef ELEMENTS_H
+#define ELEMENTS_H
+
+// Registers the GStreamer elements built into the application
+bool registerElements();
+
+#endif // ELEMENTS_H
@@ -0,0 +1,564 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QMap>
+#include <QThread>
+
+#include "encoder.h"
+#include "screencast.h"
+#include "utils.h"
+
+#include <gst/gst.h>
+
+static const char *const codecTable[] = {
+    "x264", "openh264", "vp8", "vp9", "av1", "theora"
+};
+
+static const char *const presetTable[] = {
+    "realtime", "fast", "balanced", "quality"
+};
+
+static const char *const containerTable[] = {
+    "default", "mp4", "mkv", "webm", "ogg"
+};
+
+template <typename T, size_t N>
+static bool parseEnum(const char *const (&table)[N], const QString &name, T &value)
+{
+    for (size_t i = 0; i < N; ++i) {
+        if (name.compare(QLatin1String(table[i]), Qt::CaseInsensitive) == 0) {
+            value = static_cast<T>(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <size_t N>
+static QStringList enumNames(const char *const (&table)[N])
+{
+    QStringList names;
+    for (size_t i = 0; i < N; ++i)
+        names.append(QLatin1String(table[i]));
+    return names;
+}
+
+/*
+ * EncoderSettings
+ */
+
+int EncoderSettings::effectiveThreads() const
+{
+    return threads > 0 ? threads : qMax(1, QThread::idealThreadCount());
+}
+
+QStringList EncoderSettings::codecNames()
+{
+    return enumNames(codecTable);
+}
+
+QStringList EncoderSettings::presetNames()
+{
+    return enumNames(presetTable);
+}
+
+QStringList EncoderSettings::containerNames()
+{
+    return enumNames(containerTable).mid(1);
+}
+
+bool EncoderSettings::parseCodec(const QString &name, Codec &codec)
+{
+    return parseEnum(codecTable, name, codec);
+}
+
+bool EncoderSettings::parsePreset(const QString &name, Preset &preset)
+{
+    return parseEnum(presetTable, name, preset);
+}
+
+bool EncoderSettings::parseContainer(const QString &name, Container &container)
+{
+    if (name == QLatin1String("matroska")) {
+        container = Matroska;
+        return true;
+    }
+    return parseEnum(containerTable, name, container);
+}
+
+QString EncoderSettings::containerName(Container container)
+{
+    return QLatin1String(containerTable[container]);
+}
+
+QString EncoderSettings::fileExtension(Container container)
+{
+    switch (container) {
+    case MP4:
+        return QStringLiteral("mp4");
+    case Matroska:
+        return QStringLiteral("mkv");
+    case WebM:
+        return QStringLiteral("webm");
+    case Ogg:
+        return QStringLiteral("ogv");
+    default:
+        break;
+    }
+
+    Q_UNREACHABLE();
+    return QString();
+}
+
+/*
+ * Backends
+ */
+
+class X264Encoder : public Encoder
+{
+public:
+    QString name() const override { return QStringLiteral("x264"); }
+    EncoderSettings::Container defaultContainer() const override { return EncoderSettings::Matroska; }
+
+    bool supportsContainer(EncoderSettings::Container container) const override
+    {
+        return container == EncoderSettings::MP4 || container == EncoderSettings::Matroska;
+    }
+
+protected:
+    QByteArray factoryName() const override { return QByteArrayLiteral("x264enc"); }
+    QByteArray parserFactoryName() const override { return QByteArrayLiteral("h264parse"); }
+    QByteArray payloaderFactoryName() const override { return QByteArrayLiteral("rtph264pay"); }
+
+    void configure(GstElement *element, const EncoderSettings &settings) const override
+    {
+        static const char *const presets[] = { "ultrafast", "superfast", "veryfast", "medium" };
+        setProperty(element, "speed-preset", presets[settings.preset]);
+        setProperty(element, "threads", settings.effectiveThreads());
+        if (settings.zeroLatency) {
+            // Also switches to sliced threads, frame threads hold frames back
+            setProperty(element, "tune", "zerolatency");
+            setProperty(element, "bframes", 0);
+            setProperty(element, "rc-lookahead", 0);
+        }
+        if (settings.keyframeInterval > 0)
+            setProperty(element, "key-int-max", settings.keyframeInterval);
+
+        if (settings.bitrate > 0) {
+            setProperty(element, "pass", "cbr");
+            setProperty(element, "bitrate", settings.bitrate);
+        } else {
+            setProperty(element, "pass", "qual");
+            setProperty(element, "quantizer", 21);
+        }
+    }
+};
+
+class OpenH264Encoder : public Encoder
+{
+public:
+    QString name() const override { return QStringLiteral("openh264"); }
+    EncoderSettings::Container defaultContainer() const override { return EncoderSettings::Matroska; }
+
+    bool supportsContainer(EncoderSettings::Container container) const override
+    {
+        return container == EncoderSettings::MP4 || container == EncoderSettings::Matroska;
+    }
+
+protected:
+    QByteArray factoryName() const override { return QByteArrayLiteral("openh264enc"); }
+    QByteArray parserFactoryName() const override { return QByteArrayLiteral("h264parse"); }
+    QByteArray payloaderFactoryName() const override { return QByteArrayLiteral("rtph264pay"); }
+
+    void configure(GstElement *element, const EncoderSettings &settings) const override
+    {
+        // The baseline profile has no B-frames, latency needs no tuning
+        static const char *const complexity[] = { "low", "low", "medium", "high" };
+        setProperty(element, "complexity", complexity[settings.preset]);
+        setProperty(element, "multi-thread", settings.effectiveThreads());
+        setProperty(element, "usage-type", "screen");
+        if (settings.keyframeInterval > 0)
+            setProperty(element, "gop-size", settings.keyframeInterval);
+
+        if (settings.bitrate > 0) {
+            setProperty(element, "rate-control", "bitrate");
+            setProperty(element, "bitrate", settings.bitrate * 1000);
+        } else {
+            setProperty(element, "rate-control", "quality");
+        }
+    }
+};
+
+class VpxEncoder : public Encoder
+{
+public:
+    explicit VpxEncoder(bool vp9)
+        : m_vp9(vp9)
+    {
+    }
+
+    QString name() const override { return m_vp9 ? QStringLiteral("vp9") : QStringLiteral("vp8"); }
+    EncoderSettings::Container defaultContainer() const override { return EncoderSettings::WebM; }
+
+    bool supportsContainer(EncoderSettings::Container container) const override
+    {
+        return container == EncoderSettings::Matroska || container == EncoderSettings::WebM ||
+               (m_vp9 && container == EncoderSettings::MP4);
+    }
+
+protected:
+    QByteArray factoryName() const override
+    {
+        return m_vp9 ? QByteArrayLiteral("vp9enc") : QByteArrayLiteral("vp8enc");
+    }
+
+    QByteArray payloaderFactoryName() const override
+    {
+        return m_vp9 ? QByteArrayLiteral("rtpvp9pay") : QByteArrayLiteral("rtpvp8pay");
+    }
+
+    void configure(GstElement *element, const EncoderSettings &settings) const override
+    {
+        static const int vp8CpuUsed[] = { 16, 8, 4, 2 };
+        static const int vp9CpuUsed[] = { 9, 8, 6, 4 };
+        const int threads = settings.effectiveThreads();
+
+        // Realtime deadline unless quality was explicitly requested
+        const bool realtime = settings.zeroLatency || settings.preset != EncoderSettings::Quality;
+        setProperty(element, "deadline", realtime ? 1 : 1000000);
+        setProperty(element, "cpu-used", m_vp9 ? vp9CpuUsed[settings.preset] : vp8CpuUsed[settings.preset]);
+        setProperty(element, "threads", threads);
+        if (settings.zeroLatency)
+            setProperty(element, "lag-in-frames", 0);
+        if (settings.keyframeInterval > 0)
+            setProperty(element, "keyframe-max-dist", settings.keyframeInterval);
+
+        if (m_vp9) {
+            // Tile columns are expressed as log2, libvpx caps them at 6
+            int tileColumns = 0;
+            while (tileColumns < 6 && (2 << tileColumns) <= threads)
+                ++tileColumns;
+            setProperty(element, "tile-columns", tileColumns);
+            setProperty(element, "row-mt", "true");
+        }
+
+        if (settings.bitrate > 0) {
+            setProperty(element, "end-usage", "cbr");
+            setProperty(element, "target-bitrate", settings.bitrate * 1000);
+        } else {
+            setProperty(element, "end-usage", "cq");
+            setProperty(element, "cq-level", 20);
+            setProperty(element, "target-bitrate", 0);
+        }
+    }
+
+private:
+    bool m_vp9 = false;
+};
+
+class AV1Encoder : public Encoder
+{
+public:
+    QString name() const override { return QStringLiteral("av1"); }
+    EncoderSettings::Container defaultContainer() const override { return EncoderSettings::WebM; }
+
+    bool supportsContainer(EncoderSettings::Container container) const override
+    {
+        return container != EncoderSettings::Ogg;
+    }
+
+protected:
+    QByteArray factoryName() const override
+    {
+        // Prefer the fastest software encoder that is installed
+        static const char *const factories[] = { "svtav1enc", "rav1enc", "av1enc" };
+        for (const char *factory : factories) {
+            GstElementFactory *f = gst_element_factory_find(factory);
+            if (f) {
+                gst_object_unref(f);
+                return QByteArray(factory);
+            }
+        }
+        return QByteArrayLiteral("svtav1enc");
+    }
+
+    QByteArray parserFactoryName() const override { return QByteArrayLiteral("av1parse"); }
+    QByteArray payloaderFactoryName() const override { return QByteArrayLiteral("rtpav1pay"); }
+
+    void configure(GstElement *element, const EncoderSettings &settings) const override
+    {
+        const QByteArray factory = GST_OBJECT_NAME(gst_element_get_factory(element));
+
+        if (factory == "svtav1enc") {
+            static const int presets[] = { 12, 10, 8, 6 };
+            setProperty(element, "preset", presets[settings.preset]);
+            setProperty(element, "logical-processors", settings.effectiveThreads());
+            if (settings.keyframeInterval > 0)
+                setProperty(element, "intra-period-length", settings.keyframeInterval);
+            if (settings.bitrate > 0)
+                setProperty(element, "target-bitrate", settings.bitrate);
+        } else if (factory == "rav1enc") {
+            static const int presets[] = { 10, 9, 8, 6 };
+            setProperty(element, "speed-preset", presets[settings.preset]);
+            setProperty(element, "threads", settings.effectiveThreads());
+            setProperty(element, "low-latency", "true");
+            if (settings.keyframeInterval > 0)
+                setProperty(element, "max-key-frame-interval", settings.keyframeInterval);
+            if (settings.bitrate > 0)
+                setProperty(element, "bitrate", settings.bitrate * 1000);
+        } else {
+            static const int cpuUsed[] = { 8, 7, 6, 4 };
+            setProperty(element, "usage-profile", "realtime");
+            setProperty(element, "cpu-used", cpuUsed[settings.preset]);
+            setProperty(element, "threads", settings.effectiveThreads());
+            setProperty(element, "row-mt", "true");
+            if (settings.zeroLatency)
+                setProperty(element, "lag-in-frames", 0);
+            if (settings.keyframeInterval > 0)
+                setProperty(element, "keyframe-max-dist", settings.keyframeInterval);
+            if (settings.bitrate > 0)
+                setProperty(element, "target-bitrate", settings.bitrate);
+        }
+    }
+};
+
+class TheoraEncoder : public Encoder
+{
+public:
+    QString name() const override { return QStringLiteral("theora"); }
+    EncoderSettings::Container defaultContainer() const override { return EncoderSettings::Ogg; }
+
+    bool supportsContainer(EncoderSettings::Container container) const override
+    {
+        return container == EncoderSettings::Ogg || container == EncoderSettings::Matroska;
+    }
+
+protected:
+    QByteArray factoryName() const override { return QByteArrayLiteral("theoraenc"); }
+    QByteArray payloaderFactoryName() const override { return QByteArrayLiteral("rtptheorapay"); }
+
+    void configure(GstElement *element, const EncoderSettings &settings) const override
+    {
+        // Theora has no threading, only the speed level can be tuned
+        static const int speedLevel[] = { 2, 2, 1, 0 };
+        setProperty(element, "speed-level", speedLevel[settings.preset]);
+        if (settings.keyframeInterval > 0)
+            setProperty(element, "keyframe-freq", settings.keyframeInterval);
+        if (settings.bitrate > 0)
+            setProperty(element, "bitrate", settings.bitrate);
+    }
+};
+
+static QMap<QByteArray, QByteArray> propertyValues(GstElement *element)
+{
+    QMap<QByteArray, QByteArray> values;
+
+    guint count = 0;
+    GParamSpec **specs = g_object_class_list_properties(G_OBJECT_GET_CLASS(element), &count);
+    for (guint i = 0; i < count; ++i) {
+        if (!(specs[i]->flags & G_PARAM_READABLE) || !(specs[i]->flags & G_PARAM_WRITABLE))
+            continue;
+
+        GValue value = G_VALUE_INIT;
+        g_value_init(&value, specs[i]->value_type);
+        g_object_get_property(G_OBJECT(element), specs[i]->name, &value);
+        gchar *serialized = gst_value_serialize(&value);
+        values.insert(specs[i]->name, serialized);
+        g_free(serialized);
+        g_value_unset(&value);
+    }
+    g_free(specs);
+
+    return values;
+}
+
+/*
+ * Encoder
+ */
+
+bool Encoder::isAvailable() const
+{
+    GstElementFactory *factory = gst_element_factory_find(factoryName().constData());
+    if (!factory)
+        return false;
+    gst_object_unref(factory);
+    return true;
+}
+
+GstElement *Encoder::createEncoder(const EncoderSettings &settings) const
+{
+    const QByteArray factory = factoryName();
+    GstElement *element = gst_element_factory_make(factory.constData(), nullptr);
+    if (!element) {
+        qCWarning(lcScreencast, "Encoder \"%s\" is not available", factory.constData());
+        return nullptr;
+    }
+
+    configure(element, settings);
+
+    qCInfo(lcScreencast, "Using encoder %s with %d threads",
+           factory.constData(), settings.effectiveThreads());
+
+    return element;
+}
+
+GstElement *Encoder::createParser() const
+{
+    const QByteArray factory = parserFactoryName();
+    if (factory.isEmpty())
+        return nullptr;
+
+    // Parsers are optional unless the muxer needs them, let the
+    // caller fail linking if it's missing
+    return gst_element_factory_make(factory.constData(), nullptr);
+}
+
+GstElement *Encoder::createPayloader() const
+{
+    const QByteArray factory = payloaderFactoryName();
+    GstElement *element = gst_element_factory_make(factory.constData(), nullptr);
+    if (!element) {
+        qCWarning(lcScreencast, "Payloader \"%s\" is not available", factory.constData());
+        return nullptr;
+    }
+
+    // Receivers that join late need the codec headers, which
+    // are sent again along with every keyframe
+    setProperty(element, "config-interval", -1);
+
+    return element;
+}
+
+bool Encoder::reconfigure(GstElement *element, const EncoderSettings &settings) const
+{
+    const auto before = propertyValues(element);
+    configure(element, settings);
+    return propertyValues(element) != before;
+}
+
+bool Encoder::canReconfigure(GstElement *element, const EncoderSettings &from, const EncoderSettings &to) const
+{
+    // Tried on a spare element, the running one is left alone
+    GstElementFactory *factory = gst_element_get_factory(element);
+    GstElement *spare = factory ? gst_element_factory_create(factory, nullptr) : nullptr;
+    if (!spare)
+        return false;
+    gst_object_ref_sink(spare);
+
+    configure(spare, from);
+    const auto before = propertyValues(spare);
+    configure(spare, to);
+    const auto after = propertyValues(spare);
+
+    bool changed = false;
+    bool mutableOnly = true;
+    for (auto it = after.cbegin(); it != after.cend(); ++it) {
+        if (before.value(it.key()) == it.value())
+            continue;
+        changed = true;
+        GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(spare), it.key().constData());
+        if (!spec || !(spec->flags & GST_PARAM_MUTABLE_PLAYING))
+            mutableOnly = false;
+    }
+
+    gst_object_unref(spare);
+    return changed && mutableOnly;
+}
+
+GstElement *Encoder::createMuxer(const EncoderSettings &settings) const
+{
+    const auto container = settings.container == EncoderSettings::DefaultContainer
+            ? defaultContainer() : settings.container;
+    const char *factory = nullptr;
+
+    switch (container) {
+    case EncoderSettings::MP4:
+        factory = "mp4mux";
+        break;
+    case EncoderSettings::Matroska:
+        factory = "matroskamux";
+        break;
+    case EncoderSettings::WebM:
+        factory = "webmmux";
+        break;
+    case EncoderSettings::Ogg:
+        factory = "oggmux";
+        break;
+    default:
+        Q_UNREACHABLE();
+        break;
+    }
+
+    GstElement *element = gst_element_factory_make(factory, nullptr);
+    if (!element) {
+        qCWarning(lcScreencast, "Muxer \"%s\" is not available", factory);
+        return nullptr;
+    }
+
+    if (settings.fragmentDuration > 0) {
+        // Everything written before the last fragment stays playable
+        // if the process dies, muxers never seek back to the headers
+        const qint64 duration = qint64(settings.fragmentDuration) * GST_MSECOND;
+
+        switch (container) {
+        case EncoderSettings::MP4:
+            setElementProperty(element, "fragment-duration", settings.fragmentDuration);
+            setElementProperty(element, "streamable", "true");
+            break;
+        case EncoderSettings::Matroska:
+        case EncoderSettings::WebM:
+            setElementProperty(element, "streamable", "true");
+            setElementProperty(element, "min-cluster-duration", qMin<qint64>(duration, 500 * GST_MSECOND));
+            setElementProperty(element, "max-cluster-duration", duration);
+            break;
+        case EncoderSettings::Ogg:
+            setElementProperty(element, "max-delay", duration);
+            setElementProperty(element, "max-page-delay", duration);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return element;
+}
+
+Encoder *Encoder::create(EncoderSettings::Codec codec)
+{
+    switch (codec) {
+    case EncoderSettings::X264:
+        return new X264Encoder();
+    case EncoderSettings::OpenH264:
+        return new OpenH264Encoder();
+    case EncoderSettings::VP8:
+        return new VpxEncoder(false);
+    case EncoderSettings::VP9:
+        return new VpxEncoder(true);
+    case EncoderSettings::AV1:
+        return new AV1Encoder();
+    case EncoderSettings::Theora:
+        return new TheoraEncoder();
+    }
+
+    Q_UNREACHABLE();
+    return nullptr;
+}
+
+QByteArray Encoder::parserFactoryName() const
+{
+    return QByteArray();
+}
+
+void Encoder::setProperty(GstElement *element, const char *name, const char *value)
+{
+    setElementProperty(element, name, value);
+}
+
+void Encoder::setProperty(GstElement *element, const char *name, int value)
+{
+    setElementProperty(element, name, value);
+}
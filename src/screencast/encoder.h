@@ -0,0 +1,110 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+
+#include <gst/gstelement.h>
+
+class EncoderSettings
+{
+public:
+    enum Codec {
+        X264,
+        OpenH264,
+        VP8,
+        VP9,
+        AV1,
+        Theora
+    };
+
+    enum Preset {
+        Realtime,
+        Fast,
+        Balanced,
+        Quality
+    };
+
+    enum Container {
+        DefaultContainer,
+        MP4,
+        Matroska,
+        WebM,
+        Ogg
+    };
+
+    Codec codec = X264;
+    Preset preset = Fast;
+    Container container = DefaultContainer;
+    // Number of encoder threads, 0 means one per core
+    int threads = 0;
+    // Target bitrate in kbit/s, 0 means constant quality
+    int bitrate = 0;
+    // Write self-contained fragments of this many milliseconds,
+    // 0 means a regular file that is only complete once finalized
+    int fragmentDuration = 0;
+    // Every frame leaves the encoder before the next one comes in:
+    // no lookahead, no B-frames and no frame threading
+    bool zeroLatency = false;
+    // Frames between keyframes, 0 leaves it to the encoder
+    int keyframeInterval = 0;
+
+    int effectiveThreads() const;
+
+    static QStringList codecNames();
+    static QStringList presetNames();
+    static QStringList containerNames();
+
+    static bool parseCodec(const QString &name, Codec &codec);
+    static bool parsePreset(const QString &name, Preset &preset);
+    static bool parseContainer(const QString &name, Container &container);
+
+    static QString containerName(Container container);
+    static QString fileExtension(Container container);
+};
+
+class Encoder
+{
+public:
+    virtual ~Encoder() = default;
+
+    virtual QString name() const = 0;
+    virtual EncoderSettings::Container defaultContainer() const = 0;
+    virtual bool supportsContainer(EncoderSettings::Container container) const = 0;
+
+    bool isAvailable() const;
+
+    // Elements are floating references, ready to be added to a bin
+    GstElement *createEncoder(const EncoderSettings &settings) const;
+    GstElement *createParser() const;
+    GstElement *createMuxer(const EncoderSettings &settings) const;
+    // Packs the encoded frames into RTP packets, for live streaming
+    GstElement *createPayloader() const;
+
+    // Applies new settings to a running encoder, only properties that
+    // can change while playing are set; returns false if none changed
+    bool reconfigure(GstElement *element, const EncoderSettings &settings) const;
+    // Whether reconfigure() can go from one to the other while playing,
+    // that is if everything that differs is mutable in that state
+    bool canReconfigure(GstElement *element, const EncoderSettings &from, const EncoderSettings &to) const;
+
+    static Encoder *create(EncoderSettings::Codec codec);
+
+protected:
+    virtual QByteArray factoryName() const = 0;
+    virtual QByteArray parserFactoryName() const;
+    virtual QByteArray payloaderFactoryName() const = 0;
+    virtual void configure(GstElement *element, const EncoderSettings &settings) const = 0;
+
+    static void setProperty(GstElement *element, const char *name, const char *value);
+    static void setProperty(GstElement *element, const char *name, int value);
+};
+
+#endif // ENCODER_H
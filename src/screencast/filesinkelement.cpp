@@ -0,0 +1,400 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "asyncwriter.h"
+#include "filesinkelement.h"
+
+enum {
+    PROP_0,
+    PROP_LOCATION,
+    PROP_BUFFER_SIZE,
+    PROP_BUFFER_COUNT,
+    PROP_PREALLOCATE,
+    PROP_WRITEBACK_SIZE,
+    PROP_SYNC_INTERVAL,
+    PROP_USE_IO_URING,
+    PROP_IO_BACKEND,
+    PROP_STATS
+};
+
+struct _ScreencastFileSink
+{
+    GstBaseSink parent;
+
+    gchar *location;
+    guint bufferSize;
+    guint bufferCount;
+    guint64 preallocate;
+    guint64 writebackSize;
+    GstClockTime syncInterval;
+    gboolean useIoUring;
+
+    // Kept after stop so that the final stats can be read
+    AsyncWriter *writer;
+    gint64 lastSync;
+};
+
+G_DEFINE_TYPE(ScreencastFileSink, screencast_file_sink, GST_TYPE_BASE_SINK)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+static void screencast_file_sink_write_error(ScreencastFileSink *self)
+{
+    GST_ELEMENT_ERROR(self, RESOURCE, WRITE, ("Error writing to \"%s\"", self->location),
+                      ("%s", g_strerror(self->writer->error())));
+}
+
+static void add_histogram(GstStructure *structure, const char *prefix, const AsyncWriter::Histogram &histogram)
+{
+    for (int i = 0; i < AsyncWriter::Histogram::bucketCount; ++i) {
+        gchar *name = g_strdup_printf("%s-%s", prefix, AsyncWriter::Histogram::bucketName(i));
+        gst_structure_set(structure, name, G_TYPE_UINT64, guint64(histogram.buckets[i]), nullptr);
+        g_free(name);
+    }
+
+    gchar *name = g_strdup_printf("%s-max", prefix);
+    gst_structure_set(structure, name, G_TYPE_UINT64, guint64(histogram.max), nullptr);
+    g_free(name);
+}
+
+static GstStructure *screencast_file_sink_stats(ScreencastFileSink *self)
+{
+    AsyncWriter::Stats stats;
+    GST_OBJECT_LOCK(self);
+    if (self->writer)
+        stats = self->writer->stats();
+    GST_OBJECT_UNLOCK(self);
+
+    // Durations are in nanoseconds, "stall-1ms" counts the stalls
+    // between 100us and 1ms and so on
+    GstStructure *structure = gst_structure_new("stats",
+                                                "bytes-written", G_TYPE_UINT64, guint64(stats.bytesWritten),
+                                                "writes", G_TYPE_UINT64, guint64(stats.writes),
+                                                "syncs", G_TYPE_UINT64, guint64(stats.syncs),
+                                                "stalls", G_TYPE_UINT64, guint64(stats.stalls.count),
+                                                "stall-time", G_TYPE_UINT64, guint64(stats.stalls.total),
+                                                nullptr);
+    add_histogram(structure, "stall", stats.stalls);
+    add_histogram(structure, "write", stats.writeLatency);
+
+    return structure;
+}
+
+static gboolean screencast_file_sink_start(GstBaseSink *sink)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(sink);
+
+    if (!self->location) {
+        GST_ELEMENT_ERROR(self, RESOURCE, NOT_FOUND, ("No file name specified for writing"), (nullptr));
+        return FALSE;
+    }
+
+    AsyncWriter::Options options;
+    options.bufferSize = self->bufferSize;
+    options.bufferCount = int(self->bufferCount);
+    options.preallocate = self->preallocate;
+    options.writeback = self->writebackSize;
+    options.useIoUring = self->useIoUring;
+
+    AsyncWriter *writer = new AsyncWriter(options);
+    if (!writer->open(self->location)) {
+        GST_ELEMENT_ERROR(self, RESOURCE, OPEN_WRITE, ("Could not open \"%s\" for writing", self->location),
+                          ("%s", g_strerror(writer->error())));
+        delete writer;
+        return FALSE;
+    }
+
+    GST_OBJECT_LOCK(self);
+    delete self->writer;
+    self->writer = writer;
+    GST_OBJECT_UNLOCK(self);
+
+    self->lastSync = g_get_monotonic_time();
+
+    return TRUE;
+}
+
+static gboolean screencast_file_sink_stop(GstBaseSink *sink)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(sink);
+
+    if (self->writer && !self->writer->close()) {
+        screencast_file_sink_write_error(self);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static GstFlowReturn screencast_file_sink_render(GstBaseSink *sink, GstBuffer *buffer)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(sink);
+
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_FLOW_ERROR;
+    const bool written = self->writer->write(map.data, map.size);
+    gst_buffer_unmap(buffer, &map);
+
+    if (!written) {
+        screencast_file_sink_write_error(self);
+        return GST_FLOW_ERROR;
+    }
+
+    // The I/O thread syncs once per interval, so that a crash
+    // loses at most the last interval
+    const gint64 now = g_get_monotonic_time();
+    if (self->syncInterval > 0 && guint64(now - self->lastSync) * GST_USECOND >= self->syncInterval) {
+        self->lastSync = now;
+        if (!self->writer->sync()) {
+            screencast_file_sink_write_error(self);
+            return GST_FLOW_ERROR;
+        }
+    }
+
+    return GST_FLOW_OK;
+}
+
+static gboolean screencast_file_sink_event(GstBaseSink *sink, GstEvent *event)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(sink);
+    bool ok = true;
+
+    switch (GST_EVENT_TYPE(event)) {
+    case GST_EVENT_SEGMENT: {
+        // Muxers seek back to rewrite headers when they finish
+        const GstSegment *segment = nullptr;
+        gst_event_parse_segment(event, &segment);
+        if (segment->format == GST_FORMAT_BYTES)
+            ok = self->writer->seek(segment->start);
+        break;
+    }
+    case GST_EVENT_EOS:
+        // The file is complete on disk when EOS is posted
+        ok = self->writer->flush(true);
+        break;
+    default:
+        break;
+    }
+
+    if (!ok) {
+        screencast_file_sink_write_error(self);
+        gst_event_unref(event);
+        return FALSE;
+    }
+
+    return GST_BASE_SINK_CLASS(screencast_file_sink_parent_class)->event(sink, event);
+}
+
+static gboolean screencast_file_sink_query(GstBaseSink *sink, GstQuery *query)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(sink);
+
+    switch (GST_QUERY_TYPE(query)) {
+    case GST_QUERY_SEEKING: {
+        GstFormat format;
+        gst_query_parse_seeking(query, &format, nullptr, nullptr, nullptr);
+        gst_query_set_seeking(query, format, format == GST_FORMAT_BYTES, 0, -1);
+        return TRUE;
+    }
+    case GST_QUERY_POSITION: {
+        GstFormat format;
+        gst_query_parse_position(query, &format, nullptr);
+        if (format != GST_FORMAT_BYTES || !self->writer)
+            break;
+        gst_query_set_position(query, GST_FORMAT_BYTES, gint64(self->writer->position()));
+        return TRUE;
+    }
+    default:
+        break;
+    }
+
+    return GST_BASE_SINK_CLASS(screencast_file_sink_parent_class)->query(sink, query);
+}
+
+static void screencast_file_sink_set_property(GObject *object, guint propId,
+                                              const GValue *value, GParamSpec *pspec)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(object);
+
+    switch (propId) {
+    case PROP_LOCATION:
+        g_free(self->location);
+        self->location = g_value_dup_string(value);
+        break;
+    case PROP_BUFFER_SIZE:
+        self->bufferSize = g_value_get_uint(value);
+        break;
+    case PROP_BUFFER_COUNT:
+        self->bufferCount = g_value_get_uint(value);
+        break;
+    case PROP_PREALLOCATE:
+        self->preallocate = g_value_get_uint64(value);
+        break;
+    case PROP_WRITEBACK_SIZE:
+        self->writebackSize = g_value_get_uint64(value);
+        break;
+    case PROP_SYNC_INTERVAL:
+        self->syncInterval = g_value_get_uint64(value);
+        break;
+    case PROP_USE_IO_URING:
+        self->useIoUring = g_value_get_boolean(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_file_sink_get_property(GObject *object, guint propId,
+                                              GValue *value, GParamSpec *pspec)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(object);
+
+    switch (propId) {
+    case PROP_LOCATION:
+        g_value_set_string(value, self->location);
+        break;
+    case PROP_BUFFER_SIZE:
+        g_value_set_uint(value, self->bufferSize);
+        break;
+    case PROP_BUFFER_COUNT:
+        g_value_set_uint(value, self->bufferCount);
+        break;
+    case PROP_PREALLOCATE:
+        g_value_set_uint64(value, self->preallocate);
+        break;
+    case PROP_WRITEBACK_SIZE:
+        g_value_set_uint64(value, self->writebackSize);
+        break;
+    case PROP_SYNC_INTERVAL:
+        g_value_set_uint64(value, self->syncInterval);
+        break;
+    case PROP_USE_IO_URING:
+        g_value_set_boolean(value, self->useIoUring);
+        break;
+    case PROP_IO_BACKEND:
+        GST_OBJECT_LOCK(self);
+        g_value_set_string(value, self->writer ? AsyncWriter::backendName(self->writer->backend()) : nullptr);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    case PROP_STATS:
+        g_value_take_boxed(value, screencast_file_sink_stats(self));
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_file_sink_finalize(GObject *object)
+{
+    ScreencastFileSink *self = SCREENCAST_FILE_SINK(object);
+
+    delete self->writer;
+    self->writer = nullptr;
+
+    g_free(self->location);
+    self->location = nullptr;
+
+    G_OBJECT_CLASS(screencast_file_sink_parent_class)->finalize(object);
+}
+
+static void screencast_file_sink_class_init(ScreencastFileSinkClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseSinkClass *sinkClass = GST_BASE_SINK_CLASS(klass);
+
+    objectClass->set_property = screencast_file_sink_set_property;
+    objectClass->get_property = screencast_file_sink_get_property;
+    objectClass->finalize = screencast_file_sink_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_LOCATION,
+                g_param_spec_string("location", "File location",
+                                    "Location of the file to write",
+                                    nullptr,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_BUFFER_SIZE,
+                g_param_spec_uint("buffer-size", "Buffer size",
+                                  "Size in bytes of each write, rounded up to a page",
+                                  4096, G_MAXINT, 4 * 1024 * 1024,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_BUFFER_COUNT,
+                g_param_spec_uint("buffer-count", "Buffer count",
+                                  "Number of buffers, the streaming thread stalls when all are being written",
+                                  2, 256, 8,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_PREALLOCATE,
+                g_param_spec_uint64("preallocate", "Preallocate",
+                                    "Reserve disk space in chunks of this many bytes (0 = disabled)",
+                                    0, G_MAXUINT64, 64 * 1024 * 1024,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_WRITEBACK_SIZE,
+                g_param_spec_uint64("writeback-size", "Writeback size",
+                                    "Start writing data back to disk every this many bytes (0 = leave it to the kernel)",
+                                    0, G_MAXUINT64, 8 * 1024 * 1024,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_SYNC_INTERVAL,
+                g_param_spec_uint64("sync-interval", "Sync interval",
+                                    "Sync the file to disk every this many nanoseconds (0 = only when done)",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_USE_IO_URING,
+                g_param_spec_boolean("use-io-uring", "Use io_uring",
+                                     "Write with io_uring when the kernel supports it",
+                                     TRUE,
+                                     GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_IO_BACKEND,
+                g_param_spec_string("io-backend", "I/O backend",
+                                    "How the file is being written",
+                                    nullptr,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_STATS,
+                g_param_spec_boxed("stats", "Statistics",
+                                   "Bytes written, syncs and write stall histograms",
+                                   GST_TYPE_STRUCTURE,
+                                   GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast file sink",
+                                          "Sink/File",
+                                          "Writes to a file from a dedicated I/O thread",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+
+    sinkClass->start = screencast_file_sink_start;
+    sinkClass->stop = screencast_file_sink_stop;
+    sinkClass->render = screencast_file_sink_render;
+    sinkClass->event = screencast_file_sink_event;
+    sinkClass->query = screencast_file_sink_query;
+}
+
+static void screencast_file_sink_init(ScreencastFileSink *self)
+{
+    self->location = nullptr;
+    self->bufferSize = 4 * 1024 * 1024;
+    self->bufferCount = 8;
+    self->preallocate = 64 * 1024 * 1024;
+    self->writebackSize = 8 * 1024 * 1024;
+    self->syncInterval = 0;
+    self->useIoUring = TRUE;
+    self->writer = nullptr;
+    self->lastSync = 0;
+
+    // Files are written as fast as possible
+    gst_base_sink_set_sync(GST_BASE_SINK(self), FALSE);
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef FILESINKELEMENT_H
+#define FILESINKELEMENT_H
+
+#include <gst/base/gstbasesink.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_FILE_SINK (screencast_file_sink_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastFileSink, screencast_file_sink, SCREENCAST, FILE_SINK, GstBaseSink)
+
+G_END_DECLS
+
+#endif // FILESINKELEMENT_H
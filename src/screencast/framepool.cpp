@@ -0,0 +1,122 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QAtomicInteger>
+
+#include "framepool.h"
+
+struct PoolCounters
+{
+    QAtomicInteger<quint64> bytes;
+    QAtomicInteger<quint64> peak;
+    QAtomicInteger<quint64> maxBytes;
+};
+
+struct _ScreencastFramePool
+{
+    GstVideoBufferPool parent;
+
+    PoolCounters *counters;
+};
+
+G_DEFINE_TYPE(ScreencastFramePool, screencast_frame_pool, GST_TYPE_VIDEO_BUFFER_POOL)
+
+// Size of each buffer as allocated, resizing doesn't change what it holds
+static GQuark size_quark()
+{
+    static GQuark quark = g_quark_from_static_string("screencast-frame-pool-size");
+    return quark;
+}
+
+static GstFlowReturn screencast_frame_pool_alloc_buffer(GstBufferPool *pool, GstBuffer **buffer,
+                                                        GstBufferPoolAcquireParams *params)
+{
+    ScreencastFramePool *self = SCREENCAST_FRAME_POOL(pool);
+
+    GstFlowReturn ret = GST_BUFFER_POOL_CLASS(screencast_frame_pool_parent_class)->alloc_buffer(pool, buffer, params);
+    if (ret != GST_FLOW_OK)
+        return ret;
+
+    gsize size = 0;
+    gst_buffer_get_sizes(*buffer, nullptr, &size);
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(*buffer), size_quark(), GSIZE_TO_POINTER(size), nullptr);
+
+    const quint64 bytes = self->counters->bytes.fetchAndAddRelaxed(size) + size;
+    quint64 peak = self->counters->peak.loadAcquire();
+    while (bytes > peak && !self->counters->peak.testAndSetRelaxed(peak, bytes, peak)) {
+    }
+
+    return GST_FLOW_OK;
+}
+
+static void screencast_frame_pool_free_buffer(GstBufferPool *pool, GstBuffer *buffer)
+{
+    ScreencastFramePool *self = SCREENCAST_FRAME_POOL(pool);
+
+    const gsize size = GPOINTER_TO_SIZE(gst_mini_object_get_qdata(GST_MINI_OBJECT(buffer), size_quark()));
+    self->counters->bytes.fetchAndSubRelaxed(size);
+
+    GST_BUFFER_POOL_CLASS(screencast_frame_pool_parent_class)->free_buffer(pool, buffer);
+}
+
+static void screencast_frame_pool_release_buffer(GstBufferPool *pool, GstBuffer *buffer)
+{
+    ScreencastFramePool *self = SCREENCAST_FRAME_POOL(pool);
+
+    // Tagged memory can't be trusted to be reused, so the pool frees it
+    const quint64 maxBytes = self->counters->maxBytes.loadAcquire();
+    if (maxBytes > 0 && self->counters->bytes.loadAcquire() > maxBytes)
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_TAG_MEMORY);
+
+    GST_BUFFER_POOL_CLASS(screencast_frame_pool_parent_class)->release_buffer(pool, buffer);
+}
+
+static void screencast_frame_pool_finalize(GObject *object)
+{
+    ScreencastFramePool *self = SCREENCAST_FRAME_POOL(object);
+
+    delete self->counters;
+    self->counters = nullptr;
+
+    G_OBJECT_CLASS(screencast_frame_pool_parent_class)->finalize(object);
+}
+
+static void screencast_frame_pool_class_init(ScreencastFramePoolClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstBufferPoolClass *poolClass = GST_BUFFER_POOL_CLASS(klass);
+
+    objectClass->finalize = screencast_frame_pool_finalize;
+
+    poolClass->alloc_buffer = screencast_frame_pool_alloc_buffer;
+    poolClass->free_buffer = screencast_frame_pool_free_buffer;
+    poolClass->release_buffer = screencast_frame_pool_release_buffer;
+}
+
+static void screencast_frame_pool_init(ScreencastFramePool *self)
+{
+    self->counters = new PoolCounters();
+}
+
+GstBufferPool *screencast_frame_pool_new()
+{
+    return GST_BUFFER_POOL(gst_object_ref_sink(g_object_new(SCREENCAST_TYPE_FRAME_POOL, nullptr)));
+}
+
+guint64 screencast_frame_pool_get_bytes(ScreencastFramePool *pool)
+{
+    return pool->counters->bytes.loadAcquire();
+}
+
+guint64 screencast_frame_pool_get_peak_bytes(ScreencastFramePool *pool)
+{
+    return pool->counters->peak.loadAcquire();
+}
+
+void screencast_frame_pool_set_max_bytes(ScreencastFramePool *pool, guint64 bytes)
+{
+    pool->counters->maxBytes.storeRelease(bytes);
+}
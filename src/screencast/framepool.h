@@ -0,0 +1,36 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <gst/video/gstvideopool.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_FRAME_POOL (screencast_frame_pool_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastFramePool, screencast_frame_pool, SCREENCAST, FRAME_POOL, GstVideoBufferPool)
+
+G_END_DECLS
+
+/*
+ * A video buffer pool that knows how much memory it holds.
+ *
+ * The byte limit doesn't make allocation wait, an encoder holding on
+ * to frames for its lookahead would starve the element that fills
+ * them; instead, while the pool holds more than the limit, released
+ * buffers are freed rather than kept for reuse.
+ */
+GstBufferPool *screencast_frame_pool_new();
+
+// Bytes of all the buffers allocated by the pool, in use or not
+guint64 screencast_frame_pool_get_bytes(ScreencastFramePool *pool);
+guint64 screencast_frame_pool_get_peak_bytes(ScreencastFramePool *pool);
+
+// 0 keeps every buffer for reuse, as a regular pool does
+void screencast_frame_pool_set_max_bytes(ScreencastFramePool *pool, guint64 bytes);
+
+#endif // FRAMEPOOL_H
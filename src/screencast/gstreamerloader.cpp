@@ -0,0 +1,58 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "elements.h"
+#include "gstreamerloader.h"
+#include "startupprofile.h"
+
+#include <gst/gst.h>
+
+GStreamerLoader::GStreamerLoader(QObject *parent)
+    : QObject(parent)
+{
+}
+
+GStreamerLoader::~GStreamerLoader()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void GStreamerLoader::start()
+{
+    if (m_state.loadAcquire() != NotStarted)
+        return;
+
+    m_state.storeRelease(Running);
+    m_thread = std::thread([this]() {
+        GError *error = nullptr;
+        bool succeeded = gst_init_check(nullptr, nullptr, &error);
+        if (!succeeded) {
+            qWarning("Failed to initialize GStreamer: %s", error ? error->message : "unknown error");
+            g_clear_error(&error);
+        } else if (!registerElements()) {
+            qWarning("Failed to register the built-in GStreamer elements.");
+            succeeded = false;
+        }
+
+        StartupProfile::mark("GStreamer initialized");
+        m_state.storeRelease(succeeded ? Succeeded : Failed);
+        emit finished(succeeded);
+    });
+}
+
+bool GStreamerLoader::isFinished() const
+{
+    const int state = m_state.loadAcquire();
+    return state == Succeeded || state == Failed;
+}
+
+bool GStreamerLoader::wait()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+    return m_state.loadAcquire() == Succeeded;
+}
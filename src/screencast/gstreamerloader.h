@@ -0,0 +1,49 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef GSTREAMERLOADER_H
+#define GSTREAMERLOADER_H
+
+#include <QAtomicInt>
+#include <QObject>
+
+#include <thread>
+
+/*
+ * Initializes GStreamer and registers the built-in elements on a
+ * worker thread, so that loading the plugin registry overlaps with
+ * the rest of the startup.
+ */
+class GStreamerLoader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit GStreamerLoader(QObject *parent = nullptr);
+    ~GStreamerLoader();
+
+    void start();
+
+    bool isFinished() const;
+    // Blocks until GStreamer is initialized, returns false on failure
+    bool wait();
+
+Q_SIGNALS:
+    // Emitted from the worker thread
+    void finished(bool succeeded);
+
+private:
+    enum State {
+        NotStarted,
+        Running,
+        Succeeded,
+        Failed
+    };
+
+    std::thread m_thread;
+    QAtomicInt m_state = NotStarted;
+};
+
+#endif // GSTREAMERLOADER_H
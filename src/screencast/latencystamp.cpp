@@ -0,0 +1,81 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "latencystamp.h"
+
+#include <time.h>
+
+namespace LatencyStamp {
+
+// Limited range black and white
+static const uint8_t black = 16;
+static const uint8_t white = 235;
+
+uint32_t now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint32_t(uint64_t(ts.tv_sec) * 1000000u + uint64_t(ts.tv_nsec) / 1000u);
+}
+
+bool write(uint8_t *luma, int stride, int width, int height, uint32_t time)
+{
+    if (width < Width || height < Height)
+        return false;
+
+    const uint64_t bits = uint64_t(time) | (uint64_t(~time) << 32);
+    for (int bit = 0; bit < Columns * Rows; ++bit) {
+        const uint8_t value = (bits >> bit) & 1 ? white : black;
+        const int x = (bit % Columns) * BlockSize;
+        const int y = (bit / Columns) * BlockSize;
+        for (int row = 0; row < BlockSize; ++row) {
+            uint8_t *line = luma + (y + row) * stride + x;
+            for (int column = 0; column < BlockSize; ++column)
+                line[column] = value;
+        }
+    }
+
+    return true;
+}
+
+bool read(const uint8_t *luma, int stride, int width, int height, uint32_t *time)
+{
+    if (width < Width || height < Height)
+        return false;
+
+    // Only the middle of each block is sampled, the edges are
+    // where compression artifacts end up
+    const int margin = BlockSize / 4;
+    uint64_t bits = 0;
+    for (int bit = 0; bit < Columns * Rows; ++bit) {
+        const int x = (bit % Columns) * BlockSize;
+        const int y = (bit / Columns) * BlockSize;
+        int sum = 0;
+        for (int row = margin; row < BlockSize - margin; ++row) {
+            const uint8_t *line = luma + (y + row) * stride + x;
+            for (int column = margin; column < BlockSize - margin; ++column)
+                sum += line[column];
+        }
+        const int samples = (BlockSize - 2 * margin) * (BlockSize - 2 * margin);
+        if (sum >= samples * (black + white) / 2)
+            bits |= uint64_t(1) << bit;
+    }
+
+    const uint32_t value = uint32_t(bits);
+    if (uint32_t(bits >> 32) != uint32_t(~value))
+        return false;
+
+    *time = value;
+    return true;
+}
+
+uint32_t elapsed(uint32_t time, uint32_t now)
+{
+    // Unsigned arithmetic wraps along with the clock
+    return now - time;
+}
+
+} // namespace LatencyStamp
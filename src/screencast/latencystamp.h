@@ -0,0 +1,42 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef LATENCYSTAMP_H
+#define LATENCYSTAMP_H
+
+#include <cstdint>
+
+/*
+ * A timestamp drawn into the luma plane of a frame, so that it survives
+ * encoding, streaming and decoding and the receiver can tell how long
+ * ago the frame was captured.
+ *
+ * The 32 bits of the time in microseconds, followed by their complement
+ * as a check, are drawn as black and white 8x8 blocks in the top left
+ * corner: blocks as large as the codecs' transforms come through lossy
+ * compression unharmed.
+ */
+namespace LatencyStamp {
+
+const int BlockSize = 8;
+const int Columns = 16;
+const int Rows = 4;
+const int Width = Columns * BlockSize;
+const int Height = Rows * BlockSize;
+
+// Microseconds on the monotonic clock, wrapping every 71 minutes
+uint32_t now();
+
+// Returns false if the frame is too small to hold the stamp
+bool write(uint8_t *luma, int stride, int width, int height, uint32_t time);
+bool read(const uint8_t *luma, int stride, int width, int height, uint32_t *time);
+
+// Microseconds from a stamp to now, accounting for the wrap around
+uint32_t elapsed(uint32_t time, uint32_t now);
+
+} // namespace LatencyStamp
+
+#endif // LATENCYSTAMP_H
@@ -0,0 +1,150 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "latencystamp.h"
+#include "latencystampelement.h"
+#include "screencast.h"
+
+#include <gst/video/video.h>
+
+// Planar luma first, the stamp is only drawn there
+#define FORMATS "{ I420, NV12 }"
+
+enum {
+    PROP_0,
+    PROP_FRAMES_STAMPED
+};
+
+struct _ScreencastLatencyStamp
+{
+    GstBaseTransform parent;
+
+    GstVideoInfo info;
+    bool warned;
+
+    guint64 framesStamped;
+};
+
+G_DEFINE_TYPE(ScreencastLatencyStamp, screencast_latency_stamp, GST_TYPE_BASE_TRANSFORM)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static GstStaticPadTemplate srcTemplate =
+        GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+// When the frame was captured, on the monotonic clock the receiver reads
+static uint32_t capture_time(ScreencastLatencyStamp *self, GstBuffer *buffer)
+{
+    const uint32_t now = LatencyStamp::now();
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    if (!GST_CLOCK_TIME_IS_VALID(pts))
+        return now;
+
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT(self));
+    if (!clock)
+        return now;
+
+    // Timestamps are the running time when the frame was captured,
+    // which may be on the PipeWire clock rather than the monotonic one
+    const GstClockTime runningTime = gst_clock_get_time(clock) - gst_element_get_base_time(GST_ELEMENT(self));
+    gst_object_unref(clock);
+    if (runningTime < pts)
+        return now;
+
+    return now - uint32_t((runningTime - pts) / GST_USECOND);
+}
+
+static gboolean screencast_latency_stamp_set_caps(GstBaseTransform *trans, GstCaps *incaps, GstCaps *outcaps)
+{
+    Q_UNUSED(outcaps)
+
+    ScreencastLatencyStamp *self = SCREENCAST_LATENCY_STAMP(trans);
+    return gst_video_info_from_caps(&self->info, incaps);
+}
+
+static GstFlowReturn screencast_latency_stamp_transform_ip(GstBaseTransform *trans, GstBuffer *buffer)
+{
+    ScreencastLatencyStamp *self = SCREENCAST_LATENCY_STAMP(trans);
+
+    GstVideoFrame frame;
+    if (!gst_video_frame_map(&frame, &self->info, buffer, GST_MAP_READWRITE))
+        return GST_FLOW_ERROR;
+
+    const bool stamped = LatencyStamp::write(static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0)),
+                                             GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0),
+                                             GST_VIDEO_FRAME_WIDTH(&frame), GST_VIDEO_FRAME_HEIGHT(&frame),
+                                             capture_time(self, buffer));
+    gst_video_frame_unmap(&frame);
+
+    if (!stamped && !self->warned) {
+        qCWarning(lcScreencast, "Frames smaller than %dx%d can't carry the latency stamp",
+                  LatencyStamp::Width, LatencyStamp::Height);
+        self->warned = true;
+    }
+
+    if (stamped) {
+        GST_OBJECT_LOCK(self);
+        self->framesStamped++;
+        GST_OBJECT_UNLOCK(self);
+    }
+
+    return GST_FLOW_OK;
+}
+
+static void screencast_latency_stamp_get_property(GObject *object, guint propId,
+                                                  GValue *value, GParamSpec *pspec)
+{
+    ScreencastLatencyStamp *self = SCREENCAST_LATENCY_STAMP(object);
+
+    switch (propId) {
+    case PROP_FRAMES_STAMPED:
+        GST_OBJECT_LOCK(self);
+        g_value_set_uint64(value, self->framesStamped);
+        GST_OBJECT_UNLOCK(self);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_latency_stamp_class_init(ScreencastLatencyStampClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseTransformClass *transformClass = GST_BASE_TRANSFORM_CLASS(klass);
+
+    objectClass->get_property = screencast_latency_stamp_get_property;
+
+    g_object_class_install_property(
+                objectClass, PROP_FRAMES_STAMPED,
+                g_param_spec_uint64("frames-stamped", "Frames stamped",
+                                    "Number of frames the capture time was drawn on",
+                                    0, G_MAXUINT64, 0,
+                                    GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast latency stamp",
+                                          "Filter/Effect/Video",
+                                          "Draws the capture time onto the frames for glass to glass latency measurements",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+    gst_element_class_add_static_pad_template(elementClass, &srcTemplate);
+
+    transformClass->set_caps = screencast_latency_stamp_set_caps;
+    transformClass->transform_ip = screencast_latency_stamp_transform_ip;
+}
+
+static void screencast_latency_stamp_init(ScreencastLatencyStamp *self)
+{
+    self->warned = false;
+    self->framesStamped = 0;
+
+    gst_base_transform_set_in_place(GST_BASE_TRANSFORM(self), TRUE);
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef LATENCYSTAMPELEMENT_H
+#define LATENCYSTAMPELEMENT_H
+
+#include <gst/base/gstbasetransform.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_LATENCY_STAMP (screencast_latency_stamp_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastLatencyStamp, screencast_latency_stamp, SCREENCAST, LATENCY_STAMP, GstBaseTransform)
+
+G_END_DECLS
+
+#endif // LATENCYSTAMPELEMENT_H
@@ -10,12 +10,17 @@
 #include <QDBusConnection>
 #include <QLibraryInfo>
 #include <QLocale>
+#include <QRegularExpression>
 #include <QStandardPaths>
 #include <QTranslator>
+#include <QUrl>
 
 #include <gst/gst.h>
 
+#include "encoder.h"
+#include "gstreamerloader.h"
 #include "screencast.h"
+#include "startupprofile.h"
 
 #define TR(x) QT_TRANSLATE_NOOP("Command line parser", QLatin1String(x))
 
@@ -60,6 +65,8 @@ static void loadAppTranslations()
 
 int main(int argc, char *argv[])
 {
+    StartupProfile::start();
+
     // Setup application
     QCoreApplication app(argc, argv);
     app.setApplicationName(QLatin1String("ScreenCast"));
@@ -67,6 +74,11 @@ int main(int argc, char *argv[])
     app.setOrganizationDomain(QLatin1String("liri.io"));
     app.setOrganizationName(QLatin1String("Liri"));
 
+    // Loading the plugin registry is the slowest part of the startup, it
+    // runs while the options are parsed and the portal is asked for streams
+    GStreamerLoader loader;
+    loader.start();
+
     // Load translations
     loadQtTranslations();
     loadAppTranslations();
@@ -77,25 +89,361 @@ int main(int argc, char *argv[])
     parser.addHelpOption();
     parser.addVersionOption();
 
+    // Capture options
+    QCommandLineOption framerateOption(QStringLiteral("framerate"),
+                                       TR("Target frames per second, with variable framerate this is the maximum."),
+                                       TR("fps"), QStringLiteral("30"));
+    parser.addOption(framerateOption);
+    QCommandLineOption vfrOption(QStringLiteral("variable-framerate"),
+                                 TR("Only record frames when the screen content changes."));
+    parser.addOption(vfrOption);
+    QCommandLineOption noDedupOption(QStringLiteral("no-deduplicate"),
+                                     TR("Encode frames even when they are identical to the previous one."));
+    parser.addOption(noDedupOption);
+    QCommandLineOption noAdaptiveOption(QStringLiteral("no-adaptive-quality"),
+                                        TR("Keep the encoder settings even when the machine can't keep up."));
+    parser.addOption(noAdaptiveOption);
+    QCommandLineOption nodeOption(QStringLiteral("node"),
+                                  TR("Record a node from the local PipeWire daemon instead of asking the portal, can be repeated."),
+                                  TR("id"));
+    parser.addOption(nodeOption);
+    QCommandLineOption outputModeOption(QStringLiteral("output-mode"),
+                                        TR("How to record multiple monitors: \"separate\" writes one file per monitor, \"single\" one file with a track per monitor."),
+                                        TR("mode"), QStringLiteral("separate"));
+    parser.addOption(outputModeOption);
+    QCommandLineOption pickSourcesOption(QStringLiteral("pick-sources"),
+                                         TR("Show the source picker even if sources were selected before."));
+    parser.addOption(pickSourcesOption);
+    QCommandLineOption sourceOption(QStringLiteral("source"),
+                                    TR("What to record: \"monitor\", \"window\" or \"any\" of them."),
+                                    TR("type"), QStringLiteral("monitor"));
+    parser.addOption(sourceOption);
+    QCommandLineOption regionOption(QStringLiteral("region"),
+                                    TR("Only record this rectangle of the monitor or window, as x,y,WIDTHxHEIGHT."),
+                                    TR("rect"));
+    parser.addOption(regionOption);
+    QCommandLineOption resolutionOption(QStringLiteral("resolution"),
+                                        TR("Scale frames down to fit WIDTHxHEIGHT, or a height like 1080, keeping the aspect ratio."),
+                                        TR("size"));
+    parser.addOption(resolutionOption);
+    QCommandLineOption cursorOption(QStringLiteral("cursor"),
+                                    TR("How to record the cursor: \"metadata\" draws it from the position the compositor sends, \"embedded\" lets the compositor draw it, \"hidden\" leaves it out."),
+                                    TR("mode"), QStringLiteral("metadata"));
+    parser.addOption(cursorOption);
+    QCommandLineOption daemonOption(QStringLiteral("daemon"),
+                                    TR("Stay resident and only record when asked to over D-Bus."));
+    parser.addOption(daemonOption);
+
+    // Replay buffer options
+    QCommandLineOption replayOption(QStringLiteral("replay"),
+                                    TR("Keep the last seconds of video in memory and only save them on SIGUSR1."),
+                                    TR("seconds"), QStringLiteral("0"));
+    parser.addOption(replayOption);
+    QCommandLineOption replayMemoryOption(QStringLiteral("replay-memory"),
+                                          TR("Memory limit of the replay buffer."),
+                                          TR("MiB"), QStringLiteral("512"));
+    parser.addOption(replayMemoryOption);
+
+    // Live streaming options
+    QCommandLineOption liveOption(QStringLiteral("live"),
+                                  TR("Stream live to an rtp://host:port, srt://host:port or rtsp://host:port/path URL instead of recording to a file."),
+                                  TR("url"));
+    parser.addOption(liveOption);
+    QCommandLineOption latencyStampOption(QStringLiteral("latency-stamp"),
+                                          TR("Draw the capture time in the top left corner of live streams, for screencast-live-receiver to measure the latency."));
+    parser.addOption(latencyStampOption);
+
+    // Spool options
+    QCommandLineOption spoolOption(QStringLiteral("spool"),
+                                   TR("Record losslessly compressed frames and encode them once the recording is over, in the background."));
+    parser.addOption(spoolOption);
+    QCommandLineOption spoolCompressionOption(QStringLiteral("spool-compression"),
+                                              TR("How spooled frames are compressed: \"lz4\", \"zstd\" or \"none\"."),
+                                              TR("method"), QLatin1String(Spool::compressionName(Spool::defaultCompression())));
+    parser.addOption(spoolCompressionOption);
+    QCommandLineOption keepSpoolOption(QStringLiteral("keep-spool"),
+                                       TR("Keep the spool once it was encoded."));
+    parser.addOption(keepSpoolOption);
+    QCommandLineOption transcodeOption(QStringLiteral("transcode"),
+                                       TR("Encode a spool left by an earlier recording, or a finished recording, on every core and exit, can be repeated."),
+                                       TR("file"));
+    parser.addOption(transcodeOption);
+
+    // Threading options
+    QCommandLineOption threadLayoutOption(QStringLiteral("thread-layout"),
+                                          TR("Streaming threads: \"shared\" runs capture with conversion and encoding with muxing, \"staged\" gives each its own thread, raises the priority of capture and runs encoding as SCHED_BATCH."),
+                                          TR("layout"), ThreadLayout::layoutName(ThreadLayout::Shared));
+    parser.addOption(threadLayoutOption);
+    QCommandLineOption pinOption(QStringLiteral("pin"),
+                                 QString(TR("Pin the threads of a stage to a list of CPUs, as in \"encode=2-7\", stages are: %1. Can be repeated.")).arg(ThreadLayout::stageNames().join(QLatin1String(", "))),
+                                 TR("stage=cpus"));
+    parser.addOption(pinOption);
+    QCommandLineOption encoderNiceOption(QStringLiteral("encoder-nice"),
+                                         TR("Added to the niceness of the encoding threads."),
+                                         TR("n"), QStringLiteral("0"));
+    parser.addOption(encoderNiceOption);
+
+    // Memory options
+    QCommandLineOption memoryBudgetOption(QStringLiteral("memory-budget"),
+                                          TR("Memory for raw frames waiting to be encoded, shared by all streams. 0 only limits how many frames wait."),
+                                          TR("MiB"), QStringLiteral("1024"));
+    parser.addOption(memoryBudgetOption);
+    QCommandLineOption memoryPolicyOption(QStringLiteral("memory-policy"),
+                                          QString(TR("Which frame to drop when a stream's share of the memory budget is used up, one of: %1.")).arg(MemoryBudget::policyNames().join(QLatin1String(", "))),
+                                          TR("policy"), MemoryBudget::policyName(MemoryBudget::DropOldest));
+    parser.addOption(memoryPolicyOption);
+
+    // Shutdown options
+    QCommandLineOption shutdownTimeoutOption(QStringLiteral("shutdown-timeout"),
+                                             TR("How long to wait for the files to be finalized on exit."),
+                                             TR("ms"), QStringLiteral("5000"));
+    parser.addOption(shutdownTimeoutOption);
+
+    // Encoder options
+    QCommandLineOption encoderOption(QStringLiteral("encoder"),
+                                     QString(TR("Video encoder, one of: %1.")).arg(EncoderSettings::codecNames().join(QLatin1String(", "))),
+                                     TR("name"), QStringLiteral("x264"));
+    parser.addOption(encoderOption);
+    QCommandLineOption presetOption(QStringLiteral("preset"),
+                                    QString(TR("Encoder speed/quality preset, one of: %1.")).arg(EncoderSettings::presetNames().join(QLatin1String(", "))),
+                                    TR("preset"), QStringLiteral("fast"));
+    parser.addOption(presetOption);
+    QCommandLineOption threadsOption(QStringLiteral("threads"),
+                                     TR("Number of encoder threads, 0 uses all cores. With --transcode, how many chunks are encoded at once."),
+                                     TR("count"), QStringLiteral("0"));
+    parser.addOption(threadsOption);
+    QCommandLineOption bitrateOption(QStringLiteral("bitrate"),
+                                     TR("Target bitrate in kbit/s, 0 encodes at constant quality."),
+                                     TR("kbps"), QStringLiteral("0"));
+    parser.addOption(bitrateOption);
+    QCommandLineOption containerOption(QStringLiteral("container"),
+                                       QString(TR("Container format, one of: %1. Defaults to the best match for the encoder.")).arg(EncoderSettings::containerNames().join(QLatin1String(", "))),
+                                       TR("format"));
+    parser.addOption(containerOption);
+    QCommandLineOption fragmentOption(QStringLiteral("fragment"),
+                                      TR("Write a fragmented MP4 or streamable Matroska, WebM or Ogg file, with fragments of this length that survive a crash. 0 writes a regular file."),
+                                      TR("ms"), QStringLiteral("0"));
+    parser.addOption(fragmentOption);
+
     // Parse command line
     parser.process(app);
 
+    CaptureSettings captureSettings;
+    captureSettings.framerate = parser.value(framerateOption).toInt();
+    captureSettings.variableFramerate = parser.isSet(vfrOption);
+    captureSettings.deduplicate = !parser.isSet(noDedupOption);
+    captureSettings.adaptiveQuality = !parser.isSet(noAdaptiveOption);
+    captureSettings.persistSources = !parser.isSet(pickSourcesOption);
+    const QStringList nodes = parser.values(nodeOption);
+    for (const QString &node : nodes) {
+        const uint nodeId = node.toUInt();
+        if (nodeId == 0) {
+            qWarning("Invalid node \"%s\".", qPrintable(node));
+            return 1;
+        }
+        captureSettings.pipeWireNodes.append(nodeId);
+    }
+    captureSettings.replaySeconds = qMax(0, parser.value(replayOption).toInt());
+    captureSettings.replayMemory = parser.value(replayMemoryOption).toInt();
+    if (captureSettings.replayMemory <= 0) {
+        qWarning("Invalid replay buffer memory limit \"%s\".", qPrintable(parser.value(replayMemoryOption)));
+        return 1;
+    }
+    const QString outputMode = parser.value(outputModeOption);
+    if (outputMode == QLatin1String("single")) {
+        captureSettings.multiTrack = true;
+    } else if (outputMode != QLatin1String("separate")) {
+        qWarning("Unknown output mode \"%s\".", qPrintable(outputMode));
+        return 1;
+    }
+    const QString sourceType = parser.value(sourceOption);
+    if (sourceType == QLatin1String("monitor")) {
+        captureSettings.sourceTypes = Portal::Monitor;
+    } else if (sourceType == QLatin1String("window")) {
+        captureSettings.sourceTypes = Portal::Window;
+    } else if (sourceType == QLatin1String("any")) {
+        captureSettings.sourceTypes = Portal::Monitor | Portal::Window;
+    } else {
+        qWarning("Unknown source type \"%s\".", qPrintable(sourceType));
+        return 1;
+    }
+    if (parser.isSet(regionOption)) {
+        static const QRegularExpression regionExpression(QStringLiteral("^(\\d+),(\\d+),(\\d+)x(\\d+)$"));
+        const QRegularExpressionMatch match = regionExpression.match(parser.value(regionOption));
+        const QRect region = match.hasMatch()
+                ? QRect(match.captured(1).toInt(), match.captured(2).toInt(),
+                        match.captured(3).toInt(), match.captured(4).toInt())
+                : QRect();
+        // Rounded down to even coordinates, frames are converted to 4:2:0
+        if (region.width() < 2 || region.height() < 2) {
+            qWarning("Invalid region \"%s\".", qPrintable(parser.value(regionOption)));
+            return 1;
+        }
+        captureSettings.region = region;
+    }
+    if (parser.isSet(resolutionOption)) {
+        static const QRegularExpression resolutionExpression(QStringLiteral("^(?:(\\d+)x)?(\\d+)p?$"));
+        const QRegularExpressionMatch match = resolutionExpression.match(parser.value(resolutionOption));
+        const QSize size = match.hasMatch()
+                ? QSize(match.captured(1).toInt(), match.captured(2).toInt())
+                : QSize();
+        // Sizes are kept even, frames are converted to 4:2:0
+        if (size.height() < 2 || (!match.captured(1).isEmpty() && size.width() < 2)) {
+            qWarning("Invalid resolution \"%s\".", qPrintable(parser.value(resolutionOption)));
+            return 1;
+        }
+        captureSettings.outputSize = size;
+    }
+    const QString cursorMode = parser.value(cursorOption);
+    if (cursorMode == QLatin1String("metadata")) {
+        captureSettings.cursorMode = Portal::Metadata;
+    } else if (cursorMode == QLatin1String("embedded")) {
+        captureSettings.cursorMode = Portal::Embedded;
+    } else if (cursorMode == QLatin1String("hidden")) {
+        captureSettings.cursorMode = Portal::Hidden;
+    } else {
+        qWarning("Unknown cursor mode \"%s\".", qPrintable(cursorMode));
+        return 1;
+    }
+    if (captureSettings.framerate <= 0) {
+        qWarning("Invalid framerate \"%s\".", qPrintable(parser.value(framerateOption)));
+        return 1;
+    }
+
+    EncoderSettings encoderSettings;
+    if (!EncoderSettings::parseCodec(parser.value(encoderOption), encoderSettings.codec)) {
+        qWarning("Unknown encoder \"%s\".", qPrintable(parser.value(encoderOption)));
+        return 1;
+    }
+    if (!EncoderSettings::parsePreset(parser.value(presetOption), encoderSettings.preset)) {
+        qWarning("Unknown preset \"%s\".", qPrintable(parser.value(presetOption)));
+        return 1;
+    }
+    if (parser.isSet(containerOption) &&
+            !EncoderSettings::parseContainer(parser.value(containerOption), encoderSettings.container)) {
+        qWarning("Unknown container \"%s\".", qPrintable(parser.value(containerOption)));
+        return 1;
+    }
+    encoderSettings.threads = qMax(0, parser.value(threadsOption).toInt());
+    encoderSettings.bitrate = qMax(0, parser.value(bitrateOption).toInt());
+    encoderSettings.fragmentDuration = qMax(0, parser.value(fragmentOption).toInt());
+
+    if (parser.isSet(liveOption)) {
+        const QUrl url(parser.value(liveOption));
+        if (!url.isValid() || (url.host().isEmpty() && url.port() < 0)) {
+            qWarning("Invalid live streaming URL \"%s\".", qPrintable(parser.value(liveOption)));
+            return 1;
+        }
+        if (captureSettings.replaySeconds > 0) {
+            qWarning("Live streaming and the replay buffer can't be used together.");
+            return 1;
+        }
+        captureSettings.liveUrl = url;
+        captureSettings.latencyStamp = parser.isSet(latencyStampOption);
+        // Frames go out as they come: videorate would hold each one
+        // back until the next arrives to decide whether to duplicate it
+        captureSettings.variableFramerate = true;
+        encoderSettings.zeroLatency = true;
+        // A keyframe every second, for receivers that join late
+        encoderSettings.keyframeInterval = captureSettings.framerate;
+    } else if (parser.isSet(latencyStampOption)) {
+        qWarning("The latency stamp is only drawn on live streams.");
+        return 1;
+    }
+
+    if (parser.isSet(spoolCompressionOption) &&
+            (!Spool::parseCompression(parser.value(spoolCompressionOption).toUtf8().constData(),
+                                      &captureSettings.spoolCompression) ||
+             !Spool::isSupported(captureSettings.spoolCompression))) {
+        qWarning("Unsupported spool compression \"%s\".", qPrintable(parser.value(spoolCompressionOption)));
+        return 1;
+    }
+    captureSettings.keepSpool = parser.isSet(keepSpoolOption);
+    if (parser.isSet(spoolOption)) {
+        // Spools are encoded into one file per source, from the disk
+        if (captureSettings.liveUrl.isValid() || captureSettings.replaySeconds > 0 || captureSettings.multiTrack) {
+            qWarning("Spooling can't be combined with live streaming, the replay buffer or a single output file.");
+            return 1;
+        }
+        captureSettings.spool = true;
+    }
+
+    if (!ThreadLayout::parseLayout(parser.value(threadLayoutOption), captureSettings.threadLayout)) {
+        qWarning("Unknown thread layout \"%s\".", qPrintable(parser.value(threadLayoutOption)));
+        return 1;
+    }
+    const QStringList pins = parser.values(pinOption);
+    for (const QString &pin : pins) {
+        const int separator = pin.indexOf(QLatin1Char('='));
+        ThreadLayout::Stage stage;
+        QVector<int> cpus;
+        if (separator < 0 || !ThreadLayout::parseStage(pin.left(separator), stage) ||
+                !ThreadLayout::parseCpus(pin.mid(separator + 1), cpus)) {
+            qWarning("Invalid pinning \"%s\".", qPrintable(pin));
+            return 1;
+        }
+        captureSettings.stageCpus[stage] = cpus;
+    }
+    bool niceOk = false;
+    captureSettings.encoderNice = parser.value(encoderNiceOption).toInt(&niceOk);
+    if (!niceOk || captureSettings.encoderNice < -39 || captureSettings.encoderNice > 39) {
+        qWarning("Invalid encoder niceness \"%s\".", qPrintable(parser.value(encoderNiceOption)));
+        return 1;
+    }
+    bool budgetOk = false;
+    captureSettings.memoryBudget = parser.value(memoryBudgetOption).toInt(&budgetOk);
+    if (!budgetOk || captureSettings.memoryBudget < 0) {
+        qWarning("Invalid memory budget \"%s\".", qPrintable(parser.value(memoryBudgetOption)));
+        return 1;
+    }
+    if (!MemoryBudget::parsePolicy(parser.value(memoryPolicyOption), captureSettings.memoryPolicy)) {
+        qWarning("Unknown memory policy \"%s\".", qPrintable(parser.value(memoryPolicyOption)));
+        return 1;
+    }
+
+    if (parser.isSet(transcodeOption)) {
+        // Nothing is recorded, GStreamer is needed right away
+        if (!loader.wait())
+            return 1;
+
+        Screencast *screencap = new Screencast();
+        screencap->setCaptureSettings(captureSettings);
+        screencap->setEncoderSettings(encoderSettings);
+        if (!screencap->transcode(parser.values(transcodeOption))) {
+            delete screencap;
+            gst_deinit();
+            return 1;
+        }
+        QObject::connect(&app, &QCoreApplication::aboutToQuit,
+                         screencap, &Screencast::deleteLater);
+
+        const int result = app.exec();
+        gst_deinit();
+        return result;
+    }
+
     // Check if the D-Bus session bus is available
-    if (!QDBusConnection::sessionBus().isConnected()) {
+    const bool daemon = parser.isSet(daemonOption);
+    if ((captureSettings.pipeWireNodes.isEmpty() || daemon) && !QDBusConnection::sessionBus().isConnected()) {
         qWarning("Cannot connect to the D-Bus session bus.");
         return 1;
     }
 
-    // Initialize QtGStreamer
-    gst_init(nullptr, nullptr);
-
     // Run the application
     Screencast *screencap = new Screencast();
+    screencap->setCaptureSettings(captureSettings);
+    screencap->setEncoderSettings(encoderSettings);
+    screencap->setShutdownTimeout(parser.value(shutdownTimeoutOption).toInt());
+    screencap->setGStreamerLoader(&loader);
+    screencap->setDaemon(daemon);
     QCoreApplication::postEvent(screencap, new StartupEvent());
     QObject::connect(&app, &QCoreApplication::aboutToQuit,
                      screencap, &Screencast::deleteLater);
 
+    StartupProfile::mark("options parsed");
+
     int result = app.exec();
+    loader.wait();
     gst_deinit();
     return result;
 }
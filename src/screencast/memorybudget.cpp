@@ -0,0 +1,257 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QAtomicInteger>
+#include <QMutexLocker>
+
+#include "memorybudget.h"
+
+#include <gst/gst.h>
+
+static const char *const policyTable[] = {
+    "drop-oldest", "drop-newest"
+};
+
+struct MemoryBudget::Branch
+{
+    MemoryBudget *budget = nullptr;
+    Account *account = nullptr;
+    GstElement *convertQueue = nullptr;
+    GstElement *convert = nullptr;
+    GstElement *queue = nullptr;
+    // Whether the converter can size its pool
+    bool pooled = false;
+    GstPad *queuePad = nullptr;
+    gulong probe = 0;
+    gulong overrun = 0;
+};
+
+class MemoryBudget::Account
+{
+public:
+    QVector<Branch *> branches;
+    quint64 limit = 0;
+    quint64 peak = 0;
+    QAtomicInteger<quint64> dropped = 0;
+};
+
+MemoryBudget::MemoryBudget(quint64 bytes, Policy policy)
+    : m_bytes(bytes)
+    , m_policy(policy)
+{
+}
+
+MemoryBudget::~MemoryBudget()
+{
+    while (!m_accounts.isEmpty())
+        removeAccount(m_accounts.last());
+}
+
+bool MemoryBudget::parsePolicy(const QString &name, Policy &policy)
+{
+    for (size_t i = 0; i < sizeof(policyTable) / sizeof(policyTable[0]); ++i) {
+        if (name.compare(QLatin1String(policyTable[i]), Qt::CaseInsensitive) == 0) {
+            policy = Policy(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+QString MemoryBudget::policyName(Policy policy)
+{
+    return QLatin1String(policyTable[policy]);
+}
+
+QStringList MemoryBudget::policyNames()
+{
+    QStringList names;
+    for (const char *name : policyTable)
+        names.append(QLatin1String(name));
+    return names;
+}
+
+quint64 MemoryBudget::bytes() const
+{
+    return m_bytes;
+}
+
+MemoryBudget::Policy MemoryBudget::policy() const
+{
+    return m_policy;
+}
+
+MemoryBudget::Account *MemoryBudget::addAccount()
+{
+    Account *account = new Account();
+
+    QMutexLocker locker(&m_mutex);
+    m_accounts.append(account);
+    rebalance();
+    return account;
+}
+
+void MemoryBudget::removeAccount(Account *account)
+{
+    if (!account)
+        return;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_accounts.removeOne(account);
+        rebalance();
+    }
+
+    for (auto *branch : qAsConst(account->branches)) {
+        if (branch->queuePad) {
+            gst_pad_remove_probe(branch->queuePad, branch->probe);
+            gst_object_unref(branch->queuePad);
+        }
+        if (branch->overrun)
+            g_signal_handler_disconnect(branch->queue, branch->overrun);
+        for (auto *element : { branch->convertQueue, branch->convert, branch->queue }) {
+            if (element)
+                gst_object_unref(element);
+        }
+        delete branch;
+    }
+    delete account;
+}
+
+void MemoryBudget::addBranch(Account *account, GstElement *convertQueue, GstElement *convert, GstElement *queue)
+{
+    Branch *branch = new Branch();
+    branch->budget = this;
+    branch->account = account;
+    if (convertQueue)
+        branch->convertQueue = GST_ELEMENT(gst_object_ref(convertQueue));
+    if (convert) {
+        branch->convert = GST_ELEMENT(gst_object_ref(convert));
+        branch->pooled = g_object_class_find_property(G_OBJECT_GET_CLASS(convert), "max-pool-bytes") != nullptr;
+    }
+    if (queue) {
+        branch->queue = GST_ELEMENT(gst_object_ref(queue));
+        branch->queuePad = gst_element_get_static_pad(queue, "sink");
+        branch->probe = gst_pad_add_probe(branch->queuePad, GST_PAD_PROBE_TYPE_BUFFER,
+                                          queueProbe, branch, nullptr);
+        branch->overrun = g_signal_connect(queue, "overrun", G_CALLBACK(queueOverrun), branch);
+    }
+
+    QMutexLocker locker(&m_mutex);
+    account->branches.append(branch);
+    rebalance();
+}
+
+MemoryBudget::Usage MemoryBudget::usage(const Account *account) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    Usage usage;
+    usage.bytes = accountBytes(account);
+    usage.peak = qMax(account->peak, usage.bytes);
+    usage.limit = account->limit;
+    usage.dropped = account->dropped.loadAcquire();
+    return usage;
+}
+
+MemoryBudget::Usage MemoryBudget::usage() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    Usage usage;
+    for (const auto *account : qAsConst(m_accounts)) {
+        usage.bytes += accountBytes(account);
+        usage.dropped += account->dropped.loadAcquire();
+    }
+    usage.peak = qMax(m_peak, usage.bytes);
+    usage.limit = m_bytes;
+    return usage;
+}
+
+void MemoryBudget::rebalance()
+{
+    // Called with the mutex held, queues take their new limits on the
+    // next frame and leak down to them
+    if (m_accounts.isEmpty())
+        return;
+
+    const quint64 accountShare = m_bytes / quint64(m_accounts.size());
+    for (auto *account : qAsConst(m_accounts)) {
+        account->limit = accountShare;
+        if (account->branches.isEmpty())
+            continue;
+
+        const quint64 share = accountShare / quint64(account->branches.size());
+        for (auto *branch : qAsConst(account->branches)) {
+            if (branch->queue)
+                g_object_set(branch->queue,
+                             "max-size-bytes", guint(qMin(share, quint64(G_MAXUINT))),
+                             "leaky", m_policy == DropOldest ? 2 : 1,
+                             nullptr);
+            if (branch->pooled)
+                g_object_set(branch->convert, "max-pool-bytes", guint64(share), nullptr);
+        }
+    }
+}
+
+quint64 MemoryBudget::branchBytes(const Branch *branch)
+{
+    // Frames in the queue are the pool's own, unless the pool was
+    // downstream's or duplicates were queued more than once
+    guint64 poolBytes = 0;
+    if (branch->pooled)
+        g_object_get(branch->convert, "pool-bytes", &poolBytes, nullptr);
+    guint queueBytes = 0;
+    if (branch->queue)
+        g_object_get(branch->queue, "current-level-bytes", &queueBytes, nullptr);
+    guint convertBytes = 0;
+    if (branch->convertQueue)
+        g_object_get(branch->convertQueue, "current-level-bytes", &convertBytes, nullptr);
+
+    return qMax(quint64(poolBytes), quint64(queueBytes)) + convertBytes;
+}
+
+quint64 MemoryBudget::accountBytes(const Account *account) const
+{
+    quint64 bytes = 0;
+    for (const auto *branch : account->branches)
+        bytes += branchBytes(branch);
+    return bytes;
+}
+
+void MemoryBudget::sample(Account *account)
+{
+    QMutexLocker locker(&m_mutex);
+
+    quint64 total = 0;
+    for (auto *other : qAsConst(m_accounts)) {
+        const quint64 bytes = accountBytes(other);
+        if (other == account)
+            account->peak = qMax(account->peak, bytes);
+        total += bytes;
+    }
+    m_peak = qMax(m_peak, total);
+}
+
+GstPadProbeReturn MemoryBudget::queueProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+    Q_UNUSED(info)
+
+    Branch *branch = static_cast<Branch *>(user_data);
+    branch->budget->sample(branch->account);
+    return GST_PAD_PROBE_OK;
+}
+
+void MemoryBudget::queueOverrun(GstElement *queue, gpointer user_data)
+{
+    Q_UNUSED(queue)
+
+    // Always leaky, a full queue means a frame is gone
+    Branch *branch = static_cast<Branch *>(user_data);
+    branch->account->dropped.fetchAndAddRelaxed(1);
+}
@@ -0,0 +1,94 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <gst/gstelement.h>
+#include <gst/gstpad.h>
+
+/*
+ * Memory for raw frames, shared by every stream.
+ *
+ * The budget is split evenly between the accounts, one per stream,
+ * and each account's share between its capture branches. A branch
+ * is bounded where frames pile up when the encoder falls behind: the
+ * queue before the encoder is limited to the share in bytes, and
+ * drops the oldest or the newest frame when it's full, and the
+ * converter's pool frees the buffers it gets back beyond the share.
+ *
+ * Shares are recomputed whenever an account comes or goes, so that
+ * a new stream takes its part from the others.
+ */
+class MemoryBudget
+{
+public:
+    enum Policy {
+        DropOldest,
+        DropNewest
+    };
+
+    struct Usage {
+        // Raw frames in the converter's pool, or in the queue before
+        // the encoder when it's not our converter, and those waiting
+        // to be converted
+        quint64 bytes = 0;
+        // Sampled whenever a frame enters the queue
+        quint64 peak = 0;
+        quint64 limit = 0;
+        // By the queue before the encoder, whenever it was full
+        quint64 dropped = 0;
+    };
+
+    class Account;
+
+    MemoryBudget(quint64 bytes, Policy policy);
+    ~MemoryBudget();
+
+    static bool parsePolicy(const QString &name, Policy &policy);
+    static QString policyName(Policy policy);
+    static QStringList policyNames();
+
+    quint64 bytes() const;
+    Policy policy() const;
+
+    Account *addAccount();
+    // Only once the account's pipeline is stopped
+    void removeAccount(Account *account);
+
+    // Puts the branch's frames on the account and bounds them; the
+    // converter is only sized when it's our own, any element can be null
+    void addBranch(Account *account, GstElement *convertQueue, GstElement *convert, GstElement *queue);
+
+    Usage usage(const Account *account) const;
+    // Of all the accounts together
+    Usage usage() const;
+
+private:
+    struct Branch;
+
+    quint64 m_bytes = 0;
+    Policy m_policy = DropOldest;
+
+    mutable QMutex m_mutex;
+    QVector<Account *> m_accounts;
+    quint64 m_peak = 0;
+
+    void rebalance();
+    static quint64 branchBytes(const Branch *branch);
+    quint64 accountBytes(const Account *account) const;
+    void sample(Account *account);
+
+    static GstPadProbeReturn queueProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    static void queueOverrun(GstElement *queue, gpointer user_data);
+};
+
+#endif // MEMORYBUDGET_H
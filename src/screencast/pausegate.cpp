@@ -0,0 +1,123 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QMutexLocker>
+
+#include "pausegate.h"
+
+PauseGate::PauseGate(GstElement *pipeline)
+    : m_pipeline(pipeline)
+{
+}
+
+PauseGate::~PauseGate()
+{
+    for (const auto &source : qAsConst(m_sources)) {
+        gst_pad_remove_probe(source.pad, source.probe);
+        gst_object_unref(source.pad);
+    }
+}
+
+void PauseGate::addSource(GstElement *source)
+{
+    Source entry;
+    entry.pad = gst_element_get_static_pad(source, "src");
+    if (!entry.pad)
+        return;
+    entry.probe = gst_pad_add_probe(entry.pad, GST_PAD_PROBE_TYPE_BUFFER, sourceProbe, this, nullptr);
+    m_sources.append(entry);
+}
+
+bool PauseGate::isPaused() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_paused;
+}
+
+void PauseGate::pause()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_paused)
+        return;
+
+    m_paused = true;
+    m_pausedAt = runningTime();
+}
+
+void PauseGate::resume()
+{
+    GstClockTime offset;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_paused)
+            return;
+
+        const GstClockTime now = runningTime();
+        if (GST_CLOCK_TIME_IS_VALID(now) && GST_CLOCK_TIME_IS_VALID(m_pausedAt) && now > m_pausedAt) {
+            m_offset += now - m_pausedAt;
+            m_resumedAt = now;
+        }
+        offset = m_offset;
+    }
+
+    // Frames are still dropped while the offsets change, so that
+    // none of them goes out with the old running time
+    for (const auto &source : qAsConst(m_sources))
+        gst_pad_set_offset(source.pad, -GstClockTimeDiff(offset));
+
+    QMutexLocker locker(&m_mutex);
+    m_paused = false;
+    m_pausedAt = GST_CLOCK_TIME_NONE;
+}
+
+GstClockTime PauseGate::pausedTime() const
+{
+    QMutexLocker locker(&m_mutex);
+    GstClockTime time = m_offset;
+    if (m_paused && GST_CLOCK_TIME_IS_VALID(m_pausedAt)) {
+        const GstClockTime now = runningTime();
+        if (GST_CLOCK_TIME_IS_VALID(now) && now > m_pausedAt)
+            time += now - m_pausedAt;
+    }
+    return time;
+}
+
+quint64 PauseGate::droppedFrames() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_dropped;
+}
+
+GstClockTime PauseGate::runningTime() const
+{
+    GstClock *clock = gst_element_get_clock(m_pipeline);
+    if (!clock)
+        return GST_CLOCK_TIME_NONE;
+
+    const GstClockTime now = gst_clock_get_time(clock);
+    const GstClockTime baseTime = gst_element_get_base_time(m_pipeline);
+    gst_object_unref(clock);
+    return now >= baseTime ? now - baseTime : GST_CLOCK_TIME_NONE;
+}
+
+GstPadProbeReturn PauseGate::sourceProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    PauseGate *self = static_cast<PauseGate *>(user_data);
+    const GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    QMutexLocker locker(&self->m_mutex);
+    // Timestamps are running times of the pipeline clock, frames
+    // captured during the pause may still be on their way
+    if (self->m_paused || (GST_CLOCK_TIME_IS_VALID(pts) && pts < self->m_resumedAt)) {
+        self->m_dropped++;
+        return GST_PAD_PROBE_DROP;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
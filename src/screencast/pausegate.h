@@ -0,0 +1,64 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef PAUSEGATE_H
+#define PAUSEGATE_H
+
+#include <QMutex>
+#include <QVector>
+
+#include <gst/gst.h>
+
+/*
+ * Pauses a recording without tearing the pipeline down.
+ *
+ * While paused, a probe on the pad of every capture source drops the
+ * frames, so PipeWire keeps delivering into its buffers but nothing
+ * downstream runs. On resume the running time of the sources is
+ * shifted back by the length of all the pauses, so that converter,
+ * encoder and muxer carry on with the same caps and state and the
+ * file has no gap.
+ */
+class PauseGate
+{
+public:
+    explicit PauseGate(GstElement *pipeline);
+    ~PauseGate();
+
+    void addSource(GstElement *source);
+
+    bool isPaused() const;
+    void pause();
+    void resume();
+
+    // Time spent paused, including the current pause
+    GstClockTime pausedTime() const;
+    // Frames dropped while paused
+    quint64 droppedFrames() const;
+
+private:
+    struct Source {
+        GstPad *pad = nullptr;
+        gulong probe = 0;
+    };
+
+    GstElement *m_pipeline = nullptr;
+    QVector<Source> m_sources;
+
+    mutable QMutex m_mutex;
+    bool m_paused = false;
+    GstClockTime m_pausedAt = GST_CLOCK_TIME_NONE;
+    // Frames captured before this were meant to be dropped
+    GstClockTime m_resumedAt = 0;
+    GstClockTime m_offset = 0;
+    quint64 m_dropped = 0;
+
+    GstClockTime runningTime() const;
+
+    static GstPadProbeReturn sourceProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+};
+
+#endif // PAUSEGATE_H
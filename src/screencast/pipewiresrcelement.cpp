@@ -0,0 +1,1072 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+/*
+ * A minimal PipeWire video source, used instead of pipewiresrc for
+ * every stream.
+ *
+ * Frames are not copied, every GstBuffer wraps the memfd or memory
+ * PipeWire mapped and the PipeWire buffer is given back when the last
+ * reference to that memory goes away. Only the latest frame is kept,
+ * older ones are returned right away.
+ *
+ * Unlike pipewiresrc it asks for the SPA_META_Cursor metadata, so the
+ * cursor can be sent as metadata, and it records part of a stream by
+ * pointing the buffer at the region, so only its pixels are compared,
+ * converted and encoded.
+ */
+
+#include <QtGlobal>
+
+#include "cursormeta.h"
+#include "pipewiresrcelement.h"
+
+#include <gst/video/video.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/buffer/meta.h>
+#include <spa/param/video/format-utils.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Largest cursor image accepted from the compositor
+static const int maxCursorSize = 256;
+// Damage rectangles per frame
+static const int maxDamageRegions = 16;
+
+enum {
+    PROP_0,
+    PROP_FD,
+    PROP_PATH,
+    PROP_CURSOR,
+    PROP_CROP_X,
+    PROP_CROP_Y,
+    PROP_CROP_WIDTH,
+    PROP_CROP_HEIGHT,
+    PROP_KEEPALIVE_TIME,
+    PROP_MIN_BUFFERS,
+    PROP_MAX_BUFFERS
+};
+
+struct _ScreencastPipeWireSrc;
+
+// PipeWire objects, outliving the element while frames are in flight
+struct Connection {
+    gint refCount = 1;
+    pw_thread_loop *loop = nullptr;
+    pw_context *context = nullptr;
+    pw_core *core = nullptr;
+    pw_stream *stream = nullptr;
+    spa_hook coreListener = {};
+    spa_hook streamListener = {};
+    // Cleared with the loop locked when the element stops
+    _ScreencastPipeWireSrc *src = nullptr;
+};
+
+struct MappedFrame {
+    Connection *connection;
+    pw_buffer *buffer;
+};
+
+struct _ScreencastPipeWireSrc
+{
+    GstPushSrc parent;
+
+    gint fd;
+    gchar *path;
+    gboolean cursor;
+    gint cropX;
+    gint cropY;
+    gint cropWidth;
+    gint cropHeight;
+    gint keepaliveTime;
+    gint minBuffers;
+    gint maxBuffers;
+
+    Connection *connection;
+
+    // Shared with the PipeWire thread
+    GMutex lock;
+    GCond cond;
+    gboolean flushing;
+    gboolean failed;
+    gchar *errorMessage;
+    GstVideoInfo info;
+    gboolean capsChanged;
+    // Part of the frames that is sent downstream
+    gint outputX;
+    gint outputY;
+    gint outputWidth;
+    gint outputHeight;
+    GstBuffer *pending;
+    GstBuffer *last;
+
+    // Cursor as of the latest PipeWire buffer
+    gboolean cursorChanged;
+    gboolean cursorVisible;
+    gint cursorX;
+    gint cursorY;
+    guint cursorSerial;
+    GstBuffer *cursorImage;
+    guint cursorWidth;
+    guint cursorHeight;
+};
+
+G_DEFINE_TYPE(ScreencastPipeWireSrc, screencast_pipewire_src, GST_TYPE_PUSH_SRC)
+
+#define FORMATS "{ BGRx, BGRA, RGBx, RGBA, xRGB, ARGB, xBGR, ABGR }"
+
+static GstStaticPadTemplate srcTemplate =
+        GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static GstVideoFormat video_format(uint32_t format)
+{
+    switch (format) {
+    case SPA_VIDEO_FORMAT_BGRx:
+        return GST_VIDEO_FORMAT_BGRx;
+    case SPA_VIDEO_FORMAT_BGRA:
+        return GST_VIDEO_FORMAT_BGRA;
+    case SPA_VIDEO_FORMAT_RGBx:
+        return GST_VIDEO_FORMAT_RGBx;
+    case SPA_VIDEO_FORMAT_RGBA:
+        return GST_VIDEO_FORMAT_RGBA;
+    case SPA_VIDEO_FORMAT_xRGB:
+        return GST_VIDEO_FORMAT_xRGB;
+    case SPA_VIDEO_FORMAT_ARGB:
+        return GST_VIDEO_FORMAT_ARGB;
+    case SPA_VIDEO_FORMAT_xBGR:
+        return GST_VIDEO_FORMAT_xBGR;
+    case SPA_VIDEO_FORMAT_ABGR:
+        return GST_VIDEO_FORMAT_ABGR;
+    default:
+        break;
+    }
+
+    return GST_VIDEO_FORMAT_UNKNOWN;
+}
+
+static int cursor_meta_size(int width, int height)
+{
+    return int(sizeof(spa_meta_cursor) + sizeof(spa_meta_bitmap)) + width * height * 4;
+}
+
+static GstClockTime running_time(ScreencastPipeWireSrc *self)
+{
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT(self));
+    if (!clock)
+        return GST_CLOCK_TIME_NONE;
+
+    const GstClockTime now = gst_clock_get_time(clock);
+    const GstClockTime baseTime = gst_element_get_base_time(GST_ELEMENT(self));
+    gst_object_unref(clock);
+    return now >= baseTime ? now - baseTime : GST_CLOCK_TIME_NONE;
+}
+
+static void fail(ScreencastPipeWireSrc *self, const char *message)
+{
+    g_mutex_lock(&self->lock);
+    if (!self->failed) {
+        self->failed = TRUE;
+        self->errorMessage = g_strdup(message ? message : "unknown error");
+    }
+    g_cond_broadcast(&self->cond);
+    g_mutex_unlock(&self->lock);
+}
+
+/*
+ * Connection
+ */
+
+static Connection *connection_ref(Connection *connection)
+{
+    g_atomic_int_inc(&connection->refCount);
+    return connection;
+}
+
+static void connection_unref(Connection *connection)
+{
+    if (!g_atomic_int_dec_and_test(&connection->refCount))
+        return;
+
+    // Never called from the PipeWire thread: the stream is inactive
+    // by the time the element lets go of its reference
+    if (connection->loop)
+        pw_thread_loop_stop(connection->loop);
+    if (connection->stream)
+        pw_stream_destroy(connection->stream);
+    if (connection->core)
+        pw_core_disconnect(connection->core);
+    if (connection->context)
+        pw_context_destroy(connection->context);
+    if (connection->loop)
+        pw_thread_loop_destroy(connection->loop);
+    delete connection;
+}
+
+static void frame_released(gpointer data)
+{
+    MappedFrame *frame = static_cast<MappedFrame *>(data);
+    Connection *connection = frame->connection;
+
+    // The loop lock is recursive, this also runs on the PipeWire
+    // thread when a pending frame is replaced by a newer one
+    pw_thread_loop_lock(connection->loop);
+    pw_stream_queue_buffer(connection->stream, frame->buffer);
+    pw_thread_loop_unlock(connection->loop);
+
+    connection_unref(connection);
+    g_free(frame);
+}
+
+/*
+ * PipeWire callbacks, called on the PipeWire thread with the loop locked
+ */
+
+static GstBuffer *convert_cursor_bitmap(const spa_meta_bitmap *bitmap)
+{
+    const int width = int(bitmap->size.width);
+    const int height = int(bitmap->size.height);
+    const int stride = bitmap->stride > 0 ? bitmap->stride : width * 4;
+
+    // Index of the blue, green, red and alpha bytes
+    int order[4];
+    switch (bitmap->format) {
+    case SPA_VIDEO_FORMAT_BGRA:
+        order[0] = 0; order[1] = 1; order[2] = 2; order[3] = 3;
+        break;
+    case SPA_VIDEO_FORMAT_RGBA:
+        order[0] = 2; order[1] = 1; order[2] = 0; order[3] = 3;
+        break;
+    case SPA_VIDEO_FORMAT_ARGB:
+        order[0] = 3; order[1] = 2; order[2] = 1; order[3] = 0;
+        break;
+    case SPA_VIDEO_FORMAT_ABGR:
+        order[0] = 1; order[1] = 2; order[2] = 3; order[3] = 0;
+        break;
+    default:
+        return nullptr;
+    }
+
+    GstBuffer *image = gst_buffer_new_allocate(nullptr, gsize(width) * gsize(height) * 4, nullptr);
+    GstMapInfo map;
+    if (!gst_buffer_map(image, &map, GST_MAP_WRITE)) {
+        gst_buffer_unref(image);
+        return nullptr;
+    }
+
+    const uint8_t *pixels = SPA_PTROFF(bitmap, bitmap->offset, const uint8_t);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *src = pixels + y * stride;
+        uint8_t *dst = map.data + y * width * 4;
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < 4; ++c)
+                dst[x * 4 + c] = src[x * 4 + order[c]];
+        }
+    }
+
+    gst_buffer_unmap(image, &map);
+    return image;
+}
+
+static bool read_cursor(ScreencastPipeWireSrc *self, pw_buffer *buffer)
+{
+    auto *cursor = static_cast<spa_meta_cursor *>(
+                spa_buffer_find_meta_data(buffer->buffer, SPA_META_Cursor, sizeof(spa_meta_cursor)));
+    // An id of 0 means there's nothing new
+    if (!cursor || !spa_meta_cursor_is_valid(cursor))
+        return false;
+
+    // Without a bitmap the image didn't change, an empty one hides the cursor
+    GstBuffer *image = nullptr;
+    guint width = 0, height = 0;
+    bool hidden = false;
+    if (cursor->bitmap_offset >= sizeof(spa_meta_cursor)) {
+        auto *bitmap = SPA_PTROFF(cursor, cursor->bitmap_offset, spa_meta_bitmap);
+        width = bitmap->size.width;
+        height = bitmap->size.height;
+        if (width == 0 || height == 0)
+            hidden = true;
+        else if (bitmap->offset >= sizeof(spa_meta_bitmap) &&
+                 int(width) <= maxCursorSize && int(height) <= maxCursorSize)
+            image = convert_cursor_bitmap(bitmap);
+    }
+
+    g_mutex_lock(&self->lock);
+    if (image) {
+        if (self->cursorImage)
+            gst_buffer_unref(self->cursorImage);
+        self->cursorImage = image;
+        self->cursorWidth = width;
+        self->cursorHeight = height;
+        self->cursorSerial++;
+    }
+    self->cursorVisible = !hidden;
+    self->cursorX = cursor->position.x - cursor->hotspot.x;
+    self->cursorY = cursor->position.y - cursor->hotspot.y;
+    self->cursorChanged = TRUE;
+    g_mutex_unlock(&self->lock);
+
+    return true;
+}
+
+// Part of the frame to record, in frame coordinates
+static GstVideoRectangle crop_rect(ScreencastPipeWireSrc *self, spa_buffer *buffer, int width, int height)
+{
+    GstVideoRectangle rect = { 0, 0, width, height };
+
+    // Window streams are usually cropped by the compositor
+    auto *crop = static_cast<spa_meta_region *>(
+                spa_buffer_find_meta_data(buffer, SPA_META_VideoCrop, sizeof(spa_meta_region)));
+    if (crop && spa_meta_region_is_valid(crop)) {
+        rect.x = crop->region.position.x;
+        rect.y = crop->region.position.y;
+        rect.w = int(crop->region.size.width);
+        rect.h = int(crop->region.size.height);
+    }
+
+    // The region asked for is relative to what the compositor sends
+    if (self->cropWidth > 0 && self->cropHeight > 0) {
+        rect.x += self->cropX;
+        rect.y += self->cropY;
+        rect.w = qMin(rect.w - self->cropX, self->cropWidth);
+        rect.h = qMin(rect.h - self->cropY, self->cropHeight);
+    }
+
+    const int x0 = qBound(0, rect.x, width);
+    const int y0 = qBound(0, rect.y, height);
+    const int x1 = qBound(0, rect.x + rect.w, width);
+    const int y1 = qBound(0, rect.y + rect.h, height);
+
+    // Even coordinates and size, for 4:2:0 chroma
+    rect.x = x0 & ~1;
+    rect.y = y0 & ~1;
+    rect.w = (x1 - rect.x) & ~1;
+    rect.h = (y1 - rect.y) & ~1;
+    return rect;
+}
+
+static GstBuffer *wrap_frame(ScreencastPipeWireSrc *self, Connection *connection, pw_buffer *frame)
+{
+    spa_buffer *buffer = frame->buffer;
+    spa_data *data = &buffer->datas[0];
+
+    g_mutex_lock(&self->lock);
+    const GstVideoInfo info = self->info;
+    g_mutex_unlock(&self->lock);
+
+    const int width = GST_VIDEO_INFO_WIDTH(&info);
+    const int height = GST_VIDEO_INFO_HEIGHT(&info);
+    const int stride = data->chunk->stride > 0 ? data->chunk->stride : GST_VIDEO_INFO_PLANE_STRIDE(&info, 0);
+    const GstVideoRectangle rect = crop_rect(self, buffer, width, height);
+    if (rect.w <= 0 || rect.h <= 0)
+        return nullptr;
+
+    // Cropping only moves the start of the memory, nothing is copied
+    const gsize offset = gsize(data->chunk->offset) + gsize(rect.y) * gsize(stride) + gsize(rect.x) * 4;
+    const gsize size = gsize(rect.h - 1) * gsize(stride) + gsize(rect.w) * 4;
+    if (offset > data->maxsize || size > data->maxsize - offset)
+        return nullptr;
+
+    MappedFrame *mapped = g_new(MappedFrame, 1);
+    mapped->connection = connection_ref(connection);
+    mapped->buffer = frame;
+    GstMemory *memory = gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY, data->data, data->maxsize,
+                                               offset, size, mapped, frame_released);
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(memory), g_quark_from_static_string(SCREENCAST_MAPPED_MEMORY_QUARK),
+                              GINT_TO_POINTER(1), nullptr);
+
+    GstBuffer *result = gst_buffer_new();
+    gst_buffer_append_memory(result, memory);
+
+    gsize offsets[GST_VIDEO_MAX_PLANES] = { 0 };
+    gint strides[GST_VIDEO_MAX_PLANES] = { stride };
+    gst_buffer_add_video_meta_full(result, GST_VIDEO_FRAME_FLAG_NONE, GST_VIDEO_INFO_FORMAT(&info),
+                                   guint(rect.w), guint(rect.h), 1, offsets, strides);
+
+    // Damage is passed on as regions of interest, as pipewiresrc does
+    spa_meta *damage = spa_buffer_find_meta(buffer, SPA_META_VideoDamage);
+    if (damage) {
+        spa_meta_region *region;
+        spa_meta_for_each(region, damage) {
+            if (!spa_meta_region_is_valid(region))
+                break;
+            const int x0 = qMax(region->region.position.x, rect.x);
+            const int y0 = qMax(region->region.position.y, rect.y);
+            const int x1 = qMin(region->region.position.x + int(region->region.size.width), rect.x + rect.w);
+            const int y1 = qMin(region->region.position.y + int(region->region.size.height), rect.y + rect.h);
+            if (x1 <= x0 || y1 <= y0)
+                continue;
+            gst_buffer_add_video_region_of_interest_meta(result, "damage", guint(x0 - rect.x), guint(y0 - rect.y),
+                                                         guint(x1 - x0), guint(y1 - y0));
+        }
+    }
+
+    g_mutex_lock(&self->lock);
+    if (rect.w != self->outputWidth || rect.h != self->outputHeight) {
+        self->outputWidth = rect.w;
+        self->outputHeight = rect.h;
+        self->capsChanged = TRUE;
+    }
+    self->outputX = rect.x;
+    self->outputY = rect.y;
+    g_mutex_unlock(&self->lock);
+
+    GST_BUFFER_PTS(result) = running_time(self);
+    return result;
+}
+
+static void on_process(void *data)
+{
+    Connection *connection = static_cast<Connection *>(data);
+    ScreencastPipeWireSrc *self = connection->src;
+    if (!self)
+        return;
+
+    // Only the latest frame matters, cursor updates come with every buffer
+    pw_buffer *frame = nullptr;
+    bool cursorChanged = false;
+    while (pw_buffer *buffer = pw_stream_dequeue_buffer(connection->stream)) {
+        if (self->cursor && read_cursor(self, buffer))
+            cursorChanged = true;
+
+        const spa_buffer *spaBuffer = buffer->buffer;
+        const bool hasFrame = spaBuffer->n_datas > 0 && spaBuffer->datas[0].data &&
+                spaBuffer->datas[0].chunk->size > 0 &&
+                !(spaBuffer->datas[0].chunk->flags & SPA_CHUNK_FLAG_CORRUPTED);
+        if (!hasFrame) {
+            // Cursor only update
+            pw_stream_queue_buffer(connection->stream, buffer);
+            continue;
+        }
+
+        if (frame)
+            pw_stream_queue_buffer(connection->stream, frame);
+        frame = buffer;
+    }
+
+    GstBuffer *buffer = nullptr;
+    if (frame) {
+        buffer = wrap_frame(self, connection, frame);
+        if (!buffer)
+            pw_stream_queue_buffer(connection->stream, frame);
+    }
+
+    if (!buffer && !cursorChanged)
+        return;
+
+    GstBuffer *dropped = nullptr;
+    g_mutex_lock(&self->lock);
+    if (buffer) {
+        dropped = self->pending;
+        self->pending = buffer;
+    }
+    g_cond_signal(&self->cond);
+    g_mutex_unlock(&self->lock);
+
+    if (dropped)
+        gst_buffer_unref(dropped);
+}
+
+static void on_param_changed(void *data, uint32_t id, const spa_pod *param)
+{
+    Connection *connection = static_cast<Connection *>(data);
+    ScreencastPipeWireSrc *self = connection->src;
+    if (!self || !param || id != SPA_PARAM_Format)
+        return;
+
+    uint32_t mediaType = 0, mediaSubtype = 0;
+    if (spa_format_parse(param, &mediaType, &mediaSubtype) < 0 ||
+            mediaType != SPA_MEDIA_TYPE_video || mediaSubtype != SPA_MEDIA_SUBTYPE_raw)
+        return;
+
+    spa_video_info_raw raw;
+    spa_zero(raw);
+    if (spa_format_video_raw_parse(param, &raw) < 0)
+        return;
+
+    const GstVideoFormat format = video_format(raw.format);
+    if (format == GST_VIDEO_FORMAT_UNKNOWN) {
+        pw_stream_set_error(connection->stream, -EINVAL, "unsupported video format");
+        return;
+    }
+
+    GstVideoInfo info;
+    gst_video_info_set_format(&info, format, raw.size.width, raw.size.height);
+    // Variable framerate streams have a framerate of 0/1
+    GST_VIDEO_INFO_FPS_N(&info) = int(raw.framerate.num);
+    GST_VIDEO_INFO_FPS_D(&info) = int(qMax(1u, raw.framerate.denom));
+
+    g_mutex_lock(&self->lock);
+    self->info = info;
+    self->capsChanged = TRUE;
+    g_mutex_unlock(&self->lock);
+
+    const int stride = GST_VIDEO_INFO_PLANE_STRIDE(&info, 0);
+    const int size = stride * int(raw.size.height);
+    const int minBuffers = qMax(1, self->minBuffers);
+    const int maxBuffers = qMax(minBuffers, self->maxBuffers);
+
+    uint8_t buffer[1024];
+    spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const spa_pod *params[5];
+    uint32_t count = 0;
+
+    params[count++] = static_cast<const spa_pod *>(spa_pod_builder_add_object(
+                &builder, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(maxBuffers, minBuffers, maxBuffers),
+                SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+                SPA_PARAM_BUFFERS_size, SPA_POD_CHOICE_RANGE_Int(size, size, INT32_MAX),
+                SPA_PARAM_BUFFERS_stride, SPA_POD_CHOICE_RANGE_Int(stride, stride, INT32_MAX),
+                SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int((1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr))));
+    params[count++] = static_cast<const spa_pod *>(spa_pod_builder_add_object(
+                &builder, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+                SPA_PARAM_META_size, SPA_POD_Int(sizeof(spa_meta_header))));
+    params[count++] = static_cast<const spa_pod *>(spa_pod_builder_add_object(
+                &builder, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+                SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(int(sizeof(spa_meta_region)) * maxDamageRegions,
+                                                              int(sizeof(spa_meta_region)),
+                                                              int(sizeof(spa_meta_region)) * maxDamageRegions)));
+    params[count++] = static_cast<const spa_pod *>(spa_pod_builder_add_object(
+                &builder, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop),
+                SPA_PARAM_META_size, SPA_POD_Int(sizeof(spa_meta_region))));
+    if (self->cursor) {
+        params[count++] = static_cast<const spa_pod *>(spa_pod_builder_add_object(
+                    &builder, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                    SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+                    SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(cursor_meta_size(64, 64),
+                                                                  cursor_meta_size(1, 1),
+                                                                  cursor_meta_size(maxCursorSize, maxCursorSize))));
+    }
+
+    pw_stream_update_params(connection->stream, params, count);
+}
+
+static void on_state_changed(void *data, pw_stream_state old, pw_stream_state state, const char *error)
+{
+    Q_UNUSED(old)
+
+    Connection *connection = static_cast<Connection *>(data);
+    if (state == PW_STREAM_STATE_ERROR && connection->src)
+        fail(connection->src, error);
+}
+
+static void on_core_error(void *data, uint32_t id, int seq, int res, const char *message)
+{
+    Q_UNUSED(seq)
+    Q_UNUSED(res)
+
+    Connection *connection = static_cast<Connection *>(data);
+    if (id == PW_ID_CORE && connection->src)
+        fail(connection->src, message);
+}
+
+static const pw_stream_events streamEvents = [] {
+    pw_stream_events events = {};
+    events.version = PW_VERSION_STREAM_EVENTS;
+    events.state_changed = on_state_changed;
+    events.param_changed = on_param_changed;
+    events.process = on_process;
+    return events;
+}();
+
+static const pw_core_events coreEvents = [] {
+    pw_core_events events = {};
+    events.version = PW_VERSION_CORE_EVENTS;
+    events.error = on_core_error;
+    return events;
+}();
+
+/*
+ * GstBaseSrc
+ */
+
+static gboolean screencast_pipewire_src_start(GstBaseSrc *src)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(src);
+
+    static gsize initialized = 0;
+    if (g_once_init_enter(&initialized)) {
+        pw_init(nullptr, nullptr);
+        g_once_init_leave(&initialized, 1);
+    }
+
+    Connection *connection = new Connection();
+    connection->src = self;
+    connection->loop = pw_thread_loop_new("screencast-pw", nullptr);
+    if (connection->loop)
+        connection->context = pw_context_new(pw_thread_loop_get_loop(connection->loop), nullptr, 0);
+    if (!connection->context || pw_thread_loop_start(connection->loop) < 0) {
+        GST_ELEMENT_ERROR(self, RESOURCE, FAILED, ("Unable to start the PipeWire thread"), (nullptr));
+        connection_unref(connection);
+        return FALSE;
+    }
+
+    pw_thread_loop_lock(connection->loop);
+
+    // The core takes ownership of the descriptor
+    connection->core = self->fd >= 0
+            ? pw_context_connect_fd(connection->context, fcntl(self->fd, F_DUPFD_CLOEXEC, 3), nullptr, 0)
+            : pw_context_connect(connection->context, nullptr, 0);
+    int result = -EIO;
+    if (connection->core) {
+        pw_core_add_listener(connection->core, &connection->coreListener, &coreEvents, connection);
+
+        connection->stream = pw_stream_new(connection->core, "liri-screencast",
+                                           pw_properties_new(PW_KEY_MEDIA_TYPE, "Video",
+                                                             PW_KEY_MEDIA_CATEGORY, "Capture",
+                                                             PW_KEY_MEDIA_ROLE, "Screen",
+                                                             nullptr));
+        pw_stream_add_listener(connection->stream, &connection->streamListener, &streamEvents, connection);
+
+        // Formats screencastconvert has a fast path for, at any size and rate
+        uint8_t buffer[1024];
+        spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+        spa_rectangle size = { 1920, 1080 };
+        spa_rectangle minSize = { 1, 1 };
+        spa_rectangle maxSize = { 16384, 16384 };
+        spa_fraction rate = { 0, 1 };
+        spa_fraction minRate = { 0, 1 };
+        spa_fraction maxRate = { 1000, 1 };
+        const spa_pod *params[1];
+        params[0] = static_cast<const spa_pod *>(spa_pod_builder_add_object(
+                    &builder, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+                    SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+                    SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+                    SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(9,
+                                                                    SPA_VIDEO_FORMAT_BGRx,
+                                                                    SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_BGRA,
+                                                                    SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_RGBA,
+                                                                    SPA_VIDEO_FORMAT_xRGB, SPA_VIDEO_FORMAT_ARGB,
+                                                                    SPA_VIDEO_FORMAT_xBGR, SPA_VIDEO_FORMAT_ABGR),
+                    SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(&size, &minSize, &maxSize),
+                    SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(&rate, &minRate, &maxRate)));
+
+        const uint32_t target = self->path ? uint32_t(g_ascii_strtoull(self->path, nullptr, 10)) : PW_ID_ANY;
+        result = pw_stream_connect(connection->stream, PW_DIRECTION_INPUT, target,
+                                   pw_stream_flags(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS),
+                                   params, 1);
+    }
+
+    pw_thread_loop_unlock(connection->loop);
+
+    if (result < 0) {
+        GST_ELEMENT_ERROR(self, RESOURCE, OPEN_READ, ("Unable to connect to PipeWire node %s", self->path),
+                          ("%s", g_strerror(-result)));
+        g_mutex_lock(&self->lock);
+        connection->src = nullptr;
+        g_mutex_unlock(&self->lock);
+        connection_unref(connection);
+        return FALSE;
+    }
+
+    self->connection = connection;
+    return TRUE;
+}
+
+static gboolean screencast_pipewire_src_stop(GstBaseSrc *src)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(src);
+
+    Connection *connection = self->connection;
+    self->connection = nullptr;
+    if (connection) {
+        // No more callbacks, buffers still in flight are returned
+        // to the inactive stream and freed with the last of them
+        pw_thread_loop_lock(connection->loop);
+        connection->src = nullptr;
+        if (connection->stream)
+            pw_stream_set_active(connection->stream, false);
+        pw_thread_loop_unlock(connection->loop);
+    }
+
+    g_mutex_lock(&self->lock);
+    GstBuffer *pending = self->pending;
+    GstBuffer *last = self->last;
+    GstBuffer *cursorImage = self->cursorImage;
+    self->pending = nullptr;
+    self->last = nullptr;
+    self->cursorImage = nullptr;
+    self->failed = FALSE;
+    g_free(self->errorMessage);
+    self->errorMessage = nullptr;
+    gst_video_info_init(&self->info);
+    self->capsChanged = FALSE;
+    self->outputX = 0;
+    self->outputY = 0;
+    self->outputWidth = 0;
+    self->outputHeight = 0;
+    self->cursorChanged = FALSE;
+    self->cursorVisible = FALSE;
+    g_mutex_unlock(&self->lock);
+
+    if (pending)
+        gst_buffer_unref(pending);
+    if (last)
+        gst_buffer_unref(last);
+    if (cursorImage)
+        gst_buffer_unref(cursorImage);
+
+    if (connection)
+        connection_unref(connection);
+
+    return TRUE;
+}
+
+static gboolean screencast_pipewire_src_negotiate(GstBaseSrc *src)
+{
+    Q_UNUSED(src)
+
+    // Caps are set from the format PipeWire negotiated, with the first frame
+    return TRUE;
+}
+
+static gboolean screencast_pipewire_src_unlock(GstBaseSrc *src)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(src);
+
+    g_mutex_lock(&self->lock);
+    self->flushing = TRUE;
+    g_cond_broadcast(&self->cond);
+    g_mutex_unlock(&self->lock);
+
+    return TRUE;
+}
+
+static gboolean screencast_pipewire_src_unlock_stop(GstBaseSrc *src)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(src);
+
+    g_mutex_lock(&self->lock);
+    self->flushing = FALSE;
+    g_mutex_unlock(&self->lock);
+
+    return TRUE;
+}
+
+static GstFlowReturn screencast_pipewire_src_create(GstPushSrc *psrc, GstBuffer **outbuf)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(psrc);
+
+    g_mutex_lock(&self->lock);
+
+    // Static screens: send the last frame again after the keepalive time
+    const gint64 deadline = self->keepaliveTime > 0
+            ? g_get_monotonic_time() + gint64(self->keepaliveTime) * G_TIME_SPAN_MILLISECOND : 0;
+    while (!self->flushing && !self->failed && !self->pending && !(self->cursorChanged && self->last)) {
+        if (deadline > 0 && self->last) {
+            if (!g_cond_wait_until(&self->cond, &self->lock, deadline))
+                break;
+        } else {
+            g_cond_wait(&self->cond, &self->lock);
+        }
+    }
+
+    if (self->flushing) {
+        g_mutex_unlock(&self->lock);
+        return GST_FLOW_FLUSHING;
+    }
+    if (self->failed) {
+        g_mutex_unlock(&self->lock);
+        GST_ELEMENT_ERROR(self, RESOURCE, READ, ("PipeWire stream failed"), ("%s", self->errorMessage));
+        return GST_FLOW_ERROR;
+    }
+
+    GstBuffer *buffer = nullptr;
+    if (self->pending) {
+        buffer = self->pending;
+        self->pending = nullptr;
+    } else {
+        // Same picture with a new timestamp, or a new cursor position
+        buffer = gst_buffer_copy(self->last);
+        GST_BUFFER_PTS(buffer) = running_time(self);
+        gpointer state = nullptr;
+        GstMeta *meta;
+        while ((meta = gst_buffer_iterate_meta_filtered(buffer, &state, GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE))) {
+            gst_buffer_remove_meta(buffer, meta);
+            state = nullptr;
+        }
+        // Nothing was damaged: an empty region lets the deduplicator
+        // tell this apart from a frame without damage information
+        gst_buffer_add_video_region_of_interest_meta(buffer, "damage", 0, 0, 0, 0);
+    }
+
+    if (self->cursor) {
+        if (ScreencastCursorMeta *meta = screencast_buffer_get_cursor_meta(buffer))
+            gst_buffer_remove_meta(buffer, &meta->meta);
+        screencast_buffer_add_cursor_meta(buffer, self->cursorVisible,
+                                          self->cursorX - self->outputX, self->cursorY - self->outputY,
+                                          self->cursorSerial, self->cursorImage,
+                                          self->cursorWidth, self->cursorHeight);
+    }
+    self->cursorChanged = FALSE;
+
+    if (self->last)
+        gst_buffer_unref(self->last);
+    self->last = gst_buffer_ref(buffer);
+
+    const gboolean capsChanged = self->capsChanged;
+    GstVideoInfo info = self->info;
+    gst_video_info_set_format(&info, GST_VIDEO_INFO_FORMAT(&self->info), guint(self->outputWidth),
+                              guint(self->outputHeight));
+    GST_VIDEO_INFO_FPS_N(&info) = GST_VIDEO_INFO_FPS_N(&self->info);
+    GST_VIDEO_INFO_FPS_D(&info) = GST_VIDEO_INFO_FPS_D(&self->info);
+    self->capsChanged = FALSE;
+
+    g_mutex_unlock(&self->lock);
+
+    if (capsChanged) {
+        GstCaps *caps = gst_video_info_to_caps(&info);
+        const gboolean negotiated = gst_base_src_set_caps(GST_BASE_SRC(self), caps);
+        gst_caps_unref(caps);
+        if (!negotiated) {
+            gst_buffer_unref(buffer);
+            return GST_FLOW_NOT_NEGOTIATED;
+        }
+    }
+
+    *outbuf = buffer;
+    return GST_FLOW_OK;
+}
+
+/*
+ * GObject
+ */
+
+static void screencast_pipewire_src_set_property(GObject *object, guint propId,
+                                                 const GValue *value, GParamSpec *pspec)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(object);
+
+    switch (propId) {
+    case PROP_FD:
+        self->fd = g_value_get_int(value);
+        break;
+    case PROP_PATH:
+        g_free(self->path);
+        self->path = g_value_dup_string(value);
+        break;
+    case PROP_CURSOR:
+        self->cursor = g_value_get_boolean(value);
+        break;
+    case PROP_CROP_X:
+        self->cropX = g_value_get_int(value);
+        break;
+    case PROP_CROP_Y:
+        self->cropY = g_value_get_int(value);
+        break;
+    case PROP_CROP_WIDTH:
+        self->cropWidth = g_value_get_int(value);
+        break;
+    case PROP_CROP_HEIGHT:
+        self->cropHeight = g_value_get_int(value);
+        break;
+    case PROP_KEEPALIVE_TIME:
+        g_mutex_lock(&self->lock);
+        self->keepaliveTime = g_value_get_int(value);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_MIN_BUFFERS:
+        self->minBuffers = g_value_get_int(value);
+        break;
+    case PROP_MAX_BUFFERS:
+        self->maxBuffers = g_value_get_int(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_pipewire_src_get_property(GObject *object, guint propId,
+                                                 GValue *value, GParamSpec *pspec)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(object);
+
+    switch (propId) {
+    case PROP_FD:
+        g_value_set_int(value, self->fd);
+        break;
+    case PROP_PATH:
+        g_value_set_string(value, self->path);
+        break;
+    case PROP_CURSOR:
+        g_value_set_boolean(value, self->cursor);
+        break;
+    case PROP_CROP_X:
+        g_value_set_int(value, self->cropX);
+        break;
+    case PROP_CROP_Y:
+        g_value_set_int(value, self->cropY);
+        break;
+    case PROP_CROP_WIDTH:
+        g_value_set_int(value, self->cropWidth);
+        break;
+    case PROP_CROP_HEIGHT:
+        g_value_set_int(value, self->cropHeight);
+        break;
+    case PROP_KEEPALIVE_TIME:
+        g_mutex_lock(&self->lock);
+        g_value_set_int(value, self->keepaliveTime);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_MIN_BUFFERS:
+        g_value_set_int(value, self->minBuffers);
+        break;
+    case PROP_MAX_BUFFERS:
+        g_value_set_int(value, self->maxBuffers);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_pipewire_src_finalize(GObject *object)
+{
+    ScreencastPipeWireSrc *self = SCREENCAST_PIPEWIRE_SRC(object);
+
+    g_free(self->path);
+    self->path = nullptr;
+    g_free(self->errorMessage);
+    self->errorMessage = nullptr;
+    g_mutex_clear(&self->lock);
+    g_cond_clear(&self->cond);
+
+    G_OBJECT_CLASS(screencast_pipewire_src_parent_class)->finalize(object);
+}
+
+static void screencast_pipewire_src_class_init(ScreencastPipeWireSrcClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseSrcClass *baseSrcClass = GST_BASE_SRC_CLASS(klass);
+    GstPushSrcClass *pushSrcClass = GST_PUSH_SRC_CLASS(klass);
+
+    objectClass->set_property = screencast_pipewire_src_set_property;
+    objectClass->get_property = screencast_pipewire_src_get_property;
+    objectClass->finalize = screencast_pipewire_src_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_FD,
+                g_param_spec_int("fd", "File descriptor",
+                                 "PipeWire remote opened by the portal (-1 = default remote)",
+                                 -1, G_MAXINT, -1,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_PATH,
+                g_param_spec_string("path", "Path",
+                                    "Id of the node to record",
+                                    nullptr,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_CURSOR,
+                g_param_spec_boolean("cursor", "Cursor",
+                                     "Ask for the cursor as metadata and attach it to the frames",
+                                     FALSE,
+                                     GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_CROP_X,
+                g_param_spec_int("crop-x", "Crop X",
+                                 "Left edge of the region to record",
+                                 0, G_MAXINT, 0,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_CROP_Y,
+                g_param_spec_int("crop-y", "Crop Y",
+                                 "Top edge of the region to record",
+                                 0, G_MAXINT, 0,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_CROP_WIDTH,
+                g_param_spec_int("crop-width", "Crop width",
+                                 "Width of the region to record (0 = whole frame)",
+                                 0, G_MAXINT, 0,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_CROP_HEIGHT,
+                g_param_spec_int("crop-height", "Crop height",
+                                 "Height of the region to record (0 = whole frame)",
+                                 0, G_MAXINT, 0,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_KEEPALIVE_TIME,
+                g_param_spec_int("keepalive-time", "Keepalive time",
+                                 "Send the last frame again after this many milliseconds (0 = never)",
+                                 0, G_MAXINT, 0,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_MIN_BUFFERS,
+                g_param_spec_int("min-buffers", "Minimum buffers",
+                                 "Minimum number of buffers to negotiate with PipeWire",
+                                 1, G_MAXINT, 4,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_MAX_BUFFERS,
+                g_param_spec_int("max-buffers", "Maximum buffers",
+                                 "Maximum number of buffers to negotiate with PipeWire",
+                                 1, G_MAXINT, 8,
+                                 GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast PipeWire source",
+                                          "Source/Video",
+                                          "Records a PipeWire video node, or part of it, with the cursor as metadata",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &srcTemplate);
+
+    baseSrcClass->start = screencast_pipewire_src_start;
+    baseSrcClass->stop = screencast_pipewire_src_stop;
+    baseSrcClass->negotiate = screencast_pipewire_src_negotiate;
+    baseSrcClass->unlock = screencast_pipewire_src_unlock;
+    baseSrcClass->unlock_stop = screencast_pipewire_src_unlock_stop;
+    pushSrcClass->create = screencast_pipewire_src_create;
+}
+
+static void screencast_pipewire_src_init(ScreencastPipeWireSrc *self)
+{
+    self->fd = -1;
+    self->path = nullptr;
+    self->cursor = FALSE;
+    self->cropX = 0;
+    self->cropY = 0;
+    self->cropWidth = 0;
+    self->cropHeight = 0;
+    self->keepaliveTime = 0;
+    self->minBuffers = 4;
+    self->maxBuffers = 8;
+    self->connection = nullptr;
+
+    g_mutex_init(&self->lock);
+    g_cond_init(&self->cond);
+    self->flushing = FALSE;
+    self->failed = FALSE;
+    self->errorMessage = nullptr;
+    gst_video_info_init(&self->info);
+    self->capsChanged = FALSE;
+    self->outputX = 0;
+    self->outputY = 0;
+    self->outputWidth = 0;
+    self->outputHeight = 0;
+    self->pending = nullptr;
+    self->last = nullptr;
+
+    self->cursorChanged = FALSE;
+    self->cursorVisible = FALSE;
+    self->cursorX = 0;
+    self->cursorY = 0;
+    self->cursorSerial = 0;
+    self->cursorImage = nullptr;
+    self->cursorWidth = 0;
+    self->cursorHeight = 0;
+
+    gst_base_src_set_live(GST_BASE_SRC(self), TRUE);
+    gst_base_src_set_format(GST_BASE_SRC(self), GST_FORMAT_TIME);
+}
@@ -0,0 +1,22 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef PIPEWIRESRCELEMENT_H
+#define PIPEWIRESRCELEMENT_H
+
+#include <gst/base/gstpushsrc.h>
+
+G_BEGIN_DECLS
+
+// Set on memory mapped straight from a PipeWire buffer
+#define SCREENCAST_MAPPED_MEMORY_QUARK "screencast-mapped-memory"
+
+#define SCREENCAST_TYPE_PIPEWIRE_SRC (screencast_pipewire_src_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastPipeWireSrc, screencast_pipewire_src, SCREENCAST, PIPEWIRE_SRC, GstPushSrc)
+
+G_END_DECLS
+
+#endif // PIPEWIRESRCELEMENT_H
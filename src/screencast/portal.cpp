@@ -9,9 +9,15 @@
 #include <QDBusPendingReply>
 #include <QDBusMessage>
 #include <QDBusUnixFileDescriptor>
+#include <QDBusVariant>
+#include <QSettings>
 
 #include "portal.h"
 #include "screencast.h"
+#include "startupprofile.h"
+
+// Persist the permission until it's explicitly revoked
+static const uint persistUntilRevoked = 2;
 
 Q_DECLARE_METATYPE(Portal::Stream)
 Q_DECLARE_METATYPE(Portal::Streams)
@@ -41,8 +47,50 @@ Portal::Portal(QObject *parent)
 {
 }
 
+bool Portal::persistSources() const
+{
+    return m_persistSources;
+}
+
+void Portal::setPersistSources(bool persist)
+{
+    m_persistSources = persist;
+
+    if (!persist)
+        QSettings().remove(restoreTokenKey());
+}
+
+uint Portal::sourceTypes() const
+{
+    return m_sourceTypes;
+}
+
+void Portal::setSourceTypes(uint types)
+{
+    m_sourceTypes = types;
+}
+
+Portal::AvailableCursorModes Portal::requestedCursorMode() const
+{
+    return m_requestedCursorMode;
+}
+
+void Portal::setCursorMode(AvailableCursorModes mode)
+{
+    m_requestedCursorMode = mode;
+}
+
+Portal::AvailableCursorModes Portal::cursorMode() const
+{
+    return m_cursorMode;
+}
+
 void Portal::createSession()
 {
+    m_sessionCreated = false;
+    m_cursorModesKnown = false;
+    queryCursorModes();
+
     auto msg = QDBusMessage::createMethodCall(QStringLiteral("org.freedesktop.portal.Desktop"),
                                               QStringLiteral("/org/freedesktop/portal/desktop"),
                                               QStringLiteral("org.freedesktop.portal.ScreenCast"),
@@ -70,6 +118,29 @@ void Portal::createSession()
         });
 }
 
+void Portal::queryCursorModes()
+{
+    // Asked while the session is created, so that it costs no round trip
+    auto msg = QDBusMessage::createMethodCall(QStringLiteral("org.freedesktop.portal.Desktop"),
+                                              QStringLiteral("/org/freedesktop/portal/desktop"),
+                                              QStringLiteral("org.freedesktop.DBus.Properties"),
+                                              QStringLiteral("Get"));
+    msg << QStringLiteral("org.freedesktop.portal.ScreenCast") << QStringLiteral("AvailableCursorModes");
+
+    QDBusPendingCall pendingCall = QDBusConnection::sessionBus().asyncCall(msg);
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(pendingCall);
+    connect(
+        watcher, &QDBusPendingCallWatcher::finished, this, [this](QDBusPendingCallWatcher *self) {
+            QDBusPendingReply<QDBusVariant> reply = *self;
+            self->deleteLater();
+
+            // Portals older than version 2 don't know about cursor modes
+            m_availableCursorModes = reply.isValid() ? reply.value().variant().toUInt() : 0;
+            m_cursorModesKnown = true;
+            maybeSelectSources();
+        });
+}
+
 QString Portal::newRequestToken() const
 {
     static quint32 count = 0;
@@ -82,6 +153,14 @@ QString Portal::newSessionToken() const
     return QStringLiteral("u") + QString::number(++count);
 }
 
+QString Portal::restoreTokenKey() const
+{
+    // A monitor selection can't be restored when a window is asked for
+    if (m_sourceTypes == Monitor)
+        return QStringLiteral("Portal/RestoreToken");
+    return QStringLiteral("Portal/RestoreToken%1").arg(m_sourceTypes);
+}
+
 void Portal::createSessionHandler(uint response, const QVariantMap &results)
 {
     if (response != 0) {
@@ -89,20 +168,49 @@ void Portal::createSessionHandler(uint response, const QVariantMap &results)
         return;
     }
 
-    auto msg = QDBusMessage::createMethodCall(QStringLiteral("org.freedesktop.portal.Desktop"),
-                                              QStringLiteral("/org/freedesktop/portal/desktop"),
-                                              QStringLiteral("org.freedesktop.portal.ScreenCast"),
-                                              QStringLiteral("SelectSources"));
+    StartupProfile::mark("session created");
+
     m_sessionHandle = QDBusObjectPath(results.value(QStringLiteral("session_handle")).toString());
 
     QDBusConnection::sessionBus().connect(
         QString(), m_sessionHandle.path(), QStringLiteral("org.freedesktop.portal.Session"),
         QStringLiteral("Closed"), this, SIGNAL(sessionClosed(QVariantMap)));
 
-    msg << QVariant::fromValue(m_sessionHandle)
-        << QVariantMap { { QStringLiteral("multiple"), false },
-                         { QStringLiteral("types"), uint(Monitor) },
-                         { QStringLiteral("handle_token"), newRequestToken() } };
+    m_sessionCreated = true;
+    maybeSelectSources();
+}
+
+void Portal::maybeSelectSources()
+{
+    if (!m_sessionCreated || !m_cursorModesKnown)
+        return;
+
+    auto msg = QDBusMessage::createMethodCall(QStringLiteral("org.freedesktop.portal.Desktop"),
+                                              QStringLiteral("/org/freedesktop/portal/desktop"),
+                                              QStringLiteral("org.freedesktop.portal.ScreenCast"),
+                                              QStringLiteral("SelectSources"));
+
+    QVariantMap options = { { QStringLiteral("multiple"), true },
+                            { QStringLiteral("types"), m_sourceTypes },
+                            { QStringLiteral("handle_token"), newRequestToken() } };
+    if (m_persistSources) {
+        // Portals older than version 4 ignore these options
+        options.insert(QStringLiteral("persist_mode"), persistUntilRevoked);
+        const QString restoreToken = QSettings().value(restoreTokenKey()).toString();
+        if (!restoreToken.isEmpty())
+            options.insert(QStringLiteral("restore_token"), restoreToken);
+    }
+
+    // Without metadata support the compositor draws the cursor into the frames
+    m_cursorMode = Embedded;
+    if (m_availableCursorModes & m_requestedCursorMode)
+        m_cursorMode = m_requestedCursorMode;
+    else if (m_availableCursorModes != 0 && m_requestedCursorMode == Metadata)
+        qCInfo(lcScreencast, "The portal can't send the cursor as metadata, embedding it");
+    if (m_availableCursorModes & m_cursorMode)
+        options.insert(QStringLiteral("cursor_mode"), uint(m_cursorMode));
+
+    msg << QVariant::fromValue(m_sessionHandle) << options;
 
     QDBusPendingCall pendingCall = QDBusConnection::sessionBus().asyncCall(msg);
     QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(pendingCall);
@@ -130,6 +238,8 @@ void Portal::selectSourcesHandler(uint response, const QVariantMap &results)
         return;
     }
 
+    StartupProfile::mark("sources selected");
+
     auto msg = QDBusMessage::createMethodCall(QStringLiteral("org.freedesktop.portal.Desktop"),
                                               QStringLiteral("/org/freedesktop/portal/desktop"),
                                               QStringLiteral("org.freedesktop.portal.ScreenCast"),
@@ -163,29 +273,40 @@ void Portal::startHandler(uint response, const QVariantMap &results)
         return;
     }
 
+    StartupProfile::mark("session started");
+
+    // Tokens can only be used once, a new one is handed out every time
+    if (m_persistSources && results.contains(QStringLiteral("restore_token")))
+        QSettings().setValue(restoreTokenKey(), results.value(QStringLiteral("restore_token")));
+
     Streams streams = qdbus_cast<Streams>(results.value(QStringLiteral("streams")));
-    for (auto stream : qAsConst(streams)) {
-        auto msg =
-            QDBusMessage::createMethodCall(QStringLiteral("org.freedesktop.portal.Desktop"),
-                                           QStringLiteral("/org/freedesktop/portal/desktop"),
-                                           QStringLiteral("org.freedesktop.portal.ScreenCast"),
-                                           QStringLiteral("OpenPipeWireRemote"));
-        msg << QVariant::fromValue(m_sessionHandle) << QVariantMap();
-
-        QDBusPendingCall pendingCall = QDBusConnection::sessionBus().asyncCall(msg);
-        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(pendingCall);
-        connect(watcher, &QDBusPendingCallWatcher::finished, this,
-                [this, stream](QDBusPendingCallWatcher *self) {
-                    QDBusPendingReply<QDBusUnixFileDescriptor> reply = *self;
-                    self->deleteLater();
-
-                    if (!reply.isValid()) {
-                        qCWarning(lcScreencast, "Failed to open PipeWire remote: %s",
-                                  qPrintable(reply.error().message()));
-                        return;
-                    }
-
-                    emit streamReady(reply.value().fileDescriptor(), stream.nodeId, stream.map);
-                });
+    if (streams.isEmpty()) {
+        qCWarning(lcScreencast, "No streams were selected");
+        return;
     }
+
+    // One remote serves all the streams of the session, the sources
+    // of every stream are opened on the same fd
+    auto msg = QDBusMessage::createMethodCall(QStringLiteral("org.freedesktop.portal.Desktop"),
+                                              QStringLiteral("/org/freedesktop/portal/desktop"),
+                                              QStringLiteral("org.freedesktop.portal.ScreenCast"),
+                                              QStringLiteral("OpenPipeWireRemote"));
+    msg << QVariant::fromValue(m_sessionHandle) << QVariantMap();
+
+    QDBusPendingCall pendingCall = QDBusConnection::sessionBus().asyncCall(msg);
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(pendingCall);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this,
+            [this, streams](QDBusPendingCallWatcher *self) {
+                QDBusPendingReply<QDBusUnixFileDescriptor> reply = *self;
+                self->deleteLater();
+
+                if (!reply.isValid()) {
+                    qCWarning(lcScreencast, "Failed to open PipeWire remote: %s",
+                              qPrintable(reply.error().message()));
+                    return;
+                }
+
+                StartupProfile::mark("PipeWire remote opened");
+                emit streamsReady(reply.value().fileDescriptor(), streams);
+            });
 }
@@ -36,17 +36,43 @@ public:
 
     explicit Portal(QObject *parent = nullptr);
 
+    // Ask the portal to remember the selected sources and reuse the
+    // previous selection, so that the picker is only shown once
+    bool persistSources() const;
+    void setPersistSources(bool persist);
+
+    // Kinds of sources the picker offers, AvailableSourceTypes flags
+    uint sourceTypes() const;
+    void setSourceTypes(uint types);
+
+    // Cursor mode asked for, the portal may not support it
+    AvailableCursorModes requestedCursorMode() const;
+    void setCursorMode(AvailableCursorModes mode);
+    // Cursor mode of the current session
+    AvailableCursorModes cursorMode() const;
+
     void createSession();
 
 Q_SIGNALS:
-    void streamReady(int fd, uint nodeId, const QVariantMap &map);
+    void streamsReady(int fd, const Portal::Streams &streams);
     void sessionClosed(const QVariantMap &map);
 
 private:
     QDBusObjectPath m_sessionHandle;
+    bool m_persistSources = true;
+    uint m_sourceTypes = Monitor;
+    AvailableCursorModes m_requestedCursorMode = Embedded;
+    AvailableCursorModes m_cursorMode = Embedded;
+    // Sources are selected once both are known
+    bool m_sessionCreated = false;
+    bool m_cursorModesKnown = false;
+    uint m_availableCursorModes = 0;
 
     QString newRequestToken() const;
     QString newSessionToken() const;
+    QString restoreTokenKey() const;
+    void queryCursorModes();
+    void maybeSelectSources();
 
 private Q_SLOTS:
     void createSessionHandler(uint response, const QVariantMap &results);
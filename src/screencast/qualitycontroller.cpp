@@ -0,0 +1,314 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QMutexLocker>
+#include <QThread>
+
+#include "qualitycontroller.h"
+#include "screencast.h"
+
+#include <sys/resource.h>
+
+// Limits of each knob
+static const int maxBitrateSteps = 3;
+static const int maxFramerateSteps = 2;
+static const int minFramerate = 5;
+
+// Lagging for this many samples in a row lowers the quality,
+// having headroom for this many raises it again
+static const int lagSamples = 2;
+static const int headroomSamples = 10;
+// Samples to wait after a change before judging its effect
+static const int cooldownSamples = 3;
+
+QualityController::QualityController(uint nodeId, const Encoder *encoder, const EncoderSettings &settings,
+                                     int framerate, GstElement *queue, GstElement *encoderElement,
+                                     QObject *parent)
+    : QObject(parent)
+    , m_nodeId(nodeId)
+    , m_encoder(encoder)
+    , m_baseSettings(settings)
+    , m_baseFramerate(framerate)
+    , m_queue(GST_ELEMENT(gst_object_ref(queue)))
+    , m_encoderElement(GST_ELEMENT(gst_object_ref(encoderElement)))
+    , m_timer(new QTimer(this))
+{
+    m_encoderSinkPad = gst_element_get_static_pad(encoderElement, "sink");
+    m_encoderSinkProbe = gst_pad_add_probe(m_encoderSinkPad, GST_PAD_PROBE_TYPE_BUFFER,
+                                           encoderInputProbe, this, nullptr);
+    m_encoderSrcPad = gst_element_get_static_pad(encoderElement, "src");
+    m_encoderSrcProbe = gst_pad_add_probe(m_encoderSrcPad, GST_PAD_PROBE_TYPE_BUFFER,
+                                          encoderOutputProbe, this, nullptr);
+    m_queueSinkPad = gst_element_get_static_pad(queue, "sink");
+    m_queueProbe = gst_pad_add_probe(m_queueSinkPad, GST_PAD_PROBE_TYPE_BUFFER,
+                                     decimationProbe, this, nullptr);
+
+    // Checked once, not each time the pipeline lags
+    m_runtime[Preset] = m_baseSettings.preset > 0 &&
+            m_encoder->canReconfigure(m_encoderElement, settingsFor(0, 0), settingsFor(1, 0));
+    m_runtime[Bitrate] = m_baseSettings.bitrate > 0 &&
+            m_encoder->canReconfigure(m_encoderElement, settingsFor(0, 0), settingsFor(0, 1));
+    m_runtime[Framerate] = true;
+    if (!m_runtime[Preset] && m_baseSettings.preset > 0)
+        qCDebug(lcScreencast, "Stream %d: the encoder preset can't change while encoding", m_nodeId);
+    if (!m_runtime[Bitrate] && m_baseSettings.bitrate > 0)
+        qCDebug(lcScreencast, "Stream %d: the bitrate can't change while encoding", m_nodeId);
+
+    m_wallTimer.start();
+    m_lastCpu = processCpuTime();
+
+    m_timer->setInterval(1000);
+    connect(m_timer, &QTimer::timeout, this, &QualityController::update);
+    m_timer->start();
+}
+
+QualityController::~QualityController()
+{
+    gst_pad_remove_probe(m_encoderSinkPad, m_encoderSinkProbe);
+    gst_pad_remove_probe(m_encoderSrcPad, m_encoderSrcProbe);
+    gst_pad_remove_probe(m_queueSinkPad, m_queueProbe);
+    gst_object_unref(m_encoderSinkPad);
+    gst_object_unref(m_encoderSrcPad);
+    gst_object_unref(m_queueSinkPad);
+    gst_object_unref(m_queue);
+    gst_object_unref(m_encoderElement);
+}
+
+QualityController::Sample QualityController::takeSample()
+{
+    Sample sample;
+
+    // With a memory budget large frames fill the queue by bytes first
+    guint level = 0, maxLevel = 0, bytes = 0, maxBytes = 0;
+    g_object_get(m_queue, "current-level-buffers", &level, "max-size-buffers", &maxLevel,
+                 "current-level-bytes", &bytes, "max-size-bytes", &maxBytes, nullptr);
+    if (maxLevel > 0)
+        sample.queueFill = double(level) / maxLevel;
+    if (maxBytes > 0)
+        sample.queueFill = qMax(sample.queueFill, double(bytes) / maxBytes);
+
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_latencyCount > 0)
+            sample.latency = double(m_latencySum) / m_latencyCount / 1e6;
+        m_latencySum = 0;
+        m_latencyCount = 0;
+    }
+
+    // CPU time of the whole process, relative to all the cores
+    const qint64 wall = m_wallTimer.nsecsElapsed() / 1000;
+    const qint64 cpu = processCpuTime();
+    if (wall > m_lastWall)
+        sample.cpu = double(cpu - m_lastCpu) / (wall - m_lastWall) / QThread::idealThreadCount();
+    m_lastWall = wall;
+    m_lastCpu = cpu;
+
+    return sample;
+}
+
+bool QualityController::canStep(Knob knob, bool lower) const
+{
+    if (!m_runtime[knob])
+        return false;
+    if (!lower)
+        return m_steps[knob] > 0;
+
+    switch (knob) {
+    case Preset:
+        return m_steps[Preset] < int(m_baseSettings.preset);
+    case Bitrate:
+        // Constant quality has no bitrate to lower
+        return m_baseSettings.bitrate > 0 && m_steps[Bitrate] < maxBitrateSteps;
+    case Framerate:
+        return m_steps[Framerate] < maxFramerateSteps && framerateFor(m_steps[Framerate] + 1) >= minFramerate;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+bool QualityController::apply(Knob knob, int steps)
+{
+    switch (knob) {
+    case Preset:
+        return m_encoder->reconfigure(m_encoderElement, settingsFor(steps, m_steps[Bitrate]));
+    case Bitrate:
+        return m_encoder->reconfigure(m_encoderElement, settingsFor(m_steps[Preset], steps));
+    case Framerate:
+        m_frameInterval.storeRelease(steps > 0 ? GST_SECOND / framerateFor(steps) : 0);
+        return true;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+QString QualityController::describe(Knob knob, int steps) const
+{
+    const auto settings = settingsFor(m_steps[Preset], m_steps[Bitrate]);
+
+    switch (knob) {
+    case Preset:
+        return QStringLiteral("encoder preset to %1").arg(EncoderSettings::presetNames().at(settings.preset));
+    case Bitrate:
+        return QStringLiteral("bitrate to %1 kbit/s").arg(settings.bitrate);
+    case Framerate:
+        return QStringLiteral("framerate to %1 fps").arg(framerateFor(steps));
+    default:
+        break;
+    }
+
+    return QString();
+}
+
+EncoderSettings QualityController::settingsFor(int presetSteps, int bitrateSteps) const
+{
+    EncoderSettings settings = m_baseSettings;
+    settings.preset = EncoderSettings::Preset(int(m_baseSettings.preset) - presetSteps);
+    for (int i = 0; i < bitrateSteps; ++i)
+        settings.bitrate = settings.bitrate * 3 / 4;
+    return settings;
+}
+
+int QualityController::framerateFor(int steps) const
+{
+    return qMax(1, m_baseFramerate >> steps);
+}
+
+qint64 QualityController::processCpuTime()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+
+    return (qint64(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000 +
+            usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+GstPadProbeReturn QualityController::encoderInputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    QualityController *self = static_cast<QualityController *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!GST_BUFFER_PTS_IS_VALID(buffer))
+        return GST_PAD_PROBE_OK;
+
+    QMutexLocker locker(&self->m_mutex);
+    // Frames the encoder dropped are forgotten eventually
+    if (self->m_entries.size() >= 256)
+        self->m_entries.pop_front();
+    self->m_entries.emplace_back(GST_BUFFER_PTS(buffer), g_get_monotonic_time());
+
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn QualityController::encoderOutputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    QualityController *self = static_cast<QualityController *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!GST_BUFFER_PTS_IS_VALID(buffer))
+        return GST_PAD_PROBE_OK;
+
+    // Frames may leave in a different order when the encoder reorders them
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    QMutexLocker locker(&self->m_mutex);
+    for (auto it = self->m_entries.begin(); it != self->m_entries.end(); ++it) {
+        if (it->first == pts) {
+            self->m_latencySum += (g_get_monotonic_time() - it->second) * 1000;
+            self->m_latencyCount++;
+            self->m_entries.erase(it);
+            break;
+        }
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn QualityController::decimationProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    QualityController *self = static_cast<QualityController *>(user_data);
+    const GstClockTime interval = self->m_frameInterval.loadAcquire();
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+
+    if (interval == 0 || !GST_CLOCK_TIME_IS_VALID(pts)) {
+        self->m_nextFrameTime = GST_CLOCK_TIME_NONE;
+        return GST_PAD_PROBE_OK;
+    }
+
+    // Same jitter tolerance as the variable framerate limiter
+    if (GST_CLOCK_TIME_IS_VALID(self->m_nextFrameTime) && pts + interval / 4 < self->m_nextFrameTime)
+        return GST_PAD_PROBE_DROP;
+
+    if (GST_CLOCK_TIME_IS_VALID(self->m_nextFrameTime) && pts < self->m_nextFrameTime + interval)
+        self->m_nextFrameTime += interval;
+    else
+        self->m_nextFrameTime = pts + interval;
+
+    return GST_PAD_PROBE_OK;
+}
+
+void QualityController::update()
+{
+    const Sample sample = takeSample();
+
+    // The latency the encoder has with the configured settings,
+    // lookahead makes it vary a lot between encoders
+    const bool baseline = m_steps[Preset] == 0 && m_steps[Bitrate] == 0 && m_steps[Framerate] == 0;
+    if (baseline && sample.latency > 0 && (m_baseLatency == 0 || sample.latency < m_baseLatency))
+        m_baseLatency = sample.latency;
+
+    const bool slowEncoder = m_baseLatency > 0 && sample.latency > 2 * m_baseLatency && sample.latency > 50;
+    const bool lagging = sample.queueFill > 0.5 || sample.cpu > 0.9 || slowEncoder;
+    const bool headroom = sample.queueFill < 0.1 && sample.cpu < 0.6 && !slowEncoder;
+
+    m_lagTicks = lagging ? m_lagTicks + 1 : 0;
+    m_headroomTicks = headroom ? m_headroomTicks + 1 : 0;
+
+    if (m_cooldown > 0) {
+        --m_cooldown;
+        return;
+    }
+
+    const QByteArray state = QStringLiteral("queue %1%, encoder latency %2 ms, CPU %3%")
+            .arg(qRound(sample.queueFill * 100)).arg(sample.latency, 0, 'f', 1)
+            .arg(qRound(sample.cpu * 100)).toUtf8();
+
+    if (m_lagTicks >= lagSamples) {
+        // Cheapest loss of quality first
+        for (Knob knob : { Preset, Bitrate, Framerate }) {
+            if (!canStep(knob, true) || !apply(knob, m_steps[knob] + 1))
+                continue;
+            m_steps[knob]++;
+            qCInfo(lcScreencast, "Stream %d is lagging (%s), lowering the %s",
+                   m_nodeId, state.constData(), qPrintable(describe(knob, m_steps[knob])));
+            m_lagTicks = 0;
+            m_cooldown = cooldownSamples;
+            return;
+        }
+
+        qCDebug(lcScreencast, "Stream %d is lagging (%s), nothing left to lower", m_nodeId, state.constData());
+        m_lagTicks = 0;
+    } else if (m_headroomTicks >= headroomSamples) {
+        for (Knob knob : { Framerate, Bitrate, Preset }) {
+            if (!canStep(knob, false) || !apply(knob, m_steps[knob] - 1))
+                continue;
+            m_steps[knob]--;
+            qCInfo(lcScreencast, "Stream %d has headroom (%s), raising the %s",
+                   m_nodeId, state.constData(), qPrintable(describe(knob, m_steps[knob])));
+            m_cooldown = cooldownSamples;
+            break;
+        }
+        m_headroomTicks = 0;
+    }
+}
@@ -0,0 +1,112 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef QUALITYCONTROLLER_H
+#define QUALITYCONTROLLER_H
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+
+#include <deque>
+
+#include <gst/gst.h>
+
+#include "encoder.h"
+
+/*
+ * Keeps a recording smooth when the machine can't keep up.
+ *
+ * Once a second the fill level of the queue in front of the encoder,
+ * the time frames spend in the encoder and the CPU usage of the
+ * process are sampled. When the pipeline lags, the encoder preset is
+ * made faster, then the bitrate and then the framerate are lowered,
+ * one step at a time; they are raised again in reverse order when
+ * there is headroom. Encoder knobs the element can't change while
+ * encoding are skipped. Every decision is logged.
+ *
+ * The resolution is left alone: the muxers don't accept new caps
+ * in the middle of a file.
+ */
+class QualityController : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QualityController(uint nodeId, const Encoder *encoder, const EncoderSettings &settings,
+                               int framerate, GstElement *queue, GstElement *encoderElement,
+                               QObject *parent = nullptr);
+    ~QualityController();
+
+private:
+    enum Knob {
+        Preset,
+        Bitrate,
+        Framerate,
+        KnobCount
+    };
+
+    struct Sample {
+        double queueFill = 0;
+        double latency = 0;
+        double cpu = 0;
+    };
+
+    uint m_nodeId = 0;
+    const Encoder *m_encoder = nullptr;
+    EncoderSettings m_baseSettings;
+    int m_baseFramerate = 0;
+    GstElement *m_queue = nullptr;
+    GstElement *m_encoderElement = nullptr;
+    QTimer *m_timer = nullptr;
+
+    // How many steps each knob was lowered
+    int m_steps[KnobCount] = {};
+    // Whether the knob can be turned while encoding
+    bool m_runtime[KnobCount] = {};
+    int m_lagTicks = 0;
+    int m_headroomTicks = 0;
+    int m_cooldown = 0;
+    double m_baseLatency = 0;
+
+    QElapsedTimer m_wallTimer;
+    qint64 m_lastWall = 0;
+    qint64 m_lastCpu = 0;
+
+    // Encoder latency, from the probes on the streaming threads
+    GstPad *m_encoderSinkPad = nullptr;
+    GstPad *m_encoderSrcPad = nullptr;
+    gulong m_encoderSinkProbe = 0;
+    gulong m_encoderSrcProbe = 0;
+    QMutex m_mutex;
+    std::deque<std::pair<GstClockTime, qint64>> m_entries;
+    qint64 m_latencySum = 0;
+    qint64 m_latencyCount = 0;
+
+    // Frame decimation in front of the queue
+    GstPad *m_queueSinkPad = nullptr;
+    gulong m_queueProbe = 0;
+    QAtomicInteger<quint64> m_frameInterval = 0;
+    GstClockTime m_nextFrameTime = GST_CLOCK_TIME_NONE;
+
+    Sample takeSample();
+    bool canStep(Knob knob, bool lower) const;
+    bool apply(Knob knob, int steps);
+    QString describe(Knob knob, int steps) const;
+    EncoderSettings settingsFor(int presetSteps, int bitrateSteps) const;
+    int framerateFor(int steps) const;
+
+    static qint64 processCpuTime();
+    static GstPadProbeReturn encoderInputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    static GstPadProbeReturn encoderOutputProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    static GstPadProbeReturn decimationProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+
+private Q_SLOTS:
+    void update();
+};
+
+#endif // QUALITYCONTROLLER_H
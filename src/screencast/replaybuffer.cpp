@@ -0,0 +1,186 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QMutexLocker>
+
+#include "replaybuffer.h"
+
+#include <gst/video/video.h>
+
+// Ask the encoder for a keyframe when a GOP gets longer than this,
+// so that saved clips start close to the requested length even when
+// static frames are skipped and the encoder's own interval is long
+static const GstClockTime maxGopDuration = 2 * GST_SECOND;
+
+static GstClockTime bufferTime(GstBuffer *buffer)
+{
+    return GST_BUFFER_DTS_IS_VALID(buffer) ? GST_BUFFER_DTS(buffer) : GST_BUFFER_PTS(buffer);
+}
+
+ReplayBuffer::ReplayBuffer(GstClockTime maxDuration, gsize maxBytes)
+    : m_maxDuration(maxDuration)
+    , m_maxBytes(maxBytes)
+{
+}
+
+ReplayBuffer::~ReplayBuffer()
+{
+    clear();
+    gst_caps_replace(&m_caps, nullptr);
+}
+
+GstElement *ReplayBuffer::createSink()
+{
+    GstElement *sink = gst_element_factory_make("appsink", nullptr);
+    if (!sink)
+        return nullptr;
+
+    // Take buffers as fast as they come, the ring is the only queue
+    g_object_set(sink, "sync", FALSE, "max-buffers", 1, "enable-last-sample", FALSE, nullptr);
+
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.new_sample = newSample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, nullptr);
+
+    return sink;
+}
+
+bool ReplayBuffer::snapshot(GstCaps **caps, QVector<GstBuffer *> &buffers) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_gops.empty() || !m_caps)
+        return false;
+
+    *caps = gst_caps_ref(m_caps);
+    for (const auto &gop : m_gops) {
+        for (auto *buffer : gop.buffers)
+            buffers.append(gst_buffer_ref(buffer));
+    }
+
+    return true;
+}
+
+ReplayBuffer::Stats ReplayBuffer::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    Stats stats;
+    stats.duration = duration();
+    stats.bytes = m_bytes;
+    stats.gops = int(m_gops.size());
+    return stats;
+}
+
+void ReplayBuffer::append(GstPad *pad, GstCaps *caps, GstBuffer *buffer)
+{
+    bool requestKeyUnit = false;
+
+    {
+        QMutexLocker locker(&m_mutex);
+
+        // Older GOPs can't be muxed with the new caps
+        if (caps && (!m_caps || !gst_caps_is_equal(caps, m_caps))) {
+            clear();
+            gst_caps_replace(&m_caps, caps);
+        }
+
+        const bool keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        if (keyframe) {
+            m_gops.emplace_back();
+            m_keyUnitRequested = false;
+        } else if (m_gops.empty()) {
+            // Clips have to start with a keyframe
+            return;
+        }
+
+        Gop &gop = m_gops.back();
+        const GstClockTime time = bufferTime(buffer);
+        GstClockTime end = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : time;
+        if (GST_CLOCK_TIME_IS_VALID(end) && GST_BUFFER_DURATION_IS_VALID(buffer))
+            end += GST_BUFFER_DURATION(buffer);
+
+        gop.buffers.append(gst_buffer_ref(buffer));
+        gop.bytes += gst_buffer_get_size(buffer);
+        if (!GST_CLOCK_TIME_IS_VALID(gop.start))
+            gop.start = time;
+        if (GST_CLOCK_TIME_IS_VALID(end) && (!GST_CLOCK_TIME_IS_VALID(gop.end) || end > gop.end))
+            gop.end = end;
+        m_bytes += gst_buffer_get_size(buffer);
+
+        if (!m_keyUnitRequested && GST_CLOCK_TIME_IS_VALID(gop.start) && GST_CLOCK_TIME_IS_VALID(time) &&
+                time > gop.start + maxGopDuration)
+            requestKeyUnit = m_keyUnitRequested = true;
+
+        trim();
+    }
+
+    if (requestKeyUnit)
+        gst_pad_push_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, FALSE, 0));
+}
+
+void ReplayBuffer::trim()
+{
+    // Drop the oldest GOP as long as the others still cover the
+    // requested duration, or the ring is over its memory limit;
+    // the GOP being written is never dropped
+    while (m_gops.size() > 1) {
+        const Gop &oldest = m_gops.front();
+        const GstClockTime next = m_gops.at(1).start;
+        const GstClockTime end = m_gops.back().end;
+        const bool enoughTime = GST_CLOCK_TIME_IS_VALID(next) && GST_CLOCK_TIME_IS_VALID(end) &&
+                end >= next && end - next >= m_maxDuration;
+        const bool overBudget = m_bytes > m_maxBytes;
+        if (!enoughTime && !overBudget)
+            break;
+
+        m_bytes -= oldest.bytes;
+        for (auto *buffer : oldest.buffers)
+            gst_buffer_unref(buffer);
+        m_gops.pop_front();
+    }
+}
+
+void ReplayBuffer::clear()
+{
+    for (const auto &gop : m_gops) {
+        for (auto *buffer : gop.buffers)
+            gst_buffer_unref(buffer);
+    }
+    m_gops.clear();
+    m_bytes = 0;
+}
+
+GstClockTime ReplayBuffer::duration() const
+{
+    if (m_gops.empty())
+        return 0;
+
+    const GstClockTime start = m_gops.front().start;
+    const GstClockTime end = m_gops.back().end;
+    if (!GST_CLOCK_TIME_IS_VALID(start) || !GST_CLOCK_TIME_IS_VALID(end) || end < start)
+        return 0;
+    return end - start;
+}
+
+GstFlowReturn ReplayBuffer::newSample(GstAppSink *sink, gpointer user_data)
+{
+    ReplayBuffer *self = static_cast<ReplayBuffer *>(user_data);
+
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (!sample)
+        return GST_FLOW_EOS;
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if (buffer) {
+        GstPad *pad = gst_element_get_static_pad(GST_ELEMENT(sink), "sink");
+        self->append(pad, gst_sample_get_caps(sample), buffer);
+        gst_object_unref(pad);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
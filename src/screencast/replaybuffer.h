@@ -0,0 +1,70 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef REPLAYBUFFER_H
+#define REPLAYBUFFER_H
+
+#include <QMutex>
+#include <QVector>
+
+#include <deque>
+
+#include <gst/app/gstappsink.h>
+
+/*
+ * Keeps the last seconds of an encoded stream in memory, as a ring
+ * of GOPs that always starts with a keyframe.
+ *
+ * Buffers come from an appsink on the streaming thread, snapshots
+ * are taken from the main thread and only hold references, so the
+ * live pipeline never waits for a clip to be written.
+ */
+class ReplayBuffer
+{
+public:
+    struct Stats {
+        GstClockTime duration = 0;
+        gsize bytes = 0;
+        int gops = 0;
+    };
+
+    explicit ReplayBuffer(GstClockTime maxDuration, gsize maxBytes);
+    ~ReplayBuffer();
+
+    // Creates the sink feeding the ring, a floating reference
+    GstElement *createSink();
+
+    // Returns new references to the caps and to the retained
+    // buffers, oldest keyframe first, false if nothing is retained
+    bool snapshot(GstCaps **caps, QVector<GstBuffer *> &buffers) const;
+
+    Stats stats() const;
+
+private:
+    struct Gop {
+        QVector<GstBuffer *> buffers;
+        gsize bytes = 0;
+        GstClockTime start = GST_CLOCK_TIME_NONE;
+        GstClockTime end = GST_CLOCK_TIME_NONE;
+    };
+
+    mutable QMutex m_mutex;
+    std::deque<Gop> m_gops;
+    GstCaps *m_caps = nullptr;
+    gsize m_bytes = 0;
+    GstClockTime m_maxDuration;
+    gsize m_maxBytes;
+    bool m_keyUnitRequested = false;
+
+    void append(GstPad *pad, GstCaps *caps, GstBuffer *buffer);
+    void trim();
+    void clear();
+    GstClockTime duration() const;
+
+    static GstFlowReturn newSample(GstAppSink *sink, gpointer user_data);
+};
+
+#endif // REPLAYBUFFER_H
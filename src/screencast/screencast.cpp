@@ -7,20 +7,47 @@
 #include <QCoreApplication>
 #include <QDateTime>
 #include <QDBusArgument>
+#include <QDBusConnection>
+#include <QDBusError>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
 #include <QPoint>
 #include <QSize>
 #include <QStandardPaths>
+#include <QStringList>
+#include <QUrlQuery>
 
+#include "capturebranch.h"
+#include "copymonitor.h"
+#include "gstreamerloader.h"
 #include "portal.h"
+#include "pausegate.h"
+#include "qualitycontroller.h"
+#include "replaybuffer.h"
 #include "screencast.h"
+#include "screencastadaptor.h"
 #include "sigwatch.h"
+#include "startupprofile.h"
+#include "statstracer.h"
+#include "transcoder.h"
+#include "utils.h"
 
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 Q_LOGGING_CATEGORY(lcScreencast, "liri.screencast")
 
 static gboolean bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 {
+    Q_UNUSED(bus)
+
+    // Deleting the stream removes this watch
     Stream *stream = static_cast<Stream *>(user_data);
     Q_ASSERT(stream);
 
@@ -29,14 +56,18 @@ static gboolean bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 
     switch (GST_MESSAGE_TYPE(msg)) {
     case GST_MESSAGE_INFO:
-        gst_message_parse_error(msg, &err, &debug_info);
+        gst_message_parse_info(msg, &err, &debug_info);
         qCInfo(lcScreencast, "Message received from element %s: %s", GST_OBJECT_NAME(msg->src), err->message);
         g_clear_error(&err);
+        g_free(debug_info);
         break;
     case GST_MESSAGE_WARNING:
-        gst_message_parse_error(msg, &err, &debug_info);
+        gst_message_parse_warning(msg, &err, &debug_info);
         qCWarning(lcScreencast, "Warning received from element %s: %s", GST_OBJECT_NAME(msg->src), err->message);
+        if (debug_info)
+            qCDebug(lcScreencast, "Debugging information: %s", debug_info);
         g_clear_error(&err);
+        g_free(debug_info);
         break;
     case GST_MESSAGE_ERROR:
         gst_message_parse_error(msg, &err, &debug_info);
@@ -45,12 +76,13 @@ static gboolean bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
             qCWarning(lcScreencast, "Debugging information: %s", debug_info);
         g_clear_error(&err);
         g_free(debug_info);
-        gst_bus_remove_watch(bus);
         delete stream;
         break;
     case GST_MESSAGE_EOS:
-        qCInfo(lcScreencast, "End of stream reached");
-        gst_bus_remove_watch(bus);
+        if (stream->drainTimer.isValid())
+            qCInfo(lcScreencast, "Stream %s drained in %lld ms", qPrintable(stream->name()), stream->drainTimer.elapsed());
+        else
+            qCInfo(lcScreencast, "End of stream reached");
         delete stream;
         break;
     case GST_MESSAGE_STATE_CHANGED:
@@ -71,6 +103,143 @@ static gboolean bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
     return true;
 }
 
+static GstPadProbeReturn frame_rate_limit_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    StreamSource *stream = static_cast<StreamSource *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    const GstClockTime interval = stream->frameInterval;
+
+    if (!GST_CLOCK_TIME_IS_VALID(pts))
+        return GST_PAD_PROBE_OK;
+
+    // Allow some jitter so that a compositor running at an exact multiple
+    // of the target rate doesn't get every other frame dropped
+    if (GST_CLOCK_TIME_IS_VALID(stream->nextFrameTime) && pts + interval / 4 < stream->nextFrameTime)
+        return GST_PAD_PROBE_DROP;
+
+    if (GST_CLOCK_TIME_IS_VALID(stream->nextFrameTime) && pts < stream->nextFrameTime + interval)
+        stream->nextFrameTime += interval;
+    else
+        stream->nextFrameTime = pts + interval;
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn first_frame_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+    Q_UNUSED(info)
+
+    Stream *stream = static_cast<Stream *>(user_data);
+    qCInfo(lcScreencast, "Stream %s: first frame encoded %lld ms after start",
+           qPrintable(stream->name()), stream->startTimer.elapsed());
+
+    StartupProfile::mark("first frame encoded");
+    StartupProfile::report();
+
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static QString stream_format(const QVariantMap &map)
+{
+    QString format = QStringLiteral("bgrx");
+    if (map.contains(QStringLiteral("format"))) {
+        QDBusArgument dbusFormat = map[QStringLiteral("format")].value<QDBusArgument>();
+        dbusFormat >> format;
+    }
+    return format;
+}
+
+static QJsonObject element_stats(ScreencastStatsTracer *tracer, GstElement *element)
+{
+    QJsonObject object;
+    GstElementFactory *factory = gst_element_get_factory(element);
+    object[QStringLiteral("name")] = QString::fromUtf8(factory ? GST_OBJECT_NAME(factory) : GST_OBJECT_NAME(element));
+
+    ElementStats stats;
+    if (!screencast_stats_tracer_lookup(tracer, element, &stats))
+        return object;
+
+    object[QStringLiteral("buffers")] = double(stats.buffers);
+    object[QStringLiteral("fps")] = stats.fps;
+    object[QStringLiteral("latency-ms")] = stats.latency / 1e6;
+    object[QStringLiteral("latency-max-ms")] = stats.latencyMax / 1e6;
+    object[QStringLiteral("age-ms")] = stats.age / 1e6;
+    return object;
+}
+
+static QJsonObject spool_stats(GstElement *sink)
+{
+    QJsonObject object;
+    GstStructure *stats = nullptr;
+    g_object_get(sink, "stats", &stats, nullptr);
+    if (!stats)
+        return object;
+
+    guint64 frames = 0, keyframes = 0, repeats = 0, bytesIn = 0, bytesWritten = 0, renderTime = 0;
+    gst_structure_get_uint64(stats, "frames", &frames);
+    gst_structure_get_uint64(stats, "keyframes", &keyframes);
+    gst_structure_get_uint64(stats, "repeats", &repeats);
+    gst_structure_get_uint64(stats, "bytes-in", &bytesIn);
+    gst_structure_get_uint64(stats, "bytes-written", &bytesWritten);
+    gst_structure_get_uint64(stats, "render-time", &renderTime);
+    gst_structure_free(stats);
+
+    object[QStringLiteral("frames")] = double(frames);
+    object[QStringLiteral("keyframes")] = double(keyframes);
+    object[QStringLiteral("repeats")] = double(repeats);
+    object[QStringLiteral("bytes-written")] = double(bytesWritten);
+    object[QStringLiteral("ratio")] = bytesWritten > 0 ? double(bytesIn) / bytesWritten : 0;
+    // What recording costs per frame, compression and writing included
+    object[QStringLiteral("ms-per-frame")] = frames > 0 ? renderTime / 1e6 / frames : 0;
+    return object;
+}
+
+static QJsonObject memory_stats(const MemoryBudget::Usage &usage)
+{
+    QJsonObject object;
+    object[QStringLiteral("bytes")] = double(usage.bytes);
+    object[QStringLiteral("peak-bytes")] = double(usage.peak);
+    object[QStringLiteral("limit-bytes")] = double(usage.limit);
+    object[QStringLiteral("dropped")] = double(usage.dropped);
+    return object;
+}
+
+static GstElement *next_element(GstElement *element)
+{
+    GstPad *pad = gst_element_get_static_pad(element, "src");
+    if (!pad)
+        return nullptr;
+
+    GstElement *next = nullptr;
+    GstPad *peer = gst_pad_get_peer(pad);
+    if (peer) {
+        next = gst_pad_get_parent_element(peer);
+        gst_object_unref(peer);
+    }
+    gst_object_unref(pad);
+
+    // The pipeline holds a reference
+    if (next)
+        gst_object_unref(next);
+    return next;
+}
+
+/*
+ * Stream
+ */
+
+QString Stream::name() const
+{
+    QStringList nodes;
+    for (auto *source : sources)
+        nodes.append(QString::number(source->nodeId));
+    return nodes.join(QLatin1Char('+'));
+}
+
 /*
  * StartupEvent
  */
@@ -90,18 +259,88 @@ StartupEvent::StartupEvent()
 Screencast::Screencast(QObject *parent)
     : QObject(parent)
     , m_portal(new Portal(this))
+    , m_statsTimer(new QTimer(this))
+    , m_shutdownTimer(new QTimer(this))
+    , m_encoder(Encoder::create(m_encoderSettings.codec))
 {
-    connect(m_portal, &Portal::streamReady, this, &Screencast::handleStreamReady);
+    connect(m_portal, &Portal::streamsReady, this, &Screencast::handleStreamsReady);
     connect(m_portal, &Portal::sessionClosed, this, &Screencast::handleSessionClosed);
 
     auto *sigwatch = new UnixSignalWatcher(this);
     sigwatch->watchForSignal(SIGINT);
     sigwatch->watchForSignal(SIGTERM);
-    connect(sigwatch, &UnixSignalWatcher::unixSignal, this, &Screencast::shutdown);
+    sigwatch->watchForSignal(SIGUSR1);
+    connect(sigwatch, &UnixSignalWatcher::unixSignal, this, &Screencast::handleUnixSignal);
+
+    m_statsTimer->setInterval(10000);
+    connect(m_statsTimer, &QTimer::timeout, this, &Screencast::reportStats);
+
+    new ScreencastAdaptor(this);
+
+    m_shutdownTimer->setSingleShot(true);
+    m_shutdownTimer->setInterval(5000);
+    connect(m_shutdownTimer, &QTimer::timeout, this, &Screencast::forceShutdown);
 }
 
 Screencast::~Screencast()
 {
+    delete m_prepared;
+    m_prepared = nullptr;
+
+    if (m_pendingFd >= 0)
+        close(m_pendingFd);
+    if (m_sessionFd >= 0)
+        close(m_sessionFd);
+}
+
+CaptureSettings Screencast::captureSettings() const
+{
+    return m_captureSettings;
+}
+
+void Screencast::setCaptureSettings(const CaptureSettings &settings)
+{
+    m_captureSettings = settings;
+    m_captureSettings.framerate = qMax(1, m_captureSettings.framerate);
+}
+
+EncoderSettings Screencast::encoderSettings() const
+{
+    return m_encoderSettings;
+}
+
+void Screencast::setEncoderSettings(const EncoderSettings &settings)
+{
+    m_encoderSettings = settings;
+    m_encoder.reset(Encoder::create(settings.codec));
+
+    if (m_encoderSettings.container == EncoderSettings::DefaultContainer)
+        m_encoderSettings.container = m_encoder->defaultContainer();
+}
+
+bool Screencast::isDaemon() const
+{
+    return m_daemon;
+}
+
+void Screencast::setDaemon(bool daemon)
+{
+    m_daemon = daemon;
+}
+
+void Screencast::setGStreamerLoader(GStreamerLoader *loader)
+{
+    m_loader = loader;
+}
+
+int Screencast::shutdownTimeout() const
+{
+    return m_shutdownTimer->interval();
+}
+
+void Screencast::setShutdownTimeout(int msecs)
+{
+    m_shutdownTimer->setInterval(qMax(0, msecs));
 }
 
 bool Screencast::event(QEvent *event)
@@ -114,11 +353,29 @@ bool Screencast::event(QEvent *event)
     return QObject::event(event);
 }
 
-QString Screencast::videoFileName() const
+QString Screencast::videoFileName(int monitor) const
+{
+    const auto container = m_encoderSettings.container == EncoderSettings::DefaultContainer
+            ? m_encoder->defaultContainer() : m_encoderSettings.container;
+    const QString dateTime = QDateTime::currentDateTime().toString(QLatin1String("yyyy-MM-dd hh:mm:ss"));
+    const QString title = monitor > 0
+            ? tr("Screencast from %1 (monitor %2)").arg(dateTime).arg(monitor)
+            : tr("Screencast from %1").arg(dateTime);
+
+    const QString dir = QStandardPaths::writableLocation(QStandardPaths::MoviesLocation);
+    const QString extension = EncoderSettings::fileExtension(container);
+
+    // Short recordings started within the same second get a suffix
+    QString fileName = QStringLiteral("%1/%2.%3").arg(dir, title, extension);
+    for (int i = 2; QFile::exists(fileName) || QFile::exists(spoolFileName(fileName)); ++i)
+        fileName = QStringLiteral("%1/%2 (%3).%4").arg(dir, title).arg(i).arg(extension);
+    return fileName;
+}
+
+QString Screencast::spoolFileName(const QString &fileName)
 {
-    return QStringLiteral("%1/%2.ogv").arg(
-                QStandardPaths::writableLocation(QStandardPaths::MoviesLocation),
-                tr("Screencast from %1").arg(QDateTime::currentDateTime().toString(QLatin1String("yyyy-MM-dd hh:mm:ss"))));
+    const QFileInfo info(fileName);
+    return QStringLiteral("%1/%2.spool").arg(info.path(), info.completeBaseName());
 }
 
 void Screencast::initialize()
@@ -128,83 +385,1453 @@ void Screencast::initialize()
 
     m_initialized = true;
 
-    m_portal->createSession();
+    if (QDBusConnection::sessionBus().isConnected()) {
+        auto bus = QDBusConnection::sessionBus();
+        if (!bus.registerService(QStringLiteral("io.liri.Screencast")) ||
+                !bus.registerObject(QStringLiteral("/io/liri/Screencast"), this)) {
+            qCWarning(lcScreencast, "Unable to register the D-Bus interface: %s",
+                      qPrintable(bus.lastError().message()));
+            // The daemon can't be controlled without it
+            if (m_daemon) {
+                QCoreApplication::exit(1);
+                return;
+            }
+        }
+    }
+
+    // Nodes recorded without the portal carry no cursor at all
+    if (m_captureSettings.cursorMode == Portal::Metadata && !m_captureSettings.pipeWireNodes.isEmpty())
+        m_captureSettings.cursorMode = Portal::Embedded;
+#ifndef HAVE_PIPEWIRE
+    if (m_captureSettings.cursorMode == Portal::Metadata) {
+        qCInfo(lcScreencast, "Built without PipeWire, the cursor is embedded by the compositor");
+        m_captureSettings.cursorMode = Portal::Embedded;
+    }
+    if (!m_captureSettings.region.isNull()) {
+        qCWarning(lcScreencast, "Built without PipeWire, regions can't be recorded: recording everything");
+        m_captureSettings.region = QRect();
+    }
+#endif
+
+    // The portal round-trips run while GStreamer is loading
+    if (m_captureSettings.pipeWireNodes.isEmpty()) {
+        m_portal->setSourceTypes(m_captureSettings.sourceTypes);
+        m_portal->setPersistSources(m_captureSettings.persistSources);
+        m_portal->setCursorMode(m_captureSettings.cursorMode);
+        m_portal->createSession();
+    }
+
+    if (!m_loader) {
+        handleGStreamerReady(true);
+        return;
+    }
+
+    connect(m_loader, &GStreamerLoader::finished, this, &Screencast::handleGStreamerReady);
+    if (m_loader->isFinished())
+        handleGStreamerReady(m_loader->wait());
+}
+
+void Screencast::handleGStreamerReady(bool succeeded)
+{
+    if (m_gstReady)
+        return;
+
+    if (!succeeded) {
+        QCoreApplication::exit(1);
+        return;
+    }
+
+    m_gstReady = true;
+
+    // Make sure the encoder can actually be used with the container
+    if (!m_encoder->isAvailable()) {
+        qCWarning(lcScreencast, "Encoder \"%s\" is not installed.", qPrintable(m_encoder->name()));
+        QCoreApplication::exit(1);
+        return;
+    }
+    if (!m_encoder->supportsContainer(m_encoderSettings.container)) {
+        qCWarning(lcScreencast, "Encoder \"%s\" cannot be used with container \"%s\".",
+                  qPrintable(m_encoder->name()),
+                  qPrintable(EncoderSettings::containerName(m_encoderSettings.container)));
+        QCoreApplication::exit(1);
+        return;
+    }
+
+    // Instrument all the pipelines from the beginning
+    screencast_stats_tracer_get();
+
+    if (m_hasPendingStreams) {
+        // The portal was faster
+        m_hasPendingStreams = false;
+        handleStreamsReady(m_pendingFd, m_pendingStreams);
+        if (m_pendingFd >= 0)
+            close(m_pendingFd);
+        m_pendingFd = -1;
+        m_pendingStreams.clear();
+    } else if (!m_captureSettings.pipeWireNodes.isEmpty()) {
+        Portal::Streams streams;
+        for (uint nodeId : qAsConst(m_captureSettings.pipeWireNodes)) {
+            Portal::Stream stream;
+            stream.nodeId = nodeId;
+            streams.append(stream);
+        }
+        handleStreamsReady(-1, streams);
+    } else {
+        prepareStream();
+    }
 }
 
-void Screencast::handleStreamReady(int fd, uint nodeId, const QVariantMap &map)
+void Screencast::prepareStream()
 {
+    // Replay buffers are cheap to build, the muxer is only created when
+    // saving; network sinks would connect before there's anything to
+    // send; spools have no encoder to load
+    if (m_captureSettings.replaySeconds > 0 || !m_captureSettings.liveUrl.isEmpty() ||
+            m_captureSettings.spool || m_shuttingDown || m_prepared)
+        return;
+
+    // Build everything but the capture source for the common case of a
+    // single monitor in a packed RGB format, so that plugins are loaded
+    // and encoder and muxer are ready by the time the user picked it
+    EncoderSettings encoderSettings = m_encoderSettings;
+    if (encoderSettings.threads == 0)
+        encoderSettings.threads = encoderSettings.effectiveThreads();
+
+    Stream *stream = new Stream();
+    stream->pipeline = gst_pipeline_new(nullptr);
+    stream->threads = createThreadLayout(stream->pipeline);
+    StreamSource *source = createBranch(GST_BIN(stream->pipeline), QStringLiteral("bgrx"), encoderSettings);
+    if (!source) {
+        delete stream;
+        return;
+    }
+    stream->sources.append(source);
+    addToMemoryBudget(stream);
+
+    if (!createOutputs(stream)) {
+        delete stream;
+        return;
+    }
+
+    // The file is only created once the sources are known
+    for (auto *sink : qAsConst(stream->sinks))
+        gst_element_set_locked_state(sink, TRUE);
+
+    if (gst_element_set_state(stream->pipeline, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE) {
+        qCWarning(lcScreencast, "Unable to prepare the pipeline");
+        delete stream;
+        return;
+    }
+
+    m_prepared = stream;
+    m_preparedSettings = encoderSettings;
+    StartupProfile::mark("pipeline prepared");
+}
+
+Stream *Screencast::takePreparedStream(const Portal::Streams &streams)
+{
+    Stream *stream = m_prepared;
+    m_prepared = nullptr;
+    if (!stream)
+        return nullptr;
+
+    // The prepared branch only fits one source with a fast format
+    if (streams.size() != 1 || !CaptureBranch::isFastFormat(stream_format(streams.first().map))) {
+        delete stream;
+        return nullptr;
+    }
+
+    // The name was picked when the pipeline was prepared
+    for (auto *sink : qAsConst(stream->sinks)) {
+        g_object_set(sink, "location", videoFileName().toUtf8().constData(), nullptr);
+        gst_element_set_locked_state(sink, FALSE);
+    }
+
+    return stream;
+}
+
+StreamSource *Screencast::createSource(GstBin *bin, int fd, const Portal::Stream &portalStream,
+                                       const EncoderSettings &encoderSettings)
+{
+    StreamSource *source = createBranch(bin, stream_format(portalStream.map), encoderSettings);
+    if (!source)
+        return nullptr;
+
+    if (!attachSource(source, bin, fd, portalStream, encoderSettings)) {
+        delete source;
+        return nullptr;
+    }
+
+    return source;
+}
+
+ThreadLayout *Screencast::createThreadLayout(GstElement *pipeline) const
+{
+    // Before any element starts a thread, so that all of them are seen
+    ThreadLayout *threads = new ThreadLayout(pipeline);
+    threads->setPolicies(m_captureSettings);
+    return threads;
+}
+
+void Screencast::addToMemoryBudget(Stream *stream)
+{
+    if (m_captureSettings.memoryBudget <= 0)
+        return;
+
+    if (!m_memoryBudget)
+        m_memoryBudget.reset(new MemoryBudget(quint64(m_captureSettings.memoryBudget) * 1024 * 1024,
+                                              m_captureSettings.memoryPolicy));
+
+    // Before the pipeline plays, so that no frame is missed
+    stream->memoryBudget = m_memoryBudget.data();
+    stream->memory = m_memoryBudget->addAccount();
+    for (auto *source : qAsConst(stream->sources))
+        m_memoryBudget->addBranch(stream->memory, source->convertQueue, source->convert, source->queue);
+}
+
+StreamSource *Screencast::createBranch(GstBin *bin, const QString &format, const EncoderSettings &encoderSettings)
+{
+    CaptureBranch branch;
+    if (!branch.create(bin, nullptr, format, m_captureSettings, m_encoder.data(), encoderSettings))
+        return nullptr;
+
+    StreamSource *source = new StreamSource();
+    source->head = branch.head;
+    source->dedup = branch.dedup;
+    source->convert = branch.convert;
+    source->convertQueue = branch.convertQueue;
+    source->cursor = branch.cursor;
+    source->stamp = branch.stamp;
+    source->rate = branch.rate;
+    source->queue = branch.queue;
+    source->encoder = branch.encoder;
+    source->tail = branch.tail;
+    return source;
+}
+
+bool Screencast::attachSource(StreamSource *source, GstBin *bin, int fd, const Portal::Stream &portalStream,
+                              const EncoderSettings &encoderSettings)
+{
+    const uint nodeId = portalStream.nodeId;
+    const QVariantMap &map = portalStream.map;
+
     // Position
     int x = 0, y = 0;
-    QDBusArgument dbusPosition = map[QStringLiteral("position")].value<QDBusArgument>();
-    dbusPosition.beginArray();
-    dbusPosition >> x >> y;
-    dbusPosition.endArray();
+    if (map.contains(QStringLiteral("position"))) {
+        QDBusArgument dbusPosition = map[QStringLiteral("position")].value<QDBusArgument>();
+        dbusPosition.beginArray();
+        dbusPosition >> x >> y;
+        dbusPosition.endArray();
+    }
 
     // Size
     int w = 0, h = 0;
-    QDBusArgument dbusSize = map[QStringLiteral("size")].value<QDBusArgument>();
-    dbusSize.beginArray();
-    dbusSize >> w >> h;
-    dbusSize.endArray();
-
-    // Format
-    QString format = QStringLiteral("bgrx");
-    if (map.contains(QStringLiteral("format"))) {
-        QDBusArgument dbusFormat = map[QStringLiteral("format")].value<QDBusArgument>();
-        dbusFormat >> format;
+    if (map.contains(QStringLiteral("size"))) {
+        QDBusArgument dbusSize = map[QStringLiteral("size")].value<QDBusArgument>();
+        dbusSize.beginArray();
+        dbusSize >> w >> h;
+        dbusSize.endArray();
     }
 
+    const uint sourceType = map.value(QStringLiteral("source_type"), uint(Portal::Monitor)).toUInt();
+
     qCInfo(lcScreencast, "Stream %d", nodeId);
+    qCInfo(lcScreencast, "Type %s", sourceType == Portal::Window ? "window" : "monitor");
     qCInfo(lcScreencast, "Position %d, %d", x, y);
     qCInfo(lcScreencast, "Size %dx%d", w, h);
+    qCInfo(lcScreencast, "Format %s", qPrintable(stream_format(map)));
 
-    // Create the pipeline
-    QString launch = QStringLiteral("pipewiresrc fd=%1 path=%2 ! " \
-                                    "rawvideoparse width=%3 height=%4 format=%5 framerate=1 ! " \
-                                    "autovideoconvert ! queue ! theoraenc ! oggmux ! " \
-                                    "filesink location=\"%6\"").arg(fd).arg(nodeId).arg(w).arg(h).arg(format).arg(videoFileName());
-    GstElement *pipeline = gst_parse_launch(launch.toUtf8(), nullptr);
-    GstBus *bus = gst_element_get_bus(pipeline);
+    // The region is clipped by the source, the size reported by the
+    // portal is in logical pixels and only used to warn early
+    const QRect &region = m_captureSettings.region;
+    if (!region.isNull()) {
+        if (w > 0 && h > 0 && !region.intersects(QRect(0, 0, w, h)))
+            qCWarning(lcScreencast, "Region %d,%d %dx%d is outside of stream %d",
+                      region.x(), region.y(), region.width(), region.height(), nodeId);
+        qCInfo(lcScreencast, "Region %d,%d %dx%d", region.x(), region.y(), region.width(), region.height());
+    }
+
+    // Caps and timestamps come from PipeWire; our own source wraps the
+    // compositor's buffers instead of copying them, asks for the cursor
+    // metadata, which pipewiresrc doesn't know about, and crops in place
+    const bool cursorMetadata = m_portal->cursorMode() == Portal::Metadata;
+    GstElement *src = gst_element_factory_make("screencastpipewiresrc", nullptr);
+    if (!src) {
+        qCWarning(lcScreencast, "Unable to create the pipeline, some elements are missing");
+        return false;
+    }
 
+    // All sources share the same PipeWire remote
+    g_object_set(src, "fd", fd, "path", QByteArray::number(nodeId).constData(), nullptr);
+    // A small fixed set of buffers, recycled frame after frame
+    setElementProperty(src, "min-buffers", 4);
+    setElementProperty(src, "max-buffers", 8);
+    if (cursorMetadata)
+        g_object_set(src, "cursor", TRUE, nullptr);
+    if (!region.isNull()) {
+        g_object_set(src, "crop-x", region.x(), "crop-y", region.y(),
+                     "crop-width", region.width(), "crop-height", region.height(), nullptr);
+    }
+    if (!m_captureSettings.variableFramerate && !source->dedup) {
+        // Resend the last frame on static screens so that videorate
+        // keeps producing output at the target rate, with deduplication
+        // this is done once per second by screencastdedup instead
+        setElementProperty(src, "keepalive-time", 1000 / m_captureSettings.framerate);
+    }
+
+    ThreadLayout::assign(src, ThreadLayout::Capture);
+    gst_bin_add(bin, src);
+    if (!gst_element_link(src, source->head)) {
+        qCWarning(lcScreencast, "Failed to link %s to %s", GST_OBJECT_NAME(src), GST_OBJECT_NAME(source->head));
+        return false;
+    }
+
+    source->nodeId = nodeId;
+    source->source = src;
+    source->copyMonitor = new CopyMonitor(src, source->encoder);
+    if (m_captureSettings.adaptiveQuality && !m_captureSettings.spool) {
+        source->quality = new QualityController(nodeId, m_encoder.data(), encoderSettings,
+                                                m_captureSettings.framerate, source->queue, source->encoder);
+    }
+
+    if (m_captureSettings.variableFramerate) {
+        // Variable framerate: pass frames as they come, up to the target rate
+        source->frameInterval = gst_util_uint64_scale_int(GST_SECOND, 1, m_captureSettings.framerate);
+        GstPad *pad = gst_element_get_static_pad(src, "src");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, frame_rate_limit_cb, source, nullptr);
+        gst_object_unref(pad);
+    }
+
+    return true;
+}
+
+GstElement *Screencast::createOutput(Stream *stream, const QString &fileName)
+{
+    GstElement *muxer = m_encoder->createMuxer(m_encoderSettings);
+    // Writes happen on the sink's own I/O thread, the muxer
+    // only waits for the disk when all its buffers are in flight
+    GstElement *sink = gst_element_factory_make("screencastfilesink", nullptr);
+
+    if (!muxer || !sink) {
+        if (muxer)
+            gst_object_unref(gst_object_ref_sink(muxer));
+        if (sink)
+            gst_object_unref(gst_object_ref_sink(sink));
+        return nullptr;
+    }
+
+    g_object_set(sink, "location", fileName.toUtf8().constData(), nullptr);
+    if (m_encoderSettings.fragmentDuration > 0) {
+        // Sync once per fragment, a crash loses at most the last one
+        g_object_set(sink, "sync-interval",
+                     guint64(m_encoderSettings.fragmentDuration) * GST_MSECOND, nullptr);
+    }
+
+    // Some muxers push from a thread of their own
+    ThreadLayout::assign(muxer, ThreadLayout::Mux);
+
+    if (!addAndLinkElements(GST_BIN(stream->pipeline), { muxer, sink }))
+        return nullptr;
+    stream->sinks.append(sink);
+
+    return muxer;
+}
+
+bool Screencast::createLiveOutput(Stream *stream)
+{
+    const QUrl &url = m_captureSettings.liveUrl;
+    if (stream->sources.size() != 1) {
+        qCWarning(lcScreencast, "Only one source can be streamed live, %d were selected",
+                  stream->sources.size());
+        return false;
+    }
+
+    QVector<GstElement *> elements;
+    GstElement *sink = nullptr;
+    const QString scheme = url.scheme();
+    if (scheme == QLatin1String("rtp")) {
+        // Bare RTP over UDP, the receiver is told the codec out of band
+        elements.append(m_encoder->createPayloader());
+        sink = gst_element_factory_make("udpsink", nullptr);
+        if (sink) {
+            if (!url.host().isEmpty())
+                g_object_set(sink, "host", url.host().toUtf8().constData(), nullptr);
+            g_object_set(sink, "port", url.port(5000), nullptr);
+        }
+    } else if (scheme == QLatin1String("srt")) {
+        // MPEG-TS, seven packets to a datagram
+        GstElement *muxer = gst_element_factory_make("mpegtsmux", nullptr);
+        if (muxer)
+            setElementProperty(muxer, "alignment", 7);
+        elements.append(muxer);
+        sink = gst_element_factory_make("srtsink", nullptr);
+        if (sink) {
+            g_object_set(sink, "uri", url.toString().toUtf8().constData(), nullptr);
+            // Lost packets are resent within this window, the default
+            // is meant for the internet rather than a local receiver
+            if (!QUrlQuery(url).hasQueryItem(QStringLiteral("latency")))
+                setElementProperty(sink, "latency", 20);
+        }
+    } else if (scheme == QLatin1String("rtsp")) {
+        // Published to an RTSP server, which the viewers connect to
+        sink = gst_element_factory_make("rtspclientsink", nullptr);
+        if (sink) {
+            g_object_set(sink, "location", url.toString().toUtf8().constData(), nullptr);
+            setElementProperty(sink, "latency", 0);
+        }
+    } else {
+        qCWarning(lcScreencast, "Unsupported live streaming URL %s, use rtp://, srt:// or rtsp://",
+                  qPrintable(url.toString()));
+        return false;
+    }
+    elements.append(sink);
+
+    if (elements.contains(nullptr)) {
+        qCWarning(lcScreencast, "Unable to stream to %s, some elements are missing", qPrintable(url.toString()));
+        for (auto *element : qAsConst(elements)) {
+            if (element)
+                gst_object_unref(gst_object_ref_sink(element));
+        }
+        return false;
+    }
+
+    // Packets leave as soon as frames are encoded, the receiver
+    // schedules them from their timestamps
+    setElementProperty(sink, "sync", "false");
+    setElementProperty(sink, "async", "false");
+
+    StreamSource *source = stream->sources.first();
+    if (!addAndLinkElements(GST_BIN(stream->pipeline), elements) ||
+            !gst_element_link(source->tail, elements.first())) {
+        qCWarning(lcScreencast, "Unable to link stream %d to %s", source->nodeId, qPrintable(url.toString()));
+        return false;
+    }
+    stream->liveSink = sink;
+
+    return true;
+}
+
+void Screencast::handleStreamsReady(int fd, const Portal::Streams &streams)
+{
+    if (streams.isEmpty()) {
+        qCWarning(lcScreencast, "No streams to record");
+        return;
+    }
+
+    if (!m_gstReady) {
+        // GStreamer is still loading, the fd is closed by the portal
+        // as soon as we return so keep a copy of it
+        m_pendingFd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 3) : -1;
+        m_pendingStreams = streams;
+        m_hasPendingStreams = true;
+        return;
+    }
+
+    m_hasSession = true;
+
+    if (m_daemon) {
+        // The portal session stays open, every recording reuses its
+        // sources and the fd that is closed as soon as we return
+        if (m_sessionFd >= 0)
+            close(m_sessionFd);
+        m_sessionFd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 3) : -1;
+        m_sessionStreams = streams;
+        qCInfo(lcScreencast, "Ready to record %d streams", streams.size());
+
+        prepareStream();
+        if (m_startRequested) {
+            m_startRequested = false;
+            startRecording(m_sessionFd, m_sessionStreams);
+        }
+        updateState();
+        return;
+    }
+
+    startRecording(fd, streams);
+    updateState();
+}
+
+bool Screencast::startRecording(int fd, const Portal::Streams &streams)
+{
+    if (Stream *stream = takePreparedStream(streams)) {
+        stream->screencast = this;
+        StreamSource *source = stream->sources.first();
+        if (!attachSource(source, GST_BIN(stream->pipeline), fd, streams.first(), m_preparedSettings)) {
+            delete stream;
+            return false;
+        }
+
+        stream->pauseGate = createPauseGate(stream);
+        if (!startStream(stream))
+            return false;
+
+        StartupProfile::mark("pipeline playing");
+        watchFirstFrame(stream);
+        m_statsTimer->start();
+        return true;
+    }
+
+    // Split the cores between the sources so they all encode in parallel
+    EncoderSettings encoderSettings = m_encoderSettings;
+    if (encoderSettings.threads == 0)
+        encoderSettings.threads = qMax(1, encoderSettings.effectiveThreads() / streams.size());
+
+    // Sources are branches of the same pipeline, so that
+    // they all run with the same clock and base time
     Stream *stream = new Stream();
     stream->screencast = this;
-    stream->pipeline = pipeline;
+    stream->pipeline = gst_pipeline_new(nullptr);
+    stream->threads = createThreadLayout(stream->pipeline);
+    GstBin *bin = GST_BIN(stream->pipeline);
+
+    for (const auto &portalStream : streams) {
+        StreamSource *source = createSource(bin, fd, portalStream, encoderSettings);
+        if (!source) {
+            delete stream;
+            return false;
+        }
+        stream->sources.append(source);
+    }
+    addToMemoryBudget(stream);
+
+    if (m_captureSettings.replaySeconds > 0) {
+        // Encoded video goes to memory, files are only written on request
+        const gsize maxBytes = gsize(m_captureSettings.replayMemory) * 1024 * 1024 / streams.size();
+        for (auto *source : qAsConst(stream->sources)) {
+            source->replay = new ReplayBuffer(m_captureSettings.replaySeconds * GST_SECOND, maxBytes);
+            GstElement *sink = source->replay->createSink();
+            if (!sink) {
+                qCWarning(lcScreencast, "Unable to create the replay buffer sink");
+                delete stream;
+                return false;
+            }
+            gst_bin_add(bin, sink);
+            if (!gst_element_link(source->tail, sink)) {
+                qCWarning(lcScreencast, "Unable to link stream %d to the replay buffer", source->nodeId);
+                delete stream;
+                return false;
+            }
+        }
+        qCInfo(lcScreencast, "Keeping the last %d seconds in memory, send SIGUSR1 to save them",
+               m_captureSettings.replaySeconds);
+    } else if (!createOutputs(stream)) {
+        delete stream;
+        return false;
+    }
+
+    stream->pauseGate = createPauseGate(stream);
+    if (!startStream(stream))
+        return false;
+
+    StartupProfile::mark("pipeline playing");
+    watchFirstFrame(stream);
+    m_statsTimer->start();
+    return true;
+}
+
+PauseGate *Screencast::createPauseGate(Stream *stream)
+{
+    PauseGate *gate = new PauseGate(stream->pipeline);
+    for (auto *source : qAsConst(stream->sources))
+        gate->addSource(source->source);
+    return gate;
+}
+
+void Screencast::watchFirstFrame(Stream *stream)
+{
+    // A spool sink ends the branch, frames are caught on their way in
+    GstElement *tail = stream->sources.first()->tail;
+    GstPad *pad = gst_element_get_static_pad(tail, "src");
+    if (!pad)
+        pad = gst_element_get_static_pad(tail, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, first_frame_cb, stream, nullptr);
+    gst_object_unref(pad);
+}
+
+bool Screencast::createOutputs(Stream *stream)
+{
+    if (!m_captureSettings.liveUrl.isEmpty())
+        return createLiveOutput(stream);
+
+    const int count = stream->sources.size();
+
+    if (m_captureSettings.spool) {
+        // One spool per source, each encoded into its own file later
+        for (int i = 0; i < count; ++i) {
+            const QString fileName = videoFileName(count > 1 ? i + 1 : 0);
+            const QString spoolFile = spoolFileName(fileName);
+            g_object_set(stream->sources.at(i)->encoder, "location", spoolFile.toUtf8().constData(), nullptr);
+            stream->fileNames.append(fileName);
+            stream->spoolFiles.append(spoolFile);
+        }
+        return true;
+    }
+
+    const bool multiTrack = m_captureSettings.multiTrack && count > 1;
+    GstElement *sharedMuxer = multiTrack ? createOutput(stream, videoFileName()) : nullptr;
+    if (multiTrack && !sharedMuxer)
+        return false;
+
+    for (int i = 0; i < count; ++i) {
+        StreamSource *source = stream->sources.at(i);
+        GstElement *muxer = sharedMuxer;
+        if (!muxer)
+            muxer = createOutput(stream, videoFileName(count > 1 ? i + 1 : 0));
+        if (!muxer || !gst_element_link(source->tail, muxer)) {
+            qCWarning(lcScreencast, "Unable to link stream %d to the muxer", source->nodeId);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Screencast::startStream(Stream *stream)
+{
     m_streams.append(stream);
-    gst_bus_add_watch(bus, bus_watch_cb, stream);
+
+    GstBus *bus = gst_element_get_bus(stream->pipeline);
+    stream->busWatch = gst_bus_add_watch(bus, bus_watch_cb, stream);
+    gst_object_unref(bus);
 
     // Start playing
-    GstStateChangeReturn ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    stream->startTimer.start();
+    GstStateChangeReturn ret = gst_element_set_state(stream->pipeline, GST_STATE_PLAYING);
     if (ret == GST_STATE_CHANGE_FAILURE) {
         qCWarning(lcScreencast, "Unable to set the pipeline to the playing state");
-        gst_bus_remove_watch(bus);
         delete stream;
+        return false;
+    }
+
+    for (auto *sink : qAsConst(stream->sinks)) {
+        gchar *location = nullptr;
+        g_object_get(sink, "location", &location, nullptr);
+        qCInfo(lcScreencast, "Recording to %s", location);
+        g_free(location);
     }
+    for (const auto &spoolFile : qAsConst(stream->spoolFiles))
+        qCInfo(lcScreencast, "Spooling to %s", qPrintable(spoolFile));
+    if (stream->liveSink)
+        qCInfo(lcScreencast, "Streaming to %s", qPrintable(m_captureSettings.liveUrl.toString()));
+
+    return true;
 }
 
 void Screencast::handleSessionClosed(const QVariantMap &map)
 {
     Q_UNUSED(map)
 
-    // TODO: Not clear what map contains, anyway we should kill the stream,
-    // but which one?
+    // All the streams belong to the only session we have
+    qCInfo(lcScreencast, "The portal closed the session");
+
+    m_hasSession = false;
+    m_sessionStreams.clear();
+    if (m_sessionFd >= 0)
+        close(m_sessionFd);
+    m_sessionFd = -1;
+
+    if (!m_daemon) {
+        shutdown();
+        return;
+    }
+
+    if (!recordings().isEmpty())
+        stop();
+    updateState();
+}
+
+void Screencast::handleUnixSignal(int signal)
+{
+    if (signal == SIGUSR1)
+        saveReplay();
+    else
+        shutdown();
+}
+
+void Screencast::reportStats()
+{
+    for (auto *stream : qAsConst(m_streams)) {
+        for (auto *source : qAsConst(stream->sources)) {
+            if (source->copyMonitor)
+                source->copyMonitor->report(source->nodeId);
+
+            if (source->dedup) {
+                guint64 framesIn = 0, framesDropped = 0;
+                g_object_get(source->dedup, "frames-in", &framesIn, "frames-dropped", &framesDropped, nullptr);
+                // At constant framerate videorate encodes a duplicate instead
+                const char *saved = source->rate ? "converted" : "converted or encoded";
+                if (framesIn > 0)
+                    qCInfo(lcScreencast, "Stream %d: %llu of %llu frames were identical and not %s (%.1f%%)",
+                           source->nodeId, framesDropped, framesIn, saved, framesDropped * 100.0 / framesIn);
+            }
+
+            if (!stream->spoolFiles.isEmpty()) {
+                const QJsonObject spool = spool_stats(source->encoder);
+                qCInfo(lcScreencast, "Stream %d: %.0f frames spooled, %.1f MiB at %.1f:1, %.2f ms per frame",
+                       source->nodeId, spool[QStringLiteral("frames")].toDouble(),
+                       spool[QStringLiteral("bytes-written")].toDouble() / (1024.0 * 1024.0),
+                       spool[QStringLiteral("ratio")].toDouble(), spool[QStringLiteral("ms-per-frame")].toDouble());
+            }
+
+            if (source->replay) {
+                const auto stats = source->replay->stats();
+                qCInfo(lcScreencast, "Stream %d: replay buffer holds %.1f s in %d GOPs, %.1f MiB",
+                       source->nodeId, double(stats.duration) / GST_SECOND, stats.gops,
+                       stats.bytes / (1024.0 * 1024.0));
+            }
+        }
+
+        if (stream->threads) {
+            qint64 stageTime[ThreadLayout::Other + 1] = {};
+            for (const auto &thread : stream->threads->threads())
+                stageTime[thread.stage] += thread.cpuTime;
+            QStringList stages;
+            for (int stage = ThreadLayout::Capture; stage <= ThreadLayout::Other; ++stage) {
+                if (stageTime[stage] > 0)
+                    stages.append(QStringLiteral("%1 %2 s").arg(ThreadLayout::stageName(ThreadLayout::Stage(stage)))
+                                  .arg(stageTime[stage] / 1e9, 0, 'f', 1));
+            }
+            if (!stages.isEmpty())
+                qCInfo(lcScreencast, "Stream %s: CPU time of the streaming threads: %s",
+                       qPrintable(stream->name()), qPrintable(stages.join(QLatin1String(", "))));
+        }
+
+        if (stream->memory) {
+            const auto usage = stream->memoryBudget->usage(stream->memory);
+            qCInfo(lcScreencast, "Stream %s: %.1f MiB of raw frames, %.1f MiB at most, of %.1f MiB; "
+                   "%llu frames dropped by full queues",
+                   qPrintable(stream->name()), usage.bytes / (1024.0 * 1024.0), usage.peak / (1024.0 * 1024.0),
+                   usage.limit / (1024.0 * 1024.0), usage.dropped);
+        }
+
+        for (auto *sink : qAsConst(stream->sinks)) {
+            GstStructure *stats = nullptr;
+            gchar *location = nullptr;
+            gchar *backend = nullptr;
+            g_object_get(sink, "stats", &stats, "location", &location, "io-backend", &backend, nullptr);
+            if (!stats) {
+                g_free(location);
+                g_free(backend);
+                continue;
+            }
+
+            // Stalls are the times the muxer had to wait for the disk
+            guint64 bytesWritten = 0, stalls = 0, stallTime = 0, stallMax = 0, writeMax = 0;
+            gst_structure_get_uint64(stats, "bytes-written", &bytesWritten);
+            gst_structure_get_uint64(stats, "stalls", &stalls);
+            gst_structure_get_uint64(stats, "stall-time", &stallTime);
+            gst_structure_get_uint64(stats, "stall-max", &stallMax);
+            gst_structure_get_uint64(stats, "write-max", &writeMax);
+            QStringList histogram;
+            for (const char *bucket : { "100us", "1ms", "10ms", "100ms", "1s", "inf" }) {
+                guint64 count = 0;
+                gst_structure_get_uint64(stats, QByteArray("stall-").append(bucket).constData(), &count);
+                histogram.append(QStringLiteral("<%1: %2").arg(QLatin1String(bucket)).arg(count));
+            }
+            qCInfo(lcScreencast, "Output %s: %.1f MiB written with %s, slowest write %.1f ms",
+                   location, bytesWritten / (1024.0 * 1024.0), backend, writeMax / 1e6);
+            qCInfo(lcScreencast, "Output %s: %llu write stalls, %.1f ms total, %.1f ms max (%s)",
+                   location, stalls, stallTime / 1e6, stallMax / 1e6, qPrintable(histogram.join(QLatin1String(", "))));
+
+            gst_structure_free(stats);
+            g_free(location);
+            g_free(backend);
+        }
+    }
+
+    for (auto *transcoder : qAsConst(m_transcoders)) {
+        qCInfo(lcScreencast, "Encoding %s: %d of %d chunks on %d threads, %llu frames, %.1f fps",
+               qPrintable(transcoder->fileName()), transcoder->chunksDone(), transcoder->chunkCount(),
+               transcoder->threadCount(), transcoder->framesDone(),
+               transcoder->elapsed() > 0 ? transcoder->framesDone() * 1000.0 / transcoder->elapsed() : 0);
+    }
+
+    // The same numbers in a form that tools can parse
+    if (!m_streams.isEmpty() || !m_transcoders.isEmpty())
+        qCInfo(lcScreencast, "Stats: %s", QJsonDocument(stats()).toJson(QJsonDocument::Compact).constData());
+}
+
+QJsonObject Screencast::stats() const
+{
+    ScreencastStatsTracer *tracer = screencast_stats_tracer_get();
+    QJsonArray streams;
+
+    for (auto *stream : qAsConst(m_streams)) {
+        QJsonArray sources;
+        for (auto *source : qAsConst(stream->sources)) {
+            QJsonObject object;
+            object[QStringLiteral("node")] = double(source->nodeId);
+
+            // Every element of the branch, from capture to the muxer input
+            QJsonArray elements;
+            for (GstElement *element = source->source; element; element = next_element(element)) {
+                elements.append(element_stats(tracer, element));
+                if (element == source->tail)
+                    break;
+            }
+            object[QStringLiteral("elements")] = elements;
+
+            // Frames don't survive muxing, so the time from capture
+            // to the file is measured where they enter the muxer
+            ElementStats tailStats;
+            if (screencast_stats_tracer_lookup(tracer, source->tail, &tailStats)) {
+                object[QStringLiteral("glass-to-mux-ms")] = tailStats.age / 1e6;
+                object[QStringLiteral("glass-to-mux-max-ms")] = tailStats.ageMax / 1e6;
+            }
+
+            if (source->queue) {
+                guint level = 0, maxLevel = 0, bytes = 0, maxBytes = 0;
+                g_object_get(source->queue, "current-level-buffers", &level, "max-size-buffers", &maxLevel,
+                             "current-level-bytes", &bytes, "max-size-bytes", &maxBytes, nullptr);
+                QJsonObject queue;
+                queue[QStringLiteral("level")] = int(level);
+                queue[QStringLiteral("max")] = int(maxLevel);
+                queue[QStringLiteral("bytes")] = double(bytes);
+                queue[QStringLiteral("max-bytes")] = double(maxBytes);
+                object[QStringLiteral("queue")] = queue;
+            }
+
+            guint64 dropped = 0, duplicated = 0;
+            if (source->dedup) {
+                guint64 identical = 0;
+                g_object_get(source->dedup, "frames-dropped", &identical, nullptr);
+                dropped += identical;
+            }
+            if (source->rate) {
+                guint64 rateDropped = 0, rateDuplicated = 0;
+                g_object_get(source->rate, "drop", &rateDropped, "duplicate", &rateDuplicated, nullptr);
+                dropped += rateDropped;
+                duplicated += rateDuplicated;
+            }
+            object[QStringLiteral("dropped")] = double(dropped);
+            object[QStringLiteral("duplicated")] = double(duplicated);
+            if (source->cursor) {
+                guint64 blended = 0;
+                g_object_get(source->cursor, "frames-blended", &blended, nullptr);
+                object[QStringLiteral("cursor-blended")] = double(blended);
+            }
+            if (source->stamp) {
+                guint64 stamped = 0;
+                g_object_get(source->stamp, "frames-stamped", &stamped, nullptr);
+                object[QStringLiteral("latency-stamped")] = double(stamped);
+            }
+
+            if (!stream->spoolFiles.isEmpty())
+                object[QStringLiteral("spool")] = spool_stats(source->encoder);
+
+            ElementStats encoderStats;
+            if (source->encoder && screencast_stats_tracer_lookup(tracer, source->encoder, &encoderStats)) {
+                QJsonObject encoder;
+                encoder[QStringLiteral("fps")] = encoderStats.fps;
+                encoder[QStringLiteral("kbps")] = encoderStats.bytesPerSecond * 8 / 1000;
+                encoder[QStringLiteral("latency-ms")] = encoderStats.latency / 1e6;
+                object[QStringLiteral("encoder")] = encoder;
+            }
+
+            sources.append(object);
+        }
+
+        QJsonArray outputs;
+        for (auto *sink : qAsConst(stream->sinks)) {
+            GstStructure *stats = nullptr;
+            gchar *location = nullptr;
+            g_object_get(sink, "stats", &stats, "location", &location, nullptr);
+
+            QJsonObject output;
+            output[QStringLiteral("location")] = QString::fromUtf8(location);
+            if (stats) {
+                guint64 bytesWritten = 0, stalls = 0, stallMax = 0;
+                gst_structure_get_uint64(stats, "bytes-written", &bytesWritten);
+                gst_structure_get_uint64(stats, "stalls", &stalls);
+                gst_structure_get_uint64(stats, "stall-max", &stallMax);
+                output[QStringLiteral("bytes-written")] = double(bytesWritten);
+                output[QStringLiteral("stalls")] = double(stalls);
+                output[QStringLiteral("stall-max-ms")] = stallMax / 1e6;
+                gst_structure_free(stats);
+            }
+            outputs.append(output);
+            g_free(location);
+        }
+        if (stream->liveSink) {
+            QJsonObject output;
+            output[QStringLiteral("url")] = m_captureSettings.liveUrl.toString();
+            outputs.append(output);
+        }
+        for (const auto &spoolFile : qAsConst(stream->spoolFiles)) {
+            QJsonObject output;
+            output[QStringLiteral("location")] = spoolFile;
+            outputs.append(output);
+        }
+
+        QJsonArray threads;
+        if (stream->threads) {
+            for (const auto &thread : stream->threads->threads()) {
+                QJsonObject entry;
+                entry[QStringLiteral("name")] = thread.name;
+                entry[QStringLiteral("stage")] = ThreadLayout::stageName(thread.stage);
+                entry[QStringLiteral("tid")] = thread.tid;
+                entry[QStringLiteral("cpu-ms")] = thread.cpuTime / 1e6;
+                entry[QStringLiteral("running")] = thread.running;
+                threads.append(entry);
+            }
+        }
+
+        QJsonObject object;
+        object[QStringLiteral("name")] = stream->name();
+        object[QStringLiteral("draining")] = stream->drainTimer.isValid();
+        if (stream->pauseGate) {
+            object[QStringLiteral("paused")] = stream->pauseGate->isPaused();
+            object[QStringLiteral("paused-ms")] = stream->pauseGate->pausedTime() / 1e6;
+            object[QStringLiteral("pause-dropped")] = double(stream->pauseGate->droppedFrames());
+        }
+        object[QStringLiteral("sources")] = sources;
+        object[QStringLiteral("outputs")] = outputs;
+        object[QStringLiteral("threads")] = threads;
+        if (stream->memory)
+            object[QStringLiteral("memory")] = memory_stats(stream->memoryBudget->usage(stream->memory));
+        streams.append(object);
+    }
+
+    QJsonArray transcodes;
+    for (auto *transcoder : qAsConst(m_transcoders)) {
+        QJsonObject object;
+        object[QStringLiteral("input")] = transcoder->input();
+        object[QStringLiteral("location")] = transcoder->fileName();
+        object[QStringLiteral("chunks")] = transcoder->chunksDone();
+        object[QStringLiteral("chunks-total")] = transcoder->chunkCount();
+        object[QStringLiteral("threads")] = transcoder->threadCount();
+        object[QStringLiteral("frames")] = double(transcoder->framesDone());
+        object[QStringLiteral("total")] = double(transcoder->frameCount());
+        object[QStringLiteral("elapsed-ms")] = double(transcoder->elapsed());
+        transcodes.append(object);
+    }
+
+    // Threads that encoders and converters start themselves are only
+    // part of the total
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    QJsonObject object;
+    object[QStringLiteral("streams")] = streams;
+    object[QStringLiteral("transcodes")] = transcodes;
+    if (m_memoryBudget) {
+        QJsonObject memory = memory_stats(m_memoryBudget->usage());
+        memory[QStringLiteral("policy")] = MemoryBudget::policyName(m_memoryBudget->policy());
+        object[QStringLiteral("memory")] = memory;
+    }
+    object[QStringLiteral("cpu-ms")] = (double(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000 +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+    return object;
+}
+
+bool Screencast::start(QString *errorMessage)
+{
+    if (m_shuttingDown) {
+        if (errorMessage)
+            *errorMessage = tr("Shutting down");
+        return false;
+    }
+    if (!recordings().isEmpty()) {
+        if (errorMessage)
+            *errorMessage = tr("Already recording");
+        return false;
+    }
+    if (!m_daemon) {
+        if (errorMessage)
+            *errorMessage = tr("Only a daemon can record more than once");
+        return false;
+    }
+
+    if (!m_gstReady || !m_hasSession) {
+        // Recording starts as soon as the sources are selected,
+        // asking the portal again if the session was closed
+        if (m_gstReady && !m_startRequested && m_captureSettings.pipeWireNodes.isEmpty())
+            m_portal->createSession();
+        m_startRequested = true;
+        return true;
+    }
+
+    if (!startRecording(m_sessionFd, m_sessionStreams)) {
+        if (errorMessage)
+            *errorMessage = tr("Unable to start the recording");
+        updateState();
+        return false;
+    }
+
+    updateState();
+    return true;
+}
+
+bool Screencast::stop(QString *errorMessage)
+{
+    if (!m_daemon) {
+        shutdown();
+        return true;
+    }
+
+    // Cancels a recording that is waiting for the sources
+    const bool requested = m_startRequested;
+    m_startRequested = false;
+
+    const auto streams = recordings();
+    if (streams.isEmpty()) {
+        updateState();
+        if (requested)
+            return true;
+        if (errorMessage)
+            *errorMessage = tr("Not recording");
+        return false;
+    }
+
+    // Same as on exit, except that the daemon keeps running
+    for (auto *stream : streams) {
+        stream->drainTimer.start();
+        gst_element_send_event(stream->pipeline, gst_event_new_eos());
+    }
+    QTimer::singleShot(m_shutdownTimer->interval(), this, &Screencast::dropStalledStreams);
+
+    updateState();
+    return true;
+}
+
+bool Screencast::pause(QString *errorMessage)
+{
+    const auto streams = recordings();
+    if (streams.isEmpty()) {
+        if (errorMessage)
+            *errorMessage = tr("Not recording");
+        return false;
+    }
+
+    // The pipeline keeps playing, frames are dropped as they are captured
+    for (auto *stream : streams) {
+        if (!stream->pauseGate || stream->pauseGate->isPaused())
+            continue;
+        stream->pauseGate->pause();
+        qCInfo(lcScreencast, "Stream %s paused", qPrintable(stream->name()));
+    }
+
+    updateState();
+    return true;
+}
+
+bool Screencast::resume(QString *errorMessage)
+{
+    const auto streams = recordings();
+    if (streams.isEmpty()) {
+        if (errorMessage)
+            *errorMessage = tr("Not recording");
+        return false;
+    }
+
+    for (auto *stream : streams) {
+        if (!stream->pauseGate || !stream->pauseGate->isPaused())
+            continue;
+        stream->pauseGate->resume();
+        qCInfo(lcScreencast, "Stream %s resumed, paused for %.1f s in total",
+               qPrintable(stream->name()), double(stream->pauseGate->pausedTime()) / GST_SECOND);
+    }
+
+    updateState();
+    return true;
+}
+
+QString Screencast::state() const
+{
+    const auto streams = recordings();
+    if (streams.isEmpty()) {
+        if (!m_streams.isEmpty())
+            return QStringLiteral("stopping");
+        if (!m_gstReady || !m_hasSession || m_startRequested)
+            return QStringLiteral("starting");
+        return QStringLiteral("idle");
+    }
+
+    for (auto *stream : streams) {
+        if (!stream->pauseGate || !stream->pauseGate->isPaused())
+            return QStringLiteral("recording");
+    }
+    return QStringLiteral("paused");
+}
+
+QStringList Screencast::files() const
+{
+    QStringList files;
+    for (auto *stream : recordings()) {
+        for (auto *sink : qAsConst(stream->sinks)) {
+            gchar *location = nullptr;
+            g_object_get(sink, "location", &location, nullptr);
+            if (location)
+                files.append(QString::fromUtf8(location));
+            g_free(location);
+        }
+        files.append(stream->spoolFiles);
+    }
+    return files;
+}
+
+QVariantMap Screencast::status() const
+{
+    // Length of the file, pauses are cut out
+    qint64 duration = 0;
+    for (auto *stream : recordings()) {
+        qint64 elapsed = stream->startTimer.elapsed();
+        if (stream->pauseGate)
+            elapsed -= qint64(stream->pauseGate->pausedTime() / GST_MSECOND);
+        duration = qMax(duration, elapsed);
+    }
+
+    QVariantMap map;
+    map.insert(QStringLiteral("state"), state());
+    map.insert(QStringLiteral("files"), files());
+    map.insert(QStringLiteral("duration"), duration);
+    map.insert(QStringLiteral("sources"), m_daemon ? m_sessionStreams.size() : m_streams.size());
+    map.insert(QStringLiteral("transcoding"), m_transcoders.size());
+    return map;
+}
+
+QVector<Stream *> Screencast::recordings() const
+{
+    // Replay clips and stopped streams are draining on their own
+    QVector<Stream *> streams;
+    for (auto *stream : m_streams) {
+        if (!stream->drainTimer.isValid())
+            streams.append(stream);
+    }
+    return streams;
+}
+
+void Screencast::updateState()
+{
+    const QString current = state();
+    if (current == m_lastState)
+        return;
+
+    m_lastState = current;
+    qCInfo(lcScreencast, "State: %s", qPrintable(current));
+    emit stateChanged(current);
+}
+
+void Screencast::saveReplay()
+{
+    if (m_shuttingDown)
+        return;
+
+    const auto streams = m_streams;
+    for (auto *live : streams) {
+        // Skip clips that are still being saved
+        if (live->drainTimer.isValid())
+            continue;
+
+        // Take a snapshot of every ring, the clip is written
+        // by its own pipeline while recording goes on
+        Stream *stream = new Stream();
+        stream->screencast = this;
+        stream->pipeline = gst_pipeline_new(nullptr);
+        QVector<QVector<GstBuffer *>> clips;
+        GstClockTime base = GST_CLOCK_TIME_NONE;
+
+        for (auto *liveSource : qAsConst(live->sources)) {
+            GstCaps *caps = nullptr;
+            QVector<GstBuffer *> buffers;
+            if (!liveSource->replay || !liveSource->replay->snapshot(&caps, buffers))
+                continue;
+
+            GstElement *src = gst_element_factory_make("appsrc", nullptr);
+            if (!src) {
+                qCWarning(lcScreencast, "Unable to create the replay source");
+                gst_caps_unref(caps);
+                for (auto *buffer : qAsConst(buffers))
+                    gst_buffer_unref(buffer);
+                continue;
+            }
+            g_object_set(src, "caps", caps, "format", GST_FORMAT_TIME, nullptr);
+            gst_caps_unref(caps);
+            gst_bin_add(GST_BIN(stream->pipeline), src);
+
+            StreamSource *source = new StreamSource();
+            source->nodeId = liveSource->nodeId;
+            source->source = src;
+            source->tail = src;
+            stream->sources.append(source);
+            clips.append(buffers);
+
+            const GstClockTime start = GST_BUFFER_DTS_IS_VALID(buffers.first())
+                    ? GST_BUFFER_DTS(buffers.first()) : GST_BUFFER_PTS(buffers.first());
+            if (GST_CLOCK_TIME_IS_VALID(start) && (!GST_CLOCK_TIME_IS_VALID(base) || start < base))
+                base = start;
+        }
+
+        if (stream->sources.isEmpty()) {
+            qCInfo(lcScreencast, "Nothing to save for stream %s yet", qPrintable(live->name()));
+            delete stream;
+            continue;
+        }
+
+        const bool created = createOutputs(stream);
+        if (!created || !startStream(stream)) {
+            for (const auto &buffers : qAsConst(clips)) {
+                for (auto *buffer : buffers)
+                    gst_buffer_unref(buffer);
+            }
+            // startStream() deletes the stream when it fails
+            if (!created)
+                delete stream;
+            continue;
+        }
+
+        // Clips start from zero, sources keep their relative offsets
+        if (!GST_CLOCK_TIME_IS_VALID(base))
+            base = 0;
+        for (int i = 0; i < clips.size(); ++i) {
+            GstAppSrc *src = GST_APP_SRC(stream->sources.at(i)->source);
+            for (auto *buffer : clips.at(i)) {
+                // Metadata is shared with the ring, the payload is not copied
+                GstBuffer *copy = gst_buffer_copy(buffer);
+                gst_buffer_unref(buffer);
+                if (GST_BUFFER_PTS_IS_VALID(copy))
+                    GST_BUFFER_PTS(copy) = GST_BUFFER_PTS(copy) > base ? GST_BUFFER_PTS(copy) - base : 0;
+                if (GST_BUFFER_DTS_IS_VALID(copy))
+                    GST_BUFFER_DTS(copy) = GST_BUFFER_DTS(copy) > base ? GST_BUFFER_DTS(copy) - base : 0;
+                gst_app_src_push_buffer(src, copy);
+            }
+            gst_app_src_end_of_stream(src);
+        }
+
+        // The clip drains on its own, shutdown must not cut it short
+        stream->drainTimer.start();
+        qCInfo(lcScreencast, "Saving the replay buffer of stream %s", qPrintable(live->name()));
+    }
 }
 
 void Screencast::shutdown()
 {
-    qDeleteAll(m_streams);
+    // A second signal doesn't wait for the streams to drain
+    if (m_shuttingDown) {
+        forceShutdown();
+        return;
+    }
+
+    m_shuttingDown = true;
+
+    if (m_streams.isEmpty()) {
+        quitWhenDone();
+        return;
+    }
+
+    // Send EOS to all the streams at once, muxers will finalize the files
+    // and each stream is deleted when its EOS reaches the bus
+    qCInfo(lcScreencast, "Stopping %d streams, waiting up to %d ms for them to drain",
+           m_streams.size(), m_shutdownTimer->interval());
+    const auto streams = m_streams;
+    for (auto *stream : streams) {
+        // Replay clips being saved are already draining
+        if (stream->drainTimer.isValid())
+            continue;
+        stream->drainTimer.start();
+        gst_element_send_event(stream->pipeline, gst_event_new_eos());
+    }
+
+    m_shutdownTimer->start();
+}
+
+void Screencast::forceShutdown()
+{
+    for (auto *stream : qAsConst(m_streams)) {
+        qCWarning(lcScreencast, "Stream %s did not drain in %lld ms, files may be truncated",
+                  qPrintable(stream->name()), stream->drainTimer.isValid() ? stream->drainTimer.elapsed() : 0);
+        // Spools are readable up to the last frame, they are left for later
+        for (const auto &spoolFile : qAsConst(stream->spoolFiles))
+            qCWarning(lcScreencast, "Spool %s is kept, encode it with --transcode", qPrintable(spoolFile));
+        stream->spoolFiles.clear();
+    }
+
+    // Transcoders remove themselves from the list when cancelled
+    const auto transcoders = m_transcoders;
+    for (auto *transcoder : transcoders)
+        transcoder->cancel();
+
+    // Streams remove themselves from the list when deleted
+    const auto streams = m_streams;
+    qDeleteAll(streams);
     QCoreApplication::quit();
 }
 
+void Screencast::dropStalledStreams()
+{
+    const auto streams = m_streams;
+    for (auto *stream : streams) {
+        if (!stream->drainTimer.isValid() || stream->drainTimer.elapsed() < m_shutdownTimer->interval())
+            continue;
+        qCWarning(lcScreencast, "Stream %s did not drain in %lld ms, files may be truncated",
+                  qPrintable(stream->name()), stream->drainTimer.elapsed());
+        delete stream;
+    }
+}
+
+void Screencast::removeStream(Stream *stream)
+{
+    m_streams.removeOne(stream);
+
+    // Also after an error, the spool holds everything up to it
+    for (int i = 0; i < stream->spoolFiles.size(); ++i)
+        startTranscoder(stream->spoolFiles.at(i), stream->fileNames.at(i), true);
+
+    if (m_shuttingDown) {
+        if (m_streams.isEmpty()) {
+            m_shutdownTimer->stop();
+            quitWhenDone();
+        }
+        return;
+    }
+
+    if (m_streams.isEmpty()) {
+        if (m_transcoders.isEmpty())
+            m_statsTimer->stop();
+        // Have the encoder and muxer ready for the next recording
+        if (m_daemon)
+            prepareStream();
+    }
+    updateState();
+}
+
+bool Screencast::startTranscoder(const QString &input, const QString &fileName, bool background)
+{
+    auto *transcoder = new Transcoder(input, fileName, m_encoder.data(), m_encoderSettings, this);
+    connect(transcoder, &Transcoder::finished, this, [this, transcoder](bool succeeded) {
+        handleTranscoderFinished(transcoder, succeeded);
+    });
+
+    // In the background only idle cores are used, otherwise as many
+    // as there are encoder threads
+    if (background)
+        transcoder->setIdlePriority(true);
+    else
+        transcoder->setThreads(m_encoderSettings.threads);
+
+    if (!transcoder->start()) {
+        if (background)
+            qCWarning(lcScreencast, "Spool %s is kept, encode it with --transcode", qPrintable(input));
+        delete transcoder;
+        return false;
+    }
+
+    qCInfo(lcScreencast, "Encoding %s into %s%s, %d chunks on %d threads",
+           qPrintable(input), qPrintable(fileName), background ? " in the background" : "",
+           transcoder->chunkCount(), transcoder->threadCount());
+    m_transcoders.append(transcoder);
+    m_statsTimer->start();
+    return true;
+}
+
+void Screencast::handleTranscoderFinished(Transcoder *transcoder, bool succeeded)
+{
+    m_transcoders.removeOne(transcoder);
+    transcoder->deleteLater();
+
+    if (succeeded) {
+        const qint64 elapsed = transcoder->elapsed();
+        qCInfo(lcScreencast, "Encoded %s in %.1f s, %llu frames at %.1f fps",
+               qPrintable(transcoder->fileName()), elapsed / 1000.0, transcoder->framesDone(),
+               elapsed > 0 ? transcoder->framesDone() * 1000.0 / elapsed : 0);
+        if (transcoder->isSpool() && !m_captureSettings.keepSpool && !QFile::remove(transcoder->input()))
+            qCWarning(lcScreencast, "Unable to remove spool %s", qPrintable(transcoder->input()));
+    } else {
+        // The muxer didn't finalize it, encoding again starts over
+        m_transcodeFailed = true;
+        QFile::remove(transcoder->fileName());
+        if (transcoder->isSpool())
+            qCWarning(lcScreencast, "Spool %s is kept, encode it with --transcode", qPrintable(transcoder->input()));
+    }
+
+    if (m_streams.isEmpty() && m_transcoders.isEmpty())
+        m_statsTimer->stop();
+    if (m_shuttingDown)
+        quitWhenDone();
+}
+
+void Screencast::quitWhenDone()
+{
+    if (!m_streams.isEmpty())
+        return;
+
+    if (m_transcoders.isEmpty()) {
+        QCoreApplication::exit(m_transcodeFailed ? 1 : 0);
+        return;
+    }
+
+    qCInfo(lcScreencast, "Waiting for %d files to be encoded, stop again to cancel",
+           m_transcoders.size());
+}
+
+bool Screencast::transcode(const QStringList &inputs)
+{
+    if (!m_encoder->isAvailable()) {
+        qCWarning(lcScreencast, "Encoder \"%s\" is not installed.", qPrintable(m_encoder->name()));
+        return false;
+    }
+    if (!m_encoder->supportsContainer(m_encoderSettings.container)) {
+        qCWarning(lcScreencast, "Encoder \"%s\" cannot be used with container \"%s\".",
+                  qPrintable(m_encoder->name()),
+                  qPrintable(EncoderSettings::containerName(m_encoderSettings.container)));
+        return false;
+    }
+
+    // Next to the input, with the same name
+    const QString extension = EncoderSettings::fileExtension(m_encoderSettings.container);
+    for (const QString &input : inputs) {
+        const QFileInfo info(input);
+        const QString base = QStringLiteral("%1/%2").arg(info.absolutePath(), info.completeBaseName());
+        QString fileName = QStringLiteral("%1.%2").arg(base, extension);
+        for (int i = 2; QFile::exists(fileName); ++i)
+            fileName = QStringLiteral("%1 (%2).%3").arg(base, QString::number(i), extension);
+        startTranscoder(info.absoluteFilePath(), fileName, false);
+    }
+
+    // Quits when the last one is done, a signal cancels them
+    m_shuttingDown = true;
+    return !m_transcoders.isEmpty();
+}
+
+StreamSource::~StreamSource()
+{
+    delete copyMonitor;
+    copyMonitor = nullptr;
+
+    delete replay;
+    replay = nullptr;
+
+    delete quality;
+    quality = nullptr;
+}
+
 Stream::~Stream()
 {
+    // However the stream ends, no message may reach it once it's gone
+    if (busWatch)
+        g_source_remove(busWatch);
+    busWatch = 0;
+
     if (pipeline) {
         gst_element_set_state(pipeline, GST_STATE_NULL);
+        // Threads are gone, their last messages were handled
+        delete threads;
+        threads = nullptr;
+        if (memory)
+            memoryBudget->removeAccount(memory);
+        memory = nullptr;
         gst_object_unref(pipeline);
         pipeline = nullptr;
     }
 
+    delete pauseGate;
+    pauseGate = nullptr;
+
+    qDeleteAll(sources);
+    sources.clear();
+
     if (screencast) {
-        screencast->m_streams.removeOne(this);
+        screencast->removeStream(this);
         screencast = nullptr;
     }
 }
@@ -7,16 +7,99 @@
 #ifndef SCREENCAST_H
 #define SCREENCAST_H
 
+#include <QElapsedTimer>
 #include <QEvent>
+#include <QJsonObject>
 #include <QLoggingCategory>
 #include <QObject>
+#include <QRect>
+#include <QSize>
+#include <QScopedPointer>
+#include <QStringList>
+#include <QTimer>
+#include <QUrl>
 
 #include <gst/gstelement.h>
 
+#include "encoder.h"
+#include "memorybudget.h"
+#include "portal.h"
+#include "spool.h"
+#include "threadlayout.h"
+
 Q_DECLARE_LOGGING_CATEGORY(lcScreencast)
 
-class Portal;
+class CopyMonitor;
+class GStreamerLoader;
+class PauseGate;
+class QualityController;
+class ReplayBuffer;
+class Transcoder;
 class Stream;
+class StreamSource;
+
+class CaptureSettings
+{
+public:
+    // Target frames per second, in variable framerate mode this
+    // is the maximum rate frames are passed to the encoder
+    int framerate = 30;
+    // Only encode frames when the compositor delivers them
+    bool variableFramerate = false;
+    // Drop frames identical to the previous one
+    bool deduplicate = true;
+    // Lower the encoder settings when the machine can't keep up
+    bool adaptiveQuality = true;
+    // Record all monitors into a single file with one track
+    // each, instead of one file per monitor
+    bool multiTrack = false;
+    // Record these nodes from the default PipeWire remote,
+    // bypassing the portal (empty means ask the portal)
+    QVector<uint> pipeWireNodes;
+    // Keep this many seconds of encoded video in memory and only
+    // write them when asked to (0 records straight to disk)
+    int replaySeconds = 0;
+    // Memory limit of the replay buffer in MiB, shared by all sources
+    int replayMemory = 512;
+    // Reuse the sources selected last time instead of showing the picker
+    bool persistSources = true;
+    // What the picker offers, Portal::AvailableSourceTypes flags
+    uint sourceTypes = Portal::Monitor;
+    // Only record this part of each source, relative to its top left
+    // corner (null records everything)
+    QRect region;
+    // Scale frames down to fit this size keeping the aspect ratio, a
+    // zero width only limits the height (null keeps the source size)
+    QSize outputSize;
+    // With Metadata the cursor is drawn after conversion, so that
+    // moving it doesn't cost a whole new frame from the compositor
+    Portal::AvailableCursorModes cursorMode = Portal::Metadata;
+    // Send the video live to this rtp://, srt:// or rtsp:// URL
+    // instead of writing files (empty records to disk)
+    QUrl liveUrl;
+    // Draw the capture time onto every frame, so that the receiver
+    // can measure the glass to glass latency
+    bool latencyStamp = false;
+    // Write losslessly compressed raw frames while recording and
+    // encode them once the recording is over
+    bool spool = false;
+    Spool::Compression spoolCompression = Spool::defaultCompression();
+    // Keep the spool after it was encoded
+    bool keepSpool = false;
+    // Whether capture, conversion, encoding and muxing share two
+    // streaming threads or have one each
+    ThreadLayout::Layout threadLayout = ThreadLayout::Shared;
+    // CPUs the streaming threads of each stage are pinned to, indexed
+    // by ThreadLayout::Stage, empty lets the scheduler pick
+    QVector<int> stageCpus[ThreadLayout::Other];
+    // Added to the niceness of the encoding threads
+    int encoderNice = 0;
+    // Memory for raw frames in MiB, shared by all streams, 0 only
+    // limits the number of frames each queue holds
+    int memoryBudget = 1024;
+    // Which frame a stream drops when its share is used up
+    MemoryBudget::Policy memoryPolicy = MemoryBudget::DropOldest;
+};
 
 class Screencast : public QObject
 {
@@ -25,6 +108,48 @@ public:
     explicit Screencast(QObject *parent = nullptr);
     ~Screencast();
 
+    CaptureSettings captureSettings() const;
+    void setCaptureSettings(const CaptureSettings &settings);
+
+    EncoderSettings encoderSettings() const;
+    void setEncoderSettings(const EncoderSettings &settings);
+
+    // Recording starts once the loader is done
+    void setGStreamerLoader(GStreamerLoader *loader);
+
+    // How long to wait for streams to finalize their files on exit
+    int shutdownTimeout() const;
+    void setShutdownTimeout(int msecs);
+
+    // Stay resident once the sources are selected and only record
+    // when asked to, the first recording starts with the D-Bus call
+    bool isDaemon() const;
+    void setDaemon(bool daemon);
+
+    // Recording control, on failure the reason is set and false is returned
+    bool start(QString *errorMessage = nullptr);
+    bool stop(QString *errorMessage = nullptr);
+    bool pause(QString *errorMessage = nullptr);
+    bool resume(QString *errorMessage = nullptr);
+
+    // One of "starting", "idle", "recording", "paused" or "stopping"
+    QString state() const;
+    // Files written by the current recording
+    QStringList files() const;
+    // State, files and duration of the current recording
+    QVariantMap status() const;
+
+    // Health of every stream, element by element
+    QJsonObject stats() const;
+
+    // Encodes spools left by earlier recordings, or finished recordings
+    // again, and quits when done, returns false if none of them could
+    // be started
+    bool transcode(const QStringList &inputs);
+
+Q_SIGNALS:
+    void stateChanged(const QString &state);
+
 protected:
     bool event(QEvent *event) override;
 
@@ -32,27 +157,146 @@ private:
     friend class Stream;
 
     bool m_initialized = false;
+    bool m_gstReady = false;
+    bool m_shuttingDown = false;
+    bool m_daemon = false;
+    GStreamerLoader *m_loader = nullptr;
     Portal *m_portal = nullptr;
+    QTimer *m_statsTimer = nullptr;
+    QTimer *m_shutdownTimer = nullptr;
     QVector<Stream *> m_streams;
+    QVector<Transcoder *> m_transcoders;
+    bool m_transcodeFailed = false;
+    CaptureSettings m_captureSettings;
+    EncoderSettings m_encoderSettings;
+    QScopedPointer<Encoder> m_encoder;
+    // Created with the first stream
+    QScopedPointer<MemoryBudget> m_memoryBudget;
+
+    // Built while the portal is asked for the streams
+    Stream *m_prepared = nullptr;
+    EncoderSettings m_preparedSettings;
+    // Streams the portal handed out before GStreamer was ready
+    bool m_hasPendingStreams = false;
+    int m_pendingFd = -1;
+    Portal::Streams m_pendingStreams;
+    // Sources selected for the whole portal session, in daemon mode
+    bool m_hasSession = false;
+    bool m_startRequested = false;
+    int m_sessionFd = -1;
+    Portal::Streams m_sessionStreams;
+    QString m_lastState;
 
-    QString videoFileName() const;
+    QString videoFileName(int monitor = 0) const;
+    static QString spoolFileName(const QString &fileName);
 
     void initialize();
+    bool startRecording(int fd, const Portal::Streams &streams);
+    QVector<Stream *> recordings() const;
+    void updateState();
+    StreamSource *createSource(GstBin *bin, int fd, const Portal::Stream &portalStream,
+                               const EncoderSettings &encoderSettings);
+    ThreadLayout *createThreadLayout(GstElement *pipeline) const;
+    void addToMemoryBudget(Stream *stream);
+    StreamSource *createBranch(GstBin *bin, const QString &format, const EncoderSettings &encoderSettings);
+    bool attachSource(StreamSource *source, GstBin *bin, int fd, const Portal::Stream &portalStream,
+                      const EncoderSettings &encoderSettings);
+    void prepareStream();
+    Stream *takePreparedStream(const Portal::Streams &streams);
+    GstElement *createOutput(Stream *stream, const QString &fileName);
+    bool createLiveOutput(Stream *stream);
+    bool createOutputs(Stream *stream);
+    bool startStream(Stream *stream);
+    PauseGate *createPauseGate(Stream *stream);
+    void watchFirstFrame(Stream *stream);
+    void removeStream(Stream *stream);
+    bool startTranscoder(const QString &input, const QString &fileName, bool background);
+    void handleTranscoderFinished(Transcoder *transcoder, bool succeeded);
+    void quitWhenDone();
 
 private Q_SLOTS:
-    void handleStreamReady(int fd, uint nodeId, const QVariantMap &map);
+    void handleGStreamerReady(bool succeeded);
+    void handleStreamsReady(int fd, const Portal::Streams &streams);
     void handleSessionClosed(const QVariantMap &map);
+    void handleUnixSignal(int signal);
+    void reportStats();
+    void saveReplay();
     void shutdown();
+    void forceShutdown();
+    void dropStalledStreams();
+};
+
+// One monitor or window being recorded
+class StreamSource
+{
+public:
+    StreamSource() = default;
+    ~StreamSource();
+
+    uint nodeId = 0;
+    CopyMonitor *copyMonitor = nullptr;
+    // Only in replay mode
+    ReplayBuffer *replay = nullptr;
+    QualityController *quality = nullptr;
+
+    // Owned by the pipeline
+    GstElement *source = nullptr;
+    // First element after the source
+    GstElement *head = nullptr;
+    GstElement *dedup = nullptr;
+    GstElement *convert = nullptr;
+    // Only with the staged thread layout
+    GstElement *convertQueue = nullptr;
+    // Only when the cursor is sent as metadata
+    GstElement *cursor = nullptr;
+    // Only when measuring the latency of a live stream
+    GstElement *stamp = nullptr;
+    // Only at constant framerate
+    GstElement *rate = nullptr;
+    GstElement *queue = nullptr;
+    GstElement *encoder = nullptr;
+    // Last element of the branch, linked to the muxer
+    GstElement *tail = nullptr;
+
+    // Variable framerate rate limiting
+    GstClockTime frameInterval = GST_CLOCK_TIME_NONE;
+    GstClockTime nextFrameTime = GST_CLOCK_TIME_NONE;
 };
 
+// A pipeline recording one or more sources on a common clock
 class Stream
 {
 public:
     Stream() = default;
     ~Stream();
 
+    QString name() const;
+
     Screencast *screencast = nullptr;
     GstElement *pipeline = nullptr;
+    QVector<StreamSource *> sources;
+    // File sinks, owned by the pipeline
+    QVector<GstElement *> sinks;
+    // Source id of the bus watch, once the pipeline was started
+    guint busWatch = 0;
+    // Network sink when streaming live, owned by the pipeline
+    GstElement *liveSink = nullptr;
+    // Spool written for each source and the file it's encoded into,
+    // in spool mode; the sinks are the sources' encoders
+    QStringList spoolFiles;
+    QStringList fileNames;
+
+    // Started when the pipeline is set to playing
+    QElapsedTimer startTimer;
+    // Started when EOS is sent
+    QElapsedTimer drainTimer;
+    // Only for recordings
+    PauseGate *pauseGate = nullptr;
+    // Streaming threads of the pipeline
+    ThreadLayout *threads = nullptr;
+    // Share of the memory budget, when there is one
+    MemoryBudget *memoryBudget = nullptr;
+    MemoryBudget::Account *memory = nullptr;
 };
 
 class StartupEvent : public QEvent
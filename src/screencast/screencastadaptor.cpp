@@ -0,0 +1,58 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QJsonDocument>
+
+#include "screencast.h"
+#include "screencastadaptor.h"
+
+ScreencastAdaptor::ScreencastAdaptor(Screencast *parent)
+    : QDBusAbstractAdaptor(parent)
+    , m_screencast(parent)
+{
+    connect(parent, &Screencast::stateChanged, this, &ScreencastAdaptor::StateChanged);
+}
+
+QStringList ScreencastAdaptor::Start()
+{
+    QString errorMessage;
+    reply(m_screencast->start(&errorMessage), errorMessage);
+    return m_screencast->files();
+}
+
+void ScreencastAdaptor::Stop()
+{
+    QString errorMessage;
+    reply(m_screencast->stop(&errorMessage), errorMessage);
+}
+
+void ScreencastAdaptor::Pause()
+{
+    QString errorMessage;
+    reply(m_screencast->pause(&errorMessage), errorMessage);
+}
+
+void ScreencastAdaptor::Resume()
+{
+    QString errorMessage;
+    reply(m_screencast->resume(&errorMessage), errorMessage);
+}
+
+QVariantMap ScreencastAdaptor::Status()
+{
+    return m_screencast->status();
+}
+
+QString ScreencastAdaptor::Stats()
+{
+    return QString::fromUtf8(QJsonDocument(m_screencast->stats()).toJson(QJsonDocument::Compact));
+}
+
+void ScreencastAdaptor::reply(bool succeeded, const QString &errorMessage)
+{
+    if (!succeeded && calledFromDBus())
+        sendErrorReply(QStringLiteral("io.liri.Screencast.Error.Failed"), errorMessage);
+}
@@ -0,0 +1,49 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef SCREENCASTADAPTOR_H
+#define SCREENCASTADAPTOR_H
+
+#include <QDBusAbstractAdaptor>
+#include <QDBusContext>
+#include <QStringList>
+#include <QVariantMap>
+
+class Screencast;
+
+/*
+ * The io.liri.Screencast interface, exported on the session bus
+ * so that a recording can be controlled and monitored from outside.
+ */
+class ScreencastAdaptor : public QDBusAbstractAdaptor, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "io.liri.Screencast")
+public:
+    explicit ScreencastAdaptor(Screencast *parent);
+
+public Q_SLOTS:
+    // Returns the files being written, empty if the
+    // recording starts once the sources are selected
+    QStringList Start();
+    void Stop();
+    void Pause();
+    void Resume();
+    // State, files, duration in ms and number of sources
+    QVariantMap Status();
+    // Same JSON document as the periodic stats line
+    QString Stats();
+
+Q_SIGNALS:
+    void StateChanged(const QString &state);
+
+private:
+    Screencast *m_screencast = nullptr;
+
+    void reply(bool succeeded, const QString &errorMessage);
+};
+
+#endif // SCREENCASTADAPTOR_H
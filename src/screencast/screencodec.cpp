@@ -0,0 +1,706 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <queue>
+
+#include "screencodec.h"
+#include "slicepool.h"
+
+using namespace ScreenCodec;
+
+static const uint32_t frameMagic = 0x4e524353;
+static const uint16_t frameVersion = 1;
+static const uint16_t keyframeFlag = 0x1;
+
+struct FrameHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t width;
+    uint32_t height;
+    uint32_t slices;
+};
+
+struct StreamHeader {
+    uint32_t rawSize;
+    uint32_t size;
+    uint8_t method;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(FrameHeader) == 20, "Frame header must be packed");
+static_assert(sizeof(StreamHeader) == 12, "Stream header must be packed");
+
+enum TileMode : uint8_t {
+    SkipTile,
+    PaletteTile,
+    RawTile
+};
+
+enum StreamMethod : uint8_t {
+    Stored,
+    Huffman,
+    // A single byte repeated
+    Constant
+};
+
+// Short enough for a 2048 entry decoding table that stays in L1
+static const int maxCodeLength = 11;
+static const uint32_t tableMask = (1u << maxCodeLength) - 1;
+// Code lengths, two per byte
+static const size_t lengthsSize = 128;
+// The decoder reads 8 bytes at a time, up to 8 bytes past the last code
+static const size_t streamPadding = 16;
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline void store32(uint8_t *p, uint32_t value)
+{
+    memcpy(p, &value, sizeof(value));
+}
+
+// Byte by byte arithmetic on four bytes at once, wrapping around
+static inline uint32_t subBytes(uint32_t a, uint32_t b)
+{
+    return ((a | 0x80808080u) - (b & 0x7f7f7f7fu)) ^ ((a ^ ~b) & 0x80808080u);
+}
+
+static inline uint32_t addBytes(uint32_t a, uint32_t b)
+{
+    return ((a & 0x7f7f7f7fu) + (b & 0x7f7f7f7fu)) ^ ((a ^ b) & 0x80808080u);
+}
+
+static int paletteBits(int colours)
+{
+    return colours <= 2 ? 1 : colours <= 4 ? 2 : 4;
+}
+
+// Same split on both sides, from the slice count in the header
+static void sliceRows(int slice, int slices, int rows, int *first, int *last)
+{
+    *first = slice * rows / slices;
+    *last = (slice + 1) * rows / slices;
+}
+
+/*
+ * Huffman coding
+ */
+
+static void buildLengths(const uint32_t *counts, uint8_t *lengths)
+{
+    std::vector<int> symbols;
+    for (int i = 0; i < 256; ++i) {
+        lengths[i] = 0;
+        if (counts[i] > 0)
+            symbols.push_back(i);
+    }
+    const int used = int(symbols.size());
+
+    // The tree, leaves first, every parent after its children
+    std::vector<uint64_t> weights(size_t(used * 2 - 1));
+    std::vector<int> parents(size_t(used * 2 - 1), 0);
+    using Node = std::pair<uint64_t, int>;
+    std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+    for (int i = 0; i < used; ++i) {
+        weights[size_t(i)] = counts[symbols[size_t(i)]];
+        queue.push({ weights[size_t(i)], i });
+    }
+    for (int next = used; next < used * 2 - 1; ++next) {
+        const Node a = queue.top();
+        queue.pop();
+        const Node b = queue.top();
+        queue.pop();
+        weights[size_t(next)] = a.first + b.first;
+        parents[size_t(a.second)] = next;
+        parents[size_t(b.second)] = next;
+        queue.push({ weights[size_t(next)], next });
+    }
+
+    std::vector<int> depths(size_t(used * 2 - 1), 0);
+    int lengthCounts[64] = {};
+    for (int i = used * 2 - 3; i >= 0; --i) {
+        depths[size_t(i)] = depths[size_t(parents[size_t(i)])] + 1;
+        if (i < used)
+            lengthCounts[std::min(depths[size_t(i)], maxCodeLength)]++;
+    }
+
+    // Longer codes are cut to the limit, then codes are made longer
+    // until the lengths describe a complete code again
+    uint32_t total = 0;
+    for (int length = 1; length <= maxCodeLength; ++length)
+        total += uint32_t(lengthCounts[length]) << (maxCodeLength - length);
+    while (total != (1u << maxCodeLength)) {
+        lengthCounts[maxCodeLength]--;
+        for (int length = maxCodeLength - 1; length > 0; --length) {
+            if (lengthCounts[length] > 0) {
+                lengthCounts[length]--;
+                lengthCounts[length + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The most frequent symbols get the shortest codes
+    std::stable_sort(symbols.begin(), symbols.end(), [counts](int a, int b) {
+        return counts[a] > counts[b];
+    });
+    size_t symbol = 0;
+    for (int length = 1; length <= maxCodeLength; ++length) {
+        for (int i = 0; i < lengthCounts[length]; ++i)
+            lengths[symbols[symbol++]] = uint8_t(length);
+    }
+}
+
+// Canonical codes, bit reversed to be written least significant bit first
+static void buildCodes(const uint8_t *lengths, uint16_t *codes)
+{
+    int lengthCounts[maxCodeLength + 1] = {};
+    for (int i = 0; i < 256; ++i)
+        lengthCounts[lengths[i]]++;
+    lengthCounts[0] = 0;
+
+    uint32_t next[maxCodeLength + 1] = {};
+    uint32_t code = 0;
+    for (int length = 1; length <= maxCodeLength; ++length) {
+        code = (code + uint32_t(lengthCounts[length - 1])) << 1;
+        next[length] = code;
+    }
+
+    for (int i = 0; i < 256; ++i) {
+        codes[i] = 0;
+        if (lengths[i] == 0)
+            continue;
+
+        const uint32_t value = next[lengths[i]]++;
+        uint32_t reversed = 0;
+        for (int bit = 0; bit < lengths[i]; ++bit)
+            reversed |= ((value >> bit) & 1) << (lengths[i] - 1 - bit);
+        codes[i] = uint16_t(reversed);
+    }
+}
+
+static void compressStream(const std::vector<uint8_t> &input, std::vector<uint8_t> &output)
+{
+    StreamHeader header = {};
+    header.rawSize = uint32_t(input.size());
+    header.method = Stored;
+
+    uint32_t counts[256] = {};
+    for (uint8_t value : input)
+        counts[value]++;
+
+    const int used = int(std::count_if(counts, counts + 256, [](uint32_t count) { return count > 0; }));
+    uint8_t lengths[256];
+    uint64_t bits = 0;
+    if (used == 1) {
+        header.method = Constant;
+    } else if (used > 1) {
+        buildLengths(counts, lengths);
+        for (int i = 0; i < 256; ++i)
+            bits += uint64_t(counts[i]) * lengths[i];
+        if (lengthsSize + (bits + 7) / 8 + streamPadding < input.size())
+            header.method = Huffman;
+    }
+
+    const size_t start = output.size();
+    output.resize(start + sizeof(header));
+
+    switch (header.method) {
+    case Stored:
+        output.insert(output.end(), input.begin(), input.end());
+        break;
+    case Constant:
+        output.push_back(input.front());
+        break;
+    case Huffman: {
+        uint16_t codes[256];
+        buildCodes(lengths, codes);
+
+        const size_t payload = output.size();
+        output.resize(payload + lengthsSize + (bits + 7) / 8 + 4 + streamPadding, 0);
+        uint8_t *p = output.data() + payload;
+        for (size_t i = 0; i < lengthsSize; ++i)
+            p[i] = uint8_t(lengths[i * 2] | (lengths[i * 2 + 1] << 4));
+        p += lengthsSize;
+
+        uint64_t buffer = 0;
+        int count = 0;
+        for (uint8_t value : input) {
+            buffer |= uint64_t(codes[value]) << count;
+            count += lengths[value];
+            if (count >= 32) {
+                store32(p, uint32_t(buffer));
+                p += 4;
+                buffer >>= 32;
+                count -= 32;
+            }
+        }
+        for (; count > 0; count -= 8) {
+            *p++ = uint8_t(buffer);
+            buffer >>= 8;
+        }
+
+        output.resize(size_t(p - output.data()) + streamPadding);
+        break;
+    }
+    }
+
+    header.size = uint32_t(output.size() - start - sizeof(header));
+    memcpy(output.data() + start, &header, sizeof(header));
+}
+
+static bool decompressStream(const uint8_t **data, const uint8_t *end, std::vector<uint8_t> &output)
+{
+    StreamHeader header;
+    if (size_t(end - *data) < sizeof(header))
+        return false;
+    memcpy(&header, *data, sizeof(header));
+    const uint8_t *payload = *data + sizeof(header);
+    if (size_t(end - payload) < header.size)
+        return false;
+    const uint8_t *payloadEnd = payload + header.size;
+    *data = payloadEnd;
+
+    output.resize(header.rawSize);
+
+    switch (header.method) {
+    case Stored:
+        if (header.size != header.rawSize)
+            return false;
+        if (header.rawSize > 0)
+            memcpy(output.data(), payload, header.rawSize);
+        return true;
+    case Constant:
+        if (header.size != 1)
+            return false;
+        memset(output.data(), payload[0], header.rawSize);
+        return true;
+    case Huffman:
+        break;
+    default:
+        return false;
+    }
+
+    if (header.size < lengthsSize + streamPadding)
+        return false;
+
+    uint8_t lengths[256];
+    for (size_t i = 0; i < lengthsSize; ++i) {
+        lengths[i * 2] = payload[i] & 0xf;
+        lengths[i * 2 + 1] = payload[i] >> 4;
+    }
+
+    // Only complete codes fill the whole table
+    uint32_t total = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (lengths[i] > maxCodeLength)
+            return false;
+        if (lengths[i] > 0)
+            total += 1u << (maxCodeLength - lengths[i]);
+    }
+    if (total != (1u << maxCodeLength))
+        return false;
+
+    uint16_t codes[256];
+    buildCodes(lengths, codes);
+    uint16_t table[1u << maxCodeLength];
+    for (int i = 0; i < 256; ++i) {
+        if (lengths[i] == 0)
+            continue;
+        for (uint32_t high = 0; high < (1u << (maxCodeLength - lengths[i])); ++high)
+            table[codes[i] | (high << lengths[i])] = uint16_t((i << 4) | lengths[i]);
+    }
+
+    const uint8_t *p = payload + lengthsSize;
+    uint8_t *out = output.data();
+    const size_t size = header.rawSize;
+    uint64_t buffer = 0;
+    int count = 0;
+    size_t i = 0;
+    while (i < size) {
+        if (p + 8 > payloadEnd)
+            return false;
+
+        // At least 56 bits afterwards, five codes
+        buffer |= load64(p) << count;
+        p += (63 - count) >> 3;
+        count |= 56;
+
+        const size_t n = std::min<size_t>(5, size - i);
+        for (size_t k = 0; k < n; ++k) {
+            const uint16_t entry = table[buffer & tableMask];
+            out[i++] = uint8_t(entry >> 4);
+            buffer >>= entry & 0xf;
+            count -= entry & 0xf;
+        }
+    }
+
+    return true;
+}
+
+bool ScreenCodec::isKeyframe(const uint8_t *data, size_t size)
+{
+    FrameHeader header;
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    return header.magic == frameMagic && (header.flags & keyframeFlag);
+}
+
+/*
+ * ScreenEncoder
+ */
+
+ScreenEncoder::ScreenEncoder(int width, int height, int slices)
+    : m_width(width)
+    , m_height(height)
+    , m_columns((width + tileSize - 1) / tileSize)
+    , m_rows((height + tileSize - 1) / tileSize)
+    , m_previous(size_t(width) * size_t(height) * 4)
+{
+    const int count = std::max(1, std::min(slices, m_rows));
+    m_slices.resize(size_t(count));
+    for (int i = 0; i < count; ++i)
+        sliceRows(i, count, m_rows, &m_slices[size_t(i)].firstRow, &m_slices[size_t(i)].lastRow);
+}
+
+void ScreenEncoder::encode(const uint8_t *pixels, int stride, bool keyframe,
+                           std::vector<uint8_t> &output, SlicePool *pool)
+{
+    keyframe = keyframe || !m_hasPrevious;
+    m_hasPrevious = true;
+
+    const std::function<void(int)> job = [&](int i) {
+        encodeSlice(m_slices[size_t(i)], pixels, stride, keyframe);
+    };
+    if (pool) {
+        pool->run(int(m_slices.size()), job);
+    } else {
+        for (int i = 0; i < int(m_slices.size()); ++i)
+            job(i);
+    }
+
+    FrameHeader header;
+    header.magic = frameMagic;
+    header.version = frameVersion;
+    header.flags = keyframe ? keyframeFlag : 0;
+    header.width = uint32_t(m_width);
+    header.height = uint32_t(m_height);
+    header.slices = uint32_t(m_slices.size());
+
+    const size_t start = output.size();
+    output.resize(start + sizeof(header) + m_slices.size() * sizeof(uint32_t));
+    memcpy(output.data() + start, &header, sizeof(header));
+    for (size_t i = 0; i < m_slices.size(); ++i) {
+        const Slice &slice = m_slices[i];
+        store32(output.data() + start + sizeof(header) + i * sizeof(uint32_t), uint32_t(slice.output.size()));
+        output.insert(output.end(), slice.output.begin(), slice.output.end());
+
+        m_stats.skipTiles += slice.stats.skipTiles;
+        m_stats.paletteTiles += slice.stats.paletteTiles;
+        m_stats.rawTiles += slice.stats.rawTiles;
+    }
+
+    m_stats.frames++;
+    if (keyframe)
+        m_stats.keyframes++;
+    m_stats.bytesIn += uint64_t(m_width) * uint64_t(m_height) * 4;
+    m_stats.bytesOut += output.size() - start;
+}
+
+void ScreenEncoder::encodeSlice(Slice &slice, const uint8_t *pixels, int stride, bool keyframe)
+{
+    Streams &streams = slice.streams;
+    streams.modes.clear();
+    streams.colours.clear();
+    streams.indices.clear();
+    streams.residuals.clear();
+    slice.stats = ScreenCodec::Stats();
+
+    const int previousStride = m_width * 4;
+    uint32_t colours[maxColours];
+    uint8_t indices[tileSize * tileSize];
+
+    for (int row = slice.firstRow; row < slice.lastRow; ++row) {
+        const int y = row * tileSize;
+        const int height = std::min(tileSize, m_height - y);
+
+        for (int column = 0; column < m_columns; ++column) {
+            const int x = column * tileSize;
+            const int width = std::min(tileSize, m_width - x);
+            const size_t rowSize = size_t(width) * 4;
+            const uint8_t *tile = pixels + ptrdiff_t(y) * stride + x * 4;
+            uint8_t *previous = m_previous.data() + size_t(y) * size_t(previousStride) + size_t(x) * 4;
+
+            bool same = !keyframe;
+            for (int i = 0; i < height && same; ++i)
+                same = memcmp(tile + ptrdiff_t(i) * stride, previous + i * previousStride, rowSize) == 0;
+            if (same) {
+                streams.modes.push_back(SkipTile);
+                slice.stats.skipTiles++;
+                continue;
+            }
+            for (int i = 0; i < height; ++i)
+                memcpy(previous + i * previousStride, tile + ptrdiff_t(i) * stride, rowSize);
+
+            // Text, icons and flat areas rarely have more colours than this
+            int count = 0;
+            int pixelCount = 0;
+            uint32_t last = 0;
+            int lastIndex = -1;
+            bool palette = true;
+            for (int i = 0; i < height && palette; ++i) {
+                const uint8_t *line = tile + ptrdiff_t(i) * stride;
+                for (int j = 0; j < width; ++j) {
+                    const uint32_t pixel = load32(line + j * 4);
+                    if (pixel != last || lastIndex < 0) {
+                        lastIndex = 0;
+                        while (lastIndex < count && colours[lastIndex] != pixel)
+                            lastIndex++;
+                        if (lastIndex == count) {
+                            if (count == maxColours) {
+                                palette = false;
+                                break;
+                            }
+                            colours[count++] = pixel;
+                        }
+                        last = pixel;
+                    }
+                    indices[pixelCount++] = uint8_t(lastIndex);
+                }
+            }
+
+            if (palette) {
+                streams.modes.push_back(PaletteTile);
+                streams.colours.push_back(uint8_t(count - 1));
+                const size_t offset = streams.colours.size();
+                streams.colours.resize(offset + size_t(count) * 4);
+                memcpy(streams.colours.data() + offset, colours, size_t(count) * 4);
+
+                if (count > 1) {
+                    const int bits = paletteBits(count);
+                    const size_t indexOffset = streams.indices.size();
+                    streams.indices.resize(indexOffset + (size_t(pixelCount) * size_t(bits) + 7) / 8, 0);
+                    uint8_t *packed = streams.indices.data() + indexOffset;
+                    for (int i = 0, bit = 0; i < pixelCount; ++i, bit += bits)
+                        packed[bit >> 3] |= uint8_t(indices[i] << (bit & 7));
+                }
+                slice.stats.paletteTiles++;
+                continue;
+            }
+
+            streams.modes.push_back(RawTile);
+            const size_t offset = streams.residuals.size();
+            streams.residuals.resize(offset + size_t(width) * size_t(height) * 4);
+            uint8_t *out = streams.residuals.data() + offset;
+
+            uint32_t left = 0;
+            for (int j = 0; j < width; ++j) {
+                const uint32_t pixel = load32(tile + j * 4);
+                store32(out, subBytes(pixel, left));
+                out += 4;
+                left = pixel;
+            }
+            for (int i = 1; i < height; ++i) {
+                const uint8_t *line = tile + ptrdiff_t(i) * stride;
+                const uint8_t *above = line - stride;
+                for (int j = 0; j < width; ++j) {
+                    store32(out, subBytes(load32(line + j * 4), load32(above + j * 4)));
+                    out += 4;
+                }
+            }
+            slice.stats.rawTiles++;
+        }
+    }
+
+    slice.output.clear();
+    compressStream(streams.modes, slice.output);
+    compressStream(streams.colours, slice.output);
+    compressStream(streams.indices, slice.output);
+    compressStream(streams.residuals, slice.output);
+}
+
+/*
+ * ScreenDecoder
+ */
+
+ScreenDecoder::ScreenDecoder(int width, int height)
+    : m_width(width)
+    , m_height(height)
+    , m_columns((width + tileSize - 1) / tileSize)
+    , m_rows((height + tileSize - 1) / tileSize)
+{
+}
+
+bool ScreenDecoder::decode(const uint8_t *data, size_t size,
+                           const uint8_t *previous, int previousStride,
+                           uint8_t *pixels, int stride, SlicePool *pool)
+{
+    FrameHeader header;
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != frameMagic || header.version != frameVersion ||
+            header.width != uint32_t(m_width) || header.height != uint32_t(m_height) ||
+            header.slices == 0 || header.slices > uint32_t(std::max(1, m_rows)))
+        return false;
+    if (!(header.flags & keyframeFlag) && !previous)
+        return false;
+
+    const int slices = int(header.slices);
+    const size_t tableSize = size_t(slices) * sizeof(uint32_t);
+    if (size - sizeof(header) < tableSize)
+        return false;
+
+    std::vector<size_t> offsets(size_t(slices) + 1);
+    offsets[0] = sizeof(header) + tableSize;
+    for (int i = 0; i < slices; ++i) {
+        offsets[size_t(i) + 1] = offsets[size_t(i)] + load32(data + sizeof(header) + size_t(i) * sizeof(uint32_t));
+        if (offsets[size_t(i) + 1] > size)
+            return false;
+    }
+
+    if (m_slices.size() < size_t(slices))
+        m_slices.resize(size_t(slices));
+    std::vector<char> decoded(size_t(slices), 0);
+
+    const std::function<void(int)> job = [&](int i) {
+        int firstRow, lastRow;
+        sliceRows(i, slices, m_rows, &firstRow, &lastRow);
+        decoded[size_t(i)] = decodeSlice(m_slices[size_t(i)], data + offsets[size_t(i)],
+                                         offsets[size_t(i) + 1] - offsets[size_t(i)], firstRow, lastRow,
+                                         previous, previousStride, pixels, stride);
+    };
+    if (pool) {
+        pool->run(slices, job);
+    } else {
+        for (int i = 0; i < slices; ++i)
+            job(i);
+    }
+
+    return std::all_of(decoded.begin(), decoded.end(), [](char ok) { return ok; });
+}
+
+bool ScreenDecoder::decodeSlice(Slice &slice, const uint8_t *data, size_t size, int firstRow, int lastRow,
+                                const uint8_t *previous, int previousStride, uint8_t *pixels, int stride)
+{
+    const uint8_t *end = data + size;
+    if (!decompressStream(&data, end, slice.modes) || !decompressStream(&data, end, slice.colours) ||
+            !decompressStream(&data, end, slice.indices) || !decompressStream(&data, end, slice.residuals))
+        return false;
+
+    const uint8_t *mode = slice.modes.data();
+    const uint8_t *modeEnd = mode + slice.modes.size();
+    const uint8_t *colour = slice.colours.data();
+    const uint8_t *colourEnd = colour + slice.colours.size();
+    const uint8_t *index = slice.indices.data();
+    const uint8_t *indexEnd = index + slice.indices.size();
+    const uint8_t *residual = slice.residuals.data();
+    const uint8_t *residualEnd = residual + slice.residuals.size();
+
+    for (int row = firstRow; row < lastRow; ++row) {
+        const int y = row * tileSize;
+        const int height = std::min(tileSize, m_height - y);
+
+        for (int column = 0; column < m_columns; ++column) {
+            const int x = column * tileSize;
+            const int width = std::min(tileSize, m_width - x);
+            const size_t rowSize = size_t(width) * 4;
+            uint8_t *tile = pixels + ptrdiff_t(y) * stride + x * 4;
+
+            if (mode == modeEnd)
+                return false;
+
+            switch (*mode++) {
+            case SkipTile: {
+                if (!previous)
+                    return false;
+                const uint8_t *source = previous + ptrdiff_t(y) * previousStride + x * 4;
+                for (int i = 0; i < height; ++i)
+                    memcpy(tile + ptrdiff_t(i) * stride, source + ptrdiff_t(i) * previousStride, rowSize);
+                break;
+            }
+            case PaletteTile: {
+                if (colour == colourEnd)
+                    return false;
+                const int count = *colour++ + 1;
+                if (count > maxColours || size_t(colourEnd - colour) < size_t(count) * 4)
+                    return false;
+                // Indices past the palette of damaged frames stay in bounds
+                uint32_t colours[maxColours] = {};
+                memcpy(colours, colour, size_t(count) * 4);
+                colour += count * 4;
+
+                if (count == 1) {
+                    for (int i = 0; i < height; ++i) {
+                        uint8_t *line = tile + ptrdiff_t(i) * stride;
+                        for (int j = 0; j < width; ++j)
+                            store32(line + j * 4, colours[0]);
+                    }
+                    break;
+                }
+
+                const int bits = paletteBits(count);
+                const uint32_t mask = (1u << bits) - 1;
+                const size_t packedSize = (size_t(width) * size_t(height) * size_t(bits) + 7) / 8;
+                if (size_t(indexEnd - index) < packedSize)
+                    return false;
+
+                size_t bit = 0;
+                for (int i = 0; i < height; ++i) {
+                    uint8_t *line = tile + ptrdiff_t(i) * stride;
+                    for (int j = 0; j < width; ++j) {
+                        store32(line + j * 4, colours[(index[bit >> 3] >> (bit & 7)) & mask]);
+                        bit += size_t(bits);
+                    }
+                }
+                index += packedSize;
+                break;
+            }
+            case RawTile: {
+                if (size_t(residualEnd - residual) < size_t(width) * size_t(height) * 4)
+                    return false;
+
+                uint32_t left = 0;
+                for (int j = 0; j < width; ++j) {
+                    left = addBytes(left, load32(residual));
+                    store32(tile + j * 4, left);
+                    residual += 4;
+                }
+                for (int i = 1; i < height; ++i) {
+                    uint8_t *line = tile + ptrdiff_t(i) * stride;
+                    const uint8_t *above = line - stride;
+                    for (int j = 0; j < width; ++j) {
+                        store32(line + j * 4, addBytes(load32(above + j * 4), load32(residual)));
+                        residual += 4;
+                    }
+                }
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
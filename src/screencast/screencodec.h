@@ -0,0 +1,129 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef SCREENCODEC_H
+#define SCREENCODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class SlicePool;
+
+/*
+ * Lossless codec for screen content, on frames of packed 32-bit pixels.
+ *
+ * Frames are cut into 16x16 tiles, each one stored as:
+ *  - skip: unchanged since the previous frame, nothing is stored
+ *  - palette: up to 16 colours and 1, 2 or 4 bit indices, a flat tile
+ *    is a palette of one colour without indices
+ *  - raw: the difference of each pixel with the one above it, byte by
+ *    byte, and with the one on its left on the first row
+ *
+ * Tile modes, colours, indices and differences go to four streams,
+ * each compressed with a canonical Huffman code of its own that is
+ * decoded with one table lookup per byte.
+ *
+ * Frames are also cut into slices of whole rows of tiles, which are
+ * encoded and decoded independently, on several threads if needed.
+ */
+namespace ScreenCodec {
+
+// Tiles on the right and bottom edges are cut short
+static const int tileSize = 16;
+static const int maxColours = 16;
+
+struct Stats {
+    uint64_t frames = 0;
+    uint64_t keyframes = 0;
+    uint64_t skipTiles = 0;
+    uint64_t paletteTiles = 0;
+    uint64_t rawTiles = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+};
+
+// Whether a compressed frame can be decoded without the one before
+bool isKeyframe(const uint8_t *data, size_t size);
+
+} // namespace ScreenCodec
+
+class ScreenEncoder
+{
+public:
+    ScreenEncoder(int width, int height, int slices);
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int sliceCount() const { return int(m_slices.size()); }
+
+    // Appends the compressed frame to output, the first frame is
+    // always a keyframe; slices run on the pool when there is one
+    void encode(const uint8_t *pixels, int stride, bool keyframe,
+                std::vector<uint8_t> &output, SlicePool *pool = nullptr);
+
+    const ScreenCodec::Stats &stats() const { return m_stats; }
+
+private:
+    struct Streams {
+        std::vector<uint8_t> modes;
+        std::vector<uint8_t> colours;
+        std::vector<uint8_t> indices;
+        std::vector<uint8_t> residuals;
+    };
+
+    struct Slice {
+        int firstRow = 0;
+        int lastRow = 0;
+        Streams streams;
+        std::vector<uint8_t> output;
+        ScreenCodec::Stats stats;
+    };
+
+    int m_width;
+    int m_height;
+    int m_columns;
+    int m_rows;
+    bool m_hasPrevious = false;
+    // Only the tiles that changed are copied
+    std::vector<uint8_t> m_previous;
+    std::vector<Slice> m_slices;
+    ScreenCodec::Stats m_stats;
+
+    void encodeSlice(Slice &slice, const uint8_t *pixels, int stride, bool keyframe);
+};
+
+class ScreenDecoder
+{
+public:
+    ScreenDecoder(int width, int height);
+
+    // Decodes into pixels, previous is the frame decoded before and is
+    // only read for unchanged tiles; fails on damaged data, or when
+    // the frame depends on a previous one and there is none
+    bool decode(const uint8_t *data, size_t size,
+                const uint8_t *previous, int previousStride,
+                uint8_t *pixels, int stride, SlicePool *pool = nullptr);
+
+private:
+    struct Slice {
+        std::vector<uint8_t> modes;
+        std::vector<uint8_t> colours;
+        std::vector<uint8_t> indices;
+        std::vector<uint8_t> residuals;
+    };
+
+    int m_width;
+    int m_height;
+    int m_columns;
+    int m_rows;
+    std::vector<Slice> m_slices;
+
+    bool decodeSlice(Slice &slice, const uint8_t *data, size_t size, int firstRow, int lastRow,
+                     const uint8_t *previous, int previousStride, uint8_t *pixels, int stride);
+};
+
+#endif // SCREENCODEC_H
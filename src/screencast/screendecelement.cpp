@@ -0,0 +1,262 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QThread>
+
+#include "screencast.h"
+#include "screencodec.h"
+#include "screendecelement.h"
+#include "slicepool.h"
+
+#include <gst/video/video.h>
+
+#define FORMATS "{ BGRx, BGRA, RGBx, RGBA, xRGB, ARGB, xBGR, ABGR }"
+
+enum {
+    PROP_0,
+    PROP_N_THREADS
+};
+
+struct _ScreencastScreenDec
+{
+    GstVideoDecoder parent;
+
+    guint nThreads;
+
+    GstVideoInfo info;
+    ScreenDecoder *decoder;
+    SlicePool *pool;
+    // Last decoded frame, unchanged tiles are copied from it
+    GstBuffer *previous;
+};
+
+G_DEFINE_TYPE(ScreencastScreenDec, screencast_screen_dec, GST_TYPE_VIDEO_DECODER)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS("video/x-screencast-screen, "
+                                                "format = (string) " FORMATS ", "
+                                                "width = (int) [ 1, max ], "
+                                                "height = (int) [ 1, max ]"));
+
+static GstStaticPadTemplate srcTemplate =
+        GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static void screencast_screen_dec_reset(ScreencastScreenDec *self)
+{
+    gst_buffer_replace(&self->previous, nullptr);
+}
+
+static gboolean screencast_screen_dec_start(GstVideoDecoder *decoder)
+{
+    gst_video_decoder_set_packetized(decoder, TRUE);
+    return TRUE;
+}
+
+static gboolean screencast_screen_dec_stop(GstVideoDecoder *decoder)
+{
+    ScreencastScreenDec *self = SCREENCAST_SCREEN_DEC(decoder);
+
+    screencast_screen_dec_reset(self);
+    delete self->decoder;
+    self->decoder = nullptr;
+    delete self->pool;
+    self->pool = nullptr;
+
+    return TRUE;
+}
+
+static gboolean screencast_screen_dec_flush(GstVideoDecoder *decoder)
+{
+    screencast_screen_dec_reset(SCREENCAST_SCREEN_DEC(decoder));
+    return TRUE;
+}
+
+static gboolean screencast_screen_dec_set_format(GstVideoDecoder *decoder, GstVideoCodecState *state)
+{
+    ScreencastScreenDec *self = SCREENCAST_SCREEN_DEC(decoder);
+
+    GstStructure *structure = gst_caps_get_structure(state->caps, 0);
+    const gchar *formatName = gst_structure_get_string(structure, "format");
+    gint width = 0, height = 0;
+    if (!formatName || !gst_structure_get_int(structure, "width", &width) ||
+            !gst_structure_get_int(structure, "height", &height)) {
+        GST_ELEMENT_ERROR(self, STREAM, FORMAT, ("Incomplete caps for the screen decoder"), (nullptr));
+        return FALSE;
+    }
+
+    const GstVideoFormat format = gst_video_format_from_string(formatName);
+    GstVideoCodecState *outputState = gst_video_decoder_set_output_state(decoder, format, width, height, state);
+    self->info = outputState->info;
+    gst_video_codec_state_unref(outputState);
+
+    const int threads = self->nThreads > 0
+            ? int(self->nThreads) : qBound(1, QThread::idealThreadCount() / 2, 2);
+    if (!self->pool || self->pool->threadCount() != threads) {
+        delete self->pool;
+        self->pool = threads > 1 ? new SlicePool(threads) : nullptr;
+    }
+
+    delete self->decoder;
+    self->decoder = new ScreenDecoder(width, height);
+    screencast_screen_dec_reset(self);
+
+    return gst_video_decoder_negotiate(decoder);
+}
+
+static GstFlowReturn screencast_screen_dec_handle_frame(GstVideoDecoder *decoder, GstVideoCodecFrame *frame)
+{
+    ScreencastScreenDec *self = SCREENCAST_SCREEN_DEC(decoder);
+
+    if (!self->decoder) {
+        gst_video_codec_frame_unref(frame);
+        return GST_FLOW_NOT_NEGOTIATED;
+    }
+
+    GstMapInfo input;
+    if (!gst_buffer_map(frame->input_buffer, &input, GST_MAP_READ)) {
+        GST_ELEMENT_ERROR(self, STREAM, DECODE, ("Unable to map the input frame"), (nullptr));
+        gst_video_codec_frame_unref(frame);
+        return GST_FLOW_ERROR;
+    }
+
+    // Joined in the middle of the stream, wait for the next keyframe
+    const bool keyframe = ScreenCodec::isKeyframe(input.data, input.size);
+    if (!keyframe && !self->previous) {
+        gst_buffer_unmap(frame->input_buffer, &input);
+        return gst_video_decoder_drop_frame(decoder, frame);
+    }
+    if (keyframe)
+        GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT(frame);
+
+    GstFlowReturn ret = gst_video_decoder_allocate_output_frame(decoder, frame);
+    if (ret != GST_FLOW_OK) {
+        gst_buffer_unmap(frame->input_buffer, &input);
+        gst_video_decoder_drop_frame(decoder, frame);
+        return ret;
+    }
+
+    GstVideoFrame output, previous;
+    const bool hasPrevious = !keyframe &&
+            gst_video_frame_map(&previous, &self->info, self->previous, GST_MAP_READ);
+    if (!gst_video_frame_map(&output, &self->info, frame->output_buffer, GST_MAP_WRITE)) {
+        if (hasPrevious)
+            gst_video_frame_unmap(&previous);
+        gst_buffer_unmap(frame->input_buffer, &input);
+        GST_ELEMENT_ERROR(self, STREAM, DECODE, ("Unable to map the output frame"), (nullptr));
+        gst_video_decoder_drop_frame(decoder, frame);
+        return GST_FLOW_ERROR;
+    }
+
+    const bool decoded = self->decoder->decode(
+                input.data, input.size,
+                hasPrevious ? static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&previous, 0)) : nullptr,
+                hasPrevious ? GST_VIDEO_FRAME_PLANE_STRIDE(&previous, 0) : 0,
+                static_cast<uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&output, 0)),
+                GST_VIDEO_FRAME_PLANE_STRIDE(&output, 0), self->pool);
+
+    gst_video_frame_unmap(&output);
+    if (hasPrevious)
+        gst_video_frame_unmap(&previous);
+    gst_buffer_unmap(frame->input_buffer, &input);
+
+    if (!decoded) {
+        screencast_screen_dec_reset(self);
+        GST_ELEMENT_ERROR(self, STREAM, DECODE, ("Damaged screen frame"), (nullptr));
+        gst_video_decoder_drop_frame(decoder, frame);
+        return GST_FLOW_ERROR;
+    }
+
+    // Downstream only reads output buffers, so it is safe to keep one
+    gst_buffer_replace(&self->previous, frame->output_buffer);
+
+    return gst_video_decoder_finish_frame(decoder, frame);
+}
+
+static void screencast_screen_dec_set_property(GObject *object, guint propId,
+                                               const GValue *value, GParamSpec *pspec)
+{
+    ScreencastScreenDec *self = SCREENCAST_SCREEN_DEC(object);
+
+    switch (propId) {
+    case PROP_N_THREADS:
+        self->nThreads = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_screen_dec_get_property(GObject *object, guint propId,
+                                               GValue *value, GParamSpec *pspec)
+{
+    ScreencastScreenDec *self = SCREENCAST_SCREEN_DEC(object);
+
+    switch (propId) {
+    case PROP_N_THREADS:
+        g_value_set_uint(value, self->nThreads);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_screen_dec_finalize(GObject *object)
+{
+    ScreencastScreenDec *self = SCREENCAST_SCREEN_DEC(object);
+
+    screencast_screen_dec_reset(self);
+    delete self->decoder;
+    self->decoder = nullptr;
+    delete self->pool;
+    self->pool = nullptr;
+
+    G_OBJECT_CLASS(screencast_screen_dec_parent_class)->finalize(object);
+}
+
+static void screencast_screen_dec_class_init(ScreencastScreenDecClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstVideoDecoderClass *decoderClass = GST_VIDEO_DECODER_CLASS(klass);
+
+    objectClass->set_property = screencast_screen_dec_set_property;
+    objectClass->get_property = screencast_screen_dec_get_property;
+    objectClass->finalize = screencast_screen_dec_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_N_THREADS,
+                g_param_spec_uint("n-threads", "Threads",
+                                  "Number of decoding threads (0 = automatic)",
+                                  0, 64, 0,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast lossless screen decoder",
+                                          "Codec/Decoder/Video",
+                                          "Decodes frames of the lossless screen encoder",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+    gst_element_class_add_static_pad_template(elementClass, &srcTemplate);
+
+    decoderClass->start = screencast_screen_dec_start;
+    decoderClass->stop = screencast_screen_dec_stop;
+    decoderClass->flush = screencast_screen_dec_flush;
+    decoderClass->set_format = screencast_screen_dec_set_format;
+    decoderClass->handle_frame = screencast_screen_dec_handle_frame;
+}
+
+static void screencast_screen_dec_init(ScreencastScreenDec *self)
+{
+    self->nThreads = 0;
+    gst_video_info_init(&self->info);
+    self->decoder = nullptr;
+    self->pool = nullptr;
+    self->previous = nullptr;
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef SCREENDECELEMENT_H
+#define SCREENDECELEMENT_H
+
+#include <gst/video/gstvideodecoder.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_SCREEN_DEC (screencast_screen_dec_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastScreenDec, screencast_screen_dec, SCREENCAST, SCREEN_DEC, GstVideoDecoder)
+
+G_END_DECLS
+
+#endif // SCREENDECELEMENT_H
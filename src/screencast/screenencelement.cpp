@@ -0,0 +1,270 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QThread>
+
+#include "screencast.h"
+#include "screencodec.h"
+#include "screenencelement.h"
+#include "slicepool.h"
+
+#include <gst/video/video.h>
+
+#define FORMATS "{ BGRx, BGRA, RGBx, RGBA, xRGB, ARGB, xBGR, ABGR }"
+
+enum {
+    PROP_0,
+    PROP_N_THREADS,
+    PROP_KEYFRAME_INTERVAL,
+    PROP_STATS
+};
+
+struct _ScreencastScreenEnc
+{
+    GstVideoEncoder parent;
+
+    guint nThreads;
+    guint keyframeInterval;
+
+    GstVideoInfo info;
+    ScreenEncoder *encoder;
+    SlicePool *pool;
+    std::vector<uint8_t> *output;
+    guint framesSinceKeyframe;
+
+    // Copied after every frame, for the stats property
+    ScreenCodec::Stats stats;
+    guint64 encodeTime;
+};
+
+G_DEFINE_TYPE(ScreencastScreenEnc, screencast_screen_enc, GST_TYPE_VIDEO_ENCODER)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(FORMATS)));
+
+static GstStaticPadTemplate srcTemplate =
+        GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                                GST_STATIC_CAPS("video/x-screencast-screen, "
+                                                "format = (string) " FORMATS ", "
+                                                "width = (int) [ 1, max ], "
+                                                "height = (int) [ 1, max ], "
+                                                "framerate = (fraction) [ 0, max ]"));
+
+static GstStructure *screencast_screen_enc_stats(ScreencastScreenEnc *self)
+{
+    GST_OBJECT_LOCK(self);
+    const ScreenCodec::Stats stats = self->stats;
+    const guint64 encodeTime = self->encodeTime;
+    GST_OBJECT_UNLOCK(self);
+
+    return gst_structure_new("stats",
+                             "frames", G_TYPE_UINT64, guint64(stats.frames),
+                             "keyframes", G_TYPE_UINT64, guint64(stats.keyframes),
+                             "skip-tiles", G_TYPE_UINT64, guint64(stats.skipTiles),
+                             "palette-tiles", G_TYPE_UINT64, guint64(stats.paletteTiles),
+                             "raw-tiles", G_TYPE_UINT64, guint64(stats.rawTiles),
+                             "bytes-in", G_TYPE_UINT64, guint64(stats.bytesIn),
+                             "bytes-out", G_TYPE_UINT64, guint64(stats.bytesOut),
+                             "encode-time", G_TYPE_UINT64, encodeTime,
+                             nullptr);
+}
+
+static gboolean screencast_screen_enc_stop(GstVideoEncoder *encoder)
+{
+    ScreencastScreenEnc *self = SCREENCAST_SCREEN_ENC(encoder);
+
+    delete self->encoder;
+    self->encoder = nullptr;
+    delete self->pool;
+    self->pool = nullptr;
+
+    return TRUE;
+}
+
+static gboolean screencast_screen_enc_set_format(GstVideoEncoder *encoder, GstVideoCodecState *state)
+{
+    ScreencastScreenEnc *self = SCREENCAST_SCREEN_ENC(encoder);
+
+    self->info = state->info;
+    const int width = GST_VIDEO_INFO_WIDTH(&state->info);
+    const int height = GST_VIDEO_INFO_HEIGHT(&state->info);
+
+    // One or two cores keep up with 4K screen content
+    const int threads = self->nThreads > 0
+            ? int(self->nThreads) : qBound(1, QThread::idealThreadCount() / 2, 2);
+    if (!self->pool || self->pool->threadCount() != threads) {
+        delete self->pool;
+        self->pool = threads > 1 ? new SlicePool(threads) : nullptr;
+    }
+
+    // Two slices per thread to even out threads that get descheduled
+    delete self->encoder;
+    self->encoder = new ScreenEncoder(width, height, threads * 2);
+    self->framesSinceKeyframe = 0;
+
+    GstCaps *caps = gst_caps_new_simple("video/x-screencast-screen",
+                                        "format", G_TYPE_STRING,
+                                        gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&state->info)),
+                                        nullptr);
+    GstVideoCodecState *outputState = gst_video_encoder_set_output_state(encoder, caps, state);
+    gst_video_codec_state_unref(outputState);
+
+    qCInfo(lcScreencast, "Encoding %s %dx%d losslessly in %d slices on %d threads",
+           gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&state->info)), width, height,
+           self->encoder->sliceCount(), threads);
+
+    return gst_video_encoder_negotiate(encoder);
+}
+
+static GstFlowReturn screencast_screen_enc_handle_frame(GstVideoEncoder *encoder, GstVideoCodecFrame *frame)
+{
+    ScreencastScreenEnc *self = SCREENCAST_SCREEN_ENC(encoder);
+
+    if (!self->encoder) {
+        gst_video_codec_frame_unref(frame);
+        return GST_FLOW_NOT_NEGOTIATED;
+    }
+
+    GstVideoFrame input;
+    if (!gst_video_frame_map(&input, &self->info, frame->input_buffer, GST_MAP_READ)) {
+        GST_ELEMENT_ERROR(self, STREAM, ENCODE, ("Unable to map the input frame"), (nullptr));
+        gst_video_codec_frame_unref(frame);
+        return GST_FLOW_ERROR;
+    }
+
+    const bool keyframe = GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME(frame) ||
+            self->framesSinceKeyframe == 0 ||
+            (self->keyframeInterval > 0 && self->framesSinceKeyframe >= self->keyframeInterval);
+    self->framesSinceKeyframe = keyframe ? 1 : self->framesSinceKeyframe + 1;
+
+    const gint64 start = g_get_monotonic_time();
+    self->output->clear();
+    self->encoder->encode(static_cast<const uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&input, 0)),
+                          GST_VIDEO_FRAME_PLANE_STRIDE(&input, 0), keyframe, *self->output, self->pool);
+    const gint64 elapsed = g_get_monotonic_time() - start;
+    gst_video_frame_unmap(&input);
+
+    frame->output_buffer = gst_video_encoder_allocate_output_buffer(encoder, self->output->size());
+    gst_buffer_fill(frame->output_buffer, 0, self->output->data(), self->output->size());
+    if (keyframe)
+        GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT(frame);
+
+    GST_OBJECT_LOCK(self);
+    self->stats = self->encoder->stats();
+    self->encodeTime += guint64(elapsed) * GST_USECOND;
+    GST_OBJECT_UNLOCK(self);
+
+    return gst_video_encoder_finish_frame(encoder, frame);
+}
+
+static void screencast_screen_enc_set_property(GObject *object, guint propId,
+                                               const GValue *value, GParamSpec *pspec)
+{
+    ScreencastScreenEnc *self = SCREENCAST_SCREEN_ENC(object);
+
+    switch (propId) {
+    case PROP_N_THREADS:
+        self->nThreads = g_value_get_uint(value);
+        break;
+    case PROP_KEYFRAME_INTERVAL:
+        self->keyframeInterval = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_screen_enc_get_property(GObject *object, guint propId,
+                                               GValue *value, GParamSpec *pspec)
+{
+    ScreencastScreenEnc *self = SCREENCAST_SCREEN_ENC(object);
+
+    switch (propId) {
+    case PROP_N_THREADS:
+        g_value_set_uint(value, self->nThreads);
+        break;
+    case PROP_KEYFRAME_INTERVAL:
+        g_value_set_uint(value, self->keyframeInterval);
+        break;
+    case PROP_STATS:
+        g_value_take_boxed(value, screencast_screen_enc_stats(self));
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_screen_enc_finalize(GObject *object)
+{
+    ScreencastScreenEnc *self = SCREENCAST_SCREEN_ENC(object);
+
+    delete self->encoder;
+    self->encoder = nullptr;
+    delete self->pool;
+    self->pool = nullptr;
+    delete self->output;
+    self->output = nullptr;
+
+    G_OBJECT_CLASS(screencast_screen_enc_parent_class)->finalize(object);
+}
+
+static void screencast_screen_enc_class_init(ScreencastScreenEncClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstVideoEncoderClass *encoderClass = GST_VIDEO_ENCODER_CLASS(klass);
+
+    objectClass->set_property = screencast_screen_enc_set_property;
+    objectClass->get_property = screencast_screen_enc_get_property;
+    objectClass->finalize = screencast_screen_enc_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_N_THREADS,
+                g_param_spec_uint("n-threads", "Threads",
+                                  "Number of encoding threads (0 = automatic)",
+                                  0, 64, 0,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_KEYFRAME_INTERVAL,
+                g_param_spec_uint("keyframe-interval", "Keyframe interval",
+                                  "Encode every tile again every this many frames (0 = only the first frame)",
+                                  0, G_MAXINT, 300,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_STATS,
+                g_param_spec_boxed("stats", "Statistics",
+                                   "Frames, tiles by mode, bytes in and out and time spent encoding",
+                                   GST_TYPE_STRUCTURE,
+                                   GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast lossless screen encoder",
+                                          "Codec/Encoder/Video",
+                                          "Encodes screen content losslessly with tiles that are skipped, palettized or entropy coded",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+    gst_element_class_add_static_pad_template(elementClass, &srcTemplate);
+
+    encoderClass->stop = screencast_screen_enc_stop;
+    encoderClass->set_format = screencast_screen_enc_set_format;
+    encoderClass->handle_frame = screencast_screen_enc_handle_frame;
+}
+
+static void screencast_screen_enc_init(ScreencastScreenEnc *self)
+{
+    self->nThreads = 0;
+    self->keyframeInterval = 300;
+    gst_video_info_init(&self->info);
+    self->encoder = nullptr;
+    self->pool = nullptr;
+    self->output = new std::vector<uint8_t>();
+    self->framesSinceKeyframe = 0;
+    self->stats = ScreenCodec::Stats();
+    self->encodeTime = 0;
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef SCREENENCELEMENT_H
+#define SCREENENCELEMENT_H
+
+#include <gst/video/gstvideoencoder.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_SCREEN_ENC (screencast_screen_enc_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastScreenEnc, screencast_screen_enc, SCREENCAST, SCREEN_ENC, GstVideoEncoder)
+
+G_END_DECLS
+
+#endif // SCREENENCELEMENT_H
@@ -0,0 +1,91 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "slicepool.h"
+
+SlicePool::SlicePool(int threads)
+{
+    // Workers start from the current generation, rather than whatever
+    // it is once they get to run, or they'd miss the first job
+    for (int i = 1; i < threads; ++i)
+        m_workers.emplace_back(&SlicePool::workerLoop, this, m_generation);
+}
+
+SlicePool::~SlicePool()
+{
+    {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+
+    for (auto &worker : m_workers)
+        worker.join();
+}
+
+int SlicePool::threadCount() const
+{
+    return int(m_workers.size()) + 1;
+}
+
+void SlicePool::run(int slices, const std::function<void(int)> &job)
+{
+    if (slices <= 0)
+        return;
+
+    if (m_workers.empty() || slices == 1) {
+        for (int i = 0; i < slices; ++i)
+            job(i);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_job = &job;
+    m_slices = slices;
+    m_next = 0;
+    m_pending = slices;
+    ++m_generation;
+    m_wake.notify_all();
+
+    while (runOne(lock)) {
+    }
+
+    m_done.wait(lock, [this] { return m_pending == 0; });
+    m_job = nullptr;
+}
+
+void SlicePool::workerLoop(unsigned long seen)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;) {
+        m_wake.wait(lock, [this, seen] { return m_quit || m_generation != seen; });
+        if (m_quit)
+            return;
+
+        seen = m_generation;
+        while (runOne(lock)) {
+        }
+    }
+}
+
+bool SlicePool::runOne(std::unique_lock<std::mutex> &lock)
+{
+    if (!m_job || m_next >= m_slices)
+        return false;
+
+    const int slice = m_next++;
+    const std::function<void(int)> &job = *m_job;
+
+    lock.unlock();
+    job(slice);
+    lock.lock();
+
+    if (--m_pending == 0)
+        m_done.notify_all();
+
+    return true;
+}
@@ -0,0 +1,49 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef SLICEPOOL_H
+#define SLICEPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Runs the slices of a frame on a fixed set of worker threads.
+ *
+ * The calling thread works on slices too and run() only returns
+ * when all of them are done, so per-frame state can live on the
+ * caller's stack.
+ */
+class SlicePool
+{
+public:
+    explicit SlicePool(int threads);
+    ~SlicePool();
+
+    int threadCount() const;
+
+    void run(int slices, const std::function<void(int)> &job);
+
+private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void(int)> *m_job = nullptr;
+    unsigned long m_generation = 0;
+    int m_slices = 0;
+    int m_next = 0;
+    int m_pending = 0;
+    bool m_quit = false;
+
+    void workerLoop(unsigned long seen);
+    bool runOne(std::unique_lock<std::mutex> &lock);
+};
+
+#endif // SLICEPOOL_H
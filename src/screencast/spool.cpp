@@ -0,0 +1,537 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "spool.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static const size_t pageSize = 4096;
+
+// The file grows, and is written back, this much at a time
+static const size_t chunkSize = 64 * 1024 * 1024;
+
+static const char fileMagic[8] = { 'L', 'S', 'S', 'P', 'O', 'O', 'L', '\n' };
+static const uint32_t fileVersion = 1;
+static const uint32_t recordMagic = 0x31435253;
+
+// Payload stored as is, it didn't compress
+static const uint16_t storedFlag = 0x1;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t compression;
+};
+
+struct RecordHeader {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
+    uint32_t payloadSize;
+    uint64_t pts;
+    uint64_t duration;
+};
+
+static_assert(sizeof(FileHeader) == 16, "Spool header must be packed");
+static_assert(sizeof(RecordHeader) == 32, "Spool record header must be packed");
+
+static size_t padded(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+// Returns false if the frames are identical
+static bool xorFrames(const uint8_t *a, const uint8_t *b, uint8_t *out, size_t size)
+{
+    uint64_t changed = 0;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        x ^= y;
+        changed |= x;
+        memcpy(out + i, &x, 8);
+    }
+    for (; i < size; ++i) {
+        out[i] = a[i] ^ b[i];
+        changed |= out[i];
+    }
+    return changed != 0;
+}
+
+/*
+ * Spool
+ */
+
+bool Spool::isSupported(Compression compression)
+{
+    switch (compression) {
+    case None:
+        return true;
+    case LZ4:
+#ifdef HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    case Zstd:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+Spool::Compression Spool::defaultCompression()
+{
+    if (isSupported(LZ4))
+        return LZ4;
+    if (isSupported(Zstd))
+        return Zstd;
+    return None;
+}
+
+const char *Spool::compressionName(Compression compression)
+{
+    switch (compression) {
+    case None:
+        return "none";
+    case LZ4:
+        return "lz4";
+    case Zstd:
+        return "zstd";
+    }
+    return "";
+}
+
+bool Spool::parseCompression(const char *name, Compression *compression)
+{
+    for (Compression candidate : { None, LZ4, Zstd }) {
+        if (name && strcmp(name, compressionName(candidate)) == 0) {
+            *compression = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * SpoolWriter
+ */
+
+SpoolWriter::SpoolWriter(Spool::Compression compression, int keyframeInterval)
+    : m_compression(Spool::isSupported(compression) ? compression : Spool::None)
+    , m_keyframeInterval(std::max(1, keyframeInterval))
+{
+}
+
+SpoolWriter::~SpoolWriter()
+{
+    close();
+}
+
+bool SpoolWriter::open(const char *path)
+{
+    // Read access is needed for a shared mapping
+    m_fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        m_error = errno;
+        return false;
+    }
+
+#ifdef HAVE_ZSTD
+    if (m_compression == Spool::Zstd)
+        m_context = ZSTD_createCCtx();
+#endif
+
+    FileHeader header;
+    memcpy(header.magic, fileMagic, sizeof(header.magic));
+    header.version = fileVersion;
+    header.compression = uint32_t(m_compression);
+
+    uint8_t *data = reserve(sizeof(header));
+    if (!data) {
+        close();
+        return false;
+    }
+    memcpy(data, &header, sizeof(header));
+    m_position = sizeof(header);
+    m_stats.bytesWritten = m_position;
+
+    return true;
+}
+
+bool SpoolWriter::close()
+{
+    if (m_fd < 0)
+        return m_error == 0;
+
+    unmap();
+
+    // Give back what's left of the last chunk
+    if (ftruncate(m_fd, off_t(m_position)) < 0 && m_error == 0)
+        m_error = errno;
+    if (::close(m_fd) < 0 && m_error == 0)
+        m_error = errno;
+    m_fd = -1;
+
+#ifdef HAVE_ZSTD
+    if (m_context)
+        ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(m_context));
+#endif
+    m_context = nullptr;
+
+    return m_error == 0;
+}
+
+bool SpoolWriter::writeCaps(const std::string &caps)
+{
+    if (!append(Spool::Caps, storedFlag, reinterpret_cast<const uint8_t *>(caps.data()), caps.size(),
+                caps.size(), 0, 0))
+        return false;
+
+    // Sizes may have changed, start over from a keyframe
+    m_lastSize = 0;
+    return true;
+}
+
+bool SpoolWriter::writeFrame(const uint8_t *frame, const uint8_t *previous, size_t size,
+                             uint64_t pts, uint64_t duration)
+{
+    const bool keyframe = !previous || size != m_lastSize || m_sinceKeyframe >= m_keyframeInterval;
+
+    const uint8_t *input = frame;
+    if (!keyframe) {
+        m_delta.resize(size);
+        if (!xorFrames(frame, previous, m_delta.data(), size))
+            return writeRepeat(pts, duration);
+        input = m_delta.data();
+    }
+
+    if (!append(keyframe ? Spool::Keyframe : Spool::Delta, 0, input, size, size, pts, duration))
+        return false;
+
+    m_sinceKeyframe = keyframe ? 1 : m_sinceKeyframe + 1;
+    m_lastSize = size;
+    m_stats.frames++;
+    if (keyframe)
+        m_stats.keyframes++;
+    m_stats.bytesIn += size;
+    return true;
+}
+
+bool SpoolWriter::writeRepeat(uint64_t pts, uint64_t duration)
+{
+    if (!append(Spool::Repeat, storedFlag, nullptr, 0, m_lastSize, pts, duration))
+        return false;
+
+    m_sinceKeyframe++;
+    m_stats.frames++;
+    m_stats.repeats++;
+    m_stats.bytesIn += m_lastSize;
+    return true;
+}
+
+uint8_t *SpoolWriter::reserve(size_t size)
+{
+    if (m_fd < 0) {
+        if (m_error == 0)
+            m_error = EBADF;
+        return nullptr;
+    }
+
+    if (m_map && m_position + size <= m_mapOffset + m_mapSize)
+        return m_map + (m_position - m_mapOffset);
+
+    unmap();
+
+    // Blocks are allocated before they are mapped, writing
+    // to a hole on a full disk would raise SIGBUS
+    const uint64_t start = m_position / pageSize * pageSize;
+    const size_t needed = size_t(m_position - start) + size;
+    const size_t length = std::max(chunkSize, (needed + pageSize - 1) / pageSize * pageSize);
+    const int ret = posix_fallocate(m_fd, off_t(start), off_t(length));
+    if (ret != 0) {
+        m_error = ret;
+        return nullptr;
+    }
+
+    void *map = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, off_t(start));
+    if (map == MAP_FAILED) {
+        m_error = errno;
+        return nullptr;
+    }
+
+    m_map = static_cast<uint8_t *>(map);
+    m_mapOffset = start;
+    m_mapSize = length;
+    return m_map + (m_position - m_mapOffset);
+}
+
+void SpoolWriter::unmap()
+{
+    if (!m_map)
+        return;
+
+    munmap(m_map, m_mapSize);
+    m_map = nullptr;
+
+    // Start writing the chunk back now, rather than when
+    // the kernel finds too many dirty pages
+    if (m_position > m_mapOffset)
+        sync_file_range(m_fd, off_t(m_mapOffset), off_t(m_position - m_mapOffset), SYNC_FILE_RANGE_WRITE);
+}
+
+bool SpoolWriter::append(Spool::RecordType type, uint32_t flags, const uint8_t *data, size_t size,
+                         size_t rawSize, uint64_t pts, uint64_t duration)
+{
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+    const bool compress = !(flags & storedFlag) && m_compression != Spool::None;
+#endif
+
+    size_t bound = size;
+#ifdef HAVE_LZ4
+    if (compress && m_compression == Spool::LZ4)
+        bound = size_t(LZ4_compressBound(int(size)));
+#endif
+#ifdef HAVE_ZSTD
+    if (compress && m_compression == Spool::Zstd)
+        bound = ZSTD_compressBound(size);
+#endif
+
+    uint8_t *record = reserve(sizeof(RecordHeader) + padded(std::max(bound, size)));
+    if (!record)
+        return false;
+
+    // Compressed straight into the file
+    uint8_t *payload = record + sizeof(RecordHeader);
+    size_t payloadSize = 0;
+#ifdef HAVE_LZ4
+    if (compress && m_compression == Spool::LZ4) {
+        const int ret = LZ4_compress_default(reinterpret_cast<const char *>(data), reinterpret_cast<char *>(payload),
+                                             int(size), int(bound));
+        payloadSize = ret > 0 ? size_t(ret) : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (compress && m_compression == Spool::Zstd) {
+        const size_t ret = ZSTD_compressCCtx(static_cast<ZSTD_CCtx *>(m_context), payload, bound, data, size, 1);
+        payloadSize = ZSTD_isError(ret) ? 0 : ret;
+    }
+#endif
+    if (payloadSize == 0 || payloadSize >= size) {
+        if (size > 0)
+            memcpy(payload, data, size);
+        payloadSize = size;
+        flags |= storedFlag;
+    }
+
+    RecordHeader header;
+    header.magic = recordMagic;
+    header.type = uint16_t(type);
+    header.flags = uint16_t(flags);
+    header.size = uint32_t(rawSize);
+    header.payloadSize = uint32_t(payloadSize);
+    header.pts = pts;
+    header.duration = duration;
+    memcpy(record, &header, sizeof(header));
+
+    m_position += sizeof(header) + padded(payloadSize);
+    m_stats.bytesWritten = m_position;
+    return true;
+}
+
+/*
+ * SpoolReader
+ */
+
+SpoolReader::SpoolReader()
+{
+}
+
+SpoolReader::~SpoolReader()
+{
+    close();
+}
+
+bool SpoolReader::open(const char *path)
+{
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        m_error = errno;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        m_error = errno;
+        ::close(fd);
+        return false;
+    }
+    if (size_t(st.st_size) < sizeof(FileHeader)) {
+        m_error = EINVAL;
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        m_error = errno;
+        return false;
+    }
+    m_map = static_cast<const uint8_t *>(map);
+    m_mapSize = size_t(st.st_size);
+    madvise(map, m_mapSize, MADV_SEQUENTIAL);
+
+    FileHeader header;
+    memcpy(&header, m_map, sizeof(header));
+    if (memcmp(header.magic, fileMagic, sizeof(header.magic)) != 0 || header.version != fileVersion ||
+            header.compression > Spool::Zstd) {
+        m_error = EINVAL;
+        close();
+        return false;
+    }
+    m_compression = Spool::Compression(header.compression);
+    if (!Spool::isSupported(m_compression)) {
+        m_error = ENOTSUP;
+        close();
+        return false;
+    }
+
+    // Only the headers are read, payloads are paged in when decoded
+    size_t position = sizeof(header);
+    while (position + sizeof(RecordHeader) <= m_mapSize) {
+        RecordHeader recordHeader;
+        memcpy(&recordHeader, m_map + position, sizeof(recordHeader));
+        if (recordHeader.magic != recordMagic || recordHeader.type > Spool::Repeat ||
+                position + sizeof(recordHeader) + recordHeader.payloadSize > m_mapSize)
+            break;
+
+        Record record;
+        record.type = Spool::RecordType(recordHeader.type);
+        record.pts = recordHeader.pts;
+        record.duration = recordHeader.duration;
+        record.size = recordHeader.size;
+        record.payload = m_map + position + sizeof(recordHeader);
+        record.payloadSize = recordHeader.payloadSize;
+        record.stored = recordHeader.flags & storedFlag;
+        m_records.push_back(record);
+
+        position += sizeof(recordHeader) + padded(recordHeader.payloadSize);
+    }
+    m_truncated = position < m_mapSize;
+    m_decoder.reset(new SpoolDecoder(m_compression));
+
+    return true;
+}
+
+void SpoolReader::close()
+{
+    if (m_map)
+        munmap(const_cast<uint8_t *>(m_map), m_mapSize);
+    m_map = nullptr;
+    m_mapSize = 0;
+    m_records.clear();
+    m_decoder.reset();
+}
+
+std::string SpoolReader::caps(const Record &record) const
+{
+    if (record.type != Spool::Caps)
+        return std::string();
+    return std::string(reinterpret_cast<const char *>(record.payload), record.payloadSize);
+}
+
+bool SpoolReader::decode(const Record &record, const uint8_t *previous, uint8_t *frame)
+{
+    return m_decoder && m_decoder->decode(record, previous, frame);
+}
+
+/*
+ * SpoolDecoder
+ */
+
+SpoolDecoder::SpoolDecoder(Spool::Compression compression)
+    : m_compression(compression)
+{
+#ifdef HAVE_ZSTD
+    if (m_compression == Spool::Zstd)
+        m_context = ZSTD_createDCtx();
+#endif
+}
+
+SpoolDecoder::~SpoolDecoder()
+{
+#ifdef HAVE_ZSTD
+    if (m_context)
+        ZSTD_freeDCtx(static_cast<ZSTD_DCtx *>(m_context));
+#endif
+}
+
+bool SpoolDecoder::decode(const SpoolReader::Record &record, const uint8_t *previous, uint8_t *frame)
+{
+    switch (record.type) {
+    case Spool::Keyframe:
+        return decompress(record, frame);
+    case Spool::Delta:
+        if (!previous)
+            return false;
+        m_delta.resize(record.size);
+        if (!decompress(record, m_delta.data()))
+            return false;
+        xorFrames(previous, m_delta.data(), frame, record.size);
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool SpoolDecoder::decompress(const SpoolReader::Record &record, uint8_t *output)
+{
+    if (record.stored) {
+        if (record.payloadSize != record.size)
+            return false;
+        memcpy(output, record.payload, record.size);
+        return true;
+    }
+
+#ifdef HAVE_LZ4
+    if (m_compression == Spool::LZ4) {
+        const int ret = LZ4_decompress_safe(reinterpret_cast<const char *>(record.payload),
+                                            reinterpret_cast<char *>(output),
+                                            int(record.payloadSize), int(record.size));
+        return ret >= 0 && size_t(ret) == record.size;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (m_compression == Spool::Zstd) {
+        const size_t ret = ZSTD_decompressDCtx(static_cast<ZSTD_DCtx *>(m_context), output, record.size,
+                                               record.payload, record.payloadSize);
+        return !ZSTD_isError(ret) && ret == record.size;
+    }
+#endif
+
+    return false;
+}
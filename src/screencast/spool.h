@@ -0,0 +1,196 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Raw frames recorded now and encoded later.
+ *
+ * Each frame is stored as the XOR of itself and the previous frame,
+ * so that whatever didn't change is zeros, and compressed with LZ4 or
+ * zstd: a fraction of the cost of a real encoder and lossless. Every
+ * few frames a keyframe is stored whole, so that decoding can start
+ * there and a damaged record only loses the frames up to the next one.
+ *
+ * The file is a header followed by records, each with a header and a
+ * payload padded to 8 bytes: the caps, then keyframes, deltas and
+ * repeats of the previous frame; the caps are repeated when they
+ * change. A record that is cut short ends the file, that's all a crash
+ * costs.
+ */
+namespace Spool {
+
+enum Compression {
+    None,
+    LZ4,
+    Zstd
+};
+
+enum RecordType {
+    Caps,
+    Keyframe,
+    Delta,
+    Repeat
+};
+
+// Whether this build can write and read it, None always works
+bool isSupported(Compression compression);
+// The cheapest one available
+Compression defaultCompression();
+
+const char *compressionName(Compression compression);
+bool parseCompression(const char *name, Compression *compression);
+
+} // namespace Spool
+
+/*
+ * Appends to a spool file through a memory mapping: frames are
+ * compressed straight into the page cache, the file grows by
+ * preallocated chunks so that running out of space is an error
+ * rather than a SIGBUS, and each chunk is written back to disk
+ * as soon as it's full.
+ */
+class SpoolWriter
+{
+public:
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t keyframes = 0;
+        uint64_t repeats = 0;
+        // Raw frame bytes in, file bytes out
+        uint64_t bytesIn = 0;
+        uint64_t bytesWritten = 0;
+    };
+
+    explicit SpoolWriter(Spool::Compression compression = Spool::defaultCompression(),
+                         int keyframeInterval = 60);
+    ~SpoolWriter();
+
+    // Returns false and sets error() on failure
+    bool open(const char *path);
+    bool close();
+
+    Spool::Compression compression() const { return m_compression; }
+
+    // Starts a new stream of frames, the next one is a keyframe
+    bool writeCaps(const std::string &caps);
+    // Previous is the last frame written, null if there's none; a
+    // keyframe is stored when it's null, has a different size or
+    // the keyframe interval is over
+    bool writeFrame(const uint8_t *frame, const uint8_t *previous, size_t size,
+                    uint64_t pts, uint64_t duration);
+    // Same content as the previous frame, new timestamps
+    bool writeRepeat(uint64_t pts, uint64_t duration);
+
+    // errno of the first failure, 0 if none
+    int error() const { return m_error; }
+
+    Stats stats() const { return m_stats; }
+
+private:
+    Spool::Compression m_compression;
+    int m_keyframeInterval;
+    int m_fd = -1;
+    int m_error = 0;
+    void *m_context = nullptr;
+
+    // Mapped window of the file, position is where the next record goes
+    uint8_t *m_map = nullptr;
+    uint64_t m_mapOffset = 0;
+    size_t m_mapSize = 0;
+    uint64_t m_position = 0;
+
+    int m_sinceKeyframe = 0;
+    size_t m_lastSize = 0;
+    std::vector<uint8_t> m_delta;
+    Stats m_stats;
+
+    uint8_t *reserve(size_t size);
+    void unmap();
+    bool append(Spool::RecordType type, uint32_t flags, const uint8_t *data, size_t size,
+                size_t rawSize, uint64_t pts, uint64_t duration);
+};
+
+class SpoolDecoder;
+
+/*
+ * Reads a spool back through a read-only mapping of the whole file,
+ * the records are indexed when it's opened.
+ */
+class SpoolReader
+{
+public:
+    struct Record {
+        Spool::RecordType type = Spool::Caps;
+        uint64_t pts = 0;
+        uint64_t duration = 0;
+        // Size of the frame, or of the caps string
+        size_t size = 0;
+        // Compressed payload in the mapping
+        const uint8_t *payload = nullptr;
+        size_t payloadSize = 0;
+        bool stored = false;
+    };
+
+    SpoolReader();
+    ~SpoolReader();
+
+    // Returns false and sets error() on failure, a file cut short
+    // is read up to the last complete record and sets truncated()
+    bool open(const char *path);
+    void close();
+
+    Spool::Compression compression() const { return m_compression; }
+    const std::vector<Record> &records() const { return m_records; }
+    bool isTruncated() const { return m_truncated; }
+
+    std::string caps(const Record &record) const;
+    // Writes the frame of a keyframe or delta record into frame,
+    // previous is the frame before it and only read for deltas
+    bool decode(const Record &record, const uint8_t *previous, uint8_t *frame);
+
+    // errno of the failure, EINVAL if the file is not a spool
+    int error() const { return m_error; }
+
+private:
+    Spool::Compression m_compression = Spool::None;
+    int m_error = 0;
+    const uint8_t *m_map = nullptr;
+    size_t m_mapSize = 0;
+    bool m_truncated = false;
+    std::vector<Record> m_records;
+    std::unique_ptr<SpoolDecoder> m_decoder;
+};
+
+/*
+ * Decodes the records of a reader, which are only read. Several
+ * threads can each decode their own stretch of the same spool with
+ * a decoder of their own.
+ */
+class SpoolDecoder
+{
+public:
+    explicit SpoolDecoder(Spool::Compression compression);
+    ~SpoolDecoder();
+
+    bool decode(const SpoolReader::Record &record, const uint8_t *previous, uint8_t *frame);
+
+private:
+    Spool::Compression m_compression;
+    void *m_context = nullptr;
+    std::vector<uint8_t> m_delta;
+
+    bool decompress(const SpoolReader::Record &record, uint8_t *output);
+};
+
+#endif // SPOOL_H
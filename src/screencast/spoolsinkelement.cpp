@@ -0,0 +1,293 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include "spool.h"
+#include "spoolsinkelement.h"
+
+enum {
+    PROP_0,
+    PROP_LOCATION,
+    PROP_COMPRESSION,
+    PROP_KEYFRAME_INTERVAL,
+    PROP_STATS
+};
+
+struct _ScreencastSpoolSink
+{
+    GstBaseSink parent;
+
+    gchar *location;
+    Spool::Compression compression;
+    guint keyframeInterval;
+
+    SpoolWriter *writer;
+    // The last frame written, deltas are taken against it
+    GstBuffer *previous;
+
+    // Copied after every frame, for the stats property
+    SpoolWriter::Stats stats;
+    guint64 renderTime;
+};
+
+G_DEFINE_TYPE(ScreencastSpoolSink, screencast_spool_sink, GST_TYPE_BASE_SINK)
+
+static GstStaticPadTemplate sinkTemplate =
+        GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS("video/x-raw"));
+
+static void screencast_spool_sink_write_error(ScreencastSpoolSink *self)
+{
+    GST_ELEMENT_ERROR(self, RESOURCE, WRITE, ("Error writing to \"%s\"", self->location),
+                      ("%s", g_strerror(self->writer->error())));
+}
+
+static GstStructure *screencast_spool_sink_stats(ScreencastSpoolSink *self)
+{
+    GST_OBJECT_LOCK(self);
+    const SpoolWriter::Stats stats = self->stats;
+    const guint64 renderTime = self->renderTime;
+    GST_OBJECT_UNLOCK(self);
+
+    // Bytes in are the raw frames, repeats included; the render
+    // time is what recording costs, in nanoseconds
+    return gst_structure_new("stats",
+                             "frames", G_TYPE_UINT64, guint64(stats.frames),
+                             "keyframes", G_TYPE_UINT64, guint64(stats.keyframes),
+                             "repeats", G_TYPE_UINT64, guint64(stats.repeats),
+                             "bytes-in", G_TYPE_UINT64, guint64(stats.bytesIn),
+                             "bytes-written", G_TYPE_UINT64, guint64(stats.bytesWritten),
+                             "render-time", G_TYPE_UINT64, renderTime,
+                             nullptr);
+}
+
+static gboolean screencast_spool_sink_start(GstBaseSink *sink)
+{
+    ScreencastSpoolSink *self = SCREENCAST_SPOOL_SINK(sink);
+
+    if (!self->location) {
+        GST_ELEMENT_ERROR(self, RESOURCE, NOT_FOUND, ("No file name specified for writing"), (nullptr));
+        return FALSE;
+    }
+
+    SpoolWriter *writer = new SpoolWriter(self->compression, int(self->keyframeInterval));
+    if (!writer->open(self->location)) {
+        GST_ELEMENT_ERROR(self, RESOURCE, OPEN_WRITE, ("Could not open \"%s\" for writing", self->location),
+                          ("%s", g_strerror(writer->error())));
+        delete writer;
+        return FALSE;
+    }
+
+    delete self->writer;
+    self->writer = writer;
+
+    GST_OBJECT_LOCK(self);
+    self->stats = writer->stats();
+    self->renderTime = 0;
+    GST_OBJECT_UNLOCK(self);
+
+    return TRUE;
+}
+
+static gboolean screencast_spool_sink_stop(GstBaseSink *sink)
+{
+    ScreencastSpoolSink *self = SCREENCAST_SPOOL_SINK(sink);
+
+    gst_buffer_replace(&self->previous, nullptr);
+
+    if (self->writer && !self->writer->close()) {
+        screencast_spool_sink_write_error(self);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean screencast_spool_sink_set_caps(GstBaseSink *sink, GstCaps *caps)
+{
+    ScreencastSpoolSink *self = SCREENCAST_SPOOL_SINK(sink);
+
+    // The next frame is a keyframe, whatever its size
+    gst_buffer_replace(&self->previous, nullptr);
+
+    gchar *string = gst_caps_to_string(caps);
+    const bool written = self->writer->writeCaps(string);
+    g_free(string);
+
+    if (!written) {
+        screencast_spool_sink_write_error(self);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static GstFlowReturn screencast_spool_sink_render(GstBaseSink *sink, GstBuffer *buffer)
+{
+    ScreencastSpoolSink *self = SCREENCAST_SPOOL_SINK(sink);
+    const gint64 start = g_get_monotonic_time();
+
+    // Duplicates made by videorate share the memory of the previous
+    // frame, which can't be recycled while we hold it
+    const bool repeat = self->previous && gst_buffer_n_memory(buffer) == 1 &&
+            gst_buffer_n_memory(self->previous) == 1 &&
+            gst_buffer_peek_memory(buffer, 0) == gst_buffer_peek_memory(self->previous, 0);
+
+    bool written = false;
+    if (repeat) {
+        written = self->writer->writeRepeat(GST_BUFFER_PTS(buffer), GST_BUFFER_DURATION(buffer));
+    } else {
+        GstMapInfo map, previousMap;
+        if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+            return GST_FLOW_ERROR;
+        const bool hasPrevious = self->previous && gst_buffer_map(self->previous, &previousMap, GST_MAP_READ);
+        written = self->writer->writeFrame(map.data, hasPrevious && previousMap.size == map.size ? previousMap.data : nullptr,
+                                           map.size, GST_BUFFER_PTS(buffer), GST_BUFFER_DURATION(buffer));
+        if (hasPrevious)
+            gst_buffer_unmap(self->previous, &previousMap);
+        gst_buffer_unmap(buffer, &map);
+
+        gst_buffer_replace(&self->previous, buffer);
+    }
+
+    if (!written) {
+        screencast_spool_sink_write_error(self);
+        return GST_FLOW_ERROR;
+    }
+
+    GST_OBJECT_LOCK(self);
+    self->stats = self->writer->stats();
+    self->renderTime += guint64(g_get_monotonic_time() - start) * GST_USECOND;
+    GST_OBJECT_UNLOCK(self);
+
+    return GST_FLOW_OK;
+}
+
+static void screencast_spool_sink_set_property(GObject *object, guint propId,
+                                               const GValue *value, GParamSpec *pspec)
+{
+    ScreencastSpoolSink *self = SCREENCAST_SPOOL_SINK(object);
+
+    switch (propId) {
+    case PROP_LOCATION:
+        g_free(self->location);
+        self->location = g_value_dup_string(value);
+        break;
+    case PROP_COMPRESSION: {
+        Spool::Compression compression;
+        if (Spool::parseCompression(g_value_get_string(value), &compression) && Spool::isSupported(compression))
+            self->compression = compression;
+        else
+            g_warning("Unsupported spool compression \"%s\"", g_value_get_string(value));
+        break;
+    }
+    case PROP_KEYFRAME_INTERVAL:
+        self->keyframeInterval = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_spool_sink_get_property(GObject *object, guint propId,
+                                               GValue *value, GParamSpec *pspec)
+{
+    ScreencastSpoolSink *self = SCREENCAST_SPOOL_SINK(object);
+
+    switch (propId) {
+    case PROP_LOCATION:
+        g_value_set_string(value, self->location);
+        break;
+    case PROP_COMPRESSION:
+        g_value_set_string(value, Spool::compressionName(self->compression));
+        break;
+    case PROP_KEYFRAME_INTERVAL:
+        g_value_set_uint(value, self->keyframeInterval);
+        break;
+    case PROP_STATS:
+        g_value_take_boxed(value, screencast_spool_sink_stats(self));
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propId, pspec);
+        break;
+    }
+}
+
+static void screencast_spool_sink_finalize(GObject *object)
+{
+    ScreencastSpoolSink *self = SCREENCAST_SPOOL_SINK(object);
+
+    gst_buffer_replace(&self->previous, nullptr);
+
+    delete self->writer;
+    self->writer = nullptr;
+
+    g_free(self->location);
+    self->location = nullptr;
+
+    G_OBJECT_CLASS(screencast_spool_sink_parent_class)->finalize(object);
+}
+
+static void screencast_spool_sink_class_init(ScreencastSpoolSinkClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass *elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseSinkClass *sinkClass = GST_BASE_SINK_CLASS(klass);
+
+    objectClass->set_property = screencast_spool_sink_set_property;
+    objectClass->get_property = screencast_spool_sink_get_property;
+    objectClass->finalize = screencast_spool_sink_finalize;
+
+    g_object_class_install_property(
+                objectClass, PROP_LOCATION,
+                g_param_spec_string("location", "File location",
+                                    "Location of the spool to write",
+                                    nullptr,
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_COMPRESSION,
+                g_param_spec_string("compression", "Compression",
+                                    "How frames are compressed: lz4, zstd or none",
+                                    Spool::compressionName(Spool::defaultCompression()),
+                                    GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_KEYFRAME_INTERVAL,
+                g_param_spec_uint("keyframe-interval", "Keyframe interval",
+                                  "Store a whole frame every this many frames, the others are deltas",
+                                  1, G_MAXINT, 60,
+                                  GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(
+                objectClass, PROP_STATS,
+                g_param_spec_boxed("stats", "Statistics",
+                                   "Frames, bytes in and out and time spent spooling",
+                                   GST_TYPE_STRUCTURE,
+                                   GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+    gst_element_class_set_static_metadata(elementClass,
+                                          "Screencast spool sink",
+                                          "Sink/File",
+                                          "Writes raw frames as compressed deltas, to be encoded later",
+                                          "Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>");
+    gst_element_class_add_static_pad_template(elementClass, &sinkTemplate);
+
+    sinkClass->start = screencast_spool_sink_start;
+    sinkClass->stop = screencast_spool_sink_stop;
+    sinkClass->set_caps = screencast_spool_sink_set_caps;
+    sinkClass->render = screencast_spool_sink_render;
+}
+
+static void screencast_spool_sink_init(ScreencastSpoolSink *self)
+{
+    self->location = nullptr;
+    self->compression = Spool::defaultCompression();
+    self->keyframeInterval = 60;
+    self->writer = nullptr;
+    self->previous = nullptr;
+    self->stats = SpoolWriter::Stats();
+    self->renderTime = 0;
+
+    // Frames are written as fast as possible
+    gst_base_sink_set_sync(GST_BASE_SINK(self), FALSE);
+}
@@ -0,0 +1,19 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef SPOOLSINKELEMENT_H
+#define SPOOLSINKELEMENT_H
+
+#include <gst/base/gstbasesink.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_SPOOL_SINK (screencast_spool_sink_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastSpoolSink, screencast_spool_sink, SCREENCAST, SPOOL_SINK, GstBaseSink)
+
+G_END_DECLS
+
+#endif // SPOOLSINKELEMENT_H
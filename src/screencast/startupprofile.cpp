@@ -0,0 +1,54 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QVector>
+
+#include "screencast.h"
+#include "startupprofile.h"
+
+struct Milestone {
+    const char *name;
+    qint64 time;
+};
+
+static QMutex mutex;
+static QElapsedTimer timer;
+static QVector<Milestone> milestones;
+static bool reported = false;
+
+void StartupProfile::start()
+{
+    QMutexLocker locker(&mutex);
+    timer.start();
+    milestones.clear();
+    reported = false;
+}
+
+void StartupProfile::mark(const char *milestone)
+{
+    QMutexLocker locker(&mutex);
+    if (timer.isValid() && !reported)
+        milestones.append({ milestone, timer.elapsed() });
+}
+
+void StartupProfile::report()
+{
+    QMutexLocker locker(&mutex);
+    if (!timer.isValid() || reported)
+        return;
+    reported = true;
+
+    QStringList steps;
+    for (const auto &milestone : qAsConst(milestones))
+        steps.append(QStringLiteral("%1 at %2 ms").arg(QLatin1String(milestone.name)).arg(milestone.time));
+
+    qCInfo(lcScreencast, "Time to first frame %lld ms: %s", timer.elapsed(),
+           qPrintable(steps.join(QLatin1String(", "))));
+}
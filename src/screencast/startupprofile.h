@@ -0,0 +1,27 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef STARTUPPROFILE_H
+#define STARTUPPROFILE_H
+
+/*
+ * Milestones from the start of the process to the first encoded
+ * frame, to find out where the startup time goes.
+ *
+ * Milestones can be marked from any thread, they are logged
+ * in the order they were reached.
+ */
+class StartupProfile
+{
+public:
+    static void start();
+    static void mark(const char *milestone);
+
+    // Logs the time to first frame, only the first time it's called
+    static void report();
+};
+
+#endif // STARTUPPROFILE_H
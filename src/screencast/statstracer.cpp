@@ -0,0 +1,212 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <deque>
+
+#include "statstracer.h"
+
+#include <gst/gst.h>
+
+// Weight of a new sample in the averages
+static const double smoothing = 1.0 / 16;
+// Buffers remembered per element to match outputs with inputs
+static const size_t maxPending = 64;
+
+struct TracerData
+{
+    QMutex mutex;
+    QHash<GstElement *, ElementStats> elements;
+    QHash<GstElement *, std::deque<std::pair<GstClockTime, GstClockTime>>> pending;
+};
+
+struct _ScreencastStatsTracer
+{
+    GstTracer parent;
+
+    TracerData *d;
+};
+
+G_DEFINE_TYPE(ScreencastStatsTracer, screencast_stats_tracer, GST_TYPE_TRACER)
+
+static void element_finalized(gpointer user_data, GObject *object)
+{
+    ScreencastStatsTracer *self = SCREENCAST_STATS_TRACER(user_data);
+    GstElement *element = reinterpret_cast<GstElement *>(object);
+
+    QMutexLocker locker(&self->d->mutex);
+    self->d->elements.remove(element);
+    self->d->pending.remove(element);
+}
+
+static GstClockTime running_time(GstElement *element)
+{
+    GST_OBJECT_LOCK(element);
+    GstClock *clock = GST_ELEMENT_CLOCK(element) ? GST_CLOCK(gst_object_ref(GST_ELEMENT_CLOCK(element))) : nullptr;
+    const GstClockTime baseTime = GST_ELEMENT_CAST(element)->base_time;
+    GST_OBJECT_UNLOCK(element);
+
+    if (!clock)
+        return GST_CLOCK_TIME_NONE;
+
+    const GstClockTime now = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+    return now >= baseTime ? now - baseTime : GST_CLOCK_TIME_NONE;
+}
+
+static void record_buffer(ScreencastStatsTracer *self, GstClockTime ts, GstElement *element,
+                          GstElement *next, GstClockTime now, GstBuffer *buffer)
+{
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+
+    if (!self->d->elements.contains(element))
+        g_object_weak_ref(G_OBJECT(element), element_finalized, self);
+    ElementStats &stats = self->d->elements[element];
+
+    stats.buffers++;
+    stats.bytes += gst_buffer_get_size(buffer);
+
+    // Rates over the last second
+    if (!GST_CLOCK_TIME_IS_VALID(stats.windowStart))
+        stats.windowStart = ts;
+    stats.windowBuffers++;
+    stats.windowBytes += gst_buffer_get_size(buffer);
+    if (ts >= stats.windowStart + GST_SECOND) {
+        const double seconds = double(ts - stats.windowStart) / GST_SECOND;
+        stats.fps = stats.windowBuffers / seconds;
+        stats.bytesPerSecond = stats.windowBytes / seconds;
+        stats.windowStart = ts;
+        stats.windowBuffers = 0;
+        stats.windowBytes = 0;
+    }
+
+    if (GST_CLOCK_TIME_IS_VALID(pts)) {
+        // Time spent inside the element, matched by timestamp because
+        // queues and encoders let buffers out on another thread
+        auto &pending = self->d->pending[element];
+        for (auto it = pending.begin(); it != pending.end(); ++it) {
+            if (it->first == pts) {
+                const GstClockTime latency = ts - it->second;
+                stats.latency += (double(latency) - stats.latency) * smoothing;
+                stats.latencyMax = qMax(stats.latencyMax, latency);
+                pending.erase(it);
+                break;
+            }
+        }
+
+        // How long ago the frame was captured
+        if (GST_CLOCK_TIME_IS_VALID(now) && now >= pts) {
+            const GstClockTime age = now - pts;
+            stats.age += (double(age) - stats.age) * smoothing;
+            stats.ageMax = qMax(stats.ageMax, age);
+        }
+
+        if (next) {
+            if (!self->d->elements.contains(next)) {
+                g_object_weak_ref(G_OBJECT(next), element_finalized, self);
+                self->d->elements.insert(next, ElementStats());
+            }
+            auto &nextPending = self->d->pending[next];
+            if (nextPending.size() >= maxPending)
+                nextPending.pop_front();
+            nextPending.emplace_back(pts, ts);
+        }
+    }
+}
+
+static void pad_push(ScreencastStatsTracer *self, GstClockTime ts, GstPad *pad,
+                     GstBuffer *buffer, GstBufferList *list)
+{
+    GstObject *parent = GST_OBJECT_PARENT(pad);
+    if (!parent || !GST_IS_ELEMENT(parent))
+        return;
+    GstElement *element = GST_ELEMENT(parent);
+
+    GstElement *next = nullptr;
+    GstPad *peer = gst_pad_get_peer(pad);
+    if (peer) {
+        next = gst_pad_get_parent_element(peer);
+        gst_object_unref(peer);
+    }
+
+    const GstClockTime now = running_time(element);
+
+    {
+        QMutexLocker locker(&self->d->mutex);
+        if (buffer)
+            record_buffer(self, ts, element, next, now, buffer);
+        for (guint i = 0; list && i < gst_buffer_list_length(list); ++i)
+            record_buffer(self, ts, element, next, now, gst_buffer_list_get(list, i));
+    }
+
+    if (next)
+        gst_object_unref(next);
+}
+
+static void do_push_buffer_pre(GObject *object, GstClockTime ts, GstPad *pad, GstBuffer *buffer)
+{
+    pad_push(SCREENCAST_STATS_TRACER(object), ts, pad, buffer, nullptr);
+}
+
+static void do_push_buffer_list_pre(GObject *object, GstClockTime ts, GstPad *pad, GstBufferList *list)
+{
+    pad_push(SCREENCAST_STATS_TRACER(object), ts, pad, nullptr, list);
+}
+
+static void screencast_stats_tracer_finalize(GObject *object)
+{
+    ScreencastStatsTracer *self = SCREENCAST_STATS_TRACER(object);
+
+    {
+        QMutexLocker locker(&self->d->mutex);
+        for (auto it = self->d->elements.constBegin(); it != self->d->elements.constEnd(); ++it)
+            g_object_weak_unref(G_OBJECT(it.key()), element_finalized, self);
+    }
+
+    delete self->d;
+    self->d = nullptr;
+
+    G_OBJECT_CLASS(screencast_stats_tracer_parent_class)->finalize(object);
+}
+
+static void screencast_stats_tracer_class_init(ScreencastStatsTracerClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+
+    objectClass->finalize = screencast_stats_tracer_finalize;
+}
+
+static void screencast_stats_tracer_init(ScreencastStatsTracer *self)
+{
+    self->d = new TracerData;
+
+    GstTracer *tracer = GST_TRACER(self);
+    gst_tracing_register_hook(tracer, "pad-push-pre", G_CALLBACK(do_push_buffer_pre));
+    gst_tracing_register_hook(tracer, "pad-push-list-pre", G_CALLBACK(do_push_buffer_list_pre));
+}
+
+ScreencastStatsTracer *screencast_stats_tracer_get()
+{
+    // Hooks stay registered for the lifetime of the process
+    static ScreencastStatsTracer *tracer = SCREENCAST_STATS_TRACER(
+                g_object_new(SCREENCAST_TYPE_STATS_TRACER, nullptr));
+    return tracer;
+}
+
+bool screencast_stats_tracer_lookup(ScreencastStatsTracer *tracer, GstElement *element, ElementStats *stats)
+{
+    QMutexLocker locker(&tracer->d->mutex);
+
+    auto it = tracer->d->elements.constFind(element);
+    if (it == tracer->d->elements.constEnd() || it->buffers == 0)
+        return false;
+
+    *stats = it.value();
+    return true;
+}
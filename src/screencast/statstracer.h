@@ -0,0 +1,50 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef STATSTRACER_H
+#define STATSTRACER_H
+
+#include <gst/gsttracer.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_STATS_TRACER (screencast_stats_tracer_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastStatsTracer, screencast_stats_tracer, SCREENCAST, STATS_TRACER, GstTracer)
+
+G_END_DECLS
+
+/*
+ * What the tracer knows about the buffers an element pushed.
+ *
+ * Latency is the time between a buffer entering the element and the
+ * buffer with the same timestamp leaving it, age is the running time
+ * minus the timestamp when it leaves, i.e. how long ago it was captured.
+ * Averages are exponentially weighted, rates are over the last second.
+ */
+struct ElementStats
+{
+    guint64 buffers = 0;
+    guint64 bytes = 0;
+    double fps = 0;
+    double bytesPerSecond = 0;
+    double latency = 0;
+    GstClockTime latencyMax = 0;
+    double age = 0;
+    GstClockTime ageMax = 0;
+
+    // Rate measurement window
+    GstClockTime windowStart = GST_CLOCK_TIME_NONE;
+    guint64 windowBuffers = 0;
+    guint64 windowBytes = 0;
+};
+
+// The tracer is created on first use and records every element from then on
+ScreencastStatsTracer *screencast_stats_tracer_get();
+
+// Returns false if the element didn't push any buffer yet
+bool screencast_stats_tracer_lookup(ScreencastStatsTracer *tracer, GstElement *element, ElementStats *stats);
+
+#endif // STATSTRACER_H
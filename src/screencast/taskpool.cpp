@@ -0,0 +1,171 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QAtomicInt>
+
+#include "screencast.h"
+#include "taskpool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+
+struct _ScreencastTaskPool
+{
+    GstTaskPool parent;
+
+    ThreadPolicy *policy;
+};
+
+G_DEFINE_TYPE(ScreencastTaskPool, screencast_task_pool, GST_TYPE_TASK_POOL)
+
+struct PoolThread
+{
+    pthread_t thread;
+    GstTaskPoolFunction func;
+    gpointer data;
+    ScreencastTaskPool *pool;
+};
+
+// Each failure is only worth one warning per process
+static QAtomicInt warnedAffinity;
+static QAtomicInt warnedNice;
+
+static void *pool_thread_func(void *data)
+{
+    PoolThread *thread = static_cast<PoolThread *>(data);
+    const ThreadPolicy *policy = thread->pool->policy;
+
+    // Niceness is per thread on Linux but not a pthread attribute,
+    // so the thread applies it to itself
+    if (policy->nice != 0) {
+        errno = 0;
+        const int current = getpriority(PRIO_PROCESS, 0);
+        if ((current != -1 || errno == 0) &&
+                setpriority(PRIO_PROCESS, 0, qBound(-20, current + policy->nice, 19)) != 0 &&
+                warnedNice.testAndSetRelaxed(0, 1))
+            qCInfo(lcScreencast, "Unable to change the niceness of streaming threads by %d: %s",
+                   policy->nice, strerror(errno));
+    }
+
+    thread->func(thread->data);
+    return nullptr;
+}
+
+static void init_attributes(pthread_attr_t *attr, const ThreadPolicy *policy, bool pin)
+{
+    pthread_attr_init(attr);
+    if (pin && !policy->cpus.isEmpty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : policy->cpus)
+            CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    }
+    if (policy->batch) {
+        struct sched_param param = {};
+        pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(attr, SCHED_BATCH);
+        pthread_attr_setschedparam(attr, &param);
+    }
+}
+
+static gboolean screencast_task_pool_prepare(GstTaskPool *pool, GError **error)
+{
+    Q_UNUSED(pool)
+    Q_UNUSED(error)
+
+    // Threads are started on demand, one per task
+    return TRUE;
+}
+
+static void screencast_task_pool_cleanup(GstTaskPool *pool)
+{
+    Q_UNUSED(pool)
+}
+
+static gpointer screencast_task_pool_push(GstTaskPool *pool, GstTaskPoolFunction func,
+                                          gpointer user_data, GError **error)
+{
+    ScreencastTaskPool *self = SCREENCAST_TASK_POOL(pool);
+    const ThreadPolicy *policy = self->policy;
+
+    PoolThread *thread = new PoolThread();
+    thread->func = func;
+    thread->data = user_data;
+    thread->pool = SCREENCAST_TASK_POOL(gst_object_ref(self));
+
+    pthread_attr_t attr;
+    init_attributes(&attr, policy, true);
+    int result = pthread_create(&thread->thread, &attr, pool_thread_func, thread);
+    pthread_attr_destroy(&attr);
+    if (result != 0 && !policy->cpus.isEmpty()) {
+        // CPUs that are offline or outside of our cpuset, better
+        // to record unpinned than to fail
+        if (warnedAffinity.testAndSetRelaxed(0, 1))
+            qCWarning(lcScreencast, "Unable to pin streaming threads: %s", strerror(result));
+        init_attributes(&attr, policy, false);
+        result = pthread_create(&thread->thread, &attr, pool_thread_func, thread);
+        pthread_attr_destroy(&attr);
+    }
+
+    if (result != 0) {
+        g_set_error(error, G_THREAD_ERROR, G_THREAD_ERROR_AGAIN,
+                    "Unable to create a streaming thread: %s", strerror(result));
+        gst_object_unref(thread->pool);
+        delete thread;
+        return nullptr;
+    }
+
+    return thread;
+}
+
+static void screencast_task_pool_join(GstTaskPool *pool, gpointer id)
+{
+    Q_UNUSED(pool)
+
+    PoolThread *thread = static_cast<PoolThread *>(id);
+    pthread_join(thread->thread, nullptr);
+    gst_object_unref(thread->pool);
+    delete thread;
+}
+
+static void screencast_task_pool_finalize(GObject *object)
+{
+    ScreencastTaskPool *self = SCREENCAST_TASK_POOL(object);
+
+    delete self->policy;
+    self->policy = nullptr;
+
+    G_OBJECT_CLASS(screencast_task_pool_parent_class)->finalize(object);
+}
+
+static void screencast_task_pool_class_init(ScreencastTaskPoolClass *klass)
+{
+    GObjectClass *objectClass = G_OBJECT_CLASS(klass);
+    GstTaskPoolClass *poolClass = GST_TASK_POOL_CLASS(klass);
+
+    objectClass->finalize = screencast_task_pool_finalize;
+
+    poolClass->prepare = screencast_task_pool_prepare;
+    poolClass->cleanup = screencast_task_pool_cleanup;
+    poolClass->push = screencast_task_pool_push;
+    poolClass->join = screencast_task_pool_join;
+}
+
+static void screencast_task_pool_init(ScreencastTaskPool *self)
+{
+    self->policy = new ThreadPolicy();
+}
+
+GstTaskPool *screencast_task_pool_new(const ThreadPolicy &policy)
+{
+    ScreencastTaskPool *pool = SCREENCAST_TASK_POOL(g_object_new(SCREENCAST_TYPE_TASK_POOL, nullptr));
+    *pool->policy = policy;
+    return GST_TASK_POOL(gst_object_ref_sink(pool));
+}
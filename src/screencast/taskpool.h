@@ -0,0 +1,45 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <QVector>
+
+#include <gst/gsttaskpool.h>
+
+G_BEGIN_DECLS
+
+#define SCREENCAST_TYPE_TASK_POOL (screencast_task_pool_get_type())
+G_DECLARE_FINAL_TYPE(ScreencastTaskPool, screencast_task_pool, SCREENCAST, TASK_POOL, GstTaskPool)
+
+G_END_DECLS
+
+/*
+ * How the threads of a task pool are scheduled.
+ *
+ * Threads the task then creates itself, such as the encoder's own
+ * workers, inherit all of it from the streaming thread.
+ */
+struct ThreadPolicy
+{
+    // CPUs the threads may run on, empty lets the scheduler pick
+    QVector<int> cpus;
+    // Added to the niceness of the process, lowering it usually
+    // needs CAP_SYS_NICE or a raised RLIMIT_NICE
+    int nice = 0;
+    // SCHED_BATCH: longer time slices and no wakeup preemption,
+    // for CPU bound work that doesn't care about latency
+    bool batch = false;
+
+    bool isDefault() const { return cpus.isEmpty() && nice == 0 && !batch; }
+};
+
+// Starts every streaming thread of the tasks it is set on with the
+// policy, instead of taking them from GStreamer's shared thread pool
+GstTaskPool *screencast_task_pool_new(const ThreadPolicy &policy);
+
+#endif // TASKPOOL_H
@@ -0,0 +1,291 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QMutexLocker>
+
+#include "screencast.h"
+#include "threadlayout.h"
+
+#include <gst/gst.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *const layoutTable[] = {
+    "shared", "staged"
+};
+
+static const char *const stageTable[] = {
+    "capture", "convert", "encode", "mux", "other"
+};
+
+// Only takes effect with CAP_SYS_NICE or a raised RLIMIT_NICE
+static const int captureNiceBoost = 5;
+
+static GQuark stage_quark()
+{
+    static GQuark quark = g_quark_from_static_string("screencast-thread-stage");
+    return quark;
+}
+
+static qint64 clock_time(clockid_t clock)
+{
+    struct timespec ts = {};
+    if (clock_gettime(clock, &ts) != 0)
+        return 0;
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+template <typename T, size_t N>
+static bool parseEnum(const char *const (&table)[N], const QString &name, T &value)
+{
+    for (size_t i = 0; i < N; ++i) {
+        if (name.compare(QLatin1String(table[i]), Qt::CaseInsensitive) == 0) {
+            value = static_cast<T>(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <size_t N>
+static QStringList enumNames(const char *const (&table)[N])
+{
+    QStringList names;
+    for (size_t i = 0; i < N; ++i)
+        names.append(QLatin1String(table[i]));
+    return names;
+}
+
+ThreadLayout::ThreadLayout(GstElement *pipeline)
+    : m_pipeline(pipeline)
+{
+    // Stream status messages are posted from the thread that creates
+    // the task and then from the streaming thread itself
+    GstBus *bus = gst_element_get_bus(m_pipeline);
+    gst_bus_set_sync_handler(bus, streamStatus, this, nullptr);
+    gst_object_unref(bus);
+}
+
+ThreadLayout::~ThreadLayout()
+{
+    GstBus *bus = gst_element_get_bus(m_pipeline);
+    gst_bus_set_sync_handler(bus, nullptr, nullptr, nullptr);
+    gst_object_unref(bus);
+
+    for (auto *&pool : m_pools) {
+        if (pool)
+            gst_object_unref(pool);
+        pool = nullptr;
+    }
+}
+
+bool ThreadLayout::parseLayout(const QString &name, Layout &layout)
+{
+    return parseEnum(layoutTable, name, layout);
+}
+
+QString ThreadLayout::layoutName(Layout layout)
+{
+    return QLatin1String(layoutTable[layout]);
+}
+
+QStringList ThreadLayout::layoutNames()
+{
+    return enumNames(layoutTable);
+}
+
+bool ThreadLayout::parseStage(const QString &name, Stage &stage)
+{
+    // Other is what's left, it can't be configured
+    return parseEnum(stageTable, name, stage) && stage != Other;
+}
+
+QString ThreadLayout::stageName(Stage stage)
+{
+    return QLatin1String(stageTable[stage]);
+}
+
+QStringList ThreadLayout::stageNames()
+{
+    return enumNames(stageTable).mid(0, Other);
+}
+
+bool ThreadLayout::parseCpus(const QString &value, QVector<int> &cpus)
+{
+    const int maxCpu = CPU_SETSIZE - 1;
+
+    QVector<int> result;
+    for (const auto &item : value.split(QLatin1Char(','))) {
+        const auto range = item.trimmed().split(QLatin1Char('-'));
+        bool firstOk = false, lastOk = false;
+        const int first = range.value(0).toInt(&firstOk);
+        const int last = range.size() == 2 ? range.value(1).toInt(&lastOk) : first;
+        if (range.size() > 2 || !firstOk || (range.size() == 2 && !lastOk) ||
+                first < 0 || last < first || last > maxCpu)
+            return false;
+        for (int cpu = first; cpu <= last; ++cpu) {
+            if (!result.contains(cpu))
+                result.append(cpu);
+        }
+    }
+
+    cpus = result;
+    return true;
+}
+
+void ThreadLayout::assign(GstElement *element, Stage stage)
+{
+    g_object_set_qdata(G_OBJECT(element), stage_quark(), GINT_TO_POINTER(int(stage) + 1));
+}
+
+void ThreadLayout::setPolicy(Stage stage, const ThreadPolicy &policy)
+{
+    if (stage == Other)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    if (m_pools[stage])
+        gst_object_unref(m_pools[stage]);
+    // GStreamer's own pool is as good when there's nothing to change
+    m_pools[stage] = policy.isDefault() ? nullptr : screencast_task_pool_new(policy);
+}
+
+void ThreadLayout::setPolicies(const CaptureSettings &settings)
+{
+    const bool staged = settings.threadLayout == Staged;
+
+    for (int stage = Capture; stage < Other; ++stage) {
+        ThreadPolicy policy;
+        policy.cpus = settings.stageCpus[stage];
+        if (stage == Capture && staged) {
+            // A frame that isn't picked up in time is lost for good,
+            // the other stages have queues to catch up from
+            policy.nice = -captureNiceBoost;
+        } else if (stage == Encode) {
+            policy.nice = settings.encoderNice;
+            policy.batch = staged;
+        }
+        setPolicy(Stage(stage), policy);
+    }
+}
+
+QVector<ThreadLayout::Thread> ThreadLayout::threads() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    QVector<Thread> threads;
+    threads.reserve(m_records.size());
+    for (const auto &record : m_records) {
+        Thread thread = record.thread;
+        // The clock is only valid until the thread leaves, which
+        // can't happen while the lock is held
+        if (thread.running)
+            thread.cpuTime += clock_time(record.clock) - record.enteredAt;
+        threads.append(thread);
+    }
+    return threads;
+}
+
+ThreadLayout::Stage ThreadLayout::stageOf(GstElement *element)
+{
+    const int value = element ? GPOINTER_TO_INT(g_object_get_qdata(G_OBJECT(element), stage_quark())) : 0;
+    return value > 0 ? Stage(value - 1) : Other;
+}
+
+void ThreadLayout::enter(GstElement *owner)
+{
+    // Runs on the streaming thread, before it handles any data
+    clockid_t clock;
+    if (pthread_getcpuclockid(pthread_self(), &clock) != 0)
+        return;
+
+    const QString name = QString::fromUtf8(GST_OBJECT_NAME(owner));
+
+    QMutexLocker locker(&m_mutex);
+
+    // Tasks are stopped and started again on flushes, with the
+    // same thread or a new one, the element keeps its entry
+    Record *record = nullptr;
+    for (auto &existing : m_records) {
+        if (existing.thread.name == name && !existing.thread.running) {
+            record = &existing;
+            break;
+        }
+    }
+    if (!record) {
+        m_records.append(Record());
+        record = &m_records.last();
+        record->thread.name = name;
+        record->thread.stage = stageOf(owner);
+    }
+
+    record->thread.tid = int(syscall(SYS_gettid));
+    record->thread.running = true;
+    record->clock = clock;
+    record->enteredAt = clock_time(clock);
+}
+
+void ThreadLayout::leave(GstElement *owner)
+{
+    const QString name = QString::fromUtf8(GST_OBJECT_NAME(owner));
+
+    QMutexLocker locker(&m_mutex);
+
+    for (auto &record : m_records) {
+        if (record.thread.name == name && record.thread.running &&
+                record.thread.tid == int(syscall(SYS_gettid))) {
+            record.thread.cpuTime += clock_time(record.clock) - record.enteredAt;
+            record.thread.running = false;
+            break;
+        }
+    }
+}
+
+GstBusSyncReply ThreadLayout::streamStatus(GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+    Q_UNUSED(bus)
+
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_STREAM_STATUS)
+        return GST_BUS_PASS;
+
+    ThreadLayout *self = static_cast<ThreadLayout *>(user_data);
+
+    GstStreamStatusType type;
+    GstElement *owner = nullptr;
+    gst_message_parse_stream_status(msg, &type, &owner);
+    if (!owner)
+        return GST_BUS_PASS;
+
+    switch (type) {
+    case GST_STREAM_STATUS_TYPE_CREATE: {
+        // The task is not started yet, which is the only time its pool
+        // can be changed
+        const Stage stage = stageOf(owner);
+        const GValue *value = gst_message_get_stream_status_object(msg);
+        if (stage == Other || !value || !G_VALUE_HOLDS(value, GST_TYPE_TASK))
+            break;
+
+        QMutexLocker locker(&self->m_mutex);
+        if (self->m_pools[stage])
+            gst_task_set_pool(GST_TASK(g_value_get_object(value)), self->m_pools[stage]);
+        break;
+    }
+    case GST_STREAM_STATUS_TYPE_ENTER:
+        self->enter(owner);
+        break;
+    case GST_STREAM_STATUS_TYPE_LEAVE:
+        self->leave(owner);
+        break;
+    default:
+        break;
+    }
+
+    return GST_BUS_PASS;
+}
@@ -0,0 +1,110 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef THREADLAYOUT_H
+#define THREADLAYOUT_H
+
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <gst/gstbus.h>
+#include <gst/gstelement.h>
+
+#include <time.h>
+
+#include "taskpool.h"
+
+class CaptureSettings;
+
+/*
+ * Which streaming thread runs which part of a pipeline, and how.
+ *
+ * Elements that start a streaming thread, sources and queues, are
+ * assigned a stage. When the thread is created it is taken from the
+ * task pool of its stage, which pins it and sets its priority, and
+ * while it runs its CPU time is tracked.
+ *
+ * With the shared layout capture and conversion run on the source's
+ * thread and encoding and muxing on the thread of the queue before the
+ * encoder. The staged layout adds a queue after capture and one after
+ * the encoder, so that every stage has a thread of its own.
+ */
+class ThreadLayout
+{
+public:
+    enum Layout {
+        Shared,
+        Staged
+    };
+
+    enum Stage {
+        Capture,
+        Convert,
+        Encode,
+        Mux,
+        // Threads of elements without a stage
+        Other
+    };
+
+    struct Thread {
+        Stage stage = Other;
+        // Of the element that started the thread
+        QString name;
+        int tid = 0;
+        // Nanoseconds, while the thread ran for this element
+        qint64 cpuTime = 0;
+        bool running = false;
+    };
+
+    explicit ThreadLayout(GstElement *pipeline);
+    ~ThreadLayout();
+
+    static bool parseLayout(const QString &name, Layout &layout);
+    static QString layoutName(Layout layout);
+    static QStringList layoutNames();
+
+    static bool parseStage(const QString &name, Stage &stage);
+    static QString stageName(Stage stage);
+    static QStringList stageNames();
+
+    // Parses a list of CPUs such as "0,2-3"
+    static bool parseCpus(const QString &value, QVector<int> &cpus);
+
+    // Threads the element starts from now on belong to the stage
+    static void assign(GstElement *element, Stage stage);
+
+    // Applies to threads created after the call
+    void setPolicy(Stage stage, const ThreadPolicy &policy);
+    // Pins the stages to the CPUs in the settings; with the staged
+    // layout the capture thread is also given a higher priority and
+    // encoding threads run as SCHED_BATCH
+    void setPolicies(const CaptureSettings &settings);
+
+    QVector<Thread> threads() const;
+
+private:
+    struct Record {
+        Thread thread;
+        clockid_t clock = 0;
+        qint64 enteredAt = 0;
+    };
+
+    GstElement *m_pipeline = nullptr;
+    GstTaskPool *m_pools[Other] = {};
+
+    mutable QMutex m_mutex;
+    QVector<Record> m_records;
+
+    void enter(GstElement *owner);
+    void leave(GstElement *owner);
+
+    static Stage stageOf(GstElement *element);
+    static GstBusSyncReply streamStatus(GstBus *bus, GstMessage *msg, gpointer user_data);
+};
+
+#endif // THREADLAYOUT_H
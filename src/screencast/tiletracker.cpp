@@ -0,0 +1,193 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+
+#include "tiletracker.h"
+
+// xxHash64 primes and round, four independent lanes
+static const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+static const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t prime3 = 0x165667b19e3779f9ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * prime2, 31) * prime1;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+TileTracker::TileTracker(int tileSize)
+    : m_tileSize(tileSize)
+{
+}
+
+void TileTracker::reset(int width, int height)
+{
+    m_width = width;
+    m_height = height;
+    m_columns = (width + m_tileSize - 1) / m_tileSize;
+    m_rows = (height + m_tileSize - 1) / m_tileSize;
+    m_hashes.assign(size_t(m_columns) * m_rows, 0);
+    m_dirty.assign(size_t(m_columns) * m_rows, 1);
+    m_valid = false;
+}
+
+int TileTracker::update(const uint8_t *data, int stride, const std::vector<Rect> *damage)
+{
+    // Everything is dirty until there is a previous frame to compare with
+    const bool firstFrame = !m_valid;
+    m_valid = true;
+
+    std::vector<uint8_t> candidates(m_dirty.size(), damage && !firstFrame ? 0 : 1);
+    if (damage && !firstFrame) {
+        for (const Rect &rect : *damage) {
+            const int x0 = std::max(0, rect.x) / m_tileSize;
+            const int y0 = std::max(0, rect.y) / m_tileSize;
+            const int x1 = std::min(m_columns - 1, (rect.x + rect.width - 1) / m_tileSize);
+            const int y1 = std::min(m_rows - 1, (rect.y + rect.height - 1) / m_tileSize);
+            for (int row = y0; row <= y1; ++row) {
+                for (int column = x0; column <= x1; ++column)
+                    candidates[row * m_columns + column] = 1;
+            }
+        }
+    }
+
+    int changed = 0;
+    for (int row = 0; row < m_rows; ++row) {
+        const int y = row * m_tileSize;
+        const int height = std::min(m_tileSize, m_height - y);
+
+        for (int column = 0; column < m_columns; ++column) {
+            const int index = row * m_columns + column;
+            m_dirty[index] = 0;
+            if (!candidates[index])
+                continue;
+
+            const int x = column * m_tileSize;
+            const int width = std::min(m_tileSize, m_width - x);
+            const uint64_t hash = hashTile(data + y * stride + x * 4, stride, width, height);
+
+            if (firstFrame || hash != m_hashes[index]) {
+                m_hashes[index] = hash;
+                m_dirty[index] = 1;
+                ++changed;
+            }
+        }
+    }
+
+    return changed;
+}
+
+std::vector<TileTracker::Rect> TileTracker::dirtyRegions(int maxRegions) const
+{
+    std::vector<Rect> regions;
+
+    // Horizontal runs of dirty tiles, extended downwards while the
+    // run on the next row covers exactly the same columns
+    std::vector<uint8_t> taken(m_dirty.size(), 0);
+    for (int row = 0; row < m_rows; ++row) {
+        for (int column = 0; column < m_columns; ++column) {
+            const int index = row * m_columns + column;
+            if (!m_dirty[index] || taken[index])
+                continue;
+
+            int end = column;
+            while (end < m_columns && m_dirty[row * m_columns + end] && !taken[row * m_columns + end])
+                ++end;
+
+            int bottom = row + 1;
+            for (; bottom < m_rows; ++bottom) {
+                bool same = true;
+                for (int c = column; c < end && same; ++c)
+                    same = m_dirty[bottom * m_columns + c] && !taken[bottom * m_columns + c];
+                const bool bounded = (column == 0 || !m_dirty[bottom * m_columns + column - 1]) &&
+                        (end == m_columns || !m_dirty[bottom * m_columns + end]);
+                if (!same || !bounded)
+                    break;
+            }
+
+            for (int r = row; r < bottom; ++r) {
+                for (int c = column; c < end; ++c)
+                    taken[r * m_columns + c] = 1;
+            }
+
+            Rect rect;
+            rect.x = column * m_tileSize;
+            rect.y = row * m_tileSize;
+            rect.width = std::min(end * m_tileSize, m_width) - rect.x;
+            rect.height = std::min(bottom * m_tileSize, m_height) - rect.y;
+            regions.push_back(rect);
+
+            column = end - 1;
+        }
+    }
+
+    // Too fragmented, fall back to the bounding box
+    if (int(regions.size()) > maxRegions) {
+        Rect bounds = regions.front();
+        int right = bounds.x + bounds.width;
+        int bottom = bounds.y + bounds.height;
+        for (const Rect &rect : regions) {
+            bounds.x = std::min(bounds.x, rect.x);
+            bounds.y = std::min(bounds.y, rect.y);
+            right = std::max(right, rect.x + rect.width);
+            bottom = std::max(bottom, rect.y + rect.height);
+        }
+        bounds.width = right - bounds.x;
+        bounds.height = bottom - bounds.y;
+        regions.assign(1, bounds);
+    }
+
+    return regions;
+}
+
+uint64_t TileTracker::hashTile(const uint8_t *data, int stride, int width, int height)
+{
+    const int bytes = width * 4;
+    uint64_t v1 = prime1 + prime2;
+    uint64_t v2 = prime2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - prime1;
+
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *p = data + y * stride;
+        int i = 0;
+        for (; i + 32 <= bytes; i += 32) {
+            v1 = round(v1, load64(p + i));
+            v2 = round(v2, load64(p + i + 8));
+            v3 = round(v3, load64(p + i + 16));
+            v4 = round(v4, load64(p + i + 24));
+        }
+        for (; i + 8 <= bytes; i += 8)
+            v1 = round(v1, load64(p + i));
+        if (i < bytes) {
+            // Rows are whole pixels, four bytes remain at most
+            uint32_t tail;
+            memcpy(&tail, p + i, sizeof(tail));
+            v2 = round(v2, tail);
+        }
+    }
+
+    uint64_t hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
@@ -0,0 +1,59 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef TILETRACKER_H
+#define TILETRACKER_H
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Finds which tiles of a packed 32-bit frame changed since the previous
+ * frame, by comparing a 64-bit hash of every tile.
+ *
+ * When the compositor reports damage only the damaged tiles are hashed,
+ * otherwise the whole frame is.
+ */
+class TileTracker
+{
+public:
+    struct Rect {
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+    };
+
+    explicit TileTracker(int tileSize = 64);
+
+    int tileSize() const { return m_tileSize; }
+    int columns() const { return m_columns; }
+    int rows() const { return m_rows; }
+
+    void reset(int width, int height);
+
+    // Returns the number of tiles that changed, damage can be null
+    int update(const uint8_t *data, int stride, const std::vector<Rect> *damage);
+
+    bool isDirty(int column, int row) const { return m_dirty[row * m_columns + column] != 0; }
+
+    // Merges dirty tiles into at most maxRegions rectangles, in pixels
+    std::vector<Rect> dirtyRegions(int maxRegions) const;
+
+    static uint64_t hashTile(const uint8_t *data, int stride, int width, int height);
+
+private:
+    int m_tileSize = 64;
+    int m_width = 0;
+    int m_height = 0;
+    int m_columns = 0;
+    int m_rows = 0;
+    bool m_valid = false;
+    std::vector<uint64_t> m_hashes;
+    std::vector<uint8_t> m_dirty;
+};
+
+#endif // TILETRACKER_H
@@ -0,0 +1,853 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QFile>
+#include <QThread>
+#include <QVector>
+
+#include "capturebranch.h"
+#include "screencast.h"
+#include "transcoder.h"
+#include "workstealingpool.h"
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+
+#include <algorithm>
+
+#include <sched.h>
+
+// Several chunks per thread, so that the last ones to finish are short
+static const int chunksPerThread = 4;
+
+// Every chunk of a recording is decoded from the keyframe before it,
+// which is cheap next to chunks this long
+static const GstClockTime minRecordingChunk = 10 * GST_SECOND;
+
+static void lowerPriority()
+{
+    // Only runs when the core would otherwise be idle
+    struct sched_param param = {};
+    sched_setscheduler(0, SCHED_IDLE, &param);
+}
+
+static GstBusSyncReply stream_status_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+    Q_UNUSED(bus)
+    Q_UNUSED(user_data)
+
+    // Posted from the streaming thread itself as it starts, threads
+    // the encoder creates later inherit the policy
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_STREAM_STATUS) {
+        GstStreamStatusType type;
+        gst_message_parse_stream_status(msg, &type, nullptr);
+        if (type == GST_STREAM_STATUS_TYPE_ENTER)
+            lowerPriority();
+    }
+
+    return GST_BUS_PASS;
+}
+
+static void decodebin_pad_added_cb(GstElement *decodebin, GstPad *pad, gpointer user_data)
+{
+    Q_UNUSED(decodebin)
+
+    // Only the video is transcoded
+    GstElement *next = static_cast<GstElement *>(user_data);
+    GstPad *sinkPad = gst_element_get_static_pad(next, "sink");
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps)
+        caps = gst_pad_query_caps(pad, nullptr);
+
+    if (caps && gst_caps_get_size(caps) > 0 && !gst_pad_is_linked(sinkPad) &&
+            g_str_has_prefix(gst_structure_get_name(gst_caps_get_structure(caps, 0)), "video/"))
+        gst_pad_link(pad, sinkPad);
+
+    if (caps)
+        gst_caps_unref(caps);
+    gst_object_unref(sinkPad);
+}
+
+Transcoder::Transcoder(const QString &input, const QString &fileName,
+                       const Encoder *encoder, const EncoderSettings &settings,
+                       QObject *parent)
+    : QObject(parent)
+    , m_input(input)
+    , m_fileName(fileName)
+    , m_encoder(encoder)
+    , m_settings(settings)
+{
+}
+
+Transcoder::~Transcoder()
+{
+    stopPipeline();
+}
+
+QString Transcoder::input() const
+{
+    return m_input;
+}
+
+QString Transcoder::fileName() const
+{
+    return m_fileName;
+}
+
+bool Transcoder::isSpool() const
+{
+    return m_spool;
+}
+
+void Transcoder::setThreads(int threads)
+{
+    m_threads = threads;
+}
+
+void Transcoder::setIdlePriority(bool idle)
+{
+    m_idle = idle;
+}
+
+int Transcoder::chunkCount() const
+{
+    return int(m_chunks.size());
+}
+
+int Transcoder::chunksDone() const
+{
+    return m_chunksDone.loadAcquire();
+}
+
+int Transcoder::threadCount() const
+{
+    return m_threads;
+}
+
+quint64 Transcoder::framesDone() const
+{
+    return m_framesDone.loadAcquire();
+}
+
+quint64 Transcoder::frameCount() const
+{
+    return m_frameCount;
+}
+
+qint64 Transcoder::elapsed() const
+{
+    return m_timer.isValid() ? m_timer.elapsed() : 0;
+}
+
+bool Transcoder::start()
+{
+    if (m_threads <= 0)
+        m_threads = qMax(1, QThread::idealThreadCount());
+
+    m_timer.start();
+
+    // Anything that isn't a spool is left to decodebin
+    if (m_reader.open(QFile::encodeName(m_input).constData())) {
+        m_spool = true;
+        if (!planSpool(m_threads))
+            return false;
+    } else if (m_reader.error() == EINVAL) {
+        if (!planRecording(m_threads))
+            return false;
+    } else {
+        qCWarning(lcScreencast, "Unable to read %s: %s",
+                  qPrintable(m_input), g_strerror(m_reader.error()));
+        return false;
+    }
+
+    m_threads = qMin(m_threads, int(m_chunks.size()));
+
+    if (!createMuxPipeline())
+        return false;
+
+    if (gst_element_set_state(m_pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        qCWarning(lcScreencast, "Unable to start transcoding %s", qPrintable(m_input));
+        stopPipeline();
+        return false;
+    }
+
+    // There is no deadline, chunks scale better than the encoder
+    // threads within one, which only use the cores left over
+    EncoderSettings settings = m_settings;
+    settings.threads = qMax(1, QThread::idealThreadCount() / m_threads);
+
+    m_thread = std::thread([this, settings] {
+        WorkStealingPool pool(m_threads);
+        pool.run(int(m_chunks.size()), [this, &settings](int index) {
+            encodeChunk(m_chunks[size_t(index)], settings);
+        });
+    });
+    m_joiner = std::thread(&Transcoder::join, this);
+
+    return true;
+}
+
+void Transcoder::cancel()
+{
+    finish(false);
+}
+
+bool Transcoder::planSpool(int threads)
+{
+    if (m_reader.isTruncated())
+        qCWarning(lcScreencast, "Spool %s ends with an incomplete frame, everything before it is kept",
+                  qPrintable(m_input));
+
+    // Groups of pictures never span caps, frames before the first
+    // keyframe can't be decoded
+    struct Gop {
+        size_t caps;
+        size_t first;
+        quint64 frames;
+    };
+    std::vector<Gop> gops;
+
+    const auto &records = m_reader.records();
+    size_t caps = records.size();
+    for (size_t i = 0; i < records.size(); ++i) {
+        const auto &record = records[i];
+        if (record.type == Spool::Caps) {
+            caps = i;
+            continue;
+        }
+
+        if (record.type == Spool::Keyframe && caps < records.size())
+            gops.push_back({ caps, i, 0 });
+        if (gops.empty())
+            continue;
+
+        gops.back().frames++;
+        m_frameCount++;
+        if (record.type != Spool::Repeat)
+            m_maxFrameSize = qMax(m_maxFrameSize, record.size);
+    }
+    if (gops.empty() || m_maxFrameSize == 0) {
+        qCWarning(lcScreencast, "Spool %s has no frames", qPrintable(m_input));
+        return false;
+    }
+
+    // The file starts at zero
+    m_base = records[gops.front().first].pts;
+
+    const quint64 target = qMax<quint64>(1, m_frameCount / quint64(threads * chunksPerThread));
+    quint64 frames = 0;
+    for (size_t i = 0; i < gops.size(); ++i) {
+        if (frames == 0) {
+            m_chunks.emplace_back();
+            m_chunks.back().caps = gops[i].caps;
+            m_chunks.back().first = gops[i].first;
+        }
+
+        frames += gops[i].frames;
+        const bool last = i + 1 == gops.size();
+        if (last || frames >= target || gops[i + 1].caps != gops[i].caps) {
+            m_chunks.back().last = last ? records.size() : gops[i + 1].first;
+            frames = 0;
+        }
+    }
+
+    return true;
+}
+
+bool Transcoder::planRecording(int threads)
+{
+    // Prerolls once to know how long the recording is
+    GstElement *pipeline = gst_pipeline_new(nullptr);
+    GstElement *src = gst_element_factory_make("filesrc", nullptr);
+    GstElement *decoder = gst_element_factory_make("decodebin", nullptr);
+    GstElement *sink = gst_element_factory_make("fakesink", nullptr);
+    if (!src || !decoder || !sink) {
+        qCWarning(lcScreencast, "Unable to transcode %s, some elements are missing", qPrintable(m_input));
+        for (auto *element : { src, decoder, sink }) {
+            if (element)
+                gst_object_unref(gst_object_ref_sink(element));
+        }
+        gst_object_unref(pipeline);
+        return false;
+    }
+
+    g_object_set(src, "location", QFile::encodeName(m_input).constData(), nullptr);
+    gst_bin_add_many(GST_BIN(pipeline), src, decoder, sink, nullptr);
+    gst_element_link(src, decoder);
+    g_signal_connect(decoder, "pad-added", G_CALLBACK(decodebin_pad_added_cb), sink);
+
+    gint64 duration = -1;
+    gst_element_set_state(pipeline, GST_STATE_PAUSED);
+    if (gst_element_get_state(pipeline, nullptr, nullptr, GST_CLOCK_TIME_NONE) != GST_STATE_CHANGE_FAILURE)
+        gst_element_query_duration(pipeline, GST_FORMAT_TIME, &duration);
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+    const bool failed = msg != nullptr;
+    if (msg) {
+        GError *err = nullptr;
+        gst_message_parse_error(msg, &err, nullptr);
+        qCWarning(lcScreencast, "Unable to read %s: %s", qPrintable(m_input), err->message);
+        g_clear_error(&err);
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    if (failed)
+        return false;
+    if (duration <= 0) {
+        qCWarning(lcScreencast, "Unable to tell how long %s is", qPrintable(m_input));
+        return false;
+    }
+
+    // The last chunk goes to the end, wherever that really is
+    const GstClockTime length = qMax(minRecordingChunk, GstClockTime(duration) / GstClockTime(threads * chunksPerThread));
+    for (GstClockTime start = 0; start < GstClockTime(duration); start += length) {
+        m_chunks.emplace_back();
+        m_chunks.back().start = start;
+        if (start + length < GstClockTime(duration))
+            m_chunks.back().stop = start + length;
+    }
+
+    return true;
+}
+
+bool Transcoder::createMuxPipeline()
+{
+    m_src = gst_element_factory_make("appsrc", nullptr);
+    GstElement *muxer = m_encoder->createMuxer(m_settings);
+    GstElement *sink = gst_element_factory_make("screencastfilesink", nullptr);
+
+    const QVector<GstElement *> elements = { m_src, muxer, sink };
+    if (elements.contains(nullptr)) {
+        qCWarning(lcScreencast, "Unable to transcode %s, some elements are missing", qPrintable(m_input));
+        for (auto *element : elements) {
+            if (element)
+                gst_object_unref(gst_object_ref_sink(element));
+        }
+        m_src = nullptr;
+        return false;
+    }
+
+    // Caps are set by the joiner, from the first chunk
+    g_object_set(m_src, "format", GST_FORMAT_TIME, nullptr);
+    g_object_set(sink, "location", m_fileName.toUtf8().constData(), nullptr);
+    if (m_settings.fragmentDuration > 0) {
+        g_object_set(sink, "sync-interval",
+                     guint64(m_settings.fragmentDuration) * GST_MSECOND, nullptr);
+    }
+
+    m_pipeline = gst_pipeline_new(nullptr);
+    if (!addAndLinkElements(GST_BIN(m_pipeline), elements)) {
+        stopPipeline();
+        return false;
+    }
+
+    GstBus *bus = gst_element_get_bus(m_pipeline);
+    if (m_idle)
+        gst_bus_set_sync_handler(bus, stream_status_cb, nullptr, nullptr);
+    gst_bus_add_watch(bus, busWatch, this);
+    gst_object_unref(bus);
+
+    return true;
+}
+
+void Transcoder::encodeChunk(Chunk &chunk, const EncoderSettings &settings)
+{
+    if (m_idle)
+        lowerPriority();
+
+    bool succeeded = false;
+    GstElement *head = nullptr;
+    GstElement *pipeline = m_cancelled.loadAcquire() ? nullptr : createChunkPipeline(chunk, settings, &head);
+    if (pipeline) {
+        {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            chunk.pipeline = pipeline;
+        }
+
+        if (m_spool) {
+            succeeded = gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE &&
+                    feedSpoolChunk(chunk, pipeline, head) && waitForChunk(pipeline);
+        } else {
+            // Prerolls without waiting for the sink, then jumps to the chunk
+            const bool bounded = GST_CLOCK_TIME_IS_VALID(chunk.stop);
+            succeeded = gst_element_set_state(pipeline, GST_STATE_PAUSED) != GST_STATE_CHANGE_FAILURE &&
+                    gst_element_get_state(pipeline, nullptr, nullptr, GST_CLOCK_TIME_NONE) != GST_STATE_CHANGE_FAILURE &&
+                    gst_element_seek(pipeline, 1.0, GST_FORMAT_TIME,
+                                     GstSeekFlags(GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE),
+                                     GST_SEEK_TYPE_SET, gint64(chunk.start),
+                                     bounded ? GST_SEEK_TYPE_SET : GST_SEEK_TYPE_NONE,
+                                     bounded ? gint64(chunk.stop) : gint64(-1)) &&
+                    gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE &&
+                    waitForChunk(pipeline);
+        }
+
+        {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            chunk.pipeline = nullptr;
+        }
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+    }
+
+    {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        chunk.done = true;
+        chunk.failed = !succeeded;
+    }
+    m_chunkDone.notify_all();
+
+    if (succeeded)
+        m_chunksDone.fetchAndAddRelease(1);
+}
+
+GstElement *Transcoder::createChunkPipeline(Chunk &chunk, const EncoderSettings &settings, GstElement **head)
+{
+    // Frames are converted if they were spooled in a format the encoder
+    // doesn't take, which is only the case without the fast converter
+    GstElement *src = gst_element_factory_make(m_spool ? "appsrc" : "filesrc", nullptr);
+    GstElement *decoder = m_spool ? nullptr : gst_element_factory_make("decodebin", nullptr);
+    GstElement *convert = gst_element_factory_make("videoconvert", nullptr);
+    GstElement *encoder = m_encoder->createEncoder(settings);
+    GstElement *parser = m_encoder->createParser();
+    GstElement *sink = gst_element_factory_make("appsink", nullptr);
+
+    QVector<GstElement *> elements = { convert, encoder };
+    if (parser)
+        elements.append(parser);
+    elements.append(sink);
+
+    if (!src || (!m_spool && !decoder) || elements.contains(nullptr)) {
+        qCWarning(lcScreencast, "Unable to transcode %s, some elements are missing", qPrintable(m_input));
+        elements.append(src);
+        elements.append(decoder);
+        for (auto *element : qAsConst(elements)) {
+            if (element)
+                gst_object_unref(gst_object_ref_sink(element));
+        }
+        return nullptr;
+    }
+
+    GstElement *pipeline = gst_pipeline_new(nullptr);
+    gst_bin_add(GST_BIN(pipeline), src);
+    if (decoder)
+        gst_bin_add(GST_BIN(pipeline), decoder);
+    if (!addAndLinkElements(GST_BIN(pipeline), elements) ||
+            !gst_element_link(src, decoder ? decoder : convert)) {
+        gst_object_unref(pipeline);
+        return nullptr;
+    }
+
+    if (m_spool) {
+        const auto &records = m_reader.records();
+        GstCaps *caps = gst_caps_from_string(m_reader.caps(records[chunk.caps]).c_str());
+        g_object_set(src, "format", GST_FORMAT_TIME, "caps", caps, nullptr);
+        if (caps)
+            gst_caps_unref(caps);
+    } else {
+        g_object_set(src, "location", QFile::encodeName(m_input).constData(), nullptr);
+        g_signal_connect(decoder, "pad-added", G_CALLBACK(decodebin_pad_added_cb), convert);
+
+        GstPad *pad = gst_element_get_static_pad(convert, "sink");
+        gst_pad_add_probe(pad, GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER |
+                                               GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM |
+                                               GST_PAD_PROBE_TYPE_EVENT_FLUSH),
+                          chunkProbe, &chunk, nullptr);
+        gst_object_unref(pad);
+    }
+
+    // Collects the chunk as fast as it's encoded, the sink doesn't
+    // need a buffer to reach paused
+    g_object_set(sink, "sync", FALSE, "async", FALSE, nullptr);
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.new_sample = newSample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, &chunk, nullptr);
+
+    if (m_idle) {
+        GstBus *bus = gst_element_get_bus(pipeline);
+        gst_bus_set_sync_handler(bus, stream_status_cb, nullptr, nullptr);
+        gst_object_unref(bus);
+    }
+
+    *head = src;
+    return pipeline;
+}
+
+bool Transcoder::feedSpoolChunk(const Chunk &chunk, GstElement *pipeline, GstElement *element)
+{
+    GstAppSrc *src = GST_APP_SRC(element);
+    const guint64 maxBytes = guint64(m_maxFrameSize) * 4;
+    const auto &records = m_reader.records();
+    SpoolDecoder decoder(m_reader.compression());
+    GstBuffer *previous = nullptr;
+    bool succeeded = true;
+    bool eos = false;
+
+    for (size_t i = chunk.first; i < chunk.last; ++i) {
+        const auto &record = records[i];
+
+        // Belongs to the next chunk
+        if (record.type == Spool::Caps)
+            break;
+
+        // After a damaged record everything up to the next keyframe is lost
+        if (!previous && record.type != Spool::Keyframe)
+            continue;
+
+        GstBuffer *buffer = nullptr;
+        if (record.type == Spool::Repeat) {
+            // Shares the memory of the previous frame
+            buffer = gst_buffer_copy(previous);
+        } else {
+            buffer = gst_buffer_new_allocate(nullptr, record.size, nullptr);
+            GstMapInfo map, previousMap;
+            gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+            const bool hasPrevious = record.type == Spool::Delta &&
+                    gst_buffer_map(previous, &previousMap, GST_MAP_READ);
+            const bool decoded = (!hasPrevious || previousMap.size == record.size) &&
+                    decoder.decode(record, hasPrevious ? previousMap.data : nullptr, map.data);
+            if (hasPrevious)
+                gst_buffer_unmap(previous, &previousMap);
+            gst_buffer_unmap(buffer, &map);
+
+            if (!decoded) {
+                qCWarning(lcScreencast, "Spool %s: damaged frame at %.3f s, skipping to the next keyframe",
+                          qPrintable(m_input), double(record.pts) / GST_SECOND);
+                gst_buffer_unref(buffer);
+                gst_buffer_replace(&previous, nullptr);
+                continue;
+            }
+        }
+
+        GST_BUFFER_PTS(buffer) = record.pts > m_base ? record.pts - m_base : 0;
+        GST_BUFFER_DURATION(buffer) = record.duration;
+
+        if (record.type != Spool::Repeat)
+            gst_buffer_replace(&previous, buffer);
+
+        // Room for a few frames, errors and cancellation are noticed meanwhile
+        while (succeeded && gst_app_src_get_current_level_bytes(src) >= maxBytes)
+            succeeded = pollChunk(pipeline, 5 * GST_MSECOND, &eos);
+        if (!succeeded) {
+            gst_buffer_unref(buffer);
+            break;
+        }
+        if (gst_app_src_push_buffer(src, buffer) != GST_FLOW_OK) {
+            succeeded = false;
+            break;
+        }
+    }
+
+    gst_buffer_replace(&previous, nullptr);
+
+    if (succeeded)
+        gst_app_src_end_of_stream(src);
+    return succeeded;
+}
+
+bool Transcoder::pollChunk(GstElement *pipeline, GstClockTime timeout, bool *eos)
+{
+    if (m_cancelled.loadAcquire())
+        return false;
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, timeout,
+                                                 GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    gst_object_unref(bus);
+    if (!msg)
+        return !m_cancelled.loadAcquire();
+
+    bool succeeded = true;
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+        GError *err = nullptr;
+        gchar *debug_info = nullptr;
+        gst_message_parse_error(msg, &err, &debug_info);
+        qCWarning(lcScreencast, "Error transcoding %s from element %s: %s",
+                  qPrintable(m_input), GST_OBJECT_NAME(msg->src), err->message);
+        if (debug_info)
+            qCWarning(lcScreencast, "Debugging information: %s", debug_info);
+        g_clear_error(&err);
+        g_free(debug_info);
+        succeeded = false;
+    } else {
+        *eos = true;
+    }
+    gst_message_unref(msg);
+
+    return succeeded;
+}
+
+bool Transcoder::waitForChunk(GstElement *pipeline)
+{
+    bool eos = false;
+    while (!eos) {
+        if (!pollChunk(pipeline, 100 * GST_MSECOND, &eos))
+            return false;
+    }
+    return true;
+}
+
+void Transcoder::join()
+{
+    if (m_idle)
+        lowerPriority();
+
+    GstAppSrc *src = GST_APP_SRC(m_src);
+    GstCaps *caps = nullptr;
+    GstClockTime lastDts = GST_CLOCK_TIME_NONE;
+    // How far decoding runs ahead of presentation, as the first
+    // chunk's encoder set it up
+    GstClockTime reorderDelay = GST_CLOCK_TIME_NONE;
+
+    for (size_t i = 0; i < m_chunks.size(); ++i) {
+        Chunk &chunk = m_chunks[i];
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_chunkDone.wait(lock, [this, &chunk] { return chunk.done || m_cancelled.loadAcquire(); });
+        }
+        if (m_cancelled.loadAcquire())
+            break;
+
+        if (chunk.failed) {
+            GError *error = g_error_new_literal(GST_STREAM_ERROR, GST_STREAM_ERROR_ENCODE,
+                                                "A chunk could not be encoded");
+            gst_element_post_message(m_src, gst_message_new_error(GST_OBJECT(m_src), error, nullptr));
+            g_error_free(error);
+            break;
+        }
+
+        // Every chunk comes from the same settings, the caps only
+        // differ where the spool's did
+        if (chunk.outputCaps && (!caps || !gst_caps_is_equal(caps, chunk.outputCaps))) {
+            gst_caps_replace(&caps, chunk.outputCaps);
+            gst_app_src_set_caps(src, caps);
+        }
+
+        // Encoders with reordering start decoding before their first
+        // frame, so each chunk's would overlap the end of the one
+        // before: the n-th frame in decoding order decodes at the n-th
+        // presentation time moved back by the first chunk's delay,
+        // which carries the same timeline across the seams
+        std::vector<GstClockTime> decodeTimes;
+        for (auto *buffer : chunk.buffers) {
+            if (GST_BUFFER_PTS_IS_VALID(buffer) && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER))
+                decodeTimes.push_back(GST_BUFFER_PTS(buffer));
+        }
+        std::sort(decodeTimes.begin(), decodeTimes.end());
+        if (!GST_CLOCK_TIME_IS_VALID(reorderDelay) && !decodeTimes.empty()) {
+            // Where the encoder is past its start, decoding runs
+            // steadily that far ahead
+            reorderDelay = 0;
+            GstBuffer *last = nullptr;
+            for (auto *buffer : chunk.buffers) {
+                if (GST_BUFFER_PTS_IS_VALID(buffer) && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER))
+                    last = buffer;
+            }
+            if (GST_BUFFER_DTS_IS_VALID(last) && GST_BUFFER_DTS(last) < decodeTimes.back())
+                reorderDelay = decodeTimes.back() - GST_BUFFER_DTS(last);
+        }
+
+        bool pushed = true;
+        size_t frame = 0;
+        for (auto &buffer : chunk.buffers) {
+            // Each encoder repeats the stream headers, which are in the caps
+            if (i > 0 && GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER))
+                continue;
+
+            // The first chunk keeps the encoder's own timestamps
+            if (GST_BUFFER_PTS_IS_VALID(buffer) && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER)) {
+                const GstClockTime decodeTime = decodeTimes[frame++];
+                if (i > 0 && GST_BUFFER_DTS_IS_VALID(buffer)) {
+                    buffer = gst_buffer_make_writable(buffer);
+                    GST_BUFFER_DTS(buffer) = decodeTime > reorderDelay ? decodeTime - reorderDelay : 0;
+                }
+            }
+
+            if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_DTS(buffer))) {
+                // Only when a later encoder reorders more than the first
+                if (GST_CLOCK_TIME_IS_VALID(lastDts) && GST_BUFFER_DTS(buffer) <= lastDts) {
+                    buffer = gst_buffer_make_writable(buffer);
+                    GST_BUFFER_DTS(buffer) = lastDts + 1;
+                }
+                lastDts = GST_BUFFER_DTS(buffer);
+            }
+
+            // Fails once the pipeline is stopped
+            GstBuffer *taken = buffer;
+            buffer = nullptr;
+            if (gst_app_src_push_buffer(src, taken) != GST_FLOW_OK) {
+                pushed = false;
+                break;
+            }
+            m_framesDone.fetchAndAddRelease(1);
+        }
+        if (!pushed)
+            break;
+
+        for (auto *buffer : chunk.buffers) {
+            if (buffer)
+                gst_buffer_unref(buffer);
+        }
+        chunk.buffers.clear();
+    }
+
+    if (caps)
+        gst_caps_unref(caps);
+
+    if (!m_cancelled.loadAcquire())
+        gst_app_src_end_of_stream(src);
+}
+
+void Transcoder::finish(bool succeeded)
+{
+    if (m_finished)
+        return;
+
+    m_finished = true;
+    stopPipeline();
+    emit finished(succeeded);
+}
+
+void Transcoder::stopPipeline()
+{
+    m_cancelled.storeRelease(1);
+
+    // Unblocks the workers, and the joiner waiting for them
+    {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        for (auto &chunk : m_chunks) {
+            if (chunk.pipeline)
+                gst_element_set_state(chunk.pipeline, GST_STATE_NULL);
+        }
+    }
+    m_chunkDone.notify_all();
+
+    if (m_pipeline)
+        gst_element_set_state(m_pipeline, GST_STATE_NULL);
+    if (m_joiner.joinable())
+        m_joiner.join();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    if (m_pipeline) {
+        GstBus *bus = gst_element_get_bus(m_pipeline);
+        gst_bus_remove_watch(bus);
+        gst_bus_set_sync_handler(bus, nullptr, nullptr, nullptr);
+        gst_object_unref(bus);
+
+        gst_object_unref(m_pipeline);
+        m_pipeline = nullptr;
+        m_src = nullptr;
+    }
+
+    for (auto &chunk : m_chunks) {
+        for (auto *buffer : chunk.buffers) {
+            if (buffer)
+                gst_buffer_unref(buffer);
+        }
+        chunk.buffers.clear();
+        if (chunk.outputCaps)
+            gst_caps_unref(chunk.outputCaps);
+        chunk.outputCaps = nullptr;
+    }
+
+    m_reader.close();
+}
+
+GstFlowReturn Transcoder::newSample(GstAppSink *sink, gpointer user_data)
+{
+    Chunk *chunk = static_cast<Chunk *>(user_data);
+
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (!sample)
+        return GST_FLOW_EOS;
+
+    // Parsers can complete the caps after the first buffers
+    GstCaps *caps = gst_sample_get_caps(sample);
+    if (caps)
+        gst_caps_replace(&chunk->outputCaps, caps);
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if (buffer)
+        chunk->buffers.push_back(gst_buffer_ref(buffer));
+    gst_sample_unref(sample);
+
+    return GST_FLOW_OK;
+}
+
+GstPadProbeReturn Transcoder::chunkProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    Q_UNUSED(pad)
+
+    Chunk *chunk = static_cast<Chunk *>(user_data);
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+        // What was decoded while prerolling, and frames the decoder
+        // didn't clip to the chunk
+        const GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+        if (!chunk->seeked)
+            return GST_PAD_PROBE_DROP;
+        if (GST_CLOCK_TIME_IS_VALID(pts) &&
+                (pts < chunk->start || (GST_CLOCK_TIME_IS_VALID(chunk->stop) && pts >= chunk->stop)))
+            return GST_PAD_PROBE_DROP;
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    switch (GST_EVENT_TYPE(event)) {
+    case GST_EVENT_FLUSH_STOP:
+        chunk->seeked = true;
+        break;
+    case GST_EVENT_SEGMENT: {
+        // Running time stays the time in the recording, as if all
+        // the chunks were one stream, encoders that go by it agree
+        GstSegment segment;
+        gst_event_copy_segment(event, &segment);
+        segment.base = segment.start;
+        GstEvent *rebased = gst_event_new_segment(&segment);
+        gst_event_set_seqnum(rebased, gst_event_get_seqnum(event));
+        gst_event_unref(event);
+        GST_PAD_PROBE_INFO_DATA(info) = rebased;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+gboolean Transcoder::busWatch(GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+    Q_UNUSED(bus)
+
+    Transcoder *self = static_cast<Transcoder *>(user_data);
+    GError *err = nullptr;
+    gchar *debug_info = nullptr;
+
+    switch (GST_MESSAGE_TYPE(msg)) {
+    case GST_MESSAGE_ERROR:
+        gst_message_parse_error(msg, &err, &debug_info);
+        qCWarning(lcScreencast, "Error transcoding %s from element %s: %s",
+                  qPrintable(self->m_input), GST_OBJECT_NAME(msg->src), err->message);
+        if (debug_info)
+            qCWarning(lcScreencast, "Debugging information: %s", debug_info);
+        g_clear_error(&err);
+        g_free(debug_info);
+        self->finish(false);
+        break;
+    case GST_MESSAGE_EOS:
+        self->finish(true);
+        break;
+    default:
+        break;
+    }
+
+    return TRUE;
+}
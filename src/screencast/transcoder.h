@@ -0,0 +1,147 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gst/gstelement.h>
+#include <gst/app/gstappsink.h>
+
+#include "encoder.h"
+#include "spool.h"
+
+/*
+ * Encodes a spool or a finished recording into a new file, using
+ * every core even with encoders that don't scale.
+ *
+ * The input is cut into chunks that start on a keyframe: at the
+ * spool's own keyframes, or every few seconds of a recording, which
+ * is decoded from the keyframe before. Each chunk is encoded by its
+ * own single threaded encoder on a work-stealing pool, then the
+ * chunks are passed in order to a single muxer, as if one encoder
+ * had produced them all.
+ *
+ * In the background all the threads run at idle priority, so that
+ * only the cores nothing else wants are used, including those of a
+ * recording that is running.
+ */
+class Transcoder : public QObject
+{
+    Q_OBJECT
+public:
+    Transcoder(const QString &input, const QString &fileName,
+               const Encoder *encoder, const EncoderSettings &settings,
+               QObject *parent = nullptr);
+    ~Transcoder();
+
+    QString input() const;
+    QString fileName() const;
+    // Whether the input is a spool, known once started
+    bool isSpool() const;
+
+    // Threads of the pool, 0 is one per core
+    void setThreads(int threads);
+    void setIdlePriority(bool idle);
+
+    // Returns false if the input can't be read or the pipeline built
+    bool start();
+    // Stops as soon as possible, the file is left incomplete
+    void cancel();
+
+    int chunkCount() const;
+    int chunksDone() const;
+    int threadCount() const;
+    quint64 framesDone() const;
+    // Zero when not known in advance
+    quint64 frameCount() const;
+    qint64 elapsed() const;
+
+Q_SIGNALS:
+    // Emitted once, from the main thread
+    void finished(bool succeeded);
+
+private:
+    struct Chunk {
+        // Records of the spool, caps first
+        size_t caps = 0;
+        size_t first = 0;
+        size_t last = 0;
+        // Time range of the recording
+        GstClockTime start = 0;
+        GstClockTime stop = GST_CLOCK_TIME_NONE;
+        // Decoded frames pass once the chunk was seeked to
+        bool seeked = false;
+
+        // Encoded, owned until they are muxed
+        GstCaps *outputCaps = nullptr;
+        std::vector<GstBuffer *> buffers;
+        // Running while it's being encoded, guarded by m_mutex
+        GstElement *pipeline = nullptr;
+        bool done = false;
+        bool failed = false;
+    };
+
+    QString m_input;
+    QString m_fileName;
+    const Encoder *m_encoder;
+    EncoderSettings m_settings;
+    int m_threads = 0;
+    bool m_idle = false;
+    bool m_spool = false;
+
+    // Indexes the spool, each chunk decodes with a decoder of its own
+    SpoolReader m_reader;
+    quint64 m_frameCount = 0;
+    size_t m_maxFrameSize = 0;
+    GstClockTime m_base = 0;
+
+    std::vector<Chunk> m_chunks;
+    std::mutex m_mutex;
+    std::condition_variable m_chunkDone;
+
+    // Muxes the encoded chunks in order
+    GstElement *m_pipeline = nullptr;
+    GstElement *m_src = nullptr;
+    std::thread m_thread;
+    std::thread m_joiner;
+    QAtomicInt m_cancelled = 0;
+    QAtomicInt m_chunksDone = 0;
+    QAtomicInteger<quint64> m_framesDone = 0;
+    QElapsedTimer m_timer;
+    bool m_finished = false;
+
+    bool planSpool(int threads);
+    bool planRecording(int threads);
+    bool createMuxPipeline();
+
+    void encodeChunk(Chunk &chunk, const EncoderSettings &settings);
+    GstElement *createChunkPipeline(Chunk &chunk, const EncoderSettings &settings, GstElement **head);
+    bool feedSpoolChunk(const Chunk &chunk, GstElement *pipeline, GstElement *src);
+    bool pollChunk(GstElement *pipeline, GstClockTime timeout, bool *eos);
+    bool waitForChunk(GstElement *pipeline);
+    void join();
+
+    void finish(bool succeeded);
+    void stopPipeline();
+    void fail(const QString &message);
+
+    static GstFlowReturn newSample(GstAppSink *sink, gpointer user_data);
+    static GstPadProbeReturn chunkProbe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+    static gboolean busWatch(GstBus *bus, GstMessage *msg, gpointer user_data);
+};
+
+#endif // TRANSCODER_H
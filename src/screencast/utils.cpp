@@ -0,0 +1,46 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <QByteArray>
+
+#include "screencast.h"
+#include "utils.h"
+
+#include <gst/gst.h>
+
+bool hasElementProperty(GstElement *element, const char *name)
+{
+    return g_object_class_find_property(G_OBJECT_GET_CLASS(element), name) != nullptr;
+}
+
+void setElementProperty(GstElement *element, const char *name, const char *value)
+{
+    // Properties vary between plugin versions, skip the ones we don't know about
+    GParamSpec *spec = g_object_class_find_property(G_OBJECT_GET_CLASS(element), name);
+    if (!spec) {
+        qCDebug(lcScreencast, "Element %s has no property \"%s\"",
+                GST_OBJECT_NAME(element), name);
+        return;
+    }
+
+    // Running elements only accept the properties flagged as mutable
+    const GstState state = GST_STATE(element);
+    const bool mutableProperty = state == GST_STATE_PLAYING
+            ? (spec->flags & GST_PARAM_MUTABLE_PLAYING)
+            : state != GST_STATE_PAUSED || (spec->flags & (GST_PARAM_MUTABLE_PAUSED | GST_PARAM_MUTABLE_PLAYING));
+    if (!mutableProperty) {
+        qCDebug(lcScreencast, "Property \"%s\" of element %s can't change in the %s state",
+                name, GST_OBJECT_NAME(element), gst_element_state_get_name(state));
+        return;
+    }
+
+    gst_util_set_object_arg(G_OBJECT(element), name, value);
+}
+
+void setElementProperty(GstElement *element, const char *name, qint64 value)
+{
+    setElementProperty(element, name, QByteArray::number(value).constData());
+}
@@ -0,0 +1,16 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef UTILS_H
+#define UTILS_H
+
+#include <gst/gstelement.h>
+
+bool hasElementProperty(GstElement *element, const char *name);
+void setElementProperty(GstElement *element, const char *name, const char *value);
+void setElementProperty(GstElement *element, const char *name, qint64 value);
+
+#endif // UTILS_H
@@ -0,0 +1,129 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#include <algorithm>
+
+#include "workstealingpool.h"
+
+WorkStealingPool::WorkStealingPool(int threads)
+{
+    for (int i = 0; i < std::max(1, threads); ++i)
+        m_queues.emplace_back(new Queue());
+    // As in SlicePool, the starting generation is set before the
+    // workers run, so that none misses the first job
+    for (int i = 1; i < threads; ++i)
+        m_workers.emplace_back(&WorkStealingPool::workerLoop, this, i, m_generation);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+
+    for (auto &worker : m_workers)
+        worker.join();
+}
+
+int WorkStealingPool::threadCount() const
+{
+    return int(m_workers.size()) + 1;
+}
+
+void WorkStealingPool::run(int tasks, const std::function<void(int)> &job)
+{
+    if (tasks <= 0)
+        return;
+
+    // Contiguous blocks, so that each thread starts on its own stretch
+    const int threads = threadCount();
+    for (int task = 0; task < tasks; ++task) {
+        Queue *queue = m_queues[size_t(task * threads / tasks)].get();
+        std::lock_guard<std::mutex> locker(queue->mutex);
+        queue->tasks.push_back(task);
+    }
+
+    {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        m_job = &job;
+        m_pending = tasks;
+        ++m_generation;
+    }
+    m_wake.notify_all();
+
+    work(0, job);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // The job must outlive every worker that saw it
+    m_done.wait(lock, [this] { return m_pending == 0 && m_active == 0; });
+    m_job = nullptr;
+}
+
+void WorkStealingPool::workerLoop(int index, unsigned long seen)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;) {
+        m_wake.wait(lock, [this, seen] { return m_quit || m_generation != seen; });
+        if (m_quit)
+            return;
+
+        seen = m_generation;
+        if (!m_job)
+            continue;
+
+        const std::function<void(int)> &job = *m_job;
+        ++m_active;
+        lock.unlock();
+        work(index, job);
+        lock.lock();
+        if (--m_active == 0)
+            m_done.notify_all();
+    }
+}
+
+void WorkStealingPool::work(int index, const std::function<void(int)> &job)
+{
+    int task = 0;
+    while (take(index, &task)) {
+        job(task);
+
+        std::lock_guard<std::mutex> locker(m_mutex);
+        if (--m_pending == 0)
+            m_done.notify_all();
+    }
+}
+
+bool WorkStealingPool::take(int index, int *task)
+{
+    // Own tasks in order
+    {
+        Queue *queue = m_queues[size_t(index)].get();
+        std::lock_guard<std::mutex> locker(queue->mutex);
+        if (!queue->tasks.empty()) {
+            *task = queue->tasks.front();
+            queue->tasks.pop_front();
+            return true;
+        }
+    }
+
+    // Then the last task of the next thread that has any left,
+    // the one its owner would get to last
+    const int threads = int(m_queues.size());
+    for (int i = 1; i < threads; ++i) {
+        Queue *queue = m_queues[size_t((index + i) % threads)].get();
+        std::lock_guard<std::mutex> locker(queue->mutex);
+        if (!queue->tasks.empty()) {
+            *task = queue->tasks.back();
+            queue->tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,65 @@
+/****************************************************************************
+ * SPDX-FileCopyrightText: 2020 Pier Luigi Fiorini <pierluigi.fiorini@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ ***************************************************************************/
+
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Runs long tasks of uneven length on a fixed set of worker threads.
+ *
+ * Tasks are handed out in contiguous blocks, one per thread, which
+ * works through its own from the front; a thread that runs out takes
+ * from the back of someone else's. Threads mostly stay on neighbouring
+ * tasks, so the first ones are done first, and none idles while there
+ * is work left.
+ *
+ * Like SlicePool, the calling thread is one of the workers and run()
+ * only returns when all the tasks are done.
+ */
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(int threads);
+    ~WorkStealingPool();
+
+    int threadCount() const;
+
+    // Calls job(task) for every task from 0 to tasks - 1
+    void run(int tasks, const std::function<void(int)> &job);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> m_workers;
+    // One per thread, the caller's is the first
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void(int)> *m_job = nullptr;
+    unsigned long m_generation = 0;
+    int m_pending = 0;
+    // Workers still holding on to the job
+    int m_active = 0;
+    bool m_quit = false;
+
+    void workerLoop(int index, unsigned long seen);
+    void work(int index, const std::function<void(int)> &job);
+    bool take(int index, int *task);
+};
+
+#endif // WORKSTEALINGPOOL_H